@@ -74,6 +74,8 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
     assert(sr->if_list);
     sr->if_list->next = 0;
+    sr->if_list->role = if_role_router;
+    sr->if_list->idx = 0;
     strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
     return;
   }
@@ -85,8 +87,10 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
 
   if_walker->next = (struct sr_if*)malloc(sizeof(struct sr_if));
   assert(if_walker->next);
+  if_walker->next->idx = if_walker->idx + 1;
   if_walker = if_walker->next;
   strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
+  if_walker->role = if_role_router;
   if_walker->next = 0;
 } /* -- sr_add_interface -- */
 
@@ -28,6 +28,23 @@
 
 struct sr_instance;
 
+/* ----------------------------------------------------------------------------
+ * sr_if_role
+ *
+ * What the router does with the packets received on an interface. Set by
+ * sr_init_roles once the interfaces are known; picks the row of the
+ * router's dispatch table the interface's packets are handled by.
+ *
+ * -------------------------------------------------------------------------- */
+
+typedef enum {
+  if_role_router,      /* no nat */
+  if_role_nat_inside,  /* nat, eth0: the internal network */
+  if_role_nat_outside  /* nat, the others: translated on the way in */
+} sr_if_role;
+
+#define SR_IF_ROLES 3
+
 /* ----------------------------------------------------------------------------
  * struct sr_if
  *
@@ -41,6 +58,8 @@ struct sr_if
   unsigned char addr[ETHER_ADDR_LEN];
   uint32_t ip;
   uint32_t speed;
+  sr_if_role role;
+  uint32_t idx;        /* position in the list, for the counters */
   struct sr_if* next;
 };
 
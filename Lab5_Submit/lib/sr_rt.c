@@ -12,9 +12,12 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #define __USE_MISC 1 /* force linux to show inet_aton */
 #include <arpa/inet.h>
@@ -23,58 +26,212 @@
 #include "sr_router.h"
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_rt_token(..)
+ * Scope: Local
+ *
+ * next blank separated word of the line [p, end), *len is 0 if none
  *
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+static const char* sr_rt_token(const char* p, const char* end,
+                               const char** tok, size_t* len)
+{
+  while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r')))
+    p++;
+  *tok = p;
+  while ((p < end) && (*p != ' ') && (*p != '\t') && (*p != '\r'))
+    p++;
+  *len = p - *tok;
+  return p;
+} /* -- sr_rt_token -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_aton(..)
+ * Scope: Local
+ *
+ * inet_aton of the word [tok, tok+len). Decimal dotted quads, which is
+ * what routing tables hold, are converted in place, the other forms
+ * inet_aton knows go through it.
+ *
+ *---------------------------------------------------------------------*/
+
+static int sr_rt_aton(const char* tok, size_t len, struct in_addr* addr)
+{
+  uint32_t ip = 0, octet = 0;
+  int digits = 0, dots = 0;
+  size_t i;
+  char buf[32];
+
+  for (i = 0; i < len; i++) {
+    if ((tok[i] >= '0') && (tok[i] <= '9') && (digits < 3) &&
+        !((digits == 1) && (octet == 0))) { /* -- 0-led is octal -- */
+      octet = octet * 10 + (tok[i] - '0');
+      digits++;
+    } else if ((tok[i] == '.') && digits && (octet <= 255) && (dots < 3)) {
+      ip = (ip << 8) | octet;
+      octet = 0;
+      digits = 0;
+      dots++;
+    } else {
+      break;
+    }
+  }
+  if ((i == len) && (dots == 3) && digits && (octet <= 255)) {
+    addr->s_addr = htonl((ip << 8) | octet);
+    return 1;
+  }
+
+  if (len >= sizeof(buf))
+    return 0;
+  memcpy(buf, tok, len);
+  buf[len] = 0;
+  return inet_aton(buf, addr);
+} /* -- sr_rt_aton -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt_list(..)
+ * Scope: Global
+ *
+ * The file is mapped and parsed in place, one pass, no copies of the
+ * lines; entries are appended at the tail so the load is linear.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt_list(const char* filename, struct sr_rt** list)
 {
-  FILE* fp;
-  char  line[BUFSIZ];
-  char  dest[32];
-  char  gw[32];
-  char  mask[32];
-  char  iface[32];
-  struct in_addr dest_addr;
-  struct in_addr gw_addr;
-  struct in_addr mask_addr;
+  int fd;
+  struct stat st;
+  const char* map = 0;
+  const char* p = 0;
+  const char* end = 0;
+  struct sr_rt* head = 0;
+  struct sr_rt** tail = &head;
+  struct sr_rt* entry = 0;
+  int ret = -1;
 
     /* -- REQUIRES -- */
   assert(filename);
+  assert(list);
   if( access(filename,R_OK) != 0)
   {
     perror("access");
     return -1;
   }
 
-  fp = fopen(filename,"r");
-
-  while (fgets(line,BUFSIZ,fp) != 0) {
-    sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-    if (inet_aton(dest,&dest_addr) == 0) {
-      fprintf(stderr,
-        "Error loading routing table, cannot convert %s to valid IP\n",
-        dest);
+  fd = open(filename, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) != 0)) {
+    perror("open");
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      perror("mmap");
+      close(fd);
       return -1;
     }
-    if (inet_aton(gw,&gw_addr) == 0) {
-      fprintf(stderr,
-        "Error loading routing table, cannot convert %s to valid IP\n",
-        gw);
-      return -1;
+    madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  p = map;
+  end = map + st.st_size;
+  while (p < end) {
+    const char* eol = memchr(p, '\n', end - p);
+    const char* tok[4];
+    size_t len[4];
+    struct in_addr addr[3];
+    int i;
+
+    if (eol == 0)
+      eol = end;
+    for (i = 0; i < 4; i++) {
+      p = sr_rt_token(p, eol, &tok[i], &len[i]);
+      if (len[i] == 0)
+        break;
     }
-    if (inet_aton(mask,&mask_addr) == 0) {
-      fprintf(stderr,
-        "Error loading routing table, cannot convert %s to valid IP\n",
-        mask);
-      return -1;
+    p = eol + 1;
+    if (i < 4)
+      continue; /* -- blank or short line -- */
+
+    for (i = 0; i < 3; i++) {
+      if (sr_rt_aton(tok[i], len[i], &addr[i]) == 0) {
+        fprintf(stderr,
+          "Error loading routing table, cannot convert %.*s to valid IP\n",
+          (int)len[i], tok[i]);
+        goto out;
+      }
     }
-    sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
+
+    entry = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+    assert(entry);
+    entry->next = 0;
+    entry->dest = addr[0];
+    entry->gw   = addr[1];
+    entry->mask = addr[2];
+    if (len[3] >= sr_IFACE_NAMELEN)
+      len[3] = sr_IFACE_NAMELEN - 1;
+    memcpy(entry->interface, tok[3], len[3]);
+    memset(entry->interface + len[3], 0, sr_IFACE_NAMELEN - len[3]);
+
+      /* -- keep a pointer to the tail, no walk per entry -- */
+    *tail = entry;
+    tail = &entry->next;
   } /* -- while -- */
+  ret = 0; /* -- success -- */
+
+out:
+  if (map)
+    munmap((void*)map, st.st_size);
+  if (ret != 0) {
+    sr_free_rt_list(head);
+    head = 0;
+  }
+  *list = head;
+  return ret;
+} /* -- sr_load_rt_list -- */
+
+/*---------------------------------------------------------------------
+ * Method:
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr,const char* filename)
+{
+  struct sr_rt* list = 0;
+  struct sr_rt** tail = 0;
+
+  if (sr_load_rt_list(filename,&list) != 0)
+    return -1;
+
+    /* -- append to what is there already -- */
+  tail = &sr->routing_table;
+  while (*tail) {
+    tail = &(*tail)->next;
+  }
+  *tail = list;
 
   return 0; /* -- success -- */
 } /* -- sr_load_rt -- */
 
+/*---------------------------------------------------------------------
+ * Method:
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_free_rt_list(struct sr_rt* list)
+{
+  struct sr_rt* next = 0;
+
+  while (list) {
+    next = list->next;
+    free(list);
+    list = next;
+  }
+} /* -- sr_free_rt_list -- */
+
 /*---------------------------------------------------------------------
  * Method:
  *
@@ -37,6 +37,12 @@ struct sr_rt
 };
 
 
+/* Reading a file into a list of its own, and freeing one */
+int sr_load_rt_list(const char*, struct sr_rt**);
+void sr_free_rt_list(struct sr_rt*);
+
+/* Both only change the list; the packet path forwards with the FIB, call
+   sr_fib_publish (sr_fib.h) once the routes are in. */
 int sr_load_rt(struct sr_instance*,const char*);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
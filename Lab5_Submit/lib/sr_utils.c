@@ -19,6 +19,24 @@ uint16_t cksum (const void *_data, int len) {
   return sum ? sum : 0xffff;
 }
 
+uint32_t cksum_delta16(uint32_t delta, uint16_t old_word, uint16_t new_word) {
+  delta += (uint16_t)~old_word;
+  delta += new_word;
+  return (delta & 0xffff) + (delta >> 16);
+}
+
+uint32_t cksum_delta32(uint32_t delta, uint32_t old_word, uint32_t new_word) {
+  delta = cksum_delta16(delta, (uint16_t)old_word, (uint16_t)new_word);
+  return cksum_delta16(delta, (uint16_t)(old_word >> 16), (uint16_t)(new_word >> 16));
+}
+
+uint16_t cksum_adjust(uint16_t sum, uint32_t delta) {
+  uint32_t s = (uint16_t)~sum + delta;
+  while (s > 0xffff)
+    s = (s & 0xffff) + (s >> 16);
+  return (uint16_t)~s;
+}
+
 
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
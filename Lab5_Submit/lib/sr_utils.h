@@ -30,6 +30,14 @@
 
 uint16_t cksum(const void *_data, int len);
 
+/* Incremental checksum update (RFC 1624). A delta is the ones' complement
+   sum of ~old + new over every 16 bit word a rewrite changes; both are taken
+   as they sit in the packet, so no byte swapping is needed. */
+uint32_t cksum_delta16(uint32_t delta, uint16_t old_word, uint16_t new_word);
+uint32_t cksum_delta32(uint32_t delta, uint32_t old_word, uint32_t new_word);
+/* Apply a delta to a checksum as stored in the packet. */
+uint16_t cksum_adjust(uint16_t sum, uint32_t delta);
+
 uint16_t ethertype(uint8_t *buf);
 uint8_t ip_protocol(uint8_t *buf);
 
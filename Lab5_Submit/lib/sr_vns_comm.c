@@ -41,6 +41,12 @@
 #include "sr_if.h"
 #include "sr_protocol.h"
 #include "sr_utils.h"
+#include "sr_io.h"
+#include "sr_pkt.h"
+#include "sr_worker.h"
+#include "sr_punt.h"
+#include "sr_stats.h"
+#include "sr_lat.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
@@ -50,8 +56,7 @@
 
 static void sr_log_packet(struct sr_instance* , uint8_t* , int );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
-                                  uint8_t * packet /* lent */,
-                                  unsigned int len,
+                                  struct sr_pkt* pk /* lent */,
                                   char* interface  /* lent */);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
 
@@ -345,8 +350,7 @@ sr_filter_matching_src(struct sr_instance *sr, struct in_addr *src) {
 }
 
 char *sr_filter_interface(struct sr_instance* sr,
-                          uint8_t * packet /* lent */,
-                          unsigned int len,
+                          struct sr_pkt* pk /* lent */,
                           char* interface  /* lent */)
 {
   if (sr->filter_list == NULL)
@@ -356,22 +360,14 @@ char *sr_filter_interface(struct sr_instance* sr,
   struct in_addr *src_addr = NULL;
   struct vns_filter *filter = NULL;
 
-  struct sr_ethernet_hdr *e_hdr;
-  struct sr_ip_hdr *ip_hdr;
-  struct sr_arp_hdr *arp_hdr;
-
-  e_hdr = (struct sr_ethernet_hdr *)packet;
-  ip_hdr = (struct sr_ip_hdr *)(packet + sizeof(struct sr_ethernet_hdr));
-  arp_hdr = (struct sr_arp_hdr *)(packet + sizeof(struct sr_ethernet_hdr));
-
-  if (ntohs(e_hdr->ether_type) == ethertype_ip)
-    src_addr = (struct in_addr *)&(ip_hdr->ip_src);
-  else if (ntohs(e_hdr->ether_type) == ethertype_arp)
-    /* src_addr = (struct in_addr *)&(arp_hdr->ar_sip); */
+  if ((pk->ethertype == ethertype_ip) && (pk->flags & SR_PKT_IP))
+    src_addr = (struct in_addr *)&(sr_pkt_ip(pk)->ip_src);
+  else if (pk->ethertype == ethertype_arp)
+    /* src_addr = (struct in_addr *)&(sr_pkt_arp(pk)->ar_sip); */
     return interface; /* -- dont filter ARP -- */
 
   if (src_addr == NULL) {
-    fprintf(stderr, "unknown ethernet type %d\n", ntohs(e_hdr->ether_type));
+    fprintf(stderr, "unknown ethernet type %d\n", pk->ethertype);
     return NULL;
   }
 
@@ -423,6 +419,10 @@ int sr_read_data_from_socket(int sockfd, uint8_t* buf, size_t len) {
         perror("recv(..):sr_client.c::sr_read_data_from_sock");
         return -1;
       }
+      if (ret == 0) {
+        /* -- the server closed the connection -- */
+        return -1;
+      }
       bytes_read += ret;
     } while ( errno == EINTR); /* be mindful of signals */
   }
@@ -433,24 +433,43 @@ int sr_read_data_from_socket(int sockfd, uint8_t* buf, size_t len) {
 int sr_read_incoming_packet(struct sr_instance* sr, uint8_t* buf, uint32_t len,
   char *interface)
 {
+  /* -- parse the headers once, everything after works from pk -- */
+  struct sr_pkt pk;
+  uint64_t t_in = sr_lat_batch ? sr_lat_batch : sr_lat_stamp();
+  sr_pkt_parse(&pk, buf, len);
+  pk.t_in = t_in;
+  pk.ifp = sr_get_interface(sr, interface);
+  if (pk.ifp)
+    sr_stats_rx(pk.ifp, len);
 
   /* -- check if it is an ARP to another router if so drop   -- */
-  if (sr_arp_req_not_for_us(sr, buf, len, interface))
+  if (sr_arp_req_not_for_us(sr, &pk, interface)) {
+    sr_stats_count(sr_stat_dropped);
     return -1;
+  }
 
   /* print_hdrs(buf, len); */
 
   /* -- apply filters, if any -- */
-  interface = sr_filter_interface(sr, buf, len, interface);
-  if (interface == NULL)
+  char *filtered = sr_filter_interface(sr, &pk, interface);
+  if (filtered == NULL) {
+    sr_stats_count(sr_stat_dropped);
     return -1;
+  }
+  if (filtered != interface) {
+    interface = filtered;
+    pk.ifp = sr_get_interface(sr, interface);
+  }
 
   /* -- log packet -- */
   sr_log_packet(sr, buf, len);
 
   /* -- pass to router, student's code should take over here -- */
   printf("Received packet on interface %s \n", interface);
-  sr_handlepacket(sr, buf, len, interface);
+  /* -- or to the worker of its flow, see sr_worker.h -- */
+  if (sr->workers)
+    return sr_workers_dispatch(sr, &pk);
+  sr_handlepacket_pkt(sr, &pk, interface);
 
   return 0;
 }
@@ -459,9 +478,10 @@ int sr_read_incoming_packet(struct sr_instance* sr, uint8_t* buf, uint32_t len,
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */,
                                int expected_cmd)
 {
-  int ret, command;
+  int ret;
   uint32_t len = 0;
   uint8_t *buf = NULL;
+  struct sr_pbuf *pb = NULL;
   c_packet_header *pkt = NULL;
 
   /* REQUIRES */
@@ -485,7 +505,13 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */,
     return -1;
   }
 
-  if ((buf = malloc(len)) == 0) {
+  /* -- the command is read straight into a packet buffer, so a packet in
+        it is handled, queued and sent on without being copied -- */
+  if (len >= sizeof(c_packet_header) &&
+      (pb = sr_pbuf_alloc(&(sr->pbufs), len - sizeof(c_packet_header))) != NULL) {
+    buf = sr_pbuf_data(pb) - sizeof(c_packet_header);
+  }
+  else if ((buf = malloc(len)) == 0) {
     fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
     return -1;
   }
@@ -500,6 +526,35 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */,
     return -1;
   }
 
+  ret = sr_handle_server_msg(sr, buf, len, expected_cmd);
+
+  fflush(stdout);
+
+  if (pb)
+    sr_pbuf_put(pb);
+  else
+    free(buf);
+  return ret;
+}/* -- sr_read_from_server -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_handle_server_msg(..)
+ * Scope: global
+ *
+ * Handle one complete server command of len bytes at buf. buf is lent: a
+ * packet is handed to sr_handlepacket in place. Returns 1 to carry on, 0
+ * when the server closed the session and -1 on error.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_handle_server_msg(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* lent */,
+                         uint32_t len,
+                         int expected_cmd)
+{
+  int ret, command;
+  c_packet_header *pkt = (c_packet_header *)buf;
+
   /* My entry for most unreadable line of code - guido */
   /* ... you win - mc                                  */
   /* command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1)); */
@@ -546,6 +601,8 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */,
         fprintf(stderr,"Routing table not consistent with hardware\n");
         return -1;
       }
+      sr_init_roles(sr);
+      sr_nat_default_pool(sr);
       printf(" <-- Ready to process packets --> \n");
       break;
 
@@ -573,23 +630,19 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */,
 
   }/* -- switch -- */
 
-  fflush(stdout);
-
-  if (buf) {
-    free(buf);
-  }
   return ret;
-}/* -- sr_read_from_server -- */
+}/* -- sr_handle_server_msg -- */
 
 /*-----------------------------------------------------------------------------
  * Method: sr_ether_addrs_match_interface(..)
  * Scope: Local
  *
  * Make sure ethernet addresses are sane so we don't muck uo the system.
+ * Returns the interface, or 0 if they are not.
  *
  *----------------------------------------------------------------------------*/
 
-static int
+static struct sr_if*
 sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
                                 uint8_t* buf, /* borrowed */
                                 const char* name /* borrowed */ )
@@ -621,7 +674,7 @@ sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
    * Note: This check should really be done server side ...
    */
 
-  return 1;
+  return iface;
 
 } /* -- sr_ether_addrs_match_interface -- */
 
@@ -639,7 +692,10 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
                          unsigned int len,
                          const char* iface /* borrowed */)
 {
+  c_packet_header hdr;
   c_packet_header *sr_pkt;
+  struct sr_pbuf *pb;
+  struct sr_if *ifp;
   unsigned int total_len =  len + (sizeof(c_packet_header));
 
   /* REQUIRES */
@@ -653,23 +709,83 @@ int sr_send_packet(struct sr_instance* sr /* borrowed */,
     return -1;
   }
 
-  /* Create packet */
-  sr_pkt = (c_packet_header *)malloc(len + sizeof(c_packet_header));
-  assert(sr_pkt);
-  sr_pkt->mLen  = htonl(total_len);
-  sr_pkt->mType = htonl(VNSPACKET);
-  strncpy(sr_pkt->mInterfaceName,iface,16);
-  memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header), buf,len);
+  /* iface may point into the headroom of buf, so it is copied out first */
+  hdr.mLen  = htonl(total_len);
+  hdr.mType = htonl(VNSPACKET);
+  strncpy(hdr.mInterfaceName,iface,16);
 
   /* -- log packet -- */
   sr_log_packet(sr,buf,len);
 
-  if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ) {
+  if ( (ifp = sr_ether_addrs_match_interface( sr, buf, iface)) == 0 ) {
     fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-    free ( sr_pkt );
     return -1;
   }
 
+  /* -- counted as sent once it is handed on, see sr_stats.h -- */
+  sr_stats_tx(ifp, len);
+  sr_lat_mark(sr_lat_send, sr_lat_in);
+
+  /* -- a frame in a packet buffer gets the header written into the headroom
+        in front of it and goes out in one piece, without a copy -- */
+  pb = sr_pbuf_of(&(sr->pbufs), buf);
+  if ( pb && buf - pb->room >= sizeof(c_packet_header) ) {
+    sr_pkt = (c_packet_header *)(buf - sizeof(c_packet_header));
+    memcpy(sr_pkt, &hdr, sizeof(c_packet_header));
+    /* -- a worker or the slow path leaves the sending to the I/O thread,
+          see sr_worker.h and sr_punt.h -- */
+    if ( sr_worker_self() )
+      return sr_worker_send(sr, pb, sr_pkt, total_len);
+    if ( sr_punt_self() )
+      return sr_punt_send(sr, pb, sr_pkt, total_len);
+    if ( sr->io ) {
+      if ( sr_io_send_pbuf(sr, pb, sr_pkt, total_len) != 0 ) {
+        fprintf(stderr, "Error writing packet\n");
+        return -1;
+      }
+    }
+    else if ( write(sr->sockfd, sr_pkt, total_len) < total_len ) {
+      fprintf(stderr, "Error writing packet\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  /* -- a worker or the slow path only hands over packet buffers, so the
+        frame is copied into one -- */
+  if ( sr_worker_self() || sr_punt_self() ) {
+    int ret;
+    if ( (pb = sr_pbuf_alloc(sr_pbuf_local(&(sr->pbufs)), len)) == NULL ) {
+      fprintf(stderr, "Error writing packet, no packet buffer\n");
+      return -1;
+    }
+    sr_pkt = (c_packet_header *)(sr_pbuf_data(pb) - sizeof(c_packet_header));
+    memcpy(sr_pkt, &hdr, sizeof(c_packet_header));
+    memcpy(sr_pbuf_data(pb), buf, len);
+    if ( sr_worker_self() )
+      ret = sr_worker_send(sr, pb, sr_pkt, total_len);
+    else
+      ret = sr_punt_send(sr, pb, sr_pkt, total_len);
+    sr_pbuf_put(pb);
+    return ret;
+  }
+
+  /* -- past the handshake the io backend sends the header and the frame
+        without gluing them together first -- */
+  if ( sr->io && sr->io->backend != sr_io_syscall ) {
+    if ( sr_io_send(sr, &hdr, sizeof(hdr), buf, len) != 0 ) {
+      fprintf(stderr, "Error writing packet\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  /* Create packet */
+  sr_pkt = (c_packet_header *)malloc(len + sizeof(c_packet_header));
+  assert(sr_pkt);
+  memcpy(sr_pkt, &hdr, sizeof(c_packet_header));
+  memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header), buf,len);
+
   if ( write(sr->sockfd, sr_pkt, total_len) < total_len ) {
     fprintf(stderr, "Error writing packet\n");
     free(sr_pkt);
@@ -704,8 +820,11 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
   h.caplen = size;
   h.len = (size < PACKET_DUMP_SIZE) ? size : PACKET_DUMP_SIZE;
 
+  /* the workers log too, a record must not be cut by another one */
+  flockfile(sr->logfile);
   sr_dump(sr->logfile, &h, buf);
   fflush(sr->logfile);
+  funlockfile(sr->logfile);
 } /* -- sr_log_packet -- */
 
 /*-----------------------------------------------------------------------------
@@ -715,26 +834,23 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
  *---------------------------------------------------------------------------*/
 
 int  sr_arp_req_not_for_us(struct sr_instance* sr,
-                           uint8_t * packet /* lent */,
-                           unsigned int len,
+                           struct sr_pkt* pk /* lent */,
                            char* interface  /* lent */)
 {
-  struct sr_if* iface = sr_get_interface(sr, interface);
-  struct sr_ethernet_hdr* e_hdr = 0;
+  struct sr_if* iface = pk->ifp;
   struct sr_arp_hdr*      a_hdr = 0;
 
-  if (len < sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr) ) {
+  if (!(pk->flags & SR_PKT_ARP)) {
     return 0;
   }
 
   assert(iface);
 
-  e_hdr = (struct sr_ethernet_hdr*)packet;
-  a_hdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
+  a_hdr = sr_pkt_arp(pk);
 
-  if ((e_hdr->ether_type == htons(ethertype_arp)) &&
-      (a_hdr->ar_op   == htons(arp_op_request))   &&
-      (a_hdr->ar_tip  != iface->ip ) ) {
+  if ((a_hdr->ar_op   == htons(arp_op_request))   &&
+      (a_hdr->ar_tip  != iface->ip ) &&
+      !sr_nat_pool_arp(sr, a_hdr->ar_tip, iface) ) {
     return 1;
   }
 
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include "sr_adj.h"
+#include "sr_arpcache.h"
+
+/* Tool function: adjacency idx, which must be below table->n */
+static struct sr_adj *sr_adj_at(struct sr_adj_table *table, uint32_t idx) {
+  return &(table->chunk[idx / SR_ADJ_CHUNK][idx % SR_ADJ_CHUNK]);
+}
+
+/* Tool function: writes the header and resolved of adj for the lockless
+   readers; the caller holds the ARP cache lock */
+static void sr_adj_publish(struct sr_adj *adj, const uint64_t *ehdr, uint8_t resolved) {
+  uint32_t seq = adj->seq;
+
+  __atomic_store_n(&(adj->seq), seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&(adj->ehdr[0]), ehdr[0], __ATOMIC_RELAXED);
+  __atomic_store_n(&(adj->ehdr[1]), ehdr[1], __ATOMIC_RELAXED);
+  __atomic_store_n(&(adj->resolved), resolved, __ATOMIC_RELAXED);
+  __atomic_store_n(&(adj->seq), seq + 2, __ATOMIC_RELEASE);
+}
+
+uint32_t sr_adj_get(struct sr_arpcache *cache, struct sr_if *iface, uint32_t nexthop) {
+  struct sr_adj_table *table = &(cache->adjs);
+  uint32_t idx;
+
+  pthread_mutex_lock(&(cache->lock));
+
+  for (idx = 0; idx < table->n; idx++) {
+    struct sr_adj *adj = sr_adj_at(table, idx);
+    if ((adj->nexthop == nexthop) && (adj->iface == iface))
+      goto out;
+  }
+  if ((table->n % SR_ADJ_CHUNK) == 0) {
+    struct sr_adj *chunk = NULL;
+    if (table->n < SR_ADJ_MAX)
+      chunk = calloc(SR_ADJ_CHUNK, sizeof(struct sr_adj));
+    if (chunk == NULL) {
+      if (!table->full)
+        fprintf(stderr, "adj: table full at %u next hops, the rest use the arp cache\n",
+                table->n);
+      table->full = 1;
+      idx = SR_ADJ_FULL;
+      goto out;
+    }
+    __atomic_store_n(&(table->chunk[table->n / SR_ADJ_CHUNK]), chunk, __ATOMIC_RELEASE);
+  }
+
+  idx = table->n;
+  struct sr_adj *adj = sr_adj_at(table, idx);
+  uint64_t hdr[2] = { 0, 0 };
+  struct sr_ethernet_hdr *ehdr = (struct sr_ethernet_hdr *)hdr;
+  uint8_t resolved = 0;
+  adj->nexthop = nexthop;
+  adj->iface = iface;
+  memcpy(ehdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
+  ehdr->ether_type = htons(ethertype_ip);
+
+  /* the gateway may be known already */
+  int i;
+  for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+    if ((cache->entries[i].valid) && (cache->entries[i].ip == nexthop)) {
+      memcpy(ehdr->ether_dhost, cache->entries[i].mac, ETHER_ADDR_LEN);
+      resolved = 1;
+    }
+  }
+  sr_adj_publish(adj, hdr, resolved);
+  table->n++;
+
+out:
+  pthread_mutex_unlock(&(cache->lock));
+  return idx;
+}
+
+struct sr_if *sr_adj_write_hdr(struct sr_arpcache *cache, uint32_t idx, uint8_t *frame) {
+  struct sr_adj *chunk;
+  uint64_t hdr[2];
+  uint32_t seq;
+  uint8_t resolved;
+
+  if (idx >= SR_ADJ_MAX)
+    return NULL;
+  chunk = __atomic_load_n(&(cache->adjs.chunk[idx / SR_ADJ_CHUNK]), __ATOMIC_ACQUIRE);
+  if (chunk == NULL)
+    return NULL;
+  struct sr_adj *adj = &(chunk[idx % SR_ADJ_CHUNK]);
+
+  /* a writer is rare and quick; copy again until no write overlapped */
+  do {
+    seq = __atomic_load_n(&(adj->seq), __ATOMIC_ACQUIRE);
+    hdr[0] = __atomic_load_n(&(adj->ehdr[0]), __ATOMIC_RELAXED);
+    hdr[1] = __atomic_load_n(&(adj->ehdr[1]), __ATOMIC_RELAXED);
+    resolved = __atomic_load_n(&(adj->resolved), __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || (__atomic_load_n(&(adj->seq), __ATOMIC_RELAXED) != seq));
+
+  if (!resolved)
+    return NULL;
+  memcpy(frame, hdr, sizeof(struct sr_ethernet_hdr));
+  return adj->iface;
+}
+
+void sr_adj_resolve(struct sr_adj_table *table, uint32_t ip, const unsigned char *mac) {
+  uint32_t idx;
+  for (idx = 0; idx < table->n; idx++) {
+    struct sr_adj *adj = sr_adj_at(table, idx);
+    if (adj->nexthop == ip) {
+      uint64_t hdr[2] = { adj->ehdr[0], adj->ehdr[1] };
+      memcpy(((struct sr_ethernet_hdr *)hdr)->ether_dhost, mac, ETHER_ADDR_LEN);
+      sr_adj_publish(adj, hdr, 1);
+    }
+  }
+}
+
+void sr_adj_unresolve(struct sr_adj_table *table, uint32_t ip) {
+  uint32_t idx;
+  for (idx = 0; idx < table->n; idx++) {
+    struct sr_adj *adj = sr_adj_at(table, idx);
+    if ((adj->nexthop == ip) && adj->resolved)
+      sr_adj_publish(adj, adj->ehdr, 0);
+  }
+}
+
+void sr_adj_destroy(struct sr_adj_table *table) {
+  uint32_t i;
+  for (i = 0; i < SR_ADJ_CHUNKS; i++) {
+    free(table->chunk[i]);
+    table->chunk[i] = NULL;
+  }
+  table->n = 0;
+}
@@ -0,0 +1,69 @@
+/* This file defines the adjacency table. An adjacency is one next hop: the
+   egress interface and the gateway behind it, with the 14-byte ethernet
+   header every packet sent to that gateway gets (the gateway's MAC, the
+   interface's MAC, IPv4) built once. Next hops of the FIB point to their
+   adjacency (sr_fib_nh.adj), and routes through the same gateway share one,
+   so forwarding is a longest prefix match and a 14-byte copy.
+
+   The table lives in the ARP cache and is kept in step with it: when the
+   gateway's MAC is learned every adjacency to it becomes resolved at once,
+   and when the cache entry times out they go back to unresolved, which
+   sends their packets through the ARP request queue again. Writers hold
+   the ARP cache lock. Readers take no lock: each adjacency has a sequence
+   number, odd while it is being written, and a reader copies the header
+   again if the number changed under it.
+
+   The table grows by SR_ADJ_CHUNK entries at a time, up to SR_ADJ_MAX. A
+   chunk never moves once published, so an index stays valid. Past
+   SR_ADJ_MAX a next hop is marked SR_ADJ_FULL and its header is built from
+   the ARP cache for every packet (sr_fib_nh_write_hdr). */
+
+#ifndef SR_ADJ_H
+#define SR_ADJ_H
+
+#include <inttypes.h>
+#include "sr_protocol.h"
+#include "sr_if.h"
+
+#define SR_ADJ_CHUNK  64                            /* adjacencies per chunk */
+#define SR_ADJ_CHUNKS 256
+#define SR_ADJ_MAX    (SR_ADJ_CHUNK * SR_ADJ_CHUNKS) /* next hops */
+#define SR_ADJ_NONE   0xffffffffu  /* route not bound to an adjacency yet */
+#define SR_ADJ_FULL   0xfffffffeu  /* no adjacency to spare, use the ARP cache */
+
+struct sr_adj {
+  uint32_t seq;                  /* odd while the header is written */
+  uint8_t  resolved;
+  uint32_t nexthop;              /* gateway, network byte order */
+  struct sr_if *iface;           /* egress */
+  uint64_t ehdr[2];              /* the ethernet header, in its first 14
+                                    bytes; the destination is only set if
+                                    resolved */
+};
+
+struct sr_adj_table {
+  struct sr_adj *chunk[SR_ADJ_CHUNKS];
+  uint32_t n;
+  uint8_t  full;                 /* a next hop did not fit */
+};
+
+struct sr_arpcache;
+
+/* Returns the adjacency for nexthop on iface, adding it if there is none
+   yet, or SR_ADJ_FULL if the table cannot grow. */
+uint32_t sr_adj_get(struct sr_arpcache *cache, struct sr_if *iface, uint32_t nexthop);
+
+/* Copies the ethernet header of adjacency idx to frame and returns its
+   egress interface, or returns NULL (frame untouched) if the adjacency is
+   not resolved or idx is none. Takes no lock. */
+struct sr_if *sr_adj_write_hdr(struct sr_arpcache *cache, uint32_t idx, uint8_t *frame);
+
+/* Called by the ARP cache, with its lock held, when ip is learned as mac
+   or its entry is gone. */
+void sr_adj_resolve(struct sr_adj_table *table, uint32_t ip, const unsigned char *mac);
+void sr_adj_unresolve(struct sr_adj_table *table, uint32_t ip);
+
+/* Frees the chunks; no reader may be left. */
+void sr_adj_destroy(struct sr_adj_table *table);
+
+#endif /* SR_ADJ_H */
@@ -10,6 +10,7 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_lat.h"
 
 /* This function gets called every second. See the comments in the header file
    for an idea of what it should look like. */
@@ -48,15 +49,34 @@ struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
   return copy;
 }
 
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip, unsigned char *mac) {
+  pthread_mutex_lock(&(cache->lock));
+
+  int found = 0;
+  int i;
+  for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+    if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
+      memcpy(mac, cache->entries[i].mac, 6);
+      found = 1;
+    }
+  }
+
+  pthread_mutex_unlock(&(cache->lock));
+
+  return found;
+}
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. You should free the passed *packet.
+   that corresponds to this ARP request. The packet stays where it is, the
+   queue keeps the reference to pb it is given.
 
    A pointer to the ARP request is returned; it should not be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
-                                       uint8_t *packet,           /* borrowed */
+                                       uint8_t *packet,           /* held by pb */
+                                       struct sr_pbuf *pb,        /* given */
                                        unsigned int packet_len,
                                        char *iface)
 {
@@ -81,13 +101,16 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
     struct sr_packet *new_pkt =
       (struct sr_packet *) malloc(sizeof(struct sr_packet));
 
-    new_pkt->buf = (uint8_t *)malloc(packet_len);
-    memcpy(new_pkt->buf, packet, packet_len);
+    new_pkt->buf = packet;
+    new_pkt->pb = pb;
     new_pkt->len = packet_len;
-    new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
     strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
+    new_pkt->queued = sr_lat_stamp();
+    new_pkt->t_in = sr_lat_in;
     new_pkt->next = req->packets;
     req->packets = new_pkt;
+  } else {
+    sr_pbuf_put(pb);
   }
 
   pthread_mutex_unlock(&(cache->lock));
@@ -143,6 +166,7 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
     cache->entries[i].ip = ip;
     cache->entries[i].added = time(NULL);
     cache->entries[i].valid = 1;
+    sr_adj_resolve(&(cache->adjs), ip, mac);
   }
 
   pthread_mutex_unlock(&(cache->lock));
@@ -177,10 +201,7 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
 
     for (pkt = entry->packets; pkt; pkt = nxt) {
       nxt = pkt->next;
-      if (pkt->buf)
-        free(pkt->buf);
-      if (pkt->iface)
-        free(pkt->iface);
+      sr_pbuf_put(pkt->pb);
       free(pkt);
     }
 
@@ -215,6 +236,7 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
     /* Invalidate all entries */
   memset(cache->entries, 0, sizeof(cache->entries));
   cache->requests = NULL;
+  memset(&(cache->adjs), 0, sizeof(cache->adjs));
 
     /* Acquire mutex lock */
   pthread_mutexattr_init(&(cache->attr));
@@ -226,53 +248,58 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    sr_adj_destroy(&(cache->adjs));
     return pthread_mutex_destroy(&(cache->lock)) &&
            pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
-void *sr_arpcache_timeout(void *sr_ptr) {
-  struct sr_instance *sr = sr_ptr;
+/* Sweeps through the cache and invalidates entries that were added more than
+   SR_ARPCACHE_TO seconds ago, then resends or gives up on pending requests.
+   Called once a second from the event loop. */
+void sr_arpcache_tick(struct sr_instance *sr) {
   struct sr_arpcache *cache = &(sr->cache);
 
-  while (1) {
-    sleep(1.0);
-
-    pthread_mutex_lock(&(cache->lock));
+  pthread_mutex_lock(&(cache->lock));
 
-    time_t curtime = time(NULL);
+  time_t curtime = time(NULL);
 
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-      if ((cache->entries[i].valid) &&
-          (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-        cache->entries[i].valid = 0;
+  int i;
+  for (i = 0; i < SR_ARPCACHE_SZ; i++) {
+    if ((cache->entries[i].valid) &&
+        (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
+      cache->entries[i].valid = 0;
+      /* the adjacencies follow a newer entry for the ip, if there is one */
+      int j;
+      for (j = 0; j < SR_ARPCACHE_SZ; j++) {
+        if ((cache->entries[j].valid) && (cache->entries[j].ip == cache->entries[i].ip))
+          break;
       }
-      struct sr_arpreq * req_walker = cache->requests;
-      struct sr_arpreq * req_prev = NULL;
-      while(req_walker){
-        if((req_walker->sent != 0)&&((difftime(curtime, req_walker->sent)>SR_ARPCACHE_TO))) {
-          struct sr_packet* pkt_walker = req_walker->packets;
-          while(pkt_walker){
-            // send out the icmp unreachable packet
-            sr_handlepacket_icmpUnreachable(sr, pkt_walker->buf, pkt_walker->len, pkt_walker->iface, 3, 1);
-            pkt_walker = pkt_walker->next;
-          }
-        }
-        if(req_prev != NULL){
-          req_prev->next = req_walker->next;
+      if (j < SR_ARPCACHE_SZ)
+        sr_adj_resolve(&(cache->adjs), cache->entries[j].ip, cache->entries[j].mac);
+      else
+        sr_adj_unresolve(&(cache->adjs), cache->entries[i].ip);
+    }
+    struct sr_arpreq * req_walker = cache->requests;
+    struct sr_arpreq * req_prev = NULL;
+    while(req_walker){
+      if((req_walker->sent != 0)&&((difftime(curtime, req_walker->sent)>SR_ARPCACHE_TO))) {
+        struct sr_packet* pkt_walker = req_walker->packets;
+        while(pkt_walker){
+          // send out the icmp unreachable packet
+          sr_handlepacket_icmpUnreachable(sr, pkt_walker->buf, pkt_walker->len, pkt_walker->iface, 3, 1);
+          pkt_walker = pkt_walker->next;
         }
-        req_prev = req_walker;
-        req_walker = req_walker->next;
       }
+      if(req_prev != NULL){
+        req_prev->next = req_walker->next;
+      }
+      req_prev = req_walker;
+      req_walker = req_walker->next;
     }
-
-    sr_arpcache_sweepreqs(sr);
-
-    pthread_mutex_unlock(&(cache->lock));
   }
 
-  return NULL;
+  sr_arpcache_sweepreqs(sr);
+
+  pthread_mutex_unlock(&(cache->lock));
 }
 
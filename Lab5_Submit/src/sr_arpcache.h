@@ -70,6 +70,8 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_pbuf.h"
+#include "sr_adj.h"
 
 #define SR_ARPCACHE_SZ    100
 #define SR_ARPCACHE_TO    15.0
@@ -77,7 +79,10 @@
 struct sr_packet {
     uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
     unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
+    struct sr_pbuf *pb;         /* Packet buffer holding buf, one reference */
+    char iface[sr_IFACE_NAMELEN]; /* The outgoing interface */
+    uint64_t queued;            /* Stamped when queued, 0 if not (sr_lat.h) */
+    uint64_t t_in;              /* The packet's stamp when received */
     struct sr_packet *next;
 };
 
@@ -102,6 +107,7 @@ struct sr_arpreq {
 struct sr_arpcache {
     struct sr_arpentry entries[SR_ARPCACHE_SZ];
     struct sr_arpreq *requests;
+    struct sr_adj_table adjs;   /* Next hops, kept in step with the entries */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -110,16 +116,23 @@ struct sr_arpcache {
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
+/* As sr_arpcache_lookup, but copies the MAC to mac instead of allocating a
+   copy of the entry. Returns 1 if the IP was found, 0 otherwise. */
+int sr_arpcache_lookup_mac(struct sr_arpcache *cache, uint32_t ip, unsigned char *mac);
+
 /* Adds an ARP request to the ARP request queue. If the request is already on
    the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+   that corresponds to this ARP request. The packet is not copied: pb is the
+   packet buffer holding it (see sr_pbuf_hold), and the reference the caller
+   passes in belongs to the queue from then on. It is put when the request
+   is destroyed.
 
    A pointer to the ARP request is returned; it should be freed. The caller
    can remove the ARP request from the queue by calling sr_arpreq_destroy. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
-                         uint8_t *packet,               /* borrowed */
+                         uint8_t *packet,               /* held by pb */
+                         struct sr_pbuf *pb,            /* given */
                          unsigned int packet_len,
                          char *iface);
 
@@ -142,11 +155,11 @@ void sr_arpcache_dump(struct sr_arpcache *cache);
 
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and the tick, run once a second by the event loop, times
+   out cache entries every 15 seconds. */
 
 int   sr_arpcache_init(struct sr_arpcache *cache);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
-void *sr_arpcache_timeout(void *cache_ptr);
+void  sr_arpcache_tick(struct sr_instance *sr);
 
 #endif
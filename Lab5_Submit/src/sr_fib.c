@@ -0,0 +1,840 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "sr_fib.h"
+#include "sr_rt.h"
+#include "sr_router.h"
+#include "sr_rcu.h"
+
+#define SR_FIB_TBL16_SZ (1 << 16)
+
+/* serializes the swaps and the changes in place, the readers take no
+   lock */
+static pthread_mutex_t sr_fib_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A prefix of the FIB, SR_FIB_KEY, and its next hop index + 1 share one
+   64-bit slot, the key in the low 40 bits; 0 is a free slot. */
+#define SR_FIB_KEY(prefix, len) (((uint64_t)(prefix) << 8) | (len))
+#define SR_FIB_KEY_MASK         0xffffffffffull
+#define SR_FIB_PFX_VAL(slot)    ((uint32_t)((slot) >> 40))
+
+/* open addressing with linear probing, at most half full */
+struct sr_fib_pfxtab {
+  uint64_t *slot;
+  uint32_t bits;
+  uint32_t n;
+};
+
+/* What changing a published FIB in place needs besides the FIB itself.
+   Only the writer, holding sr_fib_lock, uses it; a copy of the FIB takes
+   it over. */
+struct sr_fib_upd {
+  struct sr_fib_pfxtab pfx;     /* the prefixes, each with its next hop */
+
+  /* chunks unlinked and the grace period each one waits for, oldest
+     first: a ring of limbo_cap entries starting at limbo_head */
+  uint32_t *limbo;
+  uint64_t *limbo_gp;
+  uint32_t limbo_head;
+  uint32_t nlimbo;
+  uint32_t limbo_cap;
+};
+
+/* Tool function: prefix length of a next hop entry */
+static inline unsigned int sr_fib_entry_len(uint32_t e) {
+  return (e >> SR_FIB_LEN_SHIFT) & 0x3f;
+}
+
+/* Tool function: length of a contiguous mask (host order), -1 if it is
+   not contiguous */
+static int sr_fib_mask_len(uint32_t mask) {
+  int len = 0;
+  while ((len < 32) && (mask & (0x80000000u >> len)))
+    len++;
+  if ((len < 32) && (mask << len))
+    return -1;
+  return len;
+}
+
+static int sr_fib_limbo_get(struct sr_fib_upd *upd, uint32_t *chunk);
+
+/* Tool function: a new chunk with all its entries set to fill; a FIB
+   changed in place reuses retired chunks and never moves its chunks */
+static int sr_fib_chunk_new(struct sr_fib *fib, uint32_t fill, uint32_t *idx) {
+  uint32_t i;
+
+  if (fib->upd && (sr_fib_limbo_get(fib->upd, idx) == 0)) {
+    for (i = 0; i < 256; i++)
+      fib->chunks[(*idx << 8) | i] = fill;
+    return 0;
+  }
+  if ((fib->nchunks == fib->chunks_cap) && fib->upd)
+    return -1;
+  if (fib->nchunks == fib->chunks_cap) {
+    uint32_t cap = fib->chunks_cap ? fib->chunks_cap * 2 : 64;
+    uint32_t *chunks = realloc(fib->chunks, (size_t)cap * 256 * sizeof(uint32_t));
+    if (chunks == NULL)
+      return -1;
+    fib->chunks = chunks;
+    fib->chunks_cap = cap;
+  }
+  *idx = fib->nchunks++;
+  for (i = 0; i < 256; i++)
+    fib->chunks[(*idx << 8) | i] = fill;
+  return 0;
+}
+
+/* Tool function: the chunk below entry pos of tbl16 (top) or of the chunk
+   array, made from the entry's next hop if there is none yet */
+static int sr_fib_chunk_at(struct sr_fib *fib, int top, uint32_t pos, uint32_t *idx) {
+  uint32_t e = top ? fib->tbl16[pos] : fib->chunks[pos];
+
+  if (e & SR_FIB_CHUNK) {
+    *idx = e & ~SR_FIB_CHUNK;
+    return 0;
+  }
+  if (sr_fib_chunk_new(fib, e, idx) != 0)
+    return -1;
+  /* the chunk array may have moved; a reader that sees the link sees the
+     chunk filled in */
+  if (top)
+    __atomic_store_n(&(fib->tbl16[pos]), SR_FIB_CHUNK | *idx, __ATOMIC_RELEASE);
+  else
+    __atomic_store_n(&(fib->chunks[pos]), SR_FIB_CHUNK | *idx, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Tool function: put next hop entry val of prefix length len into *e,
+   unless a prefix at least as long is there; a chunk gets it in every
+   entry below */
+static void sr_fib_fill(struct sr_fib *fib, uint32_t *e, uint32_t val, unsigned int len) {
+  if (*e & SR_FIB_CHUNK) {
+    uint32_t *chunk = &(fib->chunks[(*e & ~SR_FIB_CHUNK) << 8]);
+    int i;
+    for (i = 0; i < 256; i++)
+      sr_fib_fill(fib, &chunk[i], val, len);
+  } else if ((*e == 0) || (len > sr_fib_entry_len(*e))) {
+    *e = val;
+  }
+}
+
+/* Tool function: expand prefix/len (host order) with next hop nh */
+static int sr_fib_insert(struct sr_fib *fib, uint32_t prefix, unsigned int len, uint32_t nh) {
+  uint32_t val = (len << SR_FIB_LEN_SHIFT) | (nh + 1);
+  uint32_t base, n, i, c;
+
+  if (len <= 16) {
+    base = prefix >> 16;
+    n = 1u << (16 - len);
+    for (i = 0; i < n; i++)
+      sr_fib_fill(fib, &(fib->tbl16[base + i]), val, len);
+    return 0;
+  }
+  if (sr_fib_chunk_at(fib, 1, prefix >> 16, &c) != 0)
+    return -1;
+  if (len <= 24) {
+    base = (c << 8) | ((prefix >> 8) & 0xff);
+    n = 1u << (24 - len);
+  } else {
+    if (sr_fib_chunk_at(fib, 0, (c << 8) | ((prefix >> 8) & 0xff), &c) != 0)
+      return -1;
+    base = (c << 8) | (prefix & 0xff);
+    n = 1u << (32 - len);
+  }
+  for (i = 0; i < n; i++)
+    sr_fib_fill(fib, &(fib->chunks[base + i]), val, len);
+  return 0;
+}
+
+/* Tool function: index of the next hop gw out of iface, added if new */
+static int sr_fib_nh_get(struct sr_fib *fib, uint32_t gw, const char *iface, uint32_t *idx) {
+  uint32_t i;
+
+  for (i = 0; i < fib->nnh; i++) {
+    if ((fib->nh[i].gw == gw) &&
+        (strncmp(fib->nh[i].interface, iface, sr_IFACE_NAMELEN) == 0)) {
+      *idx = i;
+      return 0;
+    }
+  }
+  if (fib->nnh == SR_FIB_NH_MASK)
+    return -1;
+  if ((fib->nnh == fib->nh_cap) && fib->upd)
+    return -1;
+  if (fib->nnh == fib->nh_cap) {
+    uint32_t cap = fib->nh_cap ? fib->nh_cap * 2 : 16;
+    struct sr_fib_nh *nh = realloc(fib->nh, cap * sizeof(struct sr_fib_nh));
+    if (nh == NULL)
+      return -1;
+    fib->nh = nh;
+    fib->nh_cap = cap;
+  }
+  *idx = fib->nnh++;
+  fib->nh[*idx].gw = gw;
+  fib->nh[*idx].adj = SR_ADJ_NONE;
+  strncpy(fib->nh[*idx].interface, iface, sr_IFACE_NAMELEN);
+  return 0;
+}
+
+void sr_fib_free(void *arg) {
+  struct sr_fib *fib = arg;
+  if (fib == NULL)
+    return;
+  if (fib->map) {
+    munmap(fib->map, fib->map_len);
+  } else {
+    free(fib->tbl16);
+    free(fib->chunks);
+  }
+  free(fib->nh);
+  if (fib->upd) {
+    free(fib->upd->pfx.slot);
+    free(fib->upd->limbo);
+    free(fib->upd->limbo_gp);
+    free(fib->upd);
+  }
+  free(fib);
+}
+
+/* The routes go in by increasing prefix length so a longer prefix always
+   overwrites a shorter one; of two equal prefixes the first one in the
+   table is kept, as the list walk did. */
+struct sr_fib *sr_fib_build(struct sr_rt *rib) {
+  struct sr_fib *fib = calloc(1, sizeof(struct sr_fib));
+  struct sr_rt **order = NULL;
+  uint32_t count[34] = {0};
+  struct sr_rt *rt;
+  uint32_t n = 0, i;
+
+  if (fib == NULL)
+    return NULL;
+  fib->tbl16 = calloc(SR_FIB_TBL16_SZ, sizeof(uint32_t));
+  if (fib->tbl16 == NULL)
+    goto fail;
+
+  /* bucket the routes by prefix length, count[len + 1] is where they
+     start in order[] */
+  for (rt = rib; rt; rt = rt->next) {
+    int len = sr_fib_mask_len(ntohl(rt->mask.s_addr));
+    if (len < 0)
+      continue;
+    count[len + 1]++;
+    n++;
+  }
+  for (i = 1; i < 34; i++)
+    count[i] += count[i - 1];
+  order = malloc((n ? n : 1) * sizeof(struct sr_rt *));
+  if (order == NULL)
+    goto fail;
+  for (rt = rib; rt; rt = rt->next) {
+    int len = sr_fib_mask_len(ntohl(rt->mask.s_addr));
+    if (len < 0) {
+      fprintf(stderr, "fib: mask %08x is not contiguous, route skipped\n",
+        ntohl(rt->mask.s_addr));
+      continue;
+    }
+    order[count[len]++] = rt;
+  }
+
+  for (i = 0; i < n; i++) {
+    uint32_t mask = ntohl(order[i]->mask.s_addr);
+    uint32_t nh;
+    if ((sr_fib_nh_get(fib, order[i]->gw.s_addr, order[i]->interface, &nh) != 0) ||
+        (sr_fib_insert(fib, ntohl(order[i]->dest.s_addr) & mask,
+                       sr_fib_mask_len(mask), nh) != 0))
+      goto fail;
+  }
+  fib->nroutes = n;
+  free(order);
+  return fib;
+
+fail:
+  fprintf(stderr, "Error: out of memory (sr_fib_build)\n");
+  free(order);
+  sr_fib_free(fib);
+  return NULL;
+}
+
+int sr_fib_publish(struct sr_instance *sr) {
+  struct sr_fib *fib = sr_fib_build(sr->routing_table);
+
+  if (fib == NULL)
+    return -1;
+  sr_fib_swap(sr, fib);
+  return 0;
+}
+
+void sr_fib_lookup_bulk(const struct sr_fib *fib, const uint32_t *dst,
+                        struct sr_fib_nh **nh, unsigned int n) {
+  uint32_t ip[SR_FIB_BULK], e[SR_FIB_BULK];
+  unsigned int base, m, i;
+
+  if (fib == NULL) {
+    for (i = 0; i < n; i++)
+      nh[i] = NULL;
+    return;
+  }
+  for (base = 0; base < n; base += m) {
+    m = (n - base < SR_FIB_BULK) ? n - base : SR_FIB_BULK;
+
+    for (i = 0; i < m; i++) {
+      ip[i] = ntohl(dst[base + i]);
+      __builtin_prefetch(&(fib->tbl16[ip[i] >> 16]));
+    }
+    /* top 16 bits, then the chunks for the next 8 and the last 8 */
+    for (i = 0; i < m; i++) {
+      e[i] = sr_fib_entry(fib->tbl16[ip[i] >> 16]);
+      if (e[i] & SR_FIB_CHUNK)
+        __builtin_prefetch(&(fib->chunks[((e[i] & ~SR_FIB_CHUNK) << 8) | ((ip[i] >> 8) & 0xff)]));
+    }
+    for (i = 0; i < m; i++) {
+      if (e[i] & SR_FIB_CHUNK) {
+        e[i] = sr_fib_entry(fib->chunks[((e[i] & ~SR_FIB_CHUNK) << 8) | ((ip[i] >> 8) & 0xff)]);
+        if (e[i] & SR_FIB_CHUNK)
+          __builtin_prefetch(&(fib->chunks[((e[i] & ~SR_FIB_CHUNK) << 8) | (ip[i] & 0xff)]));
+      }
+    }
+    for (i = 0; i < m; i++) {
+      if (e[i] & SR_FIB_CHUNK)
+        e[i] = sr_fib_entry(fib->chunks[((e[i] & ~SR_FIB_CHUNK) << 8) | (ip[i] & 0xff)]);
+      nh[base + i] = (e[i] & SR_FIB_NH_MASK) ? &(fib->nh[(e[i] & SR_FIB_NH_MASK) - 1]) : NULL;
+    }
+  }
+}
+
+/* Tool function: publish fib and retire the old one, holding sr_fib_lock */
+static void sr_fib_replace(struct sr_instance *sr, struct sr_fib *fib) {
+  struct sr_fib *old = __atomic_exchange_n(&(sr->fib), fib, __ATOMIC_ACQ_REL);
+
+  __atomic_add_fetch(&(sr->fib_gen), 1, __ATOMIC_RELEASE);
+  if (old)
+    sr_rcu_defer(sr_fib_free, old);
+}
+
+void sr_fib_swap(struct sr_instance *sr, struct sr_fib *fib) {
+  pthread_mutex_lock(&sr_fib_lock);
+  sr_fib_replace(sr, fib);
+  pthread_mutex_unlock(&sr_fib_lock);
+
+  fprintf(stderr, "fib: %u routes, %u next hops, %u chunks, %zu KB\n",
+    fib->nroutes, fib->nnh, fib->nchunks,
+    (SR_FIB_TBL16_SZ + (size_t)fib->nchunks * 256) * sizeof(uint32_t) / 1024);
+}
+
+void sr_fib_withdraw(struct sr_instance *sr) {
+  pthread_mutex_lock(&sr_fib_lock);
+  sr_fib_replace(sr, NULL);
+  pthread_mutex_unlock(&sr_fib_lock);
+
+  fprintf(stderr, "fib: withdrawn, no routes\n");
+}
+
+uint32_t sr_fib_nh_adj(struct sr_instance *sr, struct sr_fib_nh *nh) {
+  /* the binding is the only thing ever written to a published FIB; racing
+     threads get the same adjacency from sr_adj_get */
+  uint32_t adj = __atomic_load_n(&(nh->adj), __ATOMIC_RELAXED);
+
+  if (adj == SR_ADJ_NONE) {
+    struct sr_if *iface = sr_get_interface(sr, nh->interface);
+    if (iface) {
+      adj = sr_adj_get(&(sr->cache), iface, nh->gw);
+      __atomic_store_n(&(nh->adj), adj, __ATOMIC_RELAXED);
+    }
+  }
+  return adj;
+}
+
+struct sr_if *sr_fib_nh_write_hdr(struct sr_instance *sr, struct sr_fib_nh *nh, uint8_t *frame) {
+  uint32_t adj = sr_fib_nh_adj(sr, nh);
+  if (adj != SR_ADJ_FULL)
+    return sr_adj_write_hdr(&(sr->cache), adj, frame);
+
+  /* no adjacency to spare: the header is built from the ARP cache */
+  struct sr_if *iface = sr_get_interface(sr, nh->interface);
+  struct sr_ethernet_hdr *ehdr = (struct sr_ethernet_hdr *)frame;
+  unsigned char mac[ETHER_ADDR_LEN];
+  if ((iface == NULL) || !sr_arpcache_lookup_mac(&(sr->cache), nh->gw, mac))
+    return NULL;
+  memcpy(ehdr->ether_dhost, mac, ETHER_ADDR_LEN);
+  memcpy(ehdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
+  ehdr->ether_type = htons(ethertype_ip);
+  return iface;
+}
+
+/* Changes in place. The writer holds sr_fib_lock throughout; every entry a
+   reader may be looking at is written with one release store. */
+
+/* Tool function: slot key hashes to */
+static inline uint32_t sr_fib_pfx_hash(const struct sr_fib_pfxtab *t, uint64_t key) {
+  return (uint32_t)((key * 0x9e3779b97f4a7c15ull) >> (64 - t->bits));
+}
+
+/* Tool function: the slot of key, or the free slot it would go in */
+static uint64_t *sr_fib_pfx_find(const struct sr_fib_pfxtab *t, uint64_t key) {
+  uint32_t mask = (1u << t->bits) - 1;
+  uint32_t i = sr_fib_pfx_hash(t, key);
+
+  while (t->slot[i] && ((t->slot[i] & SR_FIB_KEY_MASK) != key))
+    i = (i + 1) & mask;
+  return &(t->slot[i]);
+}
+
+/* Tool function: next hop index + 1 of key, 0 if it is not there */
+static inline uint32_t sr_fib_pfx_get(const struct sr_fib_pfxtab *t, uint64_t key) {
+  return SR_FIB_PFX_VAL(*sr_fib_pfx_find(t, key));
+}
+
+/* Tool function: an empty table with room for n prefixes */
+static int sr_fib_pfx_init(struct sr_fib_pfxtab *t, uint32_t n) {
+  t->bits = 10;
+  while ((1ull << t->bits) < 2ull * n)
+    t->bits++;
+  t->n = 0;
+  t->slot = calloc((size_t)1 << t->bits, sizeof(uint64_t));
+  return (t->slot == NULL) ? -1 : 0;
+}
+
+/* Tool function: sets key to val, growing the table if need be */
+static int sr_fib_pfx_put(struct sr_fib_pfxtab *t, uint64_t key, uint32_t val) {
+  uint64_t *p;
+
+  if ((t->n + 1) * 2ull > (1ull << t->bits)) {
+    struct sr_fib_pfxtab grown;
+    uint32_t i;
+    if (sr_fib_pfx_init(&grown, t->n + 1) != 0)
+      return -1;
+    for (i = 0; i < (1u << t->bits); i++) {
+      if (t->slot[i])
+        *sr_fib_pfx_find(&grown, t->slot[i] & SR_FIB_KEY_MASK) = t->slot[i];
+    }
+    grown.n = t->n;
+    free(t->slot);
+    *t = grown;
+  }
+  p = sr_fib_pfx_find(t, key);
+  if (*p == 0)
+    t->n++;
+  *p = key | ((uint64_t)val << 40);
+  return 0;
+}
+
+/* Tool function: removes key, moving back the entries probed past it */
+static void sr_fib_pfx_remove(struct sr_fib_pfxtab *t, uint64_t key) {
+  uint32_t mask = (1u << t->bits) - 1;
+  uint64_t *p = sr_fib_pfx_find(t, key);
+  uint32_t i = p - t->slot, j = i;
+
+  if (*p == 0)
+    return;
+  t->n--;
+  for (;;) {
+    uint32_t k;
+    j = (j + 1) & mask;
+    if (t->slot[j] == 0)
+      break;
+    /* slot j stays if its home is cyclically in (i, j] */
+    k = sr_fib_pfx_hash(t, t->slot[j] & SR_FIB_KEY_MASK);
+    if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+      continue;
+    t->slot[i] = t->slot[j];
+    i = j;
+  }
+  t->slot[i] = 0;
+}
+
+/* Tool function: index of the next hop gw out of iface, -1 if none */
+static int sr_fib_nh_find(const struct sr_fib *fib, uint32_t gw, const char *iface) {
+  uint32_t i;
+
+  for (i = 0; i < fib->nnh; i++) {
+    if ((fib->nh[i].gw == gw) &&
+        (strncmp(fib->nh[i].interface, iface, sr_IFACE_NAMELEN) == 0))
+      return i;
+  }
+  return -1;
+}
+
+/* Tool function: the state for changing fib in place, made on first use
+   with the prefixes of rib, which fib was compiled from; of two routes
+   for a prefix the first one is in the FIB */
+static struct sr_fib_upd *sr_fib_upd_get(struct sr_fib *fib, struct sr_rt *rib) {
+  struct sr_fib_upd *upd;
+  struct sr_rt *rt;
+
+  if (fib->upd)
+    return fib->upd;
+  upd = calloc(1, sizeof(struct sr_fib_upd));
+  if ((upd == NULL) || (sr_fib_pfx_init(&(upd->pfx), fib->nroutes) != 0))
+    goto fail;
+  for (rt = rib; rt; rt = rt->next) {
+    uint32_t mask = ntohl(rt->mask.s_addr);
+    int len = sr_fib_mask_len(mask);
+    uint64_t key, *p;
+    int nh;
+    if (len < 0)
+      continue;
+    /* the table is sized for every route, no need to grow it */
+    key = SR_FIB_KEY(ntohl(rt->dest.s_addr) & mask, len);
+    p = sr_fib_pfx_find(&(upd->pfx), key);
+    if (*p)
+      continue;
+    nh = sr_fib_nh_find(fib, rt->gw.s_addr, rt->interface);
+    if (nh < 0) {
+      fprintf(stderr, "fib: routing table does not match the FIB\n");
+      goto fail;
+    }
+    *p = key | ((uint64_t)(nh + 1) << 40);
+    upd->pfx.n++;
+  }
+  fib->upd = upd;
+  fib->nroutes = upd->pfx.n;
+  return upd;
+
+fail:
+  if (upd)
+    free(upd->pfx.slot);
+  free(upd);
+  return NULL;
+}
+
+/* Tool function: chunk c was unlinked, it can be reused once the readers
+   that may still be in it are gone; if there is no memory to remember it
+   it is lost until the FIB is rebuilt */
+static void sr_fib_limbo_put(struct sr_fib_upd *upd, uint32_t c) {
+  uint32_t i;
+
+  if (upd->nlimbo == upd->limbo_cap) {
+    uint32_t cap = upd->limbo_cap ? upd->limbo_cap * 2 : 64;
+    uint32_t *limbo = malloc(cap * sizeof(uint32_t));
+    uint64_t *gp = malloc(cap * sizeof(uint64_t));
+    if ((limbo == NULL) || (gp == NULL)) {
+      free(limbo);
+      free(gp);
+      return;
+    }
+    for (i = 0; i < upd->nlimbo; i++) {
+      uint32_t j = (upd->limbo_head + i) & (upd->limbo_cap - 1);
+      limbo[i] = upd->limbo[j];
+      gp[i] = upd->limbo_gp[j];
+    }
+    free(upd->limbo);
+    free(upd->limbo_gp);
+    upd->limbo = limbo;
+    upd->limbo_gp = gp;
+    upd->limbo_head = 0;
+    upd->limbo_cap = cap;
+  }
+  i = (upd->limbo_head + upd->nlimbo) & (upd->limbo_cap - 1);
+  upd->limbo[i] = c;
+  upd->limbo_gp[i] = sr_rcu_retire();
+  upd->nlimbo++;
+}
+
+/* Tool function: the oldest retired chunk if its grace period is over */
+static int sr_fib_limbo_get(struct sr_fib_upd *upd, uint32_t *chunk) {
+  if ((upd->nlimbo == 0) || !sr_rcu_passed(upd->limbo_gp[upd->limbo_head]))
+    return -1;
+  *chunk = upd->limbo[upd->limbo_head];
+  upd->limbo_head = (upd->limbo_head + 1) & (upd->limbo_cap - 1);
+  upd->nlimbo--;
+  return 0;
+}
+
+/* Tool function: a copy of fib on the heap, with room to grow */
+static struct sr_fib *sr_fib_copy(const struct sr_fib *fib) {
+  struct sr_fib *copy = calloc(1, sizeof(struct sr_fib));
+
+  if (copy == NULL)
+    return NULL;
+  copy->chunks_cap = fib->nchunks + fib->nchunks / 2 + 64;
+  copy->nh_cap = fib->nnh * 2 + 16;
+  copy->tbl16 = malloc(SR_FIB_TBL16_SZ * sizeof(uint32_t));
+  copy->chunks = malloc((size_t)copy->chunks_cap * 256 * sizeof(uint32_t));
+  copy->nh = malloc(copy->nh_cap * sizeof(struct sr_fib_nh));
+  if ((copy->tbl16 == NULL) || (copy->chunks == NULL) || (copy->nh == NULL)) {
+    sr_fib_free(copy);
+    return NULL;
+  }
+  memcpy(copy->tbl16, fib->tbl16, SR_FIB_TBL16_SZ * sizeof(uint32_t));
+  memcpy(copy->chunks, fib->chunks, (size_t)fib->nchunks * 256 * sizeof(uint32_t));
+  memcpy(copy->nh, fib->nh, fib->nnh * sizeof(struct sr_fib_nh));
+  copy->nchunks = fib->nchunks;
+  copy->nnh = fib->nnh;
+  copy->nroutes = fib->nroutes;
+  return copy;
+}
+
+/* Tool function: the published FIB, ready for one change in place: it has
+   its state and room for the two chunks and the next hop a route may
+   need. One that is mapped or full is copied and the copy published. */
+static struct sr_fib *sr_fib_writable(struct sr_instance *sr) {
+  struct sr_fib *fib = sr->fib;
+  struct sr_fib *copy;
+
+  if (fib == NULL) {
+    fib = sr_fib_build(NULL);
+    if (fib == NULL)
+      return NULL;
+    sr_fib_replace(sr, fib);
+  }
+  if (sr_fib_upd_get(fib, sr->routing_table) == NULL)
+    return NULL;
+  if ((fib->map == NULL) && (fib->chunks_cap - fib->nchunks >= 2) &&
+      (fib->nnh < fib->nh_cap))
+    return fib;
+
+  copy = sr_fib_copy(fib);
+  if (copy == NULL)
+    return NULL;
+  copy->upd = fib->upd;
+  fib->upd = NULL;
+  sr_fib_replace(sr, copy);
+  return copy;
+}
+
+/* Tool function: *e is a chunk standing for depth bits of the address;
+   if its 256 entries are all the same next hop of a prefix no longer than
+   that, *e takes the next hop and the chunk is retired */
+static void sr_fib_fold(struct sr_fib *fib, uint32_t *e, unsigned int depth) {
+  uint32_t c = *e & ~SR_FIB_CHUNK;
+  const uint32_t *chunk = &(fib->chunks[c << 8]);
+  uint32_t v = chunk[0];
+  int i;
+
+  if ((v & SR_FIB_CHUNK) || (v && (sr_fib_entry_len(v) > depth)))
+    return;
+  for (i = 1; i < 256; i++) {
+    if (chunk[i] != v)
+      return;
+  }
+  __atomic_store_n(e, v, __ATOMIC_RELEASE);
+  sr_fib_limbo_put(fib->upd, c);
+}
+
+/* Tool function: change entry *e (standing for depth bits) and all below
+   it for a prefix of length len: an add takes the entries held by no
+   prefix or one no longer than len, a delete hands those held by len
+   itself over to val, the route covering it */
+static void sr_fib_change(struct sr_fib *fib, uint32_t *e, uint32_t val,
+                          unsigned int len, int del, unsigned int depth) {
+  uint32_t cur = *e;
+
+  if (cur & SR_FIB_CHUNK) {
+    uint32_t *chunk = &(fib->chunks[(cur & ~SR_FIB_CHUNK) << 8]);
+    int i;
+    for (i = 0; i < 256; i++)
+      sr_fib_change(fib, &chunk[i], val, len, del, depth + 8);
+    if (del)
+      sr_fib_fold(fib, e, depth);
+  } else if (del ? (cur && (sr_fib_entry_len(cur) == len))
+                 : ((cur == 0) || (sr_fib_entry_len(cur) <= len))) {
+    __atomic_store_n(e, val, __ATOMIC_RELEASE);
+  }
+}
+
+/* Tool function: apply an add or delete of prefix/len (host order) to the
+   entries it covers, at the level its length ends in */
+static int sr_fib_apply(struct sr_fib *fib, uint32_t prefix, unsigned int len,
+                        uint32_t val, int del) {
+  uint32_t *top, *mid = NULL, *base;
+  uint32_t n, i, c;
+  unsigned int depth;
+
+  if (len <= 16) {
+    for (i = 0; i < (1u << (16 - len)); i++)
+      sr_fib_change(fib, &(fib->tbl16[(prefix >> 16) + i]), val, len, del, 16);
+    return 0;
+  }
+  top = &(fib->tbl16[prefix >> 16]);
+  if (del && !(*top & SR_FIB_CHUNK))
+    return 0;
+  if (sr_fib_chunk_at(fib, 1, prefix >> 16, &c) != 0)
+    return -1;
+  if (len <= 24) {
+    base = &(fib->chunks[(c << 8) | ((prefix >> 8) & 0xff)]);
+    n = 1u << (24 - len);
+    depth = 24;
+  } else {
+    mid = &(fib->chunks[(c << 8) | ((prefix >> 8) & 0xff)]);
+    if (del && !(*mid & SR_FIB_CHUNK))
+      return 0;
+    if (sr_fib_chunk_at(fib, 0, (c << 8) | ((prefix >> 8) & 0xff), &c) != 0)
+      return -1;
+    base = &(fib->chunks[(c << 8) | (prefix & 0xff)]);
+    n = 1u << (32 - len);
+    depth = 32;
+  }
+  for (i = 0; i < n; i++)
+    sr_fib_change(fib, &base[i], val, len, del, depth);
+  if (del) {
+    if (mid)
+      sr_fib_fold(fib, mid, 24);
+    sr_fib_fold(fib, top, 16);
+  }
+  return 0;
+}
+
+/* Tool function: add (or change) or delete prefix/len (host order),
+   holding sr_fib_lock; 1 if the FIB changed */
+static int sr_fib_change_route(struct sr_instance *sr, uint32_t prefix, unsigned int len,
+                               uint32_t gw, const char *iface, int del) {
+  struct sr_fib *fib = sr_fib_writable(sr);
+  struct sr_fib_pfxtab *pfx;
+  uint64_t key = SR_FIB_KEY(prefix, len);
+  uint32_t cur, val = 0, nh;
+
+  if (fib == NULL) {
+    fprintf(stderr, "Error: out of memory (sr_fib_change_route)\n");
+    return -1;
+  }
+  pfx = &(fib->upd->pfx);
+  cur = sr_fib_pfx_get(pfx, key);
+
+  if (del) {
+    int l;
+    if (cur == 0)
+      return -1;
+    /* the entries fall back to the longest prefix covering this one */
+    for (l = (int)len - 1; l >= 0; l--) {
+      uint32_t m = l ? 0xffffffffu << (32 - l) : 0;
+      uint32_t up = sr_fib_pfx_get(pfx, SR_FIB_KEY(prefix & m, l));
+      if (up) {
+        val = ((uint32_t)l << SR_FIB_LEN_SHIFT) | up;
+        break;
+      }
+    }
+    sr_fib_apply(fib, prefix, len, val, 1);
+    sr_fib_pfx_remove(pfx, key);
+  } else {
+    if (sr_fib_nh_get(fib, gw, iface, &nh) != 0)
+      return -1;
+    if (cur == nh + 1)
+      return 0;
+    if ((sr_fib_pfx_put(pfx, key, nh + 1) != 0) ||
+        (sr_fib_apply(fib, prefix, len, (len << SR_FIB_LEN_SHIFT) | (nh + 1), 0) != 0)) {
+      fprintf(stderr, "Error: out of memory (sr_fib_change_route)\n");
+      return -1;
+    }
+  }
+  fib->nroutes = pfx->n;
+  __atomic_add_fetch(&(sr->fib_gen), 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+int sr_fib_add(struct sr_instance *sr, uint32_t dest, uint32_t mask,
+               uint32_t gw, const char *iface) {
+  int len = sr_fib_mask_len(ntohl(mask));
+  int ret;
+
+  if (len < 0)
+    return -1;
+  pthread_mutex_lock(&sr_fib_lock);
+  ret = sr_fib_change_route(sr, ntohl(dest & mask), len, gw, iface, 0);
+  pthread_mutex_unlock(&sr_fib_lock);
+  return (ret < 0) ? -1 : 0;
+}
+
+int sr_fib_del(struct sr_instance *sr, uint32_t dest, uint32_t mask) {
+  int len = sr_fib_mask_len(ntohl(mask));
+  int ret;
+
+  if (len < 0)
+    return -1;
+  pthread_mutex_lock(&sr_fib_lock);
+  ret = sr_fib_change_route(sr, ntohl(dest & mask), len, 0, NULL, 1);
+  pthread_mutex_unlock(&sr_fib_lock);
+  return (ret < 0) ? -1 : 0;
+}
+
+/* a route sr_fib_update makes sure the FIB has */
+struct sr_fib_want {
+  struct sr_rt *rt;
+  uint64_t key;
+};
+
+/* The routes rib wants are indexed first (the first route for a prefix
+   wins, as in sr_fib_build); new and changed ones go in before the stale
+   ones are removed, so a prefix split into longer ones stays covered. */
+int sr_fib_update(struct sr_instance *sr, struct sr_rt *rib) {
+  struct sr_fib_want *want = NULL;
+  struct sr_fib_pfxtab idx = { NULL, 0, 0 };
+  uint64_t *stale = NULL;
+  uint32_t nwant = 0, nstale = 0, i;
+  struct sr_fib *fib;
+  struct sr_rt *rt;
+  int changed = 0, ret;
+
+  for (rt = rib; rt; rt = rt->next)
+    nwant++;
+  want = malloc((nwant ? nwant : 1) * sizeof(struct sr_fib_want));
+  if ((want == NULL) || (sr_fib_pfx_init(&idx, nwant) != 0))
+    goto fail;
+  for (nwant = 0, rt = rib; rt; rt = rt->next) {
+    uint32_t mask = ntohl(rt->mask.s_addr);
+    int len = sr_fib_mask_len(mask);
+    uint64_t key;
+    if (len < 0)
+      continue;
+    key = SR_FIB_KEY(ntohl(rt->dest.s_addr) & mask, len);
+    if (sr_fib_pfx_get(&idx, key))
+      continue;
+    if (sr_fib_pfx_put(&idx, key, 1) != 0)
+      goto fail;
+    want[nwant].rt = rt;
+    want[nwant++].key = key;
+  }
+
+  pthread_mutex_lock(&sr_fib_lock);
+  for (i = 0; i < nwant; i++) {
+    const struct sr_fib_nh *nh;
+    uint32_t cur;
+    fib = sr_fib_writable(sr);
+    if (fib == NULL)
+      goto fail_locked;
+    cur = sr_fib_pfx_get(&(fib->upd->pfx), want[i].key);
+    nh = cur ? &(fib->nh[cur - 1]) : NULL;
+    if (nh && (nh->gw == want[i].rt->gw.s_addr) &&
+        (strncmp(nh->interface, want[i].rt->interface, sr_IFACE_NAMELEN) == 0))
+      continue;
+    ret = sr_fib_change_route(sr, want[i].key >> 8, want[i].key & 0xff,
+      want[i].rt->gw.s_addr, want[i].rt->interface, 0);
+    if (ret < 0)
+      goto fail_locked;
+    changed += ret;
+  }
+
+  fib = sr_fib_writable(sr);
+  if (fib == NULL)
+    goto fail_locked;
+  stale = malloc(((fib->upd->pfx.n > idx.n) ? fib->upd->pfx.n - idx.n : 1) * sizeof(uint64_t));
+  if (stale == NULL)
+    goto fail_locked;
+  for (i = 0; i < (1u << fib->upd->pfx.bits); i++) {
+    uint64_t key = fib->upd->pfx.slot[i] & SR_FIB_KEY_MASK;
+    if (fib->upd->pfx.slot[i] && (sr_fib_pfx_get(&idx, key) == 0))
+      stale[nstale++] = key;
+  }
+  for (i = 0; i < nstale; i++) {
+    ret = sr_fib_change_route(sr, stale[i] >> 8, stale[i] & 0xff, 0, NULL, 1);
+    if (ret < 0)
+      goto fail_locked;
+    changed += ret;
+  }
+  pthread_mutex_unlock(&sr_fib_lock);
+
+  free(stale);
+  free(idx.slot);
+  free(want);
+  return changed;
+
+fail_locked:
+  pthread_mutex_unlock(&sr_fib_lock);
+fail:
+  fprintf(stderr, "Error: out of memory (sr_fib_update)\n");
+  free(stale);
+  free(idx.slot);
+  free(want);
+  return -1;
+}
@@ -0,0 +1,151 @@
+/* This file defines the FIB, the forwarding table the packet path looks
+   routes up in. The routing table (sr->routing_table, sr_rt.h) stays the
+   RIB: the list the routes are loaded into, printed and verified from.
+   sr_fib_publish compiles it into a FIB and swaps that in for the old one.
+
+   A FIB is a 16-8-8 multibit trie: the top 16 bits of the destination
+   index a table of 64K entries, longer prefixes hang off it in 256-entry
+   chunks for the next 8 bits and the last 8 bits, so a lookup is one to
+   three loads whatever the number of routes. An entry is empty (0), a
+   chunk, or a next hop together with the length of the prefix it came
+   from; a prefix is expanded into every entry it covers that no longer
+   prefix has claimed.
+
+   The packet path reads the published FIB through sr_fib_deref without
+   locks; a FIB that is replaced is freed through sr_rcu_defer once every
+   packet thread has been quiescent (sr_rcu.h), so a lookup result stays
+   valid until the thread's next quiescent state.
+
+   Routes can also be added, changed and removed in the published FIB
+   (sr_fib_add, sr_fib_del, sr_fib_update), one writer at a time. Only the
+   entries the prefix covers are rewritten, each with a single atomic
+   store, so a lookup racing with it sees the old route or the new one and
+   never waits. A chunk is written before it is linked in, and one that
+   is unlinked is reused only after a grace period. When the FIB runs out
+   of room for chunks or next hops, or is a read-only snapshot mapping, it
+   is copied with room to spare and the copy published instead. */
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include "sr_if.h"
+#include "sr_adj.h"
+
+#define SR_FIB_CHUNK     0x80000000u /* entry is a chunk index */
+#define SR_FIB_LEN_SHIFT 24          /* prefix length of a next hop entry */
+#define SR_FIB_NH_MASK   0x00ffffffu /* next hop index + 1 */
+
+struct sr_instance;
+struct sr_rt;
+struct sr_fib_upd;
+
+struct sr_fib_nh {
+  uint32_t gw;                  /* network byte order */
+  uint32_t adj;                 /* adjacency, bound on first use */
+  char interface[sr_IFACE_NAMELEN];
+};
+
+struct sr_fib {
+  uint32_t *tbl16;              /* 1 << 16 entries */
+  uint32_t *chunks;             /* nchunks * 256 entries */
+  uint32_t nchunks;
+  uint32_t chunks_cap;
+  struct sr_fib_nh *nh;
+  uint32_t nnh;
+  uint32_t nh_cap;
+  uint32_t nroutes;
+  void *map;                    /* tbl16 and chunks point into this
+                                   mapped snapshot if set, sr_fibsnap.h */
+  size_t map_len;
+  struct sr_fib_upd *upd;       /* prefixes and free chunks, made by the
+                                   first change in place */
+};
+
+/* The FIB currently published at p, for lookups. */
+#define sr_fib_deref(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/* An entry of a FIB that may be changed under the reader, ordered with
+   the chunk it links to. */
+#define sr_fib_entry(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/* Returns the next hop of the longest prefix matching dst (network byte
+   order), or NULL if no route matches or fib is NULL. */
+static inline struct sr_fib_nh *sr_fib_lookup(const struct sr_fib *fib, uint32_t dst) {
+  uint32_t ip, e;
+
+  if (fib == NULL)
+    return NULL;
+  ip = ntohl(dst);
+  e = sr_fib_entry(fib->tbl16[ip >> 16]);
+  if (e & SR_FIB_CHUNK) {
+    e = sr_fib_entry(fib->chunks[((e & ~SR_FIB_CHUNK) << 8) | ((ip >> 8) & 0xff)]);
+    if (e & SR_FIB_CHUNK)
+      e = sr_fib_entry(fib->chunks[((e & ~SR_FIB_CHUNK) << 8) | (ip & 0xff)]);
+  }
+  return (e & SR_FIB_NH_MASK) ? &(fib->nh[(e & SR_FIB_NH_MASK) - 1]) : NULL;
+}
+
+/* The generation of the published FIB's routes: sr_fib_swap,
+   sr_fib_withdraw and every change in place bump it once the lookups see
+   the change. What was derived from a lookup (a NAT rewrite's next hop)
+   is stale once the generation read before that lookup has moved on. */
+#define sr_fib_gen(sr) __atomic_load_n(&((sr)->fib_gen), __ATOMIC_ACQUIRE)
+
+/* Looks up n destinations at once, nh[i] getting what sr_fib_lookup would
+   return for dst[i]. The destinations go through the trie a level at a
+   time, SR_FIB_BULK of them together: the entries they need at the next
+   level are prefetched for all of them before any is read, so their cache
+   misses overlap instead of following one another. */
+#define SR_FIB_BULK 64
+void sr_fib_lookup_bulk(const struct sr_fib *fib, const uint32_t *dst,
+                        struct sr_fib_nh **nh, unsigned int n);
+
+/* Compiles the routing table into a new FIB and publishes it; the old one
+   is reclaimed once no thread can still be reading it. Call it after
+   changing sr->routing_table. Returns -1 (keeping the old FIB) if out of
+   memory. */
+int sr_fib_publish(struct sr_instance *sr);
+
+/* The two halves of sr_fib_publish: compiles a routing table list into a
+   FIB (NULL if out of memory), which may be done on any thread, and
+   publishes a compiled FIB, taking it over. */
+struct sr_fib *sr_fib_build(struct sr_rt *rib);
+void sr_fib_swap(struct sr_instance *sr, struct sr_fib *fib);
+
+/* Unpublishes the FIB, so that every lookup finds no route, for a FIB that
+   is known to be wrong and cannot be rebuilt. */
+void sr_fib_withdraw(struct sr_instance *sr);
+
+/* Adds the route dest/mask via gw out of iface (network byte order) to the
+   published FIB, or changes the next hop of the route already there for
+   dest/mask; sr_fib_del removes it. They change the FIB only, a caller
+   that keeps routes in sr->routing_table as well updates it itself. The
+   first change to a FIB indexes its prefixes, taking them from
+   sr->routing_table, which it must have been compiled from. Returns -1 if
+   the mask is not contiguous or out of memory (the route is then as it
+   was), sr_fib_del also if there is no such route. */
+int sr_fib_add(struct sr_instance *sr, uint32_t dest, uint32_t mask,
+               uint32_t gw, const char *iface);
+int sr_fib_del(struct sr_instance *sr, uint32_t dest, uint32_t mask);
+
+/* Changes the published FIB in place into the one rib would compile to,
+   adding, changing and removing only the routes that differ. Returns the
+   number of routes changed, or -1 if out of memory, leaving the FIB part
+   way: publish a FIB built from rib then. */
+int sr_fib_update(struct sr_instance *sr, struct sr_rt *rib);
+
+/* Frees a FIB that is not published. */
+void sr_fib_free(void *fib);
+
+/* The adjacency of nh, bound the first time it is used since the
+   interfaces are only known once connected. */
+uint32_t sr_fib_nh_adj(struct sr_instance *sr, struct sr_fib_nh *nh);
+
+/* Writes the ethernet header for nh to frame and returns the egress
+   interface, or NULL if the next hop is not resolved: from its adjacency,
+   or from the ARP cache if the adjacency table is full. */
+struct sr_if *sr_fib_nh_write_hdr(struct sr_instance *sr, struct sr_fib_nh *nh, uint8_t *frame);
+
+#endif /* SR_FIB_H */
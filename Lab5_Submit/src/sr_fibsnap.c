@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "sr_fibsnap.h"
+#include "sr_fib.h"
+#include "sr_rt.h"
+#include "sr_router.h"
+
+#define SR_FIBSNAP_TBL16_LEN ((size_t)(1 << 16) * sizeof(uint32_t))
+#define SR_FIBSNAP_CHUNK_LEN ((size_t)256 * sizeof(uint32_t))
+
+/* Tool function: CRC32C (Castagnoli) one byte at a time */
+static uint32_t sr_fibsnap_crc_sw(uint32_t crc, const uint8_t *p, size_t n) {
+  static uint32_t table[256];
+  static int ready;
+  size_t i;
+
+  if (!ready) {
+    uint32_t b, k;
+    for (b = 0; b < 256; b++) {
+      uint32_t c = b;
+      for (k = 0; k < 8; k++)
+        c = (c & 1) ? (c >> 1) ^ 0x82f63b78u : (c >> 1);
+      table[b] = c;
+    }
+    ready = 1;
+  }
+  for (i = 0; i < n; i++)
+    crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+/* Tool function: CRC32C with the SSE4.2 instruction, 8 bytes at a time */
+__attribute__((target("sse4.2")))
+static uint32_t sr_fibsnap_crc_hw(uint32_t crc, const uint8_t *p, size_t n) {
+  uint64_t c = crc;
+  while (n >= 8) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    c = __builtin_ia32_crc32di(c, w);
+    p += 8;
+    n -= 8;
+  }
+  crc = (uint32_t)c;
+  while (n--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#endif
+
+/* Tool function: continue the CRC32C crc (start with 0) over [p, p+n) */
+static uint32_t sr_fibsnap_crc(uint32_t crc, const void *p, size_t n) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return ~sr_fibsnap_crc_hw(crc, p, n);
+#endif
+  return ~sr_fibsnap_crc_sw(crc, p, n);
+}
+
+/* Tool function: every entry of the tables points at a next hop or chunk
+   that exists, and the chunks form at most two levels, so a lookup never
+   leaves the mapping */
+static int sr_fibsnap_check_tables(const uint32_t *tbl16, const uint32_t *chunks,
+                                   uint32_t nchunks, uint32_t nnh) {
+  uint8_t *level = calloc(nchunks ? nchunks : 1, 1);
+  uint32_t i, c, j;
+  int ret = -1;
+
+  if (level == NULL)
+    return -1;
+  for (i = 0; i < (1 << 16); i++) {
+    uint32_t e = tbl16[i];
+    if (!(e & SR_FIB_CHUNK)) {
+      if ((e & SR_FIB_NH_MASK) > nnh)
+        goto out;
+      continue;
+    }
+    c = e & ~SR_FIB_CHUNK;
+    if ((c >= nchunks) || (level[c] == 3))
+      goto out;
+    level[c] = 2;
+  }
+  /* a second level chunk's chunks are the third level */
+  for (c = 0; c < nchunks; c++) {
+    for (j = 0; j < 256; j++) {
+      uint32_t e = chunks[(c << 8) | j];
+      if (!(e & SR_FIB_CHUNK)) {
+        if ((e & SR_FIB_NH_MASK) > nnh)
+          goto out;
+        continue;
+      }
+      uint32_t d = e & ~SR_FIB_CHUNK;
+      if ((level[c] != 2) || (d >= nchunks) || (level[d] == 2))
+        goto out;
+      level[d] = 3;
+    }
+  }
+  ret = 0;
+
+out:
+  free(level);
+  return ret;
+}
+
+int sr_fibsnap_load(struct sr_instance *sr, const char *path) {
+  struct sr_fibsnap_hdr hdr;
+  struct stat st;
+  struct sr_fib *fib = NULL;
+  struct sr_rt *rib = NULL, **tail = &rib;
+  uint8_t *map = MAP_FAILED;
+  const char *why = "not a snapshot";
+  uint32_t i;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(hdr))) {
+    close(fd);
+    goto bad;
+  }
+  /* the whole file is read by the check anyway */
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    why = "cannot map it";
+    goto bad;
+  }
+
+  memcpy(&hdr, map, sizeof(hdr));
+  if ((memcmp(hdr.magic, SR_FIBSNAP_MAGIC, sizeof(hdr.magic)) != 0) ||
+      (hdr.version != SR_FIBSNAP_VERSION) || (hdr.hdr_len != sizeof(hdr)))
+    goto bad;
+  why = "truncated";
+  if ((hdr.nnh > SR_FIB_NH_MASK) || (hdr.nchunks >= SR_FIB_CHUNK) ||
+      (hdr.len != (uint64_t)st.st_size - sizeof(hdr)) ||
+      (hdr.len != SR_FIBSNAP_TBL16_LEN + (uint64_t)hdr.nchunks * SR_FIBSNAP_CHUNK_LEN +
+                  (uint64_t)hdr.nnh * sizeof(struct sr_fibsnap_nh) +
+                  (uint64_t)hdr.nroutes * sizeof(struct sr_fibsnap_route)))
+    goto bad;
+  why = "checksum mismatch";
+  if (sr_fibsnap_crc(0, map + sizeof(hdr), hdr.len) != hdr.crc)
+    goto bad;
+
+  const uint32_t *tbl16 = (const uint32_t *)(map + sizeof(hdr));
+  const uint32_t *chunks = tbl16 + (1 << 16);
+  const struct sr_fibsnap_nh *nh =
+    (const struct sr_fibsnap_nh *)(chunks + (size_t)hdr.nchunks * 256);
+  const struct sr_fibsnap_route *routes =
+    (const struct sr_fibsnap_route *)(nh + hdr.nnh);
+
+  why = "bad table entry";
+  if (sr_fibsnap_check_tables(tbl16, chunks, hdr.nchunks, hdr.nnh) != 0)
+    goto bad;
+
+  why = "out of memory";
+  fib = calloc(1, sizeof(struct sr_fib));
+  if (fib == NULL)
+    goto bad;
+  fib->nh = malloc((hdr.nnh ? hdr.nnh : 1) * sizeof(struct sr_fib_nh));
+  if (fib->nh == NULL)
+    goto bad;
+  for (i = 0; i < hdr.nnh; i++) {
+    fib->nh[i].gw = nh[i].gw;
+    fib->nh[i].adj = SR_ADJ_NONE;
+    memcpy(fib->nh[i].interface, nh[i].interface, sr_IFACE_NAMELEN);
+    fib->nh[i].interface[sr_IFACE_NAMELEN - 1] = 0;
+  }
+
+  for (i = 0; i < hdr.nroutes; i++) {
+    struct sr_rt *rt;
+    if (routes[i].nh >= hdr.nnh) {
+      why = "bad route";
+      goto bad;
+    }
+    rt = malloc(sizeof(struct sr_rt));
+    if (rt == NULL)
+      goto bad;
+    rt->dest.s_addr = routes[i].dest;
+    rt->mask.s_addr = routes[i].mask;
+    rt->gw.s_addr = fib->nh[routes[i].nh].gw;
+    memcpy(rt->interface, fib->nh[routes[i].nh].interface, sr_IFACE_NAMELEN);
+    rt->next = NULL;
+    *tail = rt;
+    tail = &(rt->next);
+  }
+
+  /* the tables stay in the mapping, which the FIB now owns */
+  fib->tbl16 = (uint32_t *)tbl16;
+  fib->chunks = (uint32_t *)chunks;
+  fib->nchunks = fib->chunks_cap = hdr.nchunks;
+  fib->nnh = fib->nh_cap = hdr.nnh;
+  fib->nroutes = hdr.nroutes;
+  fib->map = map;
+  fib->map_len = st.st_size;
+
+  sr->routing_table = rib;
+  sr_fib_swap(sr, fib);
+  return 0;
+
+bad:
+  fprintf(stderr, "fibsnap: %s: %s, not used\n", path, why);
+  sr_free_rt_list(rib);
+  if (fib) {
+    free(fib->nh);
+    free(fib);
+  }
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+  return -1;
+}
+
+/* Tool function: fwrite that keeps the CRC of what it wrote */
+static int sr_fibsnap_write(FILE *fp, const void *p, size_t n, uint32_t *crc) {
+  if (n && (fwrite(p, n, 1, fp) != 1))
+    return -1;
+  *crc = sr_fibsnap_crc(*crc, p, n);
+  return 0;
+}
+
+int sr_fibsnap_save(const char *path, const struct sr_fib *fib, struct sr_rt *rib) {
+  struct sr_fibsnap_hdr hdr;
+  struct sr_fibsnap_nh nh;
+  struct sr_fibsnap_route route;
+  struct sr_rt *rt;
+  char tmp[512];
+  uint32_t crc = 0, i, n = 0;
+  FILE *fp;
+
+  /* the routes refer to the FIB's next hops, so every route must be in
+     the FIB */
+  for (rt = rib; rt; rt = rt->next)
+    n++;
+  if ((fib == NULL) || (n != fib->nroutes)) {
+    fprintf(stderr, "fibsnap: routes missing from the FIB, no snapshot written\n");
+    return -1;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fp = fopen(tmp, "wb");
+  if (fp == NULL) {
+    perror("fopen(..):sr_fibsnap.c::sr_fibsnap_save");
+    return -1;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SR_FIBSNAP_MAGIC, sizeof(hdr.magic));
+  hdr.version = SR_FIBSNAP_VERSION;
+  hdr.hdr_len = sizeof(hdr);
+  hdr.nroutes = fib->nroutes;
+  hdr.nnh = fib->nnh;
+  hdr.nchunks = fib->nchunks;
+  hdr.len = SR_FIBSNAP_TBL16_LEN + (uint64_t)fib->nchunks * SR_FIBSNAP_CHUNK_LEN +
+            (uint64_t)fib->nnh * sizeof(nh) + (uint64_t)fib->nroutes * sizeof(route);
+  /* the header goes in again once the CRC is known */
+  if ((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ||
+      (sr_fibsnap_write(fp, fib->tbl16, SR_FIBSNAP_TBL16_LEN, &crc) != 0) ||
+      (sr_fibsnap_write(fp, fib->chunks, (size_t)fib->nchunks * SR_FIBSNAP_CHUNK_LEN, &crc) != 0))
+    goto fail;
+  for (i = 0; i < fib->nnh; i++) {
+    memset(&nh, 0, sizeof(nh));
+    nh.gw = fib->nh[i].gw;
+    strncpy(nh.interface, fib->nh[i].interface, sr_IFACE_NAMELEN - 1);
+    if (sr_fibsnap_write(fp, &nh, sizeof(nh), &crc) != 0)
+      goto fail;
+  }
+  for (rt = rib; rt; rt = rt->next) {
+    /* next hops are few, a scan is fine */
+    for (i = 0; i < fib->nnh; i++) {
+      if ((fib->nh[i].gw == rt->gw.s_addr) &&
+          (strncmp(fib->nh[i].interface, rt->interface, sr_IFACE_NAMELEN) == 0))
+        break;
+    }
+    if (i == fib->nnh)
+      goto fail;
+    route.dest = rt->dest.s_addr;
+    route.mask = rt->mask.s_addr;
+    route.nh = i;
+    if (sr_fibsnap_write(fp, &route, sizeof(route), &crc) != 0)
+      goto fail;
+  }
+  hdr.crc = crc;
+  if ((fseek(fp, 0, SEEK_SET) != 0) || (fwrite(&hdr, sizeof(hdr), 1, fp) != 1))
+    goto fail;
+  if (fclose(fp) != 0) {
+    fp = NULL;
+    goto fail;
+  }
+  if (rename(tmp, path) != 0) {
+    perror("rename(..):sr_fibsnap.c::sr_fibsnap_save");
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+
+fail:
+  fprintf(stderr, "fibsnap: cannot write %s\n", tmp);
+  if (fp)
+    fclose(fp);
+  unlink(tmp);
+  return -1;
+}
+
+int sr_fibsnap_fresh(const char *path, const char *rtable) {
+  struct stat snap, text;
+
+  if (stat(path, &snap) != 0)
+    return 0;
+  if (stat(rtable, &text) != 0)
+    return 1;
+  if (snap.st_mtim.tv_sec != text.st_mtim.tv_sec)
+    return snap.st_mtim.tv_sec > text.st_mtim.tv_sec;
+  return snap.st_mtim.tv_nsec > text.st_mtim.tv_nsec;
+}
@@ -0,0 +1,69 @@
+/* This file defines the FIB snapshot, a binary image of a compiled FIB
+   and of the routing table it was compiled from, so a large table can be
+   brought up without parsing and compiling it again. Started with
+   -S file, the router boots from the snapshot when it is valid and newer
+   than the rtable file, and otherwise loads the rtable file and writes
+   the snapshot for the next start.
+
+   The file is mapped read-only and the FIB's tables point straight into
+   the mapping; only the next hops (a few) and the routing table list are
+   copied out. Layout, all in host byte order:
+
+     struct sr_fibsnap_hdr
+     uint32_t tbl16[1 << 16]
+     uint32_t chunks[nchunks * 256]
+     struct sr_fibsnap_nh    nh[nnh]
+     struct sr_fibsnap_route routes[nroutes]
+
+   The header carries a CRC32C of everything after it, and every entry of
+   the tables is checked to point at a chunk or next hop that exists, so a
+   truncated or damaged file is refused rather than forwarded with. */
+
+#ifndef SR_FIBSNAP_H
+#define SR_FIBSNAP_H
+
+#include <inttypes.h>
+#include "sr_if.h"
+
+#define SR_FIBSNAP_MAGIC   "srfib\r\n"  /* 8 bytes with the nul */
+#define SR_FIBSNAP_VERSION 1
+
+struct sr_fibsnap_hdr {
+  char     magic[8];
+  uint32_t version;
+  uint32_t hdr_len;            /* sizeof(struct sr_fibsnap_hdr) */
+  uint32_t nroutes;
+  uint32_t nnh;
+  uint32_t nchunks;
+  uint32_t crc;                /* CRC32C of the rest of the file */
+  uint64_t len;                /* length of the rest of the file */
+};
+
+struct sr_fibsnap_nh {
+  uint32_t gw;                 /* network byte order */
+  char     interface[sr_IFACE_NAMELEN];
+};
+
+struct sr_fibsnap_route {
+  uint32_t dest;               /* network byte order */
+  uint32_t mask;               /* network byte order */
+  uint32_t nh;                 /* index into nh[] */
+};
+
+struct sr_instance;
+struct sr_fib;
+struct sr_rt;
+
+/* Boots from the snapshot at path: maps it, checks it, publishes its FIB
+   and makes its routes sr->routing_table, which must be empty. Returns
+   -1, leaving sr as it was, if the file is missing or not valid. */
+int sr_fibsnap_load(struct sr_instance *sr, const char *path);
+
+/* Writes fib and the routing table rib it was compiled from to path
+   (through a temporary file and a rename). Returns -1 on failure. */
+int sr_fibsnap_save(const char *path, const struct sr_fib *fib, struct sr_rt *rib);
+
+/* 1 if path exists and was written after rtable was last changed. */
+int sr_fibsnap_fresh(const char *path, const char *rtable);
+
+#endif /* SR_FIBSNAP_H */
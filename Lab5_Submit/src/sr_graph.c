@@ -0,0 +1,469 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include "sr_graph.h"
+#include "sr_router.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_if.h"
+#include "sr_fib.h"
+#include "sr_adj.h"
+#include "sr_pkt.h"
+#include "sr_pbuf.h"
+#include "sr_punt.h"
+#include "sr_stats.h"
+#include "sr_lat.h"
+
+/* the nodes, in the order they run; a node only passes packets on to nodes
+   after it, so one pass over the list runs the whole vector */
+enum {
+  SR_NODE_ETHERNET_INPUT,
+  SR_NODE_IP4_INPUT,
+  SR_NODE_IP4_CLASSIFY,
+  SR_NODE_ICMP_ECHO,
+  SR_NODE_NAT_IN,
+  SR_NODE_NAT_OUT,
+  SR_NODE_IP4_LOOKUP,
+  SR_NODE_ARP_RESOLVE,
+  SR_NODE_INTERFACE_OUTPUT,
+  SR_NODE_PUNT,
+  SR_GRAPH_NODES
+};
+
+/* a packet in the vector and what the nodes found out about it so far */
+struct sr_graph_pkt {
+  struct sr_pkt pk;             /* the frame, parsed on receive */
+  char *iface;                  /* ingress, lent like data */
+  struct sr_pbuf *pb;           /* reference held while in the vector */
+  int nat;                      /* translated by interface-output */
+  uint32_t adj;                 /* next hop, for arp-resolve, when nat */
+  struct sr_fib_nh *nh;         /* route, when not nat */
+  struct sr_if *egress;         /* for interface-output */
+  struct sr_natfast fast;       /* when nat */
+  sr_punt_class cls;            /* why it was punted, sr_punt.h */
+};
+
+/* the packets waiting at a node, as indices into the vector */
+struct sr_graph_frame {
+  uint32_t n;
+  uint16_t pi[SR_GRAPH_VEC];
+};
+
+struct sr_graph {
+  int collecting;
+  uint32_t n;
+  struct sr_graph_pkt pkt[SR_GRAPH_VEC];
+  struct sr_graph_frame frame[SR_GRAPH_NODES];
+
+  /* counters */
+  uint64_t vectors;
+  uint64_t packets;
+  uint64_t node_pkts[SR_GRAPH_NODES];
+};
+
+/* a worker's own graph, sr_worker.h; the loop's thread uses sr->graph */
+static __thread struct sr_graph *sr_graph_tls;
+
+typedef void (*sr_graph_node_fn)(struct sr_instance *sr, struct sr_graph *g,
+                                 const uint16_t *pi, uint32_t n);
+
+/* Tool function: pass packet i on to node */
+static inline void sr_graph_next(struct sr_graph *g, int node, uint16_t i) {
+  struct sr_graph_frame *f = &(g->frame[node]);
+  f->pi[f->n++] = i;
+}
+
+/* Tool function: pass packet i on to punt, as an exception of class cls */
+static inline void sr_graph_punt_as(struct sr_graph *g, sr_punt_class cls, uint16_t i) {
+  g->pkt[i].cls = cls;
+  sr_graph_next(g, SR_NODE_PUNT, i);
+}
+
+static void sr_graph_ethernet_input(struct sr_instance *sr, struct sr_graph *g,
+                                    const uint16_t *pi, uint32_t n) {
+  uint32_t k;
+  for (k = 0; k < n; k++) {
+    struct sr_graph_pkt *p = &(g->pkt[pi[k]]);
+    if (p->pk.flags & SR_PKT_IP)
+      sr_graph_next(g, SR_NODE_IP4_INPUT, pi[k]);
+    else if (p->pk.ethertype == ethertype_arp)
+      sr_graph_punt_as(g, sr_punt_arp, pi[k]);
+    else
+      sr_graph_punt_as(g, sr_punt_other, pi[k]);
+  }
+}
+
+static void sr_graph_ip4_input(struct sr_instance *sr, struct sr_graph *g,
+                               const uint16_t *pi, uint32_t n) {
+  uint32_t k;
+  for (k = 0; k < n; k++) {
+    struct sr_pkt *pk = &(g->pkt[pi[k]].pk);
+    struct sr_ip_hdr *iphdr = sr_pkt_ip(pk);
+    uint16_t sum = iphdr->ip_sum;
+    /* the same check as sr_handlepacket's, options included; the scalar
+       handler reports a bad sum */
+    iphdr->ip_sum = 0;
+    int ok = (cksum(iphdr, sr_pkt_iphl(pk)) == sum);
+    iphdr->ip_sum = sum;
+    if (ok)
+      sr_graph_next(g, SR_NODE_IP4_CLASSIFY, pi[k]);
+    else
+      sr_graph_punt_as(g, sr_punt_other, pi[k]);
+  }
+}
+
+/* Tool function: nonzero if the icmp checksum of pk is right */
+static inline int sr_graph_icmp_ok(struct sr_pkt *pk) {
+  struct sr_icmp_hdr *icmphdr = (struct sr_icmp_hdr *)sr_pkt_l4(pk);
+  uint16_t sum = icmphdr->icmp_sum;
+  icmphdr->icmp_sum = 0;
+  int ok = (cksum(icmphdr, pk->l4_len) == sum);
+  icmphdr->icmp_sum = sum;
+  return ok;
+}
+
+static void sr_graph_ip4_classify(struct sr_instance *sr, struct sr_graph *g,
+                                  const uint16_t *pi, uint32_t n) {
+  uint32_t k;
+  for (k = 0; k < n; k++) {
+    struct sr_graph_pkt *p = &(g->pkt[pi[k]]);
+    struct sr_ip_hdr *iphdr = sr_pkt_ip(&(p->pk));
+    int local = sr_ip_equal(sr, iphdr->ip_dst);
+    int tcp_icmp = (p->pk.flags & SR_PKT_L4) &&
+                   ((p->pk.ip_proto == ip_protocol_tcp) || (p->pk.ip_proto == ip_protocol_icmp));
+    int echo = local && (p->pk.flags & SR_PKT_L4) &&
+               (p->pk.ip_proto == ip_protocol_icmp) && (p->pk.icmp_type == 8);
+    int node = SR_NODE_PUNT;
+
+    p->cls = local ? sr_punt_local : sr_punt_other;
+    if (iphdr->ip_ttl <= 1) {
+      /* time exceeded */
+      p->cls = sr_punt_icmp;
+    } else if (p->pk.ifp->role == if_role_router) {
+      if (!local)
+        node = SR_NODE_IP4_LOOKUP;
+      else if (echo)
+        node = SR_NODE_ICMP_ECHO;
+    } else if (p->pk.ifp->role == if_role_nat_inside) {
+      /* from inside, translated on the way out */
+      if (!local && tcp_icmp)
+        node = SR_NODE_NAT_OUT;
+      else if (echo)
+        node = SR_NODE_ICMP_ECHO;
+    } else if (local) {
+      /* from outside to an external address, translated on the way in */
+      if (tcp_icmp)
+        node = SR_NODE_NAT_IN;
+    } else if (p->pk.ip_proto == ip_protocol_tcp) {
+      /* from outside to inside, forwarded as it is */
+      node = SR_NODE_IP4_LOOKUP;
+    }
+    sr_graph_next(g, node, pi[k]);
+  }
+}
+
+/* Tool function: records the send of the n packets at pi, all at once;
+   the nodes that send leave sr_lat_in at 0, so sr_send_packet does not */
+static void sr_graph_lat_send(struct sr_graph *g, const uint16_t *pi, uint32_t n) {
+  uint64_t now = sr_lat_stamp();
+  uint32_t k;
+  for (k = 0; now && (k < n); k++)
+    sr_lat_record(sr_lat_send, g->pkt[pi[k]].pk.t_in, now);
+}
+
+/* an echo request to the router (not through the nat, which maps echoes
+   from outside): the request becomes its reply in place and goes back out
+   the interface it came in on */
+static void sr_graph_icmp_echo(struct sr_instance *sr, struct sr_graph *g,
+                               const uint16_t *pi, uint32_t n) {
+  uint32_t k;
+  for (k = 0; k < n; k++) {
+    struct sr_graph_pkt *p = &(g->pkt[pi[k]]);
+    /* the scalar handler reports a bad checksum */
+    if (!sr_graph_icmp_ok(&(p->pk))) {
+      sr_graph_punt_as(g, sr_punt_other, pi[k]);
+      continue;
+    }
+    sr_icmp_echo_inplace(&(p->pk));
+    sr_send_packet(sr, p->pk.data, p->pk.len, p->iface);
+  }
+  sr_graph_lat_send(g, pi, n);
+}
+
+/* Tool function: the nat-in and nat-out nodes */
+static void sr_graph_nat(struct sr_instance *sr, struct sr_graph *g,
+                         const uint16_t *pi, uint32_t n, sr_nat_dir dir) {
+  uint64_t now;
+  uint32_t k;
+  for (k = 0; k < n; k++) {
+    struct sr_graph_pkt *p = &(g->pkt[pi[k]]);
+
+    /* an echo to the router has its checksum checked before it is
+       translated, the scalar handler reports a bad one */
+    if ((dir == nat_dir_in) && (p->pk.ip_proto == ip_protocol_icmp) &&
+        !sr_graph_icmp_ok(&(p->pk))) {
+      sr_graph_punt_as(g, sr_punt_other, pi[k]);
+      continue;
+    }
+    if (sr_natfast_lookup(sr, &(p->pk), dir, &(p->fast)) != 0) {
+      /* no established flow: a new one from inside, TCP from outside
+         nobody asked for, or an echo to the router itself */
+      if (dir == nat_dir_out)
+        sr_graph_punt_as(g, sr_punt_nat, pi[k]);
+      else if (p->pk.ip_proto == ip_protocol_tcp)
+        sr_graph_punt_as(g, sr_punt_syn, pi[k]);
+      else if (p->pk.icmp_type == 8)  /* echo request */
+        sr_graph_punt_as(g, sr_punt_local, pi[k]);
+      else
+        sr_graph_punt_as(g, sr_punt_nat, pi[k]);
+      continue;
+    }
+    p->nat = 1;
+    p->adj = p->fast.rw.adj;
+    sr_graph_next(g, SR_NODE_ARP_RESOLVE, pi[k]);
+  }
+  /* one stamp for the node's vector; the punted are timed by the slow path */
+  if ((now = sr_lat_stamp()) != 0) {
+    for (k = 0; k < n; k++) {
+      struct sr_graph_pkt *p = &(g->pkt[pi[k]]);
+      if (p->nat)
+        sr_lat_record(sr_lat_nat, p->pk.t_in, now);
+    }
+  }
+}
+
+static void sr_graph_nat_in(struct sr_instance *sr, struct sr_graph *g,
+                            const uint16_t *pi, uint32_t n) {
+  sr_graph_nat(sr, g, pi, n, nat_dir_in);
+}
+
+static void sr_graph_nat_out(struct sr_instance *sr, struct sr_graph *g,
+                             const uint16_t *pi, uint32_t n) {
+  sr_graph_nat(sr, g, pi, n, nat_dir_out);
+}
+
+static void sr_graph_ip4_lookup(struct sr_instance *sr, struct sr_graph *g,
+                                const uint16_t *pi, uint32_t n) {
+  uint32_t dst[SR_GRAPH_VEC];
+  struct sr_fib_nh *nh[SR_GRAPH_VEC];
+  uint64_t now;
+  uint32_t k;
+
+  for (k = 0; k < n; k++)
+    dst[k] = sr_pkt_ip(&(g->pkt[pi[k]].pk))->ip_dst;
+  sr_fib_lookup_bulk(sr_fib_deref(sr->fib), dst, nh, n);
+  /* one stamp for the vector, as in the nat nodes */
+  now = sr_lat_stamp();
+  for (k = 0; k < n; k++) {
+    struct sr_graph_pkt *p = &(g->pkt[pi[k]]);
+    if (nh[k] == NULL) {
+      /* net unreachable, from the scalar handler */
+      sr_graph_punt_as(g, sr_punt_icmp, pi[k]);
+      continue;
+    }
+    sr_lat_record(sr_lat_lookup, p->pk.t_in, now);
+    p->nh = nh[k];
+    sr_graph_next(g, SR_NODE_ARP_RESOLVE, pi[k]);
+  }
+}
+
+static void sr_graph_arp_resolve(struct sr_instance *sr, struct sr_graph *g,
+                                 const uint16_t *pi, uint32_t n) {
+  uint32_t k;
+  for (k = 0; k < n; k++) {
+    struct sr_graph_pkt *p = &(g->pkt[pi[k]]);
+    p->egress = p->nat ? sr_adj_write_hdr(&sr->cache, p->adj, p->pk.data) :
+                         sr_fib_nh_write_hdr(sr, p->nh, p->pk.data);
+    if (p->egress) {
+      sr_graph_next(g, SR_NODE_INTERFACE_OUTPUT, pi[k]);
+    } else if (p->nat || sr->punt) {
+      /* the scalar handler queues it on its ARP request, untranslated */
+      sr_graph_punt_as(g, sr_punt_arpmiss, pi[k]);
+    } else {
+      sr_stats_count(sr_stat_forwarded);
+      sr_lat_in = p->pk.t_in;
+      sr_handlepacket_arpqueue(sr, p->pk.data, p->pk.len, p->nh->gw, p->nh->interface);
+      sr_lat_in = 0;
+    }
+  }
+}
+
+static void sr_graph_interface_output(struct sr_instance *sr, struct sr_graph *g,
+                                      const uint16_t *pi, uint32_t n) {
+  uint32_t k;
+  for (k = 0; k < n; k++) {
+    struct sr_graph_pkt *p = &(g->pkt[pi[k]]);
+    if (p->nat) {
+      sr_natfast_apply(&(p->pk), &(p->fast));
+    } else {
+      struct sr_ip_hdr *iphdr = sr_pkt_ip(&(p->pk));
+      iphdr->ip_ttl--;
+      iphdr->ip_sum = 0;
+      iphdr->ip_sum = cksum(iphdr, sr_pkt_iphl(&(p->pk)));
+    }
+    sr_send_packet(sr, p->pk.data, p->pk.len, p->egress->name);
+  }
+  sr_graph_lat_send(g, pi, n);
+  sr_stats_count_n(sr_stat_forwarded, n);
+}
+
+static void sr_graph_punt(struct sr_instance *sr, struct sr_graph *g,
+                          const uint16_t *pi, uint32_t n) {
+  uint16_t order[SR_GRAPH_VEC];
+  uint32_t j, k;
+
+  /* nodes punt in the order they run; the scalar handler gets the packets
+     in the order they arrived */
+  for (k = 0; k < n; k++) {
+    for (j = k; (j > 0) && (order[j - 1] > pi[k]); j--)
+      order[j] = order[j - 1];
+    order[j] = pi[k];
+  }
+  for (k = 0; k < n; k++) {
+    struct sr_graph_pkt *p = &(g->pkt[order[k]]);
+    /* to the slow path thread, or handled here; a class over its quota
+       is dropped */
+    if (sr->punt)
+      sr_punt_queue(sr, &(p->pk), p->pb, p->cls);
+    else
+      sr_handlepacket_slow(sr, &(p->pk), p->iface);
+  }
+  if (sr->punt)
+    sr_punt_kick(sr);
+}
+
+static const struct {
+  const char *name;
+  sr_graph_node_fn fn;
+} sr_graph_nodes[SR_GRAPH_NODES] = {
+  [SR_NODE_ETHERNET_INPUT]   = { "ethernet-input",   sr_graph_ethernet_input },
+  [SR_NODE_IP4_INPUT]        = { "ip4-input",        sr_graph_ip4_input },
+  [SR_NODE_IP4_CLASSIFY]     = { "ip4-classify",     sr_graph_ip4_classify },
+  [SR_NODE_ICMP_ECHO]        = { "icmp-echo",        sr_graph_icmp_echo },
+  [SR_NODE_NAT_IN]           = { "nat-in",           sr_graph_nat_in },
+  [SR_NODE_NAT_OUT]          = { "nat-out",          sr_graph_nat_out },
+  [SR_NODE_IP4_LOOKUP]       = { "ip4-lookup",       sr_graph_ip4_lookup },
+  [SR_NODE_ARP_RESOLVE]      = { "arp-resolve",      sr_graph_arp_resolve },
+  [SR_NODE_INTERFACE_OUTPUT] = { "interface-output", sr_graph_interface_output },
+  [SR_NODE_PUNT]             = { "punt",             sr_graph_punt },
+};
+
+/* Tool function: records the parse of the whole vector as it starts */
+static void sr_graph_lat_parse(struct sr_graph *g) {
+  uint64_t now = sr_lat_stamp();
+  uint32_t i;
+  for (i = 0; now && (i < g->n); i++)
+    sr_lat_record(sr_lat_parse, g->pkt[i].pk.t_in, now);
+}
+
+/* Tool function: run the vector through the graph and let it go */
+static void sr_graph_run(struct sr_instance *sr, struct sr_graph *g) {
+  uint32_t i;
+  int node;
+
+  if (g->n == 0)
+    return;
+  g->vectors++;
+  g->packets += g->n;
+  sr_graph_lat_parse(g);
+  for (i = 0; i < g->n; i++)
+    sr_graph_next(g, SR_NODE_ETHERNET_INPUT, i);
+  for (node = 0; node < SR_GRAPH_NODES; node++) {
+    struct sr_graph_frame *f = &(g->frame[node]);
+    if (f->n == 0)
+      continue;
+    g->node_pkts[node] += f->n;
+    sr_graph_nodes[node].fn(sr, g, f->pi, f->n);
+    f->n = 0;
+  }
+
+  for (i = 0; i < g->n; i++)
+    sr_pbuf_put(g->pkt[i].pb);
+  g->n = 0;
+}
+
+struct sr_graph *sr_graph_create(void) {
+  return (struct sr_graph *)calloc(1, sizeof(struct sr_graph));
+}
+
+void sr_graph_destroy(struct sr_graph *g) {
+  free(g);
+}
+
+void sr_graph_bind(struct sr_graph *g) {
+  sr_graph_tls = g;
+}
+
+/* Tool function: the calling thread's graph */
+static inline struct sr_graph *sr_graph_local(struct sr_instance *sr) {
+  return sr_graph_tls ? sr_graph_tls : sr->graph;
+}
+
+void sr_graph_begin(struct sr_instance *sr) {
+  struct sr_graph *g = sr_graph_local(sr);
+  if (g)
+    g->collecting = 1;
+}
+
+int sr_graph_enqueue(struct sr_instance *sr, struct sr_pkt *pk, char *interface) {
+  struct sr_graph *g = sr_graph_local(sr);
+  struct sr_pbuf *pb;
+  uint8_t *data;
+
+  if (!g->collecting) {
+    /* the slow path thread's exceptions come from the graph: a packet read
+       on its own is a vector of one */
+    if (sr->punt == NULL)
+      return -1;
+    g->collecting = 1;
+    int ret = sr_graph_enqueue(sr, pk, interface);
+    sr_graph_end(sr);
+    return ret;
+  }
+  /* the slow path takes the packet by its buffer, so one that is in none
+     gets one */
+  data = pk->data;
+  if (sr->punt)
+    data = sr_pbuf_hold(&(sr->pbufs), pk->data, pk->len, &pb);
+  else if ((pb = sr_pbuf_of(&(sr->pbufs), pk->data)) != NULL)
+    sr_pbuf_ref(pb);
+  else
+    data = NULL;
+  if (data == NULL) {
+    sr_graph_run(sr, g);
+    return -1;
+  }
+
+  struct sr_graph_pkt *p = &(g->pkt[g->n++]);
+  p->pk = *pk;
+  p->pk.data = data;
+  p->iface = interface;
+  p->pb = pb;
+  p->nat = 0;
+  if (g->n == SR_GRAPH_VEC)
+    sr_graph_run(sr, g);
+  return 0;
+}
+
+void sr_graph_end(struct sr_instance *sr) {
+  struct sr_graph *g = sr_graph_local(sr);
+  if (g == NULL)
+    return;
+  sr_graph_run(sr, g);
+  g->collecting = 0;
+}
+
+void sr_graph_print(const struct sr_graph *g) {
+  int node;
+
+  if (g == NULL)
+    return;
+  fprintf(stderr, "graph: %" PRIu64 " vectors, %" PRIu64 " packets (%.1f per vector)\n",
+    g->vectors, g->packets, g->vectors ? (double)g->packets / g->vectors : 0.0);
+  for (node = 0; node < SR_GRAPH_NODES; node++)
+    fprintf(stderr, "graph: %-16s %" PRIu64 "\n", sr_graph_nodes[node].name,
+      g->node_pkts[node]);
+}
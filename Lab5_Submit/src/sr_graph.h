@@ -0,0 +1,74 @@
+/* This file defines the vector packet path. The packets of one read of the
+   socket (the writev and uring backends, sr_io.h) are collected into a
+   vector of up to SR_GRAPH_VEC and handed through a graph of nodes. Each
+   node does its one step for the whole vector before the next node runs:
+
+     ethernet-input    IP frames that parsed whole go on (sr_pkt.h)
+     ip4-input         header checksum, options included
+     ip4-classify      for the router or forwarded, NAT direction, ttl
+     icmp-echo         an echo request to the router becomes its reply in
+                       place and goes back out
+     nat-in, nat-out   the NAT fast path's rewrite of an established flow
+     ip4-lookup        one bulk FIB lookup for the vector
+     arp-resolve       the adjacency's ethernet header; a miss is queued on
+                       its ARP request
+     interface-output  ttl, checksums or the NAT rewrite, send
+     punt              everything else, to the scalar handler
+
+   A node's loop is short and does the same to every packet, so its code
+   and the tables it reads stay in the cache across the vector, and
+   ip4-lookup overlaps the FIB's cache misses (sr_fib_lookup_bulk).
+
+   Whatever is not plain forwarding, an established NAT flow or an echo
+   request to the router -- other packets for the router, ARP, new or
+   closing NAT flows, ttl expiry, no route, a bad checksum -- is punted:
+   handed untouched, in the order it arrived, to sr_handlepacket_slow once
+   the vector's other packets are sent. The packets of one flow take the
+   same way through the graph, so their order holds. With the slow path
+   thread (sr_punt.h) the punts are queued to it instead, by the class of
+   their exception, and a packet waiting for ARP is punted too rather than
+   queued on its request here.
+
+   Each worker thread (sr_worker.h) runs the packets it takes off its ring
+   through a graph of its own, bound with sr_graph_bind; the loop's thread
+   uses sr->graph.
+
+   The syscall backend reads one packet at a time and always handles it on
+   its own, as does -P scalar. */
+
+#ifndef SR_GRAPH_H
+#define SR_GRAPH_H
+
+#define SR_GRAPH_VEC 256  /* packets per vector */
+
+struct sr_instance;
+struct sr_graph;
+struct sr_pkt;
+
+struct sr_graph *sr_graph_create(void);
+void sr_graph_destroy(struct sr_graph *g);
+
+/* Makes g the calling thread's graph, in place of sr->graph. */
+void sr_graph_bind(struct sr_graph *g);
+
+/* Starts collecting received packets into a vector. */
+void sr_graph_begin(struct sr_instance *sr);
+
+/* Adds a parsed packet to the vector, copying its descriptor and taking a
+   reference to the packet buffer holding it, and runs the vector when it
+   is full. Returns -1, taking nothing, if no vector is being collected or
+   the packet is not in a packet buffer; the packets collected so far are
+   run first then, so the caller can handle it on its own without
+   overtaking them. With the slow path thread a packet outside a vector is
+   run as a vector of one, and one that is not in a packet buffer is copied
+   into one. */
+int  sr_graph_enqueue(struct sr_instance *sr, struct sr_pkt *pk,
+                      char *interface);
+
+/* Runs the packets collected and stops collecting. */
+void sr_graph_end(struct sr_instance *sr);
+
+/* Prints the vector and node counters to stderr. */
+void sr_graph_print(const struct sr_graph *g);
+
+#endif /* SR_GRAPH_H */
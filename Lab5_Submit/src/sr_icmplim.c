@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sr_icmplim.h"
+
+static const char *sr_icmplim_names[SR_ICMPLIM_KINDS] = {
+  [sr_icmplim_ttl]   = "time-exceeded",
+  [sr_icmplim_net]   = "net-unreachable",
+  [sr_icmplim_host]  = "host-unreachable",
+  [sr_icmplim_port]  = "port-unreachable",
+  [sr_icmplim_other] = "other",
+};
+
+/* Tool function: the monotonic clock in ns. */
+static uint64_t sr_icmplim_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Tool function: the bucket of an ICMP error of type and code. */
+static sr_icmplim_kind sr_icmplim_kind_of(uint8_t type, uint8_t code) {
+  if (type == 11)
+    return sr_icmplim_ttl;
+  if (type == 3) {
+    switch (code) {
+    case 0: return sr_icmplim_net;
+    case 1: return sr_icmplim_host;
+    case 3: return sr_icmplim_port;
+    }
+  }
+  return sr_icmplim_other;
+}
+
+/* Tool function: refills b at rate up to burst tokens as of now. */
+static void sr_icmplim_refill(struct sr_icmplim_bucket *b, uint32_t rate,
+                              uint32_t burst, uint64_t now) {
+  uint64_t full = (uint64_t)burst * SR_ICMPLIM_TOKEN;
+  uint64_t elapsed = now - b->stamp;
+  b->stamp = now;
+  /* the product below stays under full, so it cannot overflow */
+  if (elapsed >= full / rate) {
+    b->tokens = full;
+    return;
+  }
+  b->tokens += elapsed * rate;
+  if (b->tokens > full)
+    b->tokens = full;
+}
+
+/* Tool function: the bucket of host dst, found in its set or put in it:
+   in a free way with a full bucket, or else in the way used longest ago,
+   keeping the tokens that way has by now. */
+static struct sr_icmplim_bucket *sr_icmplim_src(struct sr_icmplim *lim,
+                                                uint32_t dst, uint64_t now) {
+  const struct sr_icmplim_conf *conf = &(lim->conf);
+  struct sr_icmplim_src *set =
+    &(lim->srcs[((dst * 2654435761u) >> (32 - SR_ICMPLIM_BITS)) & ~(SR_ICMPLIM_WAYS - 1)]);
+  struct sr_icmplim_src *victim = NULL;
+  int i;
+
+  for (i = 0; i < SR_ICMPLIM_WAYS; i++) {
+    if (set[i].ip == dst) {
+      sr_icmplim_refill(&(set[i].b), conf->src_rate, conf->src_burst, now);
+      return &(set[i].b);
+    }
+    if ((victim == NULL) || (victim->ip && ((set[i].ip == 0) ||
+                                            (set[i].b.stamp < victim->b.stamp))))
+      victim = &(set[i]);
+  }
+
+  if (victim->ip == 0) {
+    victim->b.tokens = (uint64_t)conf->src_burst * SR_ICMPLIM_TOKEN;
+    victim->b.stamp = now;
+  } else {
+    /* a new host gets no more than the one it displaces has left, so
+       hosts that keep taking over each other's way share one bucket */
+    lim->evicted++;
+    sr_icmplim_refill(&(victim->b), conf->src_rate, conf->src_burst, now);
+  }
+  victim->ip = dst;
+  return &(victim->b);
+}
+
+/* Tool function: reads a rate with an optional /burst; the burst defaults
+   to keep. Returns where the number ended, or NULL if there is none. */
+static const char *sr_icmplim_parse_rate(const char *s, uint32_t *rate,
+                                         uint32_t *burst) {
+  char *end;
+  unsigned long r = strtoul(s, &end, 10);
+  if ((end == s) || (r > 1000000))
+    return NULL;
+  *rate = r;
+  if (*end == '/') {
+    s = end + 1;
+    unsigned long b = strtoul(s, &end, 10);
+    if ((end == s) || (b == 0) || (b > 1000000))
+      return NULL;
+    *burst = b;
+  }
+  return end;
+}
+
+int sr_icmplim_parse(const char *arg, struct sr_icmplim_conf *conf) {
+  struct sr_icmplim_conf c = *conf;
+  const char *s = sr_icmplim_parse_rate(arg, &c.type_rate, &c.type_burst);
+  if (s == NULL)
+    return -1;
+  if (*s == ',') {
+    s = sr_icmplim_parse_rate(s + 1, &c.src_rate, &c.src_burst);
+    if (s == NULL)
+      return -1;
+  }
+  if (*s != '\0')
+    return -1;
+  *conf = c;
+  return 0;
+}
+
+void sr_icmplim_defaults(struct sr_icmplim_conf *conf) {
+  conf->type_rate = SR_ICMPLIM_TYPE_RATE;
+  conf->type_burst = SR_ICMPLIM_TYPE_BURST;
+  conf->src_rate = SR_ICMPLIM_SRC_RATE;
+  conf->src_burst = SR_ICMPLIM_SRC_BURST;
+}
+
+void sr_icmplim_init(struct sr_icmplim *lim, const struct sr_icmplim_conf *conf) {
+  uint64_t now = sr_icmplim_now();
+  int i;
+  memset(lim, 0, sizeof(*lim));
+  pthread_mutex_init(&(lim->lock), NULL);
+  lim->conf = *conf;
+  for (i = 0; i < SR_ICMPLIM_KINDS; i++) {
+    lim->kinds[i].tokens = (uint64_t)conf->type_burst * SR_ICMPLIM_TOKEN;
+    lim->kinds[i].stamp = now;
+  }
+}
+
+int sr_icmplim_allow(struct sr_icmplim *lim, uint8_t type, uint8_t code,
+                     uint32_t dst) {
+  const struct sr_icmplim_conf *conf = &(lim->conf);
+  sr_icmplim_kind kind = sr_icmplim_kind_of(type, code);
+  struct sr_icmplim_bucket *kb = NULL;
+  struct sr_icmplim_bucket *sb = NULL;
+  int allow = 1;
+
+  if ((conf->type_rate == 0) && (conf->src_rate == 0))
+    return 1;
+  uint64_t now = sr_icmplim_now();
+
+  pthread_mutex_lock(&(lim->lock));
+  if (conf->src_rate) {
+    sb = sr_icmplim_src(lim, dst, now);
+    if (sb->tokens < SR_ICMPLIM_TOKEN) {
+      lim->by_src[kind]++;
+      allow = 0;
+    }
+  }
+  if (allow && conf->type_rate) {
+    kb = &(lim->kinds[kind]);
+    sr_icmplim_refill(kb, conf->type_rate, conf->type_burst, now);
+    if (kb->tokens < SR_ICMPLIM_TOKEN) {
+      lim->by_type[kind]++;
+      allow = 0;
+    }
+  }
+  /* a token is taken only when both buckets had one */
+  if (allow) {
+    if (sb)
+      sb->tokens -= SR_ICMPLIM_TOKEN;
+    if (kb)
+      kb->tokens -= SR_ICMPLIM_TOKEN;
+    lim->sent[kind]++;
+  }
+  pthread_mutex_unlock(&(lim->lock));
+  return allow;
+}
+
+void sr_icmplim_print(struct sr_icmplim *lim) {
+  int i;
+  pthread_mutex_lock(&(lim->lock));
+  fprintf(stderr, "icmp errors: %u/s of a kind (burst %u), %u/s to a host"
+          " (burst %u), %" PRIu64 " hosts evicted\n",
+          lim->conf.type_rate, lim->conf.type_burst, lim->conf.src_rate,
+          lim->conf.src_burst, lim->evicted);
+  for (i = 0; i < SR_ICMPLIM_KINDS; i++) {
+    if (lim->sent[i] || lim->by_type[i] || lim->by_src[i]) {
+      fprintf(stderr, "icmp errors: %s %" PRIu64 " sent, %" PRIu64
+              " suppressed by kind, %" PRIu64 " by host\n",
+              sr_icmplim_names[i], lim->sent[i], lim->by_type[i],
+              lim->by_src[i]);
+    }
+  }
+  pthread_mutex_unlock(&(lim->lock));
+}
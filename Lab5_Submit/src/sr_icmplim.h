@@ -0,0 +1,95 @@
+/* This file defines the rate limit on the ICMP errors the router sends
+   (time exceeded, and net, host and port unreachable), as RFC 1812 4.3.2.8
+   asks for. Each error has to take a token from two token buckets: the
+   bucket of its kind, which bounds what a traceroute storm or a port scan
+   from many hosts costs, and the bucket of the host it goes to (the
+   offending packet's source), which keeps one host from using up its
+   kind's share. Buckets refill at their rate, up to a burst.
+
+   sr_handlepacket_icmpUnreachable asks first thing, so a suppressed error
+   is not built at all; it is only counted.
+
+   The per source buckets live in a table hashed on the address, in sets
+   of SR_ICMPLIM_WAYS. A new host takes a free way with a full bucket, or
+   else the way used longest ago with the tokens left in it, so hosts that
+   push each other out share a bucket rather than refill each other.
+
+   One lock guards the buckets; the handlers call from any thread. */
+
+#ifndef SR_ICMPLIM_H
+#define SR_ICMPLIM_H
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#define SR_ICMPLIM_BITS 10
+#define SR_ICMPLIM_SRCS (1 << SR_ICMPLIM_BITS) /* per source buckets */
+#define SR_ICMPLIM_WAYS 4                      /* buckets per set */
+
+#define SR_ICMPLIM_TYPE_RATE  1000  /* errors/s of one kind, default */
+#define SR_ICMPLIM_TYPE_BURST 50
+#define SR_ICMPLIM_SRC_RATE   100   /* errors/s to one host, default */
+#define SR_ICMPLIM_SRC_BURST  20
+
+#define SR_ICMPLIM_TOKEN 1000000000ULL /* a token, so ns times errors/s refill it */
+
+/* the kinds of errors, each with its bucket */
+typedef enum {
+  sr_icmplim_ttl,    /* time exceeded */
+  sr_icmplim_net,    /* net unreachable */
+  sr_icmplim_host,   /* host unreachable */
+  sr_icmplim_port,   /* port unreachable */
+  sr_icmplim_other,
+  SR_ICMPLIM_KINDS
+} sr_icmplim_kind;
+
+/* A rate of 0 turns that limit off. */
+struct sr_icmplim_conf {
+  uint32_t type_rate;
+  uint32_t type_burst;
+  uint32_t src_rate;
+  uint32_t src_burst;
+};
+
+struct sr_icmplim_bucket {
+  uint64_t tokens;             /* SR_ICMPLIM_TOKEN per token */
+  uint64_t stamp;              /* ns, when last refilled */
+};
+
+struct sr_icmplim_src {
+  uint32_t ip;                 /* network byte order, 0 if free */
+  struct sr_icmplim_bucket b;
+};
+
+struct sr_icmplim {
+  pthread_mutex_t lock;
+  struct sr_icmplim_conf conf;
+  struct sr_icmplim_bucket kinds[SR_ICMPLIM_KINDS];
+  struct sr_icmplim_src srcs[SR_ICMPLIM_SRCS];
+
+  /* counters */
+  uint64_t sent[SR_ICMPLIM_KINDS];
+  uint64_t by_type[SR_ICMPLIM_KINDS]; /* suppressed, kind's bucket empty */
+  uint64_t by_src[SR_ICMPLIM_KINDS];  /* suppressed, host's bucket empty */
+  uint64_t evicted;                   /* sources that took over a slot */
+};
+
+/* Parses "type rate[/burst][,source rate[/burst]]" into conf, which keeps
+   its values for what is left out. Returns -1 if arg is malformed. */
+int  sr_icmplim_parse(const char *arg, struct sr_icmplim_conf *conf);
+
+/* Sets conf to the defaults. */
+void sr_icmplim_defaults(struct sr_icmplim_conf *conf);
+
+/* Sets up lim with full buckets. */
+void sr_icmplim_init(struct sr_icmplim *lim, const struct sr_icmplim_conf *conf);
+
+/* Takes a token for an ICMP error of type and code to dst (network byte
+   order). Returns 1 if the error may be sent, 0 if it is suppressed. */
+int  sr_icmplim_allow(struct sr_icmplim *lim, uint8_t type, uint8_t code,
+                      uint32_t dst);
+
+/* Prints the counters to stderr. */
+void sr_icmplim_print(struct sr_icmplim *lim);
+
+#endif /* SR_ICMPLIM_H */
@@ -0,0 +1,655 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "sr_io.h"
+#include "sr_router.h"
+#include "sr_pbuf.h"
+#include "sr_graph.h"
+#include "sr_punt.h"
+#include "sr_lat.h"
+#include "vnscommand.h"
+
+#if defined(__NR_io_uring_setup) && defined(IORING_RECV_MULTISHOT)
+#define SR_IO_HAVE_URING 1
+#endif
+
+static const char *sr_io_names[] = { "syscall", "writev", "uring" };
+
+int sr_io_parse_backend(const char *name) {
+  int i;
+  for (i = 0; i < (int)(sizeof(sr_io_names) / sizeof(sr_io_names[0])); i++) {
+    if (strcmp(name, sr_io_names[i]) == 0)
+      return i;
+  }
+  return -1;
+}
+
+const char *sr_io_backend_name(sr_io_backend backend) {
+  return sr_io_names[backend];
+}
+
+/* Tool function: handle one command. A packet is copied out of the byte
+   stream into a packet buffer first, so the router can queue it or send
+   it on without copying it again. */
+static int sr_io_handle(struct sr_instance *sr, uint8_t *cmd, uint32_t len) {
+  c_packet_header *hdr = (c_packet_header *)cmd;
+  struct sr_pbuf *pb = NULL;
+
+  if ((len >= sizeof(c_packet_header)) && (ntohl(hdr->mType) == VNSPACKET))
+    pb = sr_pbuf_alloc(&(sr->pbufs), len - sizeof(c_packet_header));
+  if (pb == NULL)
+    return sr_handle_server_msg(sr, cmd, len, 0);
+
+  uint8_t *copy = sr_pbuf_data(pb) - sizeof(c_packet_header);
+  memcpy(copy, cmd, len);
+  int ret = sr_handle_server_msg(sr, copy, len, 0);
+  sr_pbuf_put(pb);
+  return ret;
+}
+
+/* Tool function: handle every complete command in the reassembly buffer
+   and keep the incomplete tail for the next call. */
+static int sr_io_consume(struct sr_instance *sr, struct sr_io *io) {
+  uint32_t off = 0;
+  int ret = 1;
+
+  /* the packets of the batch go through the graph as vectors, all
+     received as of the read */
+  sr_graph_begin(sr);
+  sr_lat_batch = sr_lat_stamp();
+  while (io->rx_len - off >= 4) {
+    uint32_t len;
+    memcpy(&len, io->rx + off, 4);
+    len = ntohl(len);
+    if ((len < 8) || (len > SR_IO_MSG_MAX)) {
+      fprintf(stderr, "Error: bad command length %u\n", len);
+      sr_lat_batch = 0;
+      sr_graph_end(sr);
+      return -1;
+    }
+    if (io->rx_len - off < len)
+      break;
+    ret = sr_io_handle(sr, io->rx + off, len);
+    off += len;
+    io->rx_msgs++;
+    if (ret != 1)
+      break;
+  }
+  sr_lat_batch = 0;
+  sr_graph_end(sr);
+  /* what the slow path sent meanwhile goes out with the batch; the I/O
+     thread may read for a long while before it gets back to the loop */
+  if (sr->punt)
+    sr_punt_tx(sr);
+  /* the debug output of the whole batch goes out in one write */
+  fflush(stdout);
+  io->rx_batches++;
+
+  if (off > 0) {
+    memmove(io->rx, io->rx + off, io->rx_len - off);
+    io->rx_len -= off;
+  }
+  return ret;
+}
+
+/*---------------------------------------------------------------------
+ * writev backend
+ *---------------------------------------------------------------------*/
+
+static int sr_io_writev_poll(struct sr_instance *sr, struct sr_io *io) {
+  ssize_t n = recv(sr->sockfd, io->rx + io->rx_len, SR_IO_RX_SZ - io->rx_len,
+    MSG_DONTWAIT);
+  if (n == 0)
+    return 0;
+  if (n < 0) {
+    if ((errno == EAGAIN) || (errno == EINTR))
+      return 1;
+    perror("recv(..):sr_io.c::sr_io_writev_poll");
+    return -1;
+  }
+  io->rx_len += n;
+  return sr_io_consume(sr, io);
+}
+
+static int sr_io_writev_send(struct sr_instance *sr, struct sr_io *io,
+  const void *hdr, size_t hdr_len, const void *data, size_t data_len) {
+  struct iovec iov[2];
+  size_t total = hdr_len + data_len;
+  size_t done = 0;
+
+  iov[0].iov_base = (void *)hdr;
+  iov[0].iov_len = hdr_len;
+  iov[1].iov_base = (void *)data;
+  iov[1].iov_len = data_len;
+  while (done < total) {
+    /* a short write leaves the rest of the iovec to go */
+    int first = (done < hdr_len) ? 0 : 1;
+    if (first == 0) {
+      iov[0].iov_base = (uint8_t *)hdr + done;
+      iov[0].iov_len = hdr_len - done;
+    } else {
+      iov[1].iov_base = (uint8_t *)data + (done - hdr_len);
+      iov[1].iov_len = total - done;
+    }
+    ssize_t n = writev(sr->sockfd, iov + first, 2 - first);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("writev(..):sr_io.c::sr_io_writev_send");
+      return -1;
+    }
+    done += n;
+  }
+  io->tx_msgs++;
+  io->tx_batches++;
+  return 0;
+}
+
+/*---------------------------------------------------------------------
+ * io_uring backend
+ *---------------------------------------------------------------------*/
+
+#ifdef SR_IO_HAVE_URING
+
+#define SR_IO_TAG_RECV 1
+#define SR_IO_TAG_SEND 2
+
+struct sr_io_uring {
+  int ring_fd;
+  void *ring_mem;
+  size_t ring_sz;
+  struct io_uring_sqe *sqes;
+  size_t sqes_sz;
+
+  /* submission queue */
+  uint32_t *sq_head, *sq_tail, *sq_array;
+  uint32_t sq_mask, sq_entries;
+  uint32_t sq_local_tail;       /* sqes prepared, not yet published */
+
+  /* completion queue */
+  uint32_t *cq_head, *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* provided receive buffers */
+  struct io_uring_buf_ring *br;
+  uint8_t *bufs;
+  uint16_t br_tail;
+
+  /* receive completions not yet copied to rx, oldest first; there are
+     never more of them than buffers */
+  uint16_t pend_bid[SR_IO_URING_BUFS];
+  uint32_t pend_len[SR_IO_URING_BUFS];
+  uint32_t pend_head, pend_count;
+
+  int recv_armed;
+  int recv_seen;                /* a receive has completed with data */
+  int recv_err;                 /* last receive error, negative errno */
+  int eof;
+  int send_done;
+  int send_res;
+};
+
+static int sr_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sr_io_uring_enter(struct sr_io_uring *r, unsigned to_submit,
+  unsigned min_complete) {
+  unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+  int ret;
+  do {
+    ret = (int)syscall(__NR_io_uring_enter, r->ring_fd, to_submit,
+      min_complete, flags, NULL, 0);
+  } while ((ret < 0) && (errno == EINTR));
+  return ret;
+}
+
+/* Tool function: the next free sqe, zeroed, or NULL if the queue is full */
+static struct io_uring_sqe *sr_io_uring_sqe(struct sr_io_uring *r) {
+  uint32_t head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if (r->sq_local_tail - head >= r->sq_entries)
+    return NULL;
+  struct io_uring_sqe *sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_local_tail++;
+  return sqe;
+}
+
+/* Tool function: publish the prepared sqes and enter the kernel */
+static int sr_io_uring_submit(struct sr_io_uring *r, unsigned min_complete) {
+  uint32_t tail = *r->sq_tail;
+  unsigned to_submit = r->sq_local_tail - tail;
+  __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+  return sr_io_uring_enter(r, to_submit, min_complete);
+}
+
+/* Tool function: hand buffer bid back to the kernel */
+static void sr_io_uring_give(struct sr_io_uring *r, uint16_t bid) {
+  struct io_uring_buf *b = &r->br->bufs[r->br_tail & (SR_IO_URING_BUFS - 1)];
+  b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * SR_IO_URING_BUF_SZ);
+  b->len = SR_IO_URING_BUF_SZ;
+  b->bid = bid;
+  r->br_tail++;
+  __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+static int sr_io_uring_arm(struct sr_instance *sr, struct sr_io_uring *r) {
+  struct io_uring_sqe *sqe = sr_io_uring_sqe(r);
+  if (sqe == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = sr->sockfd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = SR_IO_TAG_RECV;
+  r->recv_armed = 1;
+  return (sr_io_uring_submit(r, 0) < 0) ? -1 : 0;
+}
+
+/* Tool function: take every completion off the queue. Receives are queued
+   on pend_*, not handled, so this is safe to call while sending. */
+static void sr_io_uring_reap(struct sr_io_uring *r) {
+  uint32_t head = *r->cq_head;
+  uint32_t tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+    if (cqe->user_data == SR_IO_TAG_RECV) {
+      if (cqe->res > 0) {
+        uint32_t slot = (r->pend_head + r->pend_count) % SR_IO_URING_BUFS;
+        r->pend_bid[slot] = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        r->pend_len[slot] = (uint32_t)cqe->res;
+        r->pend_count++;
+        r->recv_seen = 1;
+      } else if (cqe->res == 0) {
+        r->eof = 1;
+      } else if (cqe->res != -ENOBUFS) {
+        /* ENOBUFS only means every buffer is queued on pend_*; the
+           receive is posted again once they are given back */
+        r->recv_err = cqe->res;
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE))
+        r->recv_armed = 0;
+    } else if (cqe->user_data == SR_IO_TAG_SEND) {
+      r->send_res = cqe->res;
+      r->send_done = 1;
+    }
+    head++;
+  }
+  __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void sr_io_uring_free(struct sr_io_uring *r) {
+  if (r->br)
+    munmap(r->br, SR_IO_URING_BUFS * sizeof(struct io_uring_buf));
+  free(r->bufs);
+  if (r->sqes)
+    munmap(r->sqes, r->sqes_sz);
+  if (r->ring_mem)
+    munmap(r->ring_mem, r->ring_sz);
+  if (r->ring_fd >= 0)
+    close(r->ring_fd);
+  free(r);
+}
+
+/* Sets up the ring, the buffer ring and the first multishot receive.
+   Returns NULL, leaving nothing behind, if the kernel can't. */
+static struct sr_io_uring *sr_io_uring_new(struct sr_instance *sr) {
+  struct io_uring_params p;
+  struct sr_io_uring *r = (struct sr_io_uring *)calloc(1, sizeof(struct sr_io_uring));
+  if (r == NULL)
+    return NULL;
+
+  memset(&p, 0, sizeof(p));
+  r->ring_fd = sr_io_uring_setup(SR_IO_URING_SQ, &p);
+  if ((r->ring_fd < 0) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    fprintf(stderr, "io_uring: not available (%s)\n",
+      (r->ring_fd < 0) ? strerror(errno) : "no single mmap");
+    goto fail;
+  }
+
+  size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->ring_sz = (sq_sz > cq_sz) ? sq_sz : cq_sz;
+  r->ring_mem = mmap(NULL, r->ring_sz, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+  r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+  if ((r->ring_mem == MAP_FAILED) || (r->sqes == MAP_FAILED)) {
+    r->ring_mem = (r->ring_mem == MAP_FAILED) ? NULL : r->ring_mem;
+    r->sqes = (r->sqes == MAP_FAILED) ? NULL : r->sqes;
+    perror("mmap(..):sr_io.c::sr_io_uring_new");
+    goto fail;
+  }
+
+  uint8_t *m = (uint8_t *)r->ring_mem;
+  r->sq_head = (uint32_t *)(m + p.sq_off.head);
+  r->sq_tail = (uint32_t *)(m + p.sq_off.tail);
+  r->sq_mask = *(uint32_t *)(m + p.sq_off.ring_mask);
+  r->sq_entries = p.sq_entries;
+  r->sq_array = (uint32_t *)(m + p.sq_off.array);
+  r->sq_local_tail = *r->sq_tail;
+  r->cq_head = (uint32_t *)(m + p.cq_off.head);
+  r->cq_tail = (uint32_t *)(m + p.cq_off.tail);
+  r->cq_mask = *(uint32_t *)(m + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(m + p.cq_off.cqes);
+  uint32_t i;
+  for (i = 0; i < r->sq_entries; i++)
+    r->sq_array[i] = i;
+
+  /* the buffer ring must be page aligned, so it is mapped, not malloc'd */
+  r->br = mmap(NULL, SR_IO_URING_BUFS * sizeof(struct io_uring_buf),
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  r->bufs = (uint8_t *)malloc((size_t)SR_IO_URING_BUFS * SR_IO_URING_BUF_SZ);
+  if ((r->br == MAP_FAILED) || (r->bufs == NULL)) {
+    r->br = (r->br == MAP_FAILED) ? NULL : r->br;
+    fprintf(stderr, "io_uring: out of memory\n");
+    goto fail;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+  reg.ring_entries = SR_IO_URING_BUFS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    fprintf(stderr, "io_uring: no provided buffer rings (%s)\n", strerror(errno));
+    goto fail;
+  }
+  for (i = 0; i < SR_IO_URING_BUFS; i++)
+    sr_io_uring_give(r, (uint16_t)i);
+
+  if (sr_io_uring_arm(sr, r) != 0) {
+    fprintf(stderr, "io_uring: could not post the receive\n");
+    goto fail;
+  }
+  return r;
+
+fail:
+  sr_io_uring_free(r);
+  return NULL;
+}
+
+static int sr_io_uring_poll(struct sr_instance *sr, struct sr_io *io) {
+  struct sr_io_uring *r = io->ring;
+
+  sr_io_uring_reap(r);
+
+  /* kernels without multishot receive reject it before any data came */
+  if ((r->recv_err == -EINVAL) && !r->recv_seen) {
+    fprintf(stderr, "io_uring: no multishot receive, using writev\n");
+    sr_io_uring_free(r);
+    io->ring = NULL;
+    io->backend = sr_io_writev;
+    io->fd = sr->sockfd;
+    return 1;
+  }
+  if (r->recv_err < 0) {
+    fprintf(stderr, "io_uring: receive failed (%s)\n", strerror(-r->recv_err));
+    return -1;
+  }
+
+  int ret = 1;
+  while ((r->pend_count > 0) && (ret == 1)) {
+    uint16_t bid = r->pend_bid[r->pend_head];
+    uint32_t len = r->pend_len[r->pend_head];
+    /* rx keeps less than one command between calls, so a whole buffer
+       always fits */
+    memcpy(io->rx + io->rx_len, r->bufs + (size_t)bid * SR_IO_URING_BUF_SZ, len);
+    io->rx_len += len;
+    sr_io_uring_give(r, bid);
+    r->pend_head = (r->pend_head + 1) % SR_IO_URING_BUFS;
+    r->pend_count--;
+    if (SR_IO_RX_SZ - io->rx_len < SR_IO_URING_BUF_SZ || r->pend_count == 0)
+      ret = sr_io_consume(sr, io);
+  }
+  if (ret != 1)
+    return ret;
+  if (r->eof)
+    return 0;
+  if (!r->recv_armed && (sr_io_uring_arm(sr, r) != 0))
+    return -1;
+  return 1;
+}
+
+static int sr_io_uring_flush(struct sr_instance *sr, struct sr_io *io) {
+  struct sr_io_uring *r = io->ring;
+  struct msghdr msg;
+  uint32_t first = 0;
+
+  while (first < io->tx_iov_n) {
+    struct io_uring_sqe *sqe = sr_io_uring_sqe(r);
+    if (sqe == NULL) {
+      sr_io_uring_submit(r, 0);
+      continue;
+    }
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = io->tx_iov + first;
+    msg.msg_iovlen = io->tx_iov_n - first;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sr->sockfd;
+    sqe->addr = (uint64_t)(uintptr_t)&msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = SR_IO_TAG_SEND;
+    r->send_done = 0;
+    if (sr_io_uring_submit(r, 1) < 0) {
+      perror("io_uring_enter(..):sr_io.c::sr_io_uring_flush");
+      return -1;
+    }
+    io->tx_batches++;
+    /* the send usually completes inline; otherwise wait for it, queueing
+       any receives that complete meanwhile */
+    sr_io_uring_reap(r);
+    while (!r->send_done) {
+      if (sr_io_uring_enter(r, 0, 1) < 0) {
+        perror("io_uring_enter(..):sr_io.c::sr_io_uring_flush");
+        return -1;
+      }
+      sr_io_uring_reap(r);
+    }
+    if (r->send_res < 0) {
+      if (r->send_res == -EINTR || r->send_res == -EAGAIN)
+        continue;
+      fprintf(stderr, "io_uring: send failed (%s)\n", strerror(-r->send_res));
+      return -1;
+    }
+    /* a short send leaves the rest of the iovec to go */
+    size_t sent = r->send_res;
+    while ((first < io->tx_iov_n) && (sent >= io->tx_iov[first].iov_len)) {
+      sent -= io->tx_iov[first].iov_len;
+      first++;
+    }
+    if (sent > 0) {
+      io->tx_iov[first].iov_base = (uint8_t *)io->tx_iov[first].iov_base + sent;
+      io->tx_iov[first].iov_len -= sent;
+    }
+  }
+
+  uint32_t i;
+  for (i = 0; i < io->tx_pb_n; i++)
+    sr_pbuf_put(io->tx_pb[i]);
+  io->tx_pb_n = 0;
+  io->tx_iov_n = 0;
+  io->tx_len = 0;
+  return 0;
+}
+
+static int sr_io_uring_send(struct sr_instance *sr, struct sr_io *io,
+  const void *hdr, size_t hdr_len, const void *data, size_t data_len) {
+  if (((io->tx_len + hdr_len + data_len > SR_IO_TX_SZ) ||
+       (io->tx_iov_n == SR_IO_TX_IOV)) &&
+      (sr_io_uring_flush(sr, io) != 0))
+    return -1;
+  uint8_t *dst = io->tx + io->tx_len;
+  memcpy(dst, hdr, hdr_len);
+  memcpy(dst + hdr_len, data, data_len);
+  io->tx_len += hdr_len + data_len;
+
+  /* copies that follow each other in tx go out as one piece */
+  struct iovec *last = io->tx_iov_n ? &io->tx_iov[io->tx_iov_n - 1] : NULL;
+  if (last && ((uint8_t *)last->iov_base + last->iov_len == dst)) {
+    last->iov_len += hdr_len + data_len;
+  } else {
+    io->tx_iov[io->tx_iov_n].iov_base = dst;
+    io->tx_iov[io->tx_iov_n].iov_len = hdr_len + data_len;
+    io->tx_iov_n++;
+  }
+  io->tx_msgs++;
+  return 0;
+}
+
+static int sr_io_uring_send_pbuf(struct sr_instance *sr, struct sr_io *io,
+  struct sr_pbuf *pb, const void *cmd, size_t len) {
+  if ((io->tx_iov_n == SR_IO_TX_IOV) && (sr_io_uring_flush(sr, io) != 0))
+    return -1;
+  sr_pbuf_ref(pb);
+  io->tx_pb[io->tx_pb_n++] = pb;
+  io->tx_iov[io->tx_iov_n].iov_base = (void *)cmd;
+  io->tx_iov[io->tx_iov_n].iov_len = len;
+  io->tx_iov_n++;
+  io->tx_msgs++;
+  return 0;
+}
+
+#endif /* SR_IO_HAVE_URING */
+
+/*---------------------------------------------------------------------
+ * common entry points
+ *---------------------------------------------------------------------*/
+
+int sr_io_init(struct sr_instance *sr, sr_io_backend want) {
+  struct sr_io *io = (struct sr_io *)calloc(1, sizeof(struct sr_io));
+  if (io == NULL)
+    return -1;
+  io->backend = want;
+  io->fd = sr->sockfd;
+
+  if (want != sr_io_syscall) {
+    io->rx = (uint8_t *)malloc(SR_IO_RX_SZ);
+    if (io->rx == NULL) {
+      free(io);
+      return -1;
+    }
+  }
+
+  if (want == sr_io_uring) {
+#ifdef SR_IO_HAVE_URING
+    io->ring = sr_io_uring_new(sr);
+    if (io->ring) {
+      io->tx = (uint8_t *)malloc(SR_IO_TX_SZ);
+      io->tx_iov = (struct iovec *)malloc(SR_IO_TX_IOV * sizeof(struct iovec));
+      io->tx_pb = (struct sr_pbuf **)malloc(SR_IO_TX_IOV * sizeof(struct sr_pbuf *));
+      if ((io->tx == NULL) || (io->tx_iov == NULL) || (io->tx_pb == NULL)) {
+        sr_io_uring_free(io->ring);
+        io->ring = NULL;
+      }
+    }
+#endif
+    if (io->ring) {
+      io->fd = io->ring->ring_fd;
+    } else {
+      fprintf(stderr, "io: falling back to writev\n");
+      io->backend = sr_io_writev;
+    }
+  }
+
+  sr->io = io;
+  fprintf(stderr, "io: using the %s backend\n", sr_io_backend_name(io->backend));
+  return io->backend;
+}
+
+void sr_io_destroy(struct sr_instance *sr) {
+  struct sr_io *io = sr->io;
+  if (io == NULL)
+    return;
+  sr_io_flush(sr);
+  fprintf(stderr, "io: %" PRIu64 " commands in %" PRIu64 " batches received, %"
+    PRIu64 " packets in %" PRIu64 " batches sent\n",
+    io->rx_msgs, io->rx_batches, io->tx_msgs, io->tx_batches);
+#ifdef SR_IO_HAVE_URING
+  if (io->ring)
+    sr_io_uring_free(io->ring);
+#endif
+  free(io->rx);
+  free(io->tx);
+  free(io->tx_iov);
+  free(io->tx_pb);
+  free(io);
+  sr->io = NULL;
+}
+
+int sr_io_poll(struct sr_instance *sr) {
+  struct sr_io *io = sr->io;
+  switch (io->backend) {
+  case sr_io_writev:
+    return sr_io_writev_poll(sr, io);
+#ifdef SR_IO_HAVE_URING
+  case sr_io_uring:
+    return sr_io_uring_poll(sr, io);
+#endif
+  default:
+    io->rx_msgs++;
+    io->rx_batches++;
+    return sr_read_from_server(sr);
+  }
+}
+
+int sr_io_send(struct sr_instance *sr, const void *hdr, size_t hdr_len,
+  const void *data, size_t data_len) {
+  struct sr_io *io = sr->io;
+  switch (io->backend) {
+#ifdef SR_IO_HAVE_URING
+  case sr_io_uring:
+    return sr_io_uring_send(sr, io, hdr, hdr_len, data, data_len);
+#endif
+  default:
+    /* syscall only gets here through sr_send_packet's own write */
+    return sr_io_writev_send(sr, io, hdr, hdr_len, data, data_len);
+  }
+}
+
+int sr_io_send_pbuf(struct sr_instance *sr, struct sr_pbuf *pb,
+  const void *cmd, size_t len) {
+  struct sr_io *io = sr->io;
+  switch (io->backend) {
+#ifdef SR_IO_HAVE_URING
+  case sr_io_uring:
+    return sr_io_uring_send_pbuf(sr, io, pb, cmd, len);
+#endif
+  default:
+    /* writev and syscall send it right away, no reference needed */
+    return sr_io_writev_send(sr, io, cmd, len, NULL, 0);
+  }
+}
+
+int sr_io_pending(struct sr_instance *sr) {
+#ifdef SR_IO_HAVE_URING
+  struct sr_io *io = sr->io;
+  return (io->backend == sr_io_uring) && (io->ring->pend_count > 0);
+#else
+  return 0;
+#endif
+}
+
+int sr_io_flush(struct sr_instance *sr) {
+  struct sr_io *io = sr->io;
+#ifdef SR_IO_HAVE_URING
+  if ((io->backend == sr_io_uring) && (io->tx_iov_n > 0))
+    return sr_io_uring_flush(sr, io);
+#endif
+  return 0;
+}
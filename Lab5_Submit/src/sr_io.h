@@ -0,0 +1,112 @@
+/* This file defines the I/O backends for the VNS socket once the session is
+   set up. Connecting and authenticating always use the blocking reads of
+   sr_vns_comm.c; sr_io_init then switches the packet phase to one of:
+
+     syscall  the original path: each server command is read with two
+              blocking recv() calls, straight into a packet buffer
+              (sr_pbuf.h), and each packet sent is written with write().
+     writev   each readable event drains the socket with one recv() into a
+              reassembly buffer and handles every complete command in it;
+              a packet is sent with one writev() of its header and frame,
+              without the copy.
+     uring    io_uring (raw syscalls, no liburing). A multishot receive
+              stays posted on the socket and fills a ring of provided
+              buffers, so receiving needs no syscall at all; the event loop
+              waits on the ring's fd. Sent packets are gathered into a
+              batch that sr_io_flush hands to the kernel as one sendmsg, so
+              a burst of packets handled together costs one io_uring_enter.
+              A packet in a packet buffer joins the batch by reference; any
+              other packet is copied into it.
+
+   The writev and uring backends copy each received packet out of the byte
+   stream into a packet buffer once, before it is handled.
+
+   uring is the default. It falls back to writev when the kernel lacks
+   io_uring, provided buffer rings or multishot receive. */
+
+#ifndef SR_IO_H
+#define SR_IO_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define SR_IO_MSG_MAX    10000       /* largest server command, as in
+                                        sr_read_from_server_expect */
+#define SR_IO_RX_SZ      (256 * 1024) /* reassembly buffer */
+#define SR_IO_TX_SZ      (256 * 1024) /* uring send batch, copied packets */
+#define SR_IO_TX_IOV     256         /* uring send batch, pieces */
+#define SR_IO_URING_SQ   64          /* submission queue entries */
+#define SR_IO_URING_BUFS 64          /* provided receive buffers, power of 2 */
+#define SR_IO_URING_BUF_SZ (16 * 1024)
+
+typedef enum {
+  sr_io_syscall,
+  sr_io_writev,
+  sr_io_uring,
+} sr_io_backend;
+
+struct sr_instance;
+struct sr_pbuf;
+
+struct sr_io_uring; /* ring state, sr_io.c */
+
+struct sr_io {
+  sr_io_backend backend;
+  int fd;                 /* descriptor the event loop waits on */
+
+  /* received bytes not yet handled (writev, uring) */
+  uint8_t *rx;
+  uint32_t rx_len;
+
+  /* packets to send (uring): the batch is tx_iov, pointing into tx for
+     copied packets and into packet buffers, held in tx_pb, for the rest */
+  uint8_t *tx;
+  uint32_t tx_len;
+  struct iovec *tx_iov;
+  uint32_t tx_iov_n;
+  struct sr_pbuf **tx_pb;
+  uint32_t tx_pb_n;
+
+  struct sr_io_uring *ring;
+
+  /* counters */
+  uint64_t rx_msgs;
+  uint64_t rx_batches;    /* times received bytes were handled */
+  uint64_t tx_msgs;
+  uint64_t tx_batches;    /* syscalls that sent packets */
+};
+
+/* Parses a backend name, returns -1 if unknown. */
+int  sr_io_parse_backend(const char *name);
+const char *sr_io_backend_name(sr_io_backend backend);
+
+/* Switches sr to the backend, or the closest one available. Returns the
+   backend in use, or -1 on error. */
+int  sr_io_init(struct sr_instance *sr, sr_io_backend want);
+void sr_io_destroy(struct sr_instance *sr);
+
+/* Handles whatever the server sent; call when sr->io->fd is readable.
+   Returns 1 to carry on, 0 when the session is closed, -1 on error. */
+int  sr_io_poll(struct sr_instance *sr);
+
+/* Sends a server command made of hdr followed by data. Both are borrowed;
+   the uring backend copies them into the pending batch. Returns 0 on
+   success. */
+int  sr_io_send(struct sr_instance *sr, const void *hdr, size_t hdr_len,
+                const void *data, size_t data_len);
+
+/* Sends the server command of len bytes at cmd, which lies in the packet
+   buffer pb. The uring backend takes a reference to pb and sends from it
+   when the batch is flushed. Returns 0 on success. */
+int  sr_io_send_pbuf(struct sr_instance *sr, struct sr_pbuf *pb,
+                     const void *cmd, size_t len);
+
+/* Pushes out the pending batch. Returns 0 on success. */
+int  sr_io_flush(struct sr_instance *sr);
+
+/* Nonzero if data came in while sr_io_flush waited for its send. The ring
+   fd does not signal it again, so the caller polls once more. */
+int  sr_io_pending(struct sr_instance *sr);
+
+#endif /* SR_IO_H */
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sr_lat.h"
+
+static const char *sr_lat_names[SR_LAT_HISTS] = {
+  [sr_lat_parse]    = "parse",
+  [sr_lat_lookup]   = "lookup",
+  [sr_lat_nat]      = "nat",
+  [sr_lat_send]     = "send",
+  [sr_lat_arp_wait] = "arp-wait",
+  [sr_lat_arp_send] = "arp-send",
+};
+
+int sr_lat_on;
+__thread struct sr_lat_thread *sr_lat_tls;
+__thread uint64_t sr_lat_in;
+__thread uint64_t sr_lat_batch;
+
+/* the histograms handed out, published in order; never freed */
+static struct sr_lat_thread *sr_lat_threads[SR_LAT_THREADS];
+static uint32_t sr_lat_nthreads;
+
+/* the set the threads past SR_LAT_THREADS share; their counts can race */
+static struct sr_lat_thread sr_lat_shared;
+
+/* the stamp and the clock when turned on, to turn TSC ticks into ns */
+static uint64_t sr_lat_tsc0;
+static uint64_t sr_lat_ns0;
+
+/* Tool function: the monotonic clock in ns. */
+static uint64_t sr_lat_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void sr_lat_enable(void) {
+  sr_lat_ns0 = sr_lat_clock();
+  sr_lat_tsc0 = sr_lat_now();
+  sr_lat_on = 1;
+}
+
+/* Tool function: gives the calling thread its histograms */
+static struct sr_lat_thread *sr_lat_alloc(int slow) {
+  struct sr_lat_thread *t = NULL;
+  uint32_t slot = __atomic_fetch_add(&sr_lat_nthreads, 1, __ATOMIC_RELAXED);
+
+  if ((slot < SR_LAT_THREADS) &&
+      (posix_memalign((void **)&t, 64, sizeof(*t)) == 0)) {
+    memset(t, 0, sizeof(*t));
+    t->slow = slow;
+    __atomic_store_n(&(sr_lat_threads[slot]), t, __ATOMIC_RELEASE);
+  } else {
+    t = &sr_lat_shared;
+  }
+  sr_lat_tls = t;
+  return t;
+}
+
+struct sr_lat_thread *sr_lat_register(void) {
+  return sr_lat_alloc(0);
+}
+
+struct sr_lat_thread *sr_lat_register_slow(void) {
+  return sr_lat_alloc(1);
+}
+
+/* Tool function: the highest value bucket i holds */
+static uint64_t sr_lat_bucket_top(uint32_t i) {
+  if (i < 2 * SR_LAT_SUB) {
+    return i;
+  }
+  uint32_t q = i / SR_LAT_SUB;
+  uint64_t low = (uint64_t)(SR_LAT_SUB + i % SR_LAT_SUB) << (q - 1);
+  return low + (1ULL << (q - 1)) - 1;
+}
+
+/* Tool function: adds histogram h of every thread of the fast path, or of
+   the slow path, into sum; returns the count */
+static uint64_t sr_lat_sum(sr_lat_hist h, int slow, uint64_t *sum) {
+  uint32_t n = __atomic_load_n(&sr_lat_nthreads, __ATOMIC_RELAXED);
+  uint64_t count = 0;
+  uint32_t i, b;
+
+  memset(sum, 0, sizeof(uint64_t) * SR_LAT_BUCKETS);
+  if (n > SR_LAT_THREADS) {
+    n = SR_LAT_THREADS;
+  }
+  for (i = 0; i <= n; i++) {
+    struct sr_lat_thread *t = (i < n) ?
+      __atomic_load_n(&(sr_lat_threads[i]), __ATOMIC_ACQUIRE) : &sr_lat_shared;
+    if ((t == NULL) || (t->slow != slow)) {
+      continue;
+    }
+    for (b = 0; b < SR_LAT_BUCKETS; b++) {
+      uint64_t c = __atomic_load_n(&(t->h[h][b]), __ATOMIC_RELAXED);
+      sum[b] += c;
+      count += c;
+    }
+  }
+  return count;
+}
+
+void sr_lat_print(void) {
+  static const double qs[] = { 0.50, 0.90, 0.99, 0.999 };
+  static const char *qnames[] = { "p50", "p90", "p99", "p99.9" };
+  uint64_t sum[SR_LAT_BUCKETS];
+  int slow, h, q;
+
+  if (!sr_lat_on) {
+    return;
+  }
+  /* ticks per ns, over the whole time the histograms were on */
+  uint64_t dns = sr_lat_clock() - sr_lat_ns0;
+  uint64_t dtsc = sr_lat_now() - sr_lat_tsc0;
+  double ns_per_tick = (dns && dtsc) ? (double)dns / (double)dtsc : 1.0;
+
+  /* the fast path's, then those of the slow path that have any */
+  for (slow = 0; slow < 2; slow++) {
+    for (h = 0; h < SR_LAT_HISTS; h++) {
+      uint64_t count, seen = 0;
+      uint32_t b, top = 0;
+
+      count = sr_lat_sum(h, slow, sum);
+      if (slow && (count == 0)) {
+        continue;
+      }
+      for (b = 0; b < SR_LAT_BUCKETS; b++) {
+        if (sum[b]) {
+          top = b;
+        }
+      }
+      fprintf(stderr, "latency: %s%-8s %10" PRIu64, slow ? "slow " : "",
+              sr_lat_names[h], count);
+      if (count == 0) {
+        fprintf(stderr, "\n");
+        continue;
+      }
+      /* each percentile is the top of the bucket it falls in */
+      for (b = 0, q = 0; (b < SR_LAT_BUCKETS) && (q < 4); b++) {
+        seen += sum[b];
+        while ((q < 4) && (seen >= qs[q] * count)) {
+          fprintf(stderr, "  %s %.0f", qnames[q], sr_lat_bucket_top(b) * ns_per_tick);
+          q++;
+        }
+      }
+      fprintf(stderr, "  max %.0f ns\n", sr_lat_bucket_top(top) * ns_per_tick);
+    }
+  }
+}
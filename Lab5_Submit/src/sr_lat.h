@@ -0,0 +1,129 @@
+/* This file defines the latency histograms, turned on with -H. A packet is
+   stamped with the TSC as sr_read_incoming_packet takes it (sr_pkt.t_in),
+   or with the read it came in (sr_lat_batch) when the I/O backend reads
+   many at once, and each stage it reaches records the time since then:
+
+     parse     the descriptor is filled in (sr_pkt.h) and the packet
+               taken to be handled: its vector starts through the graph,
+               or the scalar path takes it
+     lookup    the FIB gave its next hop
+     nat       its NAT flow was found, or it was translated
+     send      sr_send_packet hands it on; in the graph, the node that
+               sent it is done with its vector
+
+   A packet held for ARP has two of its own, recorded when the reply
+   sends it: arp-wait, from sr_arpcache_queuereq to the reply, and
+   arp-send, from its stamp to that send. Its send is not in send.
+
+   The histograms are log-linear, as HDR histograms are: each power of two
+   is split into SR_LAT_SUB buckets, so a value is kept to within 1/16 of
+   it from a few cycles up to days. Each thread records into histograms of
+   its own, made the first time it records, with a load and a store like
+   the counters (sr_stats.h); a reader sums them without a lock. The graph
+   stamps a node's whole vector once, so in the vector path a packet costs
+   no TSC read of its own, only a few per read and per vector; the scalar
+   path reads the TSC at each stage.
+
+   The slow path thread (sr_punt.h) has histograms of its own, printed
+   apart, so what the exceptions wait for does not show as the fast path's.
+
+   The thread handling a packet keeps its stamp in sr_lat_in, for the send
+   and the ARP queue, which only see the frame. Packets the router makes
+   on its own (the ARP tick's requests) are sent with none and are not
+   recorded. Off, every stamp is 0 and nothing is recorded. */
+
+#ifndef SR_LAT_H
+#define SR_LAT_H
+
+#include <inttypes.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define SR_LAT_SUB_BITS 4
+#define SR_LAT_SUB      (1 << SR_LAT_SUB_BITS)  /* buckets per power of two */
+#define SR_LAT_BITS     48                      /* longer times share the last bucket */
+#define SR_LAT_BUCKETS  ((SR_LAT_BITS - SR_LAT_SUB_BITS + 1) * SR_LAT_SUB)
+#define SR_LAT_THREADS  64  /* threads with histograms; later ones share one set */
+
+/* the histograms */
+typedef enum {
+  sr_lat_parse,
+  sr_lat_lookup,
+  sr_lat_nat,
+  sr_lat_send,
+  sr_lat_arp_wait,     /* queued on an ARP request to its reply */
+  sr_lat_arp_send,     /* received to sent, held for ARP */
+  SR_LAT_HISTS
+} sr_lat_hist;
+
+struct sr_lat_thread {
+  uint64_t h[SR_LAT_HISTS][SR_LAT_BUCKETS];
+  int slow;            /* the slow path's, printed apart */
+} __attribute__((aligned(64)));
+
+extern int sr_lat_on;
+extern __thread struct sr_lat_thread *sr_lat_tls;
+extern __thread uint64_t sr_lat_in;
+extern __thread uint64_t sr_lat_batch;
+
+/* Turns the histograms on; before the threads start. */
+void sr_lat_enable(void);
+
+/* Gives the calling thread its histograms; use sr_lat_record. */
+struct sr_lat_thread *sr_lat_register(void);
+
+/* The same for the slow path thread, before it records: its histograms are
+   printed apart from the others. */
+struct sr_lat_thread *sr_lat_register_slow(void);
+
+/* The TSC, or the monotonic clock in ns where there is none. */
+static inline uint64_t sr_lat_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* A stamp, or 0 with the histograms off. */
+static inline uint64_t sr_lat_stamp(void) {
+  return sr_lat_on ? sr_lat_now() : 0;
+}
+
+/* Tool function: the bucket of v; below 2 * SR_LAT_SUB a bucket is one
+   value wide. */
+static inline uint32_t sr_lat_bucket(uint64_t v) {
+  if (v < 2 * SR_LAT_SUB)
+    return (uint32_t)v;
+  uint32_t e = 63 - __builtin_clzll(v);
+  if (e >= SR_LAT_BITS)
+    return SR_LAT_BUCKETS - 1;
+  return (e - SR_LAT_SUB_BITS) * SR_LAT_SUB + (uint32_t)(v >> (e - SR_LAT_SUB_BITS));
+}
+
+/* Records now - since in h; nothing if since is 0. */
+static inline void sr_lat_record(sr_lat_hist h, uint64_t since, uint64_t now) {
+  if (since == 0)
+    return;
+  struct sr_lat_thread *t = sr_lat_tls;
+  if (t == NULL)
+    t = sr_lat_register();
+  /* a TSC a little behind on another CPU counts as 0 */
+  uint64_t *c = &(t->h[h][sr_lat_bucket((now > since) ? now - since : 0)]);
+  __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/* Records the time since the stamp since in h, as of now. */
+static inline void sr_lat_mark(sr_lat_hist h, uint64_t since) {
+  if (since)
+    sr_lat_record(h, since, sr_lat_now());
+}
+
+/* Prints the count and percentiles of each histogram, in ns, to stderr. */
+void sr_lat_print(void);
+
+#endif /* SR_LAT_H */
@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "sr_loop.h"
+#include "sr_router.h"
+#include "sr_arpcache.h"
+#include "sr_nat.h"
+#include "sr_io.h"
+#include "sr_graph.h"
+#include "sr_rcu.h"
+#include "sr_reload.h"
+#include "sr_worker.h"
+#include "sr_punt.h"
+#include "sr_stats.h"
+#include "sr_lat.h"
+
+/* epoll user data, one per descriptor */
+enum sr_loop_src {
+  sr_loop_vns,
+  sr_loop_timer,
+  sr_loop_signal,
+  sr_loop_reload,
+  sr_loop_workers,
+  sr_loop_punt,
+};
+
+/* Tool function: monotonic clock in microseconds */
+static uint64_t sr_loop_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Tool function: add fd to the epoll set, tagged with src */
+static int sr_loop_watch(int epfd, int fd, enum sr_loop_src src) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = src;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/* Run the periodic work. 'deadline' is when the tick was due. */
+static void sr_loop_tick(struct sr_instance *sr, struct sr_loop_stats *stats,
+  uint64_t deadline) {
+  uint64_t start = sr_loop_now_us();
+  uint64_t late = (start > deadline) ? start - deadline : 0;
+
+  sr_arpcache_tick(sr);
+  if (sr->nat_enabled) {
+    sr_nat_tick(sr);
+  }
+  /* replaced FIBs whose readers have all moved on */
+  sr_rcu_reclaim();
+
+  uint64_t run = sr_loop_now_us() - start;
+  stats->ticks++;
+  if (late > stats->tick_late_max_us)
+    stats->tick_late_max_us = late;
+  if (run > stats->tick_run_max_us)
+    stats->tick_run_max_us = run;
+}
+
+void sr_loop_stats_print(const struct sr_loop_stats *stats) {
+  fprintf(stderr, "loop: %" PRIu64 " messages, %" PRIu64 " ticks (%" PRIu64
+    " coalesced), tick late max %" PRIu64 " us, tick run max %" PRIu64 " us\n",
+    stats->msgs, stats->ticks, stats->ticks_coalesced,
+    stats->tick_late_max_us, stats->tick_run_max_us);
+}
+
+int sr_loop_run(struct sr_instance *sr) {
+  struct sr_loop_stats stats;
+  struct epoll_event events[8];
+  struct itimerspec its;
+  sigset_t mask;
+  int epfd = -1, tfd = -1, sfd = -1, rfd = -1;
+  int ret = -1;
+  int running = 1;
+
+  memset(&stats, 0, sizeof(stats));
+
+  /* the signals are taken through the signalfd, so they must not be
+     delivered the usual way */
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) != 0) {
+    perror("sigprocmask(..):sr_loop.c::sr_loop_run");
+    return -1;
+  }
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  rfd = sr_reload_init(sr);
+  if ((epfd < 0) || (tfd < 0) || (sfd < 0) || (rfd < 0)) {
+    perror("sr_loop.c::sr_loop_run");
+    goto out;
+  }
+
+  /* the tick deadlines are kept on the monotonic clock so the lateness
+     of each tick can be measured */
+  memset(&its, 0, sizeof(its));
+  its.it_interval.tv_sec = SR_LOOP_TICK_MS / 1000;
+  its.it_interval.tv_nsec = (SR_LOOP_TICK_MS % 1000) * 1000000L;
+  its.it_value = its.it_interval;
+  uint64_t next_tick = sr_loop_now_us() + (uint64_t)SR_LOOP_TICK_MS * 1000;
+  if (timerfd_settime(tfd, 0, &its, NULL) != 0) {
+    perror("timerfd_settime(..):sr_loop.c::sr_loop_run");
+    goto out;
+  }
+
+  int io_fd = sr->io->fd;
+  if ((sr_loop_watch(epfd, io_fd, sr_loop_vns) != 0) ||
+      (sr_loop_watch(epfd, tfd, sr_loop_timer) != 0) ||
+      (sr_loop_watch(epfd, sfd, sr_loop_signal) != 0) ||
+      (sr_loop_watch(epfd, rfd, sr_loop_reload) != 0)) {
+    perror("epoll_ctl(..):sr_loop.c::sr_loop_run");
+    goto out;
+  }
+  if (sr->workers &&
+      (sr_loop_watch(epfd, sr_workers_fd(sr->workers), sr_loop_workers) != 0)) {
+    perror("epoll_ctl(..):sr_loop.c::sr_loop_run");
+    goto out;
+  }
+  if (sr->punt &&
+      (sr_loop_watch(epfd, sr_punt_fd(sr->punt), sr_loop_punt) != 0)) {
+    perror("epoll_ctl(..):sr_loop.c::sr_loop_run");
+    goto out;
+  }
+
+  /* the loop thread reads the FIB; it holds no pointer into it between
+     two rounds of events */
+  sr_rcu_register();
+
+  while (running) {
+    sr_rcu_quiescent();
+    int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait(..):sr_loop.c::sr_loop_run");
+      goto out;
+    }
+
+    int i;
+    for (i = 0; (i < n) && running; i++) {
+      switch (events[i].data.u32) {
+      case sr_loop_vns: {
+        int r = sr_io_poll(sr);
+        if (r != 1) {
+          /* 0: the server closed the session */
+          ret = (r == 0) ? 0 : -1;
+          running = 0;
+          break;
+        }
+        stats.msgs++;
+        /* the io backend fell back to another one */
+        if (sr->io->fd != io_fd) {
+          epoll_ctl(epfd, EPOLL_CTL_DEL, io_fd, NULL);
+          io_fd = sr->io->fd;
+          if (sr_loop_watch(epfd, io_fd, sr_loop_vns) != 0) {
+            perror("epoll_ctl(..):sr_loop.c::sr_loop_run");
+            running = 0;
+          }
+        }
+        break;
+      }
+      case sr_loop_timer: {
+        uint64_t expired = 0;
+        if (read(tfd, &expired, sizeof(expired)) != sizeof(expired) || (expired == 0))
+          break;
+        /* a busy loop misses expirations; the ticks compare timestamps, so
+           one tick catches up on all of them */
+        stats.ticks_coalesced += expired - 1;
+        next_tick += (expired - 1) * (uint64_t)SR_LOOP_TICK_MS * 1000;
+        sr_loop_tick(sr, &stats, next_tick);
+        next_tick += (uint64_t)SR_LOOP_TICK_MS * 1000;
+        break;
+      }
+      case sr_loop_signal: {
+        struct signalfd_siginfo si;
+        while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+          if (si.ssi_signo == SIGUSR1) {
+            sr_loop_stats_print(&stats);
+            sr_pbuf_pool_print(&(sr->pbufs));
+            sr_graph_print(sr->graph);
+            sr_workers_print(sr->workers);
+            sr_punt_print(sr->punt);
+            sr_icmplim_print(&(sr->icmplim));
+            sr_stats_print(sr);
+            sr_lat_print();
+            sr_rcu_print();
+          } else if (si.ssi_signo == SIGHUP) {
+            sr_reload_start(sr);
+          } else {
+            fprintf(stderr, "Caught signal %u, leaving.\n", si.ssi_signo);
+            ret = 0;
+            running = 0;
+          }
+        }
+        break;
+      }
+      case sr_loop_reload:
+        sr_reload_finish(sr);
+        break;
+      case sr_loop_workers:
+        /* what the workers handled goes out with the batch below */
+        sr_workers_tx(sr);
+        break;
+      case sr_loop_punt:
+        /* and so does what the slow path handled */
+        sr_punt_tx(sr);
+        break;
+      }
+    }
+
+    /* whatever the handled events sent goes out in one batch */
+    while (running) {
+      if (sr_io_flush(sr) != 0) {
+        ret = -1;
+        running = 0;
+      } else if (sr_io_pending(sr)) {
+        int r = sr_io_poll(sr);
+        if (r != 1) {
+          ret = (r == 0) ? 0 : -1;
+          running = 0;
+        }
+      } else {
+        break;
+      }
+    }
+  }
+
+out:
+  sr_loop_stats_print(&stats);
+  sr_pbuf_pool_print(&(sr->pbufs));
+  sr_graph_print(sr->graph);
+  sr_workers_print(sr->workers);
+  sr_punt_print(sr->punt);
+  sr_icmplim_print(&(sr->icmplim));
+  sr_stats_print(sr);
+  sr_lat_print();
+  sr_rcu_print();
+  sr_rcu_unregister();
+  sr_reload_destroy();
+  if (sfd >= 0)
+    close(sfd);
+  if (tfd >= 0)
+    close(tfd);
+  if (epfd >= 0)
+    close(epfd);
+  sigprocmask(SIG_UNBLOCK, &mask, NULL);
+  return ret;
+}
@@ -0,0 +1,49 @@
+/* This file defines the router's event loop. One thread waits in epoll on
+   every descriptor the router reacts to:
+
+     - the VNS socket, or the io_uring in front of it (sr_io.h): what the
+       server sent is handled each time it becomes readable, and the
+       packets sent meanwhile are flushed once the events are done;
+     - a timerfd firing once a second, which runs the ARP cache and NAT
+       ticks. These used to be two threads of their own, each sleeping a
+       second and then taking the locks the packet path needs;
+     - a signalfd: SIGINT and SIGTERM leave the loop, SIGUSR1 prints
+       the loop's counters and SIGHUP reloads the routing table;
+     - the eventfd of the routing table reload (sr_reload.h), which is
+       built on a thread of its own and swapped in here.
+     - with -w, the eventfd the workers (sr_worker.h) write when they
+       queued packets to send; the loop sends them, since the socket is
+       its alone. With -e thread, the slow path thread's (sr_punt.h)
+       likewise.
+
+   Packets and timeouts are handled one after the other on the same thread,
+   so the ARP cache and NAT locks are never contended and a tick runs at
+   most one packet late. With workers, or the slow path thread, packets are
+   handled on other threads too and the locks are taken for real. */
+
+#ifndef SR_LOOP_H
+#define SR_LOOP_H
+
+#include <inttypes.h>
+
+#define SR_LOOP_TICK_MS 1000 /* period of the ARP cache and NAT ticks */
+
+struct sr_instance;
+
+struct sr_loop_stats {
+  uint64_t msgs;             /* server messages handled */
+  uint64_t ticks;            /* ticks run */
+  uint64_t ticks_coalesced;  /* expirations folded into a later tick because
+                                the loop was busy */
+  uint64_t tick_late_max_us; /* worst delay of a tick past its deadline */
+  uint64_t tick_run_max_us;  /* longest tick */
+};
+
+/* Runs until the server closes the session or SIGINT/SIGTERM arrives.
+   Returns 0 then, -1 if the loop could not be set up or a read failed. */
+int  sr_loop_run(struct sr_instance *sr);
+
+/* Prints the loop counters to stderr. */
+void sr_loop_stats_print(const struct sr_loop_stats *stats);
+
+#endif /* SR_LOOP_H */
@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <arpa/inet.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
@@ -32,6 +33,13 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_loop.h"
+#include "sr_io.h"
+#include "sr_fibsnap.h"
+#include "sr_graph.h"
+#include "sr_worker.h"
+#include "sr_punt.h"
+#include "sr_lat.h"
 
 extern char* optarg;
 
@@ -48,6 +56,9 @@ extern char* optarg;
 #define DEFAULT_ICMP_TIMEOUT 60
 #define DEFAULT_TCP_ESTAB_TIMEOUT 7440
 #define DEFAULT_TCP_TRANSIT_TIMEOUT 300
+#define SR_RT_PRINT_MAX 64 /* larger tables are only counted */
+
+static char* fib_snapshot = NULL; /* -S, see sr_fibsnap.h */
 
 
 static void usage(char* );
@@ -56,6 +67,7 @@ static void sr_destroy_instance(struct sr_instance* );
 static void sr_set_user(struct sr_instance* );
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable);
 static void sr_load_filters(struct sr_instance* sr, char* filter);
+static int  sr_parse_nat_pool(char* arg, uint32_t* pool, uint32_t* pool_sz);
 
 /*-----------------------------------------------------------------------------
  *---------------------------------------------------------------------------*/
@@ -67,6 +79,13 @@ int main(int argc, char **argv)
   int icmp_timeout = DEFAULT_ICMP_TIMEOUT;
   int tcp_estab_timeout = DEFAULT_TCP_ESTAB_TIMEOUT;
   int tcp_transit_timeout = DEFAULT_TCP_TRANSIT_TIMEOUT;
+  uint32_t nat_pool[SR_NAT_POOL_MAX];
+  uint32_t nat_pool_sz = 0;
+  int io_backend = sr_io_uring;
+  int vector_path = 1;
+  int workers = 0;
+  int slow_thread = 0;
+  struct sr_icmplim_conf icmp_limit;
 
   char *host   = DEFAULT_HOST;
   char *user = 0;
@@ -81,7 +100,9 @@ int main(int argc, char **argv)
 
   printf("Using %s\n", VERSION_INFO);
 
-  while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:n::I:E:R:")) != EOF)
+  sr_icmplim_defaults(&icmp_limit);
+
+  while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:n::I:E:R:x:b:S:P:w:e:L:H")) != EOF)
   {
     switch (c)
     {
@@ -113,6 +134,9 @@ int main(int argc, char **argv)
     case 'T':
       template = optarg;
       break;
+    case 'S':
+      fib_snapshot = optarg;
+      break;
     case 'I':
       icmp_timeout = atoi((char *)optarg);
       break;
@@ -125,12 +149,65 @@ int main(int argc, char **argv)
     case 'n':
       nat_en = 1;
       break;
+    case 'x':
+      if(sr_parse_nat_pool(optarg, nat_pool, &nat_pool_sz) != 0){
+        fprintf(stderr, "Bad nat external address %s\n", optarg);
+        exit(1);
+      }
+      break;
     case 'f':
       filter = optarg;
       break;
+    case 'b':
+      if((io_backend = sr_io_parse_backend(optarg)) < 0){
+        fprintf(stderr, "Unknown io backend %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'P':
+      if(strcmp(optarg, "vector") == 0){
+        vector_path = 1;
+      }else if(strcmp(optarg, "scalar") == 0){
+        vector_path = 0;
+      }else{
+        fprintf(stderr, "Unknown packet path %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'w':
+      workers = atoi((char *) optarg);
+      if((workers < 0) || (workers > SR_WORKERS_MAX)){
+        fprintf(stderr, "Between 0 and %d workers\n", SR_WORKERS_MAX);
+        exit(1);
+      }
+      break;
+    case 'e':
+      if(strcmp(optarg, "inline") == 0){
+        slow_thread = 0;
+      }else if(strcmp(optarg, "thread") == 0){
+        slow_thread = 1;
+      }else{
+        fprintf(stderr, "Unknown slow path %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'L':
+      if(sr_icmplim_parse(optarg, &icmp_limit) != 0){
+        fprintf(stderr, "Bad icmp error rate %s\n", optarg);
+        exit(1);
+      }
+      break;
+    case 'H':
+      sr_lat_enable();
+      break;
     } /* switch */
   } /* -- while -- */
 
+  if(slow_thread && !vector_path){
+    fprintf(stderr, "The slow path thread takes its packets from the vector path\n");
+    exit(1);
+  }
+
    /* -- zero out sr instance -- */
   sr_init_instance(&sr);
 
@@ -182,8 +259,9 @@ int main(int argc, char **argv)
     Debug("Connected to new instantiation of topology template %s\n", template);
     sr_load_rt_wrap(&sr, "rtable.vrhost");
   }
-  else {
-     /* Read from specified routing table */
+  else if (template != NULL) {
+     /* Read from specified routing table; without a template it was
+        read before connecting already */
     sr_load_rt_wrap(&sr, rtable);
   }
 
@@ -193,10 +271,39 @@ int main(int argc, char **argv)
   sr.nat_icmp_timeout = icmp_timeout;
   sr.nat_tcp_estab_timeout = tcp_estab_timeout;
   sr.nat_tcp_transit_timeout = tcp_transit_timeout;
+  memcpy(sr.nat_pool, nat_pool, sizeof(uint32_t) * nat_pool_sz);
+  sr.nat_pool_sz = nat_pool_sz;
+  sr_icmplim_init(&sr.icmplim, &icmp_limit);
   sr_init(&sr);
-  
-   /* -- whizbang main loop ;-) */
-  while( sr_read_from_server(&sr) == 1);
+
+   /* -- packets received together go through the graph, see sr_graph.h -- */
+  if(vector_path && ((sr.graph = sr_graph_create()) == NULL)){
+    fprintf(stderr, "Error: out of memory (sr_graph_create)\n");
+    return 1;
+  }
+
+   /* -- switch the socket to the packet phase backend -- */
+  if(sr_io_init(&sr, io_backend) < 0){
+    return 1;
+  }
+
+   /* -- with -e thread the exceptions are handled on a thread of their
+         own, see sr_punt.h -- */
+  if(slow_thread && ((sr.punt = sr_punt_start(&sr)) == NULL)){
+    return 1;
+  }
+
+   /* -- with -w the loop only reads and sends, the workers handle the
+         packets, see sr_worker.h -- */
+  if(workers && ((sr.workers = sr_workers_start(&sr, workers)) == NULL)){
+    return 1;
+  }
+
+   /* -- whizbang main loop ;-) -- packets, timers and signals, see sr_loop.h */
+  sr_loop_run(&sr);
+  sr_workers_stop(sr.workers);
+  sr_punt_stop(sr.punt);
+  sr_io_destroy(&sr);
 
   sr_destroy_instance(&sr);
 
@@ -216,6 +323,15 @@ static void usage(char* argv0)
   printf("           [-t topo id] [-r routing table] \n");
   printf("           [-f filter file]\n");
   printf("           [-l log file] \n");
+  printf("           [-n] [-I icmp timeout] [-E tcp established timeout]\n");
+  printf("           [-R tcp transitory timeout] [-x nat address[/len]]...\n");
+  printf("           [-b io backend: uring (default), writev or syscall]\n");
+  printf("           [-S fib snapshot]\n");
+  printf("           [-P packet path: vector (default) or scalar]\n");
+  printf("           [-w worker threads (experimental), 0 (default) handles packets on the loop]\n");
+  printf("           [-e slow path: inline (default) or thread]\n");
+  printf("           [-L icmp errors/s of a kind[/burst][,to a host[/burst]], 0 unlimited]\n");
+  printf("           [-H latency histograms]\n");
   printf("   defaults server=%s port=%d host=%s  \n",
           DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -258,10 +374,55 @@ static void sr_destroy_instance(struct sr_instance* sr)
   if(sr->logfile) {
     sr_dump_close(sr->logfile);
   }
+  sr_graph_destroy(sr->graph);
 
   /* fprintf(stderr,"sr_destroy_instance leaking memory\n"); */
 } /* -- sr_destroy_instance -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_parse_nat_pool(..)
+ * Scope: Local
+ *
+ * add the addresses of "ip" or "ip/len" to the nat's external address pool.
+ * A prefix adds every address in it, network and broadcast included, since
+ * the pool addresses are only ever used as translated sources.
+ *
+ *----------------------------------------------------------------------------*/
+
+static int sr_parse_nat_pool(char* arg, uint32_t* pool, uint32_t* pool_sz)
+{
+  char buf[32];
+  char* slash;
+  struct in_addr addr;
+  int len = 32;
+  uint32_t base, count, i, j;
+
+  strncpy(buf, arg, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = '\0';
+  if((slash = strchr(buf, '/')) != NULL){
+    *slash = '\0';
+    len = atoi(slash + 1);
+  }
+  if((len < 24) || (len > 32) || (inet_pton(AF_INET, buf, &addr) != 1)){
+    return -1;
+  }
+
+  count = 1u << (32 - len);
+  base = ntohl(addr.s_addr) & ~(count - 1);
+  for(i = 0; i < count; i++){
+    uint32_t ip = htonl(base + i);
+    for(j = 0; (j < *pool_sz) && (pool[j] != ip); j++);
+    if(j < *pool_sz){
+      continue; /* already in the pool */
+    }
+    if(*pool_sz >= SR_NAT_POOL_MAX){
+      return -1;
+    }
+    pool[(*pool_sz)++] = ip;
+  }
+  return 0;
+} /* -- sr_parse_nat_pool -- */
+
 /*-----------------------------------------------------------------------------
  * Method: sr_init_instance(..)
  * Scope: Local
@@ -282,7 +443,16 @@ static void sr_init_instance(struct sr_instance* sr)
   sr->filter_list = 0;
   sr->if_list = 0;
   sr->routing_table = 0;
+  sr->rtable[0] = 0;
+  sr->fib = 0;
+  sr->fib_gen = 0;
   sr->routing_nat = 0;
+  sr->nat_pool_sz = 0;
+  sr->io = 0;
+  sr->graph = 0;
+  sr->workers = 0;
+  sr->punt = 0;
+  sr->nat_inside = 0;
   sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -335,10 +505,39 @@ int sr_verify_routing_table(struct sr_instance* sr)
 } /* -- sr_verify_routing_table -- */
 
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
-  if(sr_load_rt(sr, rtable) != 0) {
-    fprintf(stderr,"Error setting up routing table from file %s\n",
-      rtable);
-    exit(1);
+  struct sr_rt* rt_walker = 0;
+  unsigned int n = 0;
+
+  /* SIGHUP reads it again, see sr_reload.h */
+  strncpy(sr->rtable, rtable, sizeof(sr->rtable) - 1);
+
+  /* a snapshot written since the file last changed has both the table
+     and its FIB, see sr_fibsnap.h */
+  if((fib_snapshot != NULL) && (sr->routing_table == 0) &&
+     sr_fibsnap_fresh(fib_snapshot, rtable) &&
+     (sr_fibsnap_load(sr, fib_snapshot) == 0)) {
+    printf("Routing table and FIB from snapshot %s\n", fib_snapshot);
+  } else {
+    if(sr_load_rt(sr, rtable) != 0) {
+      fprintf(stderr,"Error setting up routing table from file %s\n",
+        rtable);
+      exit(1);
+    }
+    if(sr_fib_publish(sr) != 0) {
+      fprintf(stderr,"Error compiling the forwarding table\n");
+      exit(1);
+    }
+    if(fib_snapshot != NULL) {
+      sr_fibsnap_save(fib_snapshot, sr->fib, sr->routing_table);
+    }
+  }
+
+  for(rt_walker = sr->routing_table; rt_walker; rt_walker = rt_walker->next) {
+    n++;
+  }
+  if(n > SR_RT_PRINT_MAX) {
+    printf("Loaded routing table, %u routes\n", n);
+    return;
   }
 
 
@@ -9,28 +9,88 @@
 
 #include "sr_utils.h"
 #include "sr_router.h"
+#include "sr_pkt.h"
+
+/* Tool function: hash a lookup key into a bucket of hash_int or hash_ext */
+static inline uint32_t sr_nat_hash(struct sr_nat *nat, uint32_t a, uint32_t b) {
+  uint32_t h = (a * 2654435761u) ^ (b * 2246822519u);
+  h ^= h >> 15;
+  return h & nat->hash_mask;
+}
+
+#define sr_nat_hash_int(nat, ip_int, aux_int, type) \
+  sr_nat_hash((nat), (ip_int), ((uint32_t)(aux_int) << 8) | (type))
+#define sr_nat_hash_ext(nat, ip_ext, aux_ext, type) \
+  sr_nat_hash((nat), (ip_ext), ((uint32_t)(aux_ext) << 8) | (type))
+
+#define sr_nat_entry(nat, idx) \
+  ((struct sr_nat_map_entry *)sr_slab_at(&(nat)->map_slab, (idx)))
+#define sr_nat_conn(nat, idx) \
+  ((struct sr_nat_connection *)sr_slab_at(&(nat)->conn_slab, (idx)))
+
+/* Tool function: rebuild the pool address index after the pool changed */
+void sr_nat_pool_rehash(struct sr_nat *nat) {
+  uint32_t i;
+  memset(nat->pool_hash, 0xff, sizeof(nat->pool_hash));
+  for (i = 0; i < nat->pool_sz; i++) {
+    uint32_t h = (nat->pool[i] * 2654435761u) >> 16;
+    while (nat->pool_hash[h & (2 * SR_NAT_POOL_MAX - 1)] != 0xffff)
+      h++;
+    nat->pool_hash[h & (2 * SR_NAT_POOL_MAX - 1)] = (uint16_t)i;
+  }
+}
 
 int sr_nat_init(void *sr_ptr, struct sr_nat *nat) { /* Initializes the nat */
 
   assert(nat);
 
+  /* Without -x the pool gets its address from sr_nat_default_pool */
+  if (nat->pool_sz == 0) {
+    nat->pool[0] = 0;
+    nat->pool_sz = 1;
+  }
+  sr_nat_pool_rehash(nat);
+
+  /* every pool address has its own port range, so the tables grow with
+     the pool */
+  uint64_t map_cap = (uint64_t)SR_NAT_MAPPINGS_MAX * nat->pool_sz;
+  if (map_cap > SR_NAT_MAPPINGS_LIMIT)
+    map_cap = SR_NAT_MAPPINGS_LIMIT;
+  uint32_t conn_cap = (uint32_t)map_cap * (SR_NAT_CONNS_MAX / SR_NAT_MAPPINGS_MAX);
+  uint32_t hash_sz = 1;
+  while (hash_sz < map_cap)
+    hash_sz <<= 1;
+  nat->hash_mask = hash_sz - 1;
+
+  if (sr_slab_init(&(nat->map_slab), sizeof(struct sr_nat_map_entry), (uint32_t)map_cap) != 0 ||
+      sr_slab_init(&(nat->conn_slab), sizeof(struct sr_nat_connection), conn_cap) != 0) {
+    fprintf(stderr, "Error: out of memory (sr_nat_init)\n");
+    return -1;
+  }
+  nat->map_cold = (struct sr_nat_map_cold *)calloc(map_cap, sizeof(struct sr_nat_map_cold));
+  nat->hash_int = (uint32_t *)malloc(hash_sz * sizeof(uint32_t));
+  nat->hash_ext = (uint32_t *)malloc(hash_sz * sizeof(uint32_t));
+  nat->ext_ports = (uint64_t *)calloc((size_t)SR_NAT_MAPPING_TYPES * nat->pool_sz * SR_NAT_PORTMAP_WORDS,
+    sizeof(uint64_t));
+  assert(nat->map_cold && nat->hash_int && nat->hash_ext && nat->ext_ports);
+  memset(nat->hash_int, 0xff, hash_sz * sizeof(uint32_t));
+  memset(nat->hash_ext, 0xff, hash_sz * sizeof(uint32_t));
+  memset(nat->unso_syn, 0, sizeof(nat->unso_syn));
+  memset(nat->unso_syn_hash, 0xff, sizeof(nat->unso_syn_hash));
+  nat->unso_syn_head = 0;
+  nat->unso_syn_count = 0;
+  nat->unso_syn_held = nat->unso_syn_matched = 0;
+  nat->unso_syn_expired = nat->unso_syn_drops = 0;
+
   /* Acquire mutex lock */
   pthread_mutexattr_init(&(nat->attr));
   pthread_mutexattr_settype(&(nat->attr), PTHREAD_MUTEX_RECURSIVE);
   int success = pthread_mutex_init(&(nat->lock), &(nat->attr));
 
-  /* Initialize timeout thread */
-
-  pthread_attr_init(&(nat->thread_attr));
-  pthread_attr_setdetachstate(&(nat->thread_attr), PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setscope(&(nat->thread_attr), PTHREAD_SCOPE_SYSTEM);
-    
-  pthread_create(&(nat->thread), &(nat->thread_attr), sr_nat_timeout, sr_ptr);
+  /* Timeouts are handled by sr_nat_tick, run from the event loop */
 
   /* CAREFUL MODIFYING CODE ABOVE THIS LINE! */
 
-  nat->mappings = NULL;
   /* Initialize any variables here */
 
   return success;
@@ -42,291 +102,493 @@ int sr_nat_destroy(struct sr_nat *nat) {  /* Destroys the nat (free memory) */
   pthread_mutex_lock(&(nat->lock));
 
   /* free nat memory here */
+  uint32_t i;
+  for (i = 0; i < SR_NAT_UNSOSYN_SZ; i++) {
+    if (nat->unso_syn[i].valid)
+      sr_pbuf_put(nat->unso_syn[i].pb);
+  }
+  sr_slab_destroy(&(nat->map_slab));
+  sr_slab_destroy(&(nat->conn_slab));
+  free(nat->map_cold);
+  free(nat->hash_int);
+  free(nat->hash_ext);
+  free(nat->ext_ports);
 
-  pthread_kill(nat->thread, SIGKILL);
   return pthread_mutex_destroy(&(nat->lock)) &&
     pthread_mutexattr_destroy(&(nat->attr));
 
 }
 
-void *sr_nat_timeout(void *sr_ptr) {  /* Periodic Timout handling */
-  struct sr_instance *sr = (struct sr_instance *)sr_ptr;
-  struct sr_nat *nat = sr->routing_nat;
-  while (1) {
-    sleep(1.0);
-    pthread_mutex_lock(&(nat->lock));
-
-    time_t curtime = time(NULL);
-    /* handle SYN initiated from external node */
-    if(nat->unso_syn_list != NULL){
-      struct sr_nat_unsosyn * syn_walker = nat->unso_syn_list;
-      struct sr_nat_unsosyn * syn_prev = NULL;
-      while(syn_walker){
-        unsigned remove_syn = 0;
-        /* check if there is a corresponding SYN initiated from inside */
-        struct  sr_ip_hdr* iphdr = (struct sr_ip_hdr*)(syn_walker->packet + sizeof(struct sr_ethernet_hdr));
-        struct  sr_tcp_hdr*     tcphdr = (struct sr_tcp_hdr*)(syn_walker->packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
-        struct sr_nat_mapping* entry;
-        entry = sr_nat_lookup_external(nat, ntohs(tcphdr->tcp_dest), nat_mapping_tcp);
-        if(entry){
-          // fprintf(stderr, "Unso_SYN, Found Entry. \n");
-          // print_addr_ip_int(entry->ip_int);
-          // fprintf(stderr, "aux_ext: %d \n", entry->aux_ext);
-          // print_addr_ip_int(iphdr->ip_src);
-//          struct sr_nat_connection* has_connect = 0;
-//          has_connect = sr_nat_lookup_connection(entry, entry->ip_int, iphdr->ip_src);
-//          if(has_connect){
-            // fprintf(stderr, "Corresponding SYN initiated from internal. \n");
-    //        sr_handle_forwardtcp_nat(sr, syn_walker->packet, syn_walker->len, syn_walker->iface);
-            remove_syn = 1;
-//          }
-        }
-
-        /* if no, check if the unsolicited SYN is timeout */
-        time_t timediff = difftime(curtime, syn_walker->recv);
-        if(timediff > SR_NAT_UNSOSYN_TO){
-          fprintf(stderr, "Timeout: send ICMP for unsolicited SYN. \n");
-          sr_handlepacket_icmpUnreachable(sr, syn_walker->packet, syn_walker->len, syn_walker->iface, 3, 3);
-          fprintf(stderr, "ICMP packet sent. \n");
-          remove_syn = 1;
-        }
-        if(remove_syn){
-          if(syn_prev == NULL){
-            nat->unso_syn_list = nat->unso_syn_list->next;
-            syn_walker = NULL;
-          }else{
-            syn_prev->next = syn_walker->next;
-            syn_walker = NULL;
-          }
-          break;
-        }
-        syn_walker = syn_walker->next;
-      }
+/* Tool function: unlink mapping idx from the chain starting at *head. The
+   chain is linked through next_int if internal is set, else next_ext. */
+static void sr_nat_unchain(struct sr_nat *nat, uint32_t *head, uint32_t idx, int internal) {
+  uint32_t *link = head;
+  while (*link != SR_SLAB_NIL) {
+    struct sr_nat_map_entry *walker = sr_nat_entry(nat, *link);
+    if (*link == idx) {
+      *link = internal ? walker->next_int : walker->next_ext;
+      return;
     }
+    link = internal ? &(walker->next_int) : &(walker->next_ext);
+  }
+}
 
-    /* handle periodic tasks here */
-    // fprintf(stderr, "CHECK TIMEOUT. \n");
-    struct sr_nat_mapping * map_walker = nat->mappings;
-    struct sr_nat_mapping * map_prev = NULL;
-    unsigned remove_map = 0;
-    while(map_walker){
-      // fprintf(stderr, "diff time %d %d %d\n", curtime, map_walker->last_updated, nat->icmp_to);
-      time_t timediff = difftime(curtime,map_walker->last_updated);
-      if(map_walker->type == nat_mapping_icmp){
-        if(timediff > nat->icmp_to){
-          // icmp timeout
-          fprintf(stderr, "TIMEOUT: icmp mapping. \n");
-          remove_map = 1;
-        }
-      }else if(map_walker->type == nat_mapping_tcp){
-        struct sr_nat_connection * conn_walker = map_walker->conns;
-        struct sr_nat_connection * conn_prev = NULL;
-        unsigned remove_conn = 0;
-        while(conn_walker){
-          time_t conn_tdiff = difftime(curtime,conn_walker->last_updated);
-          if(conn_walker->state == nat_connection_established){
-            if(conn_tdiff > nat->tcp_estab_to){
-              // tcp established timeout
-              fprintf(stderr, "TIMEOUT: tcp established mapping. \n");
-              remove_conn = 1;
-            }
-          }else if(conn_walker->state == nat_connection_building){
-            if(conn_tdiff > nat->tcp_transit_to){
-              // tcp transit timeout
-              fprintf(stderr, "TIMEOUT: tcp transit mapping. \n");
-              remove_conn = 1;
-            }
-          }
-          if(remove_conn){
-            if(conn_prev == NULL){
-              remove_map = 1;
-              conn_walker = NULL;
-              map_walker->conns = NULL;
-              break;
-            }            
-            conn_prev->next = conn_walker->next;
-            conn_walker = NULL;
-            break;
-          }
-          conn_prev = conn_walker;
-          conn_walker = conn_walker->next;
-        }
-      }
-      if(remove_map){
-        if(map_prev == NULL){
-            // if current mapping is the last one
-            map_walker = NULL;
-            nat->mappings = NULL;
-            return NULL;
-        }
-        map_prev->next = map_walker->next;
-        map_walker = NULL;
-        return NULL;
-      }
+/* Tool function: mark external port aux_ext used or free in the port map.
+   Must be called with the nat lock held; the atomic update keeps the words
+   whole for the lock-free readers in sr_nat_port_mapped. */
+static void sr_nat_port_set(struct sr_nat *nat, uint32_t pool, uint16_t aux_ext,
+  sr_nat_mapping_type type, int used) {
+  uint64_t bit = (uint64_t)1 << (aux_ext & 63);
+  if (used)
+    __atomic_fetch_or(sr_nat_port_word(nat, type, pool, aux_ext), bit, __ATOMIC_RELEASE);
+  else
+    __atomic_fetch_and(sr_nat_port_word(nat, type, pool, aux_ext), ~bit, __ATOMIC_RELEASE);
+}
 
-      map_prev = map_walker;
-      map_walker = map_walker->next;
-    }
+/* Tool function: find the first external port of pool address pool at or
+   after start that no mapping of the type holds, wrapping around the valid
+   port range. Scans 64 ports per word. Returns 0 if every port is used.
+   Must be called with the nat lock held. */
+static uint16_t sr_nat_port_find_free(struct sr_nat *nat, uint32_t pool, uint16_t start,
+  sr_nat_mapping_type type) {
+  uint64_t *map = sr_nat_port_word(nat, type, pool, 0);
+  uint32_t first = SR_NAT_VALID_PORT / 64;
+  uint32_t word = start >> 6;
+  /* ignore the ports below start in the first word */
+  uint64_t used = map[word] | (((uint64_t)1 << (start & 63)) - 1);
+  uint32_t n;
+  for (n = 0; n <= SR_NAT_PORTMAP_WORDS - first; n++) {
+    if (~used)
+      return (uint16_t)((word << 6) + __builtin_ctzll(~used));
+    word = (word + 1 < SR_NAT_PORTMAP_WORDS) ? word + 1 : first;
+    used = map[word];
+  }
+  return 0;
+}
 
-    pthread_mutex_unlock(&(nat->lock));
+/* Tool function: remove mapping idx and its connections from the table.
+   Must be called with the nat lock held. */
+static void sr_nat_remove_mapping(struct sr_nat *nat, uint32_t idx) {
+  struct sr_nat_map_entry *entry = sr_nat_entry(nat, idx);
+  struct sr_nat_map_cold *cold = &(nat->map_cold[idx]);
+
+  sr_nat_unchain(nat, &(nat->hash_int[sr_nat_hash_int(nat, entry->ip_int, entry->aux_int, entry->type)]), idx, 1);
+  sr_nat_unchain(nat, &(nat->hash_ext[sr_nat_hash_ext(nat, entry->ip_ext, entry->aux_ext, entry->type)]), idx, 0);
+
+  uint32_t conn_idx = cold->conns;
+  while (conn_idx != SR_SLAB_NIL) {
+    uint32_t next = sr_nat_conn(nat, conn_idx)->next;
+    sr_slab_free(&(nat->conn_slab), conn_idx);
+    conn_idx = next;
   }
-  return NULL;
+  cold->conns = SR_SLAB_NIL;
+  sr_nat_port_set(nat, entry->pool, entry->aux_ext, (sr_nat_mapping_type)entry->type, 0);
+  entry->valid = 0;
+  sr_slab_free(&(nat->map_slab), idx);
+}
+
+/* Tool function: fill copy from table entry idx */
+static void sr_nat_fill_mapping(struct sr_nat *nat, uint32_t idx, struct sr_nat_mapping *copy) {
+  struct sr_nat_map_entry *entry = sr_nat_entry(nat, idx);
+  copy->type = (sr_nat_mapping_type)entry->type;
+  copy->ip_int = entry->ip_int;
+  copy->ip_ext = entry->ip_ext;
+  copy->aux_int = entry->aux_int;
+  copy->aux_ext = entry->aux_ext;
+  copy->last_updated = entry->last_updated;
+  copy->valid = entry->valid;
+  copy->idx = idx;
+}
+
+/* Tool function: unlink held SYN idx from its bucket chain and mark it
+   dead. Must be called with the nat lock held. */
+static void sr_nat_unchain_unsosyn(struct sr_nat *nat, uint32_t idx) {
+  struct sr_nat_unsosyn *syn = &(nat->unso_syn[idx]);
+  uint32_t *link = &(nat->unso_syn_hash[syn->aux_ext & (SR_NAT_UNSOSYN_BUCKETS - 1)]);
+  while (*link != SR_SLAB_NIL) {
+    if (*link == idx) {
+      *link = syn->next;
+      break;
+    }
+    link = &(nat->unso_syn[*link].next);
+  }
+  syn->valid = 0;
+  sr_pbuf_put(syn->pb);
+  syn->pb = NULL;
 }
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type ) {
+int sr_nat_hold_unsosyn(struct sr_nat *nat, const struct sr_pkt *pk,
+  uint8_t *packet, struct sr_pbuf *pb, char *iface) {
+  const struct sr_ip_hdr *iphdr = sr_pkt_ip(pk);
+  uint16_t aux_ext = ntohs(pk->dport);
+  int ret = 0;
+
   pthread_mutex_lock(&(nat->lock));
 
-  // fprintf(stderr, "Lookup external: ");
-  /* handle lookup here, malloc and assign to copy */
-  struct sr_nat_mapping *entry = NULL, *copy = NULL;
-  struct sr_nat_mapping* map_walker = nat->mappings;
-  while(map_walker) {
-    if((map_walker->valid) && (map_walker->aux_ext == aux_ext) && (map_walker->type == type)){
-      entry = map_walker;
-      // fprintf(stderr, "Found. \n");
+  /* a retransmission of a SYN we already hold is not held twice */
+  uint32_t *head = &(nat->unso_syn_hash[aux_ext & (SR_NAT_UNSOSYN_BUCKETS - 1)]);
+  uint32_t idx;
+  for (idx = *head; idx != SR_SLAB_NIL; idx = nat->unso_syn[idx].next) {
+    struct sr_nat_unsosyn *held = &(nat->unso_syn[idx]);
+    if ((held->aux_ext == aux_ext) && (held->ip_dst == iphdr->ip_dst) &&
+        (held->ip_src == iphdr->ip_src) && (held->sport == pk->sport)) {
+      pthread_mutex_unlock(&(nat->lock));
+      sr_pbuf_put(pb);
+      return 0;
     }
-    map_walker = map_walker->next;
   }
 
-  /* Must return a copy b/c another thread could jump in and modify
-  table after we return. */
-  if (entry) {
-    copy = (struct sr_nat_mapping*) malloc(sizeof(struct sr_nat_mapping));
-    memcpy(copy, entry, sizeof(struct sr_nat_mapping));
+  if (nat->unso_syn_count == SR_NAT_UNSOSYN_SZ) {
+    nat->unso_syn_drops++;
+    fprintf(stderr, "Unsolicited SYN table full, refusing SYN (%llu refused). \n",
+      (unsigned long long)nat->unso_syn_drops);
+    sr_pbuf_put(pb);
+    ret = -1;
+  } else {
+    idx = (nat->unso_syn_head + nat->unso_syn_count) % SR_NAT_UNSOSYN_SZ;
+    struct sr_nat_unsosyn *unsosyn = &(nat->unso_syn[idx]);
+    unsosyn->packet = packet;
+    unsosyn->pb = pb;
+    unsosyn->len = pk->len;
+    strncpy(unsosyn->iface, iface, sr_IFACE_NAMELEN);
+    unsosyn->aux_ext = aux_ext;
+    unsosyn->sport = pk->sport;
+    unsosyn->ip_src = iphdr->ip_src;
+    unsosyn->ip_dst = iphdr->ip_dst;
+    unsosyn->recv = (uint32_t)time(NULL);
+    unsosyn->valid = 1;
+    unsosyn->next = *head;
+    *head = idx;
+    nat->unso_syn_count++;
+    nat->unso_syn_held++;
   }
 
   pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  return ret;
+}
+
+/* Tool function: a new mapping took external (ip_ext, aux_ext), drop the
+   SYNs held for it. Must be called with the nat lock held. */
+static void sr_nat_match_unsosyn(struct sr_nat *nat, uint32_t ip_ext, uint16_t aux_ext) {
+  uint32_t idx = nat->unso_syn_hash[aux_ext & (SR_NAT_UNSOSYN_BUCKETS - 1)];
+  while (idx != SR_SLAB_NIL) {
+    struct sr_nat_unsosyn *held = &(nat->unso_syn[idx]);
+    uint32_t next = held->next;
+    if ((held->aux_ext == aux_ext) && (held->ip_dst == ip_ext)) {
+      sr_nat_unchain_unsosyn(nat, idx);
+      nat->unso_syn_matched++;
+    }
+    idx = next;
+  }
 }
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+/* Tool function: expire held SYNs. Entries are in arrival order, so this
+   stops at the first one that has not expired. */
+static void sr_nat_sweep_unsosyn(struct sr_instance *sr, struct sr_nat *nat, uint32_t now) {
+  while (nat->unso_syn_count > 0) {
+    uint32_t idx = nat->unso_syn_head;
+    struct sr_nat_unsosyn *syn = &(nat->unso_syn[idx]);
+    if (syn->valid) {
+      if (now - syn->recv <= SR_NAT_UNSOSYN_TO)
+        break;
+      nat->unso_syn_expired++;
+      fprintf(stderr, "Timeout: send ICMP for unsolicited SYN. \n");
+      sr_handlepacket_icmpUnreachable(sr, syn->packet, syn->len, syn->iface, 3, 3);
+      sr_nat_unchain_unsosyn(nat, idx);
+    }
+    nat->unso_syn_head = (nat->unso_syn_head + 1) % SR_NAT_UNSOSYN_SZ;
+    nat->unso_syn_count--;
+  }
+}
 
+/* Periodic timeout handling, run once a second by the event loop */
+void sr_nat_tick(struct sr_instance *sr) {
+  struct sr_nat *nat = sr->routing_nat;
   pthread_mutex_lock(&(nat->lock));
 
-  /* handle lookup here, malloc and assign to copy. */
-  struct sr_nat_mapping *entry = NULL, *copy = NULL;
-
-  // fprintf(stderr, "Lookup internal: ");
-  struct sr_nat_mapping* map_walker = nat->mappings;
-  
-  while(map_walker) {
-    // print_addr_ip_int(map_walker->ip_int);
-    // print_addr_ip_int(ip_int);
-    if ((map_walker->valid) && (map_walker->ip_int == ip_int) 
-        && (map_walker->aux_int == aux_int) && (map_walker->type == type)){
-      // fprintf(stderr, "Found. \n");	
-      entry = map_walker;
+  time_t curtime = time(NULL);
+  /* handle SYN initiated from external node */
+  sr_nat_sweep_unsosyn(sr, nat, (uint32_t)curtime);
+
+  /* handle periodic tasks here */
+  /* the hot halves are packed in one array, so the sweep is a linear scan
+     of [0, hwm) rather than a pointer chase */
+  uint32_t now = (uint32_t)curtime;
+  uint32_t i;
+  for (i = 0; i < nat->map_slab.hwm; i++) {
+    struct sr_nat_map_entry *entry = sr_nat_entry(nat, i);
+    if (!entry->valid)
+      continue;
+    if (entry->type == nat_mapping_icmp) {
+      if (now - entry->last_updated > (uint32_t)nat->icmp_to) {
+        // icmp timeout
+        fprintf(stderr, "TIMEOUT: icmp mapping. \n");
+        sr_nat_remove_mapping(nat, i);
+      }
+      continue;
+    }
+
+    /* tcp: time out each connection, then the mapping once it has none */
+    uint32_t *link = &(nat->map_cold[i].conns);
+    while (*link != SR_SLAB_NIL) {
+      struct sr_nat_connection *conn = sr_nat_conn(nat, *link);
+      uint32_t conn_to = (conn->state == nat_connection_established) ?
+        (uint32_t)nat->tcp_estab_to : (uint32_t)nat->tcp_transit_to;
+      if (now - conn->last_updated > conn_to) {
+        fprintf(stderr, "TIMEOUT: tcp %s connection. \n",
+          (conn->state == nat_connection_established) ? "established" : "transit");
+        uint32_t dead = *link;
+        *link = conn->next;
+        sr_slab_free(&(nat->conn_slab), dead);
+        continue;
+      }
+      link = &(conn->next);
+    }
+    if ((nat->map_cold[i].conns == SR_SLAB_NIL) &&
+        (now - entry->last_updated > (uint32_t)nat->tcp_transit_to)) {
+      fprintf(stderr, "TIMEOUT: tcp mapping. \n");
+      sr_nat_remove_mapping(nat, i);
     }
-    map_walker = map_walker->next;
   }
-  /* Must return a copy b/c another thread could jump in and modify
-  table after we return. */
-  
-  if (entry) {
-    copy = (struct sr_nat_mapping *) malloc(sizeof(struct sr_nat_mapping));
-    memcpy(copy, entry, sizeof(struct sr_nat_mapping));
+
+  pthread_mutex_unlock(&(nat->lock));
+}
+
+/* Tool function: find the mapping with internal (ip, aux) for nat_dir_out
+   or external (ip, aux) for nat_dir_in. Returns its index or SR_SLAB_NIL.
+   Must be called with the nat lock held. */
+static uint32_t sr_nat_find(struct sr_nat *nat, sr_nat_dir dir, uint32_t ip,
+  uint16_t aux, sr_nat_mapping_type type) {
+  uint32_t idx;
+  if (dir == nat_dir_out) {
+    idx = nat->hash_int[sr_nat_hash_int(nat, ip, aux, type)];
+    while (idx != SR_SLAB_NIL) {
+      struct sr_nat_map_entry *entry = sr_nat_entry(nat, idx);
+      if ((entry->ip_int == ip) && (entry->aux_int == aux) && (entry->type == type))
+        break;
+      idx = entry->next_int;
+    }
+  } else {
+    idx = nat->hash_ext[sr_nat_hash_ext(nat, ip, aux, type)];
+    while (idx != SR_SLAB_NIL) {
+      struct sr_nat_map_entry *entry = sr_nat_entry(nat, idx);
+      if ((entry->ip_ext == ip) && (entry->aux_ext == aux) && (entry->type == type))
+        break;
+      idx = entry->next_ext;
+    }
   }
-  
+  return idx;
+}
+
+/* Get the mapping associated with given external port, copied into
+   *mapping. */
+int sr_nat_lookup_external(struct sr_nat *nat, uint32_t ip_ext,
+    uint16_t aux_ext, sr_nat_mapping_type type, struct sr_nat_mapping *mapping) {
+  /* scans and backscatter to unmapped ports stop here */
+  if (!sr_nat_port_mapped(nat, ip_ext, aux_ext, type))
+    return -1;
+
+  pthread_mutex_lock(&(nat->lock));
+
+  /* handle lookup here, copy out to the caller */
+  uint32_t idx = sr_nat_find(nat, nat_dir_in, ip_ext, aux_ext, type);
+  if (idx != SR_SLAB_NIL) {
+    sr_nat_entry(nat, idx)->last_updated = (uint32_t)time(NULL);
+    /* Must return a copy b/c another thread could jump in and modify
+    table after we return. */
+    sr_nat_fill_mapping(nat, idx, mapping);
+  }
+
+  pthread_mutex_unlock(&(nat->lock));
+  return (idx != SR_SLAB_NIL) ? 0 : -1;
+}
+
+/* Get the mapping associated with given internal (ip, port) pair, copied
+   into *mapping. */
+int sr_nat_lookup_internal(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *mapping) {
+
+  pthread_mutex_lock(&(nat->lock));
+
+  /* handle lookup here, copy out to the caller */
+  uint32_t idx = sr_nat_find(nat, nat_dir_out, ip_int, aux_int, type);
+  if (idx != SR_SLAB_NIL) {
+    sr_nat_entry(nat, idx)->last_updated = (uint32_t)time(NULL);
+    /* Must return a copy b/c another thread could jump in and modify
+    table after we return. */
+    sr_nat_fill_mapping(nat, idx, mapping);
+  }
+
   pthread_mutex_unlock(&(nat->lock));
-  return copy;
+  return (idx != SR_SLAB_NIL) ? 0 : -1;
 }
 
 /* Insert a new mapping into the nat's mapping table.
    Actually returns a copy to the new mapping, for thread safety.
  */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type ) {
+int sr_nat_insert_mapping(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *copy) {
 
   pthread_mutex_lock(&(nat->lock));
-  
-  // fprintf(stderr, "Insert Mapping. \n");
-  
+
   /* handle insert here, create a mapping, and then return a copy of it */
-  struct sr_nat_mapping* mapping = NULL;
-  mapping = (struct sr_nat_mapping*)malloc(sizeof(struct sr_nat_mapping));
+  /* find the next valid port which is not in use, wrap around the valid
+     port number, the upper limit is SR_AUX_EXT_UPLIMIT */
+  if (nat->aux_ext_valid < SR_NAT_VALID_PORT)
+    nat->aux_ext_valid = SR_NAT_VALID_PORT;
+  /* pin the internal host to one pool address */
+  uint32_t pool = ((ip_int * 2654435761u) >> 8) % nat->pool_sz;
+  uint16_t aux_ext = sr_nat_port_find_free(nat, pool, nat->aux_ext_valid, type);
+  uint32_t idx = (aux_ext != 0) ? sr_slab_alloc(&(nat->map_slab)) : SR_SLAB_NIL;
+  if (idx == SR_SLAB_NIL) {
+    fprintf(stderr, "Error: nat mapping table full, dropping new mapping\n");
+    pthread_mutex_unlock(&(nat->lock));
+    return -1;
+  }
+
+  struct sr_nat_map_entry *mapping = sr_nat_entry(nat, idx);
   mapping->type = type;
   mapping->ip_int = ip_int;
   mapping->aux_int = aux_int;
-  mapping->aux_ext = nat->aux_ext_valid;
-  nat->aux_ext_valid ++;
-
-  /* wrap around the valid port number, the upper limit is SR_AUX_EXT_UPLIMIT */
-  if(nat->aux_ext_valid > SR_AUX_EXT_UPLIMIT){
-    nat->aux_ext_valid = SR_NAT_VALID_PORT;
-  }
-  struct sr_nat_mapping* map_walker = nat->mappings;
-  while(map_walker){
-    if(nat->aux_ext_valid == map_walker->aux_ext){
-      nat->aux_ext_valid ++;
-      break;
-    }
-    map_walker = map_walker->next;
-  }
+  mapping->ip_ext = nat->pool[pool];
+  mapping->pool = (uint16_t)pool;
+  mapping->aux_ext = aux_ext;
+  nat->aux_ext_valid = (aux_ext >= SR_AUX_EXT_UPLIMIT) ?
+    SR_NAT_VALID_PORT : aux_ext + 1;
   mapping->valid = 1;
-  mapping->last_updated = time(NULL);
-  mapping->next = NULL;
-  if(type == nat_mapping_icmp){
-    mapping->conns = NULL;
-  }else if(type == nat_mapping_tcp){
-    /* FIXME */
-    mapping->conns = NULL;
-  }  
-  
-  if(nat->mappings == NULL){
-    nat->mappings = mapping; 
-  }else{
-    mapping->next = nat->mappings;
-    nat->mappings = mapping;
-  }
+  mapping->last_updated = (uint32_t)time(NULL);
+  nat->map_cold[idx].conns = SR_SLAB_NIL;
+  nat->map_cold[idx].created = mapping->last_updated;
+  memset(nat->map_cold[idx].rw, 0, sizeof(nat->map_cold[idx].rw));
+
+  uint32_t *head = &(nat->hash_int[sr_nat_hash_int(nat, ip_int, aux_int, type)]);
+  mapping->next_int = *head;
+  *head = idx;
+  head = &(nat->hash_ext[sr_nat_hash_ext(nat, mapping->ip_ext, mapping->aux_ext, type)]);
+  mapping->next_ext = *head;
+  *head = idx;
+  sr_nat_port_set(nat, pool, aux_ext, type, 1);
+  if (type == nat_mapping_tcp)
+    sr_nat_match_unsosyn(nat, mapping->ip_ext, mapping->aux_ext);
+
+  sr_nat_fill_mapping(nat, idx, copy);
   pthread_mutex_unlock(&(nat->lock));
-  return mapping;
+  return 0;
 }
 
-void sr_nat_insert_connection(struct sr_nat_mapping* mapping, uint32_t ipint, uint32_t ipext, sr_nat_connection_state state){
-  struct sr_nat_connection* conns = 0;
-  conns = (struct sr_nat_connection*)malloc(sizeof(struct sr_nat_connection));
-  conns->ip_int = ipint;
-  conns->ip_ext = ipext;
-  // fprintf(stderr, "Insert Connection :  ");
-  // print_addr_ip_int(ipint);
-  // print_addr_ip_int(ipext);
-  conns->state = state;
-  conns->next = NULL;
-  if(mapping->conns == NULL){
-    mapping->conns = conns;
-  }else{
-    conns->next = mapping->conns;
-    mapping->conns = conns;
+void sr_nat_insert_connection(struct sr_nat *nat, struct sr_nat_mapping* mapping,
+  uint32_t ip_ext, sr_nat_connection_state state){
+  pthread_mutex_lock(&(nat->lock));
+
+  struct sr_nat_map_entry *entry = sr_nat_entry(nat, mapping->idx);
+  uint32_t idx = SR_SLAB_NIL;
+  /* the mapping may have timed out since the caller looked it up */
+  if (entry->valid && entry->aux_ext == mapping->aux_ext && entry->type == mapping->type)
+    idx = sr_slab_alloc(&(nat->conn_slab));
+  if (idx == SR_SLAB_NIL) {
+    pthread_mutex_unlock(&(nat->lock));
+    return;
   }
+  struct sr_nat_connection* conns = sr_nat_conn(nat, idx);
+  conns->ip_ext = ip_ext;
+  conns->state = state;
+  conns->last_updated = (uint32_t)time(NULL);
+  conns->next = nat->map_cold[mapping->idx].conns;
+  nat->map_cold[mapping->idx].conns = idx;
+
+  pthread_mutex_unlock(&(nat->lock));
   return;
 }
 
-/* lookup a connection in the connection list, if the connection exist and the state is the same as expected, return 1, if the connection doesn't exist or the state is not correct, return 0. This function also change the state if requested by setting change_state to 1 */
-struct sr_nat_connection*  sr_nat_lookup_connection(struct sr_nat_mapping* mapping, uint32_t ipint, uint32_t ipext){
-  struct sr_nat_connection* conn_walker = mapping->conns;
-  while(conn_walker){
-    if((conn_walker->ip_ext == ipext)
-      &&(conn_walker->ip_int == ipint)){
-/*      if((state == -1)||(conn_walker->state == state)){
-        if(change_state){
-          // change state from building to established
-          conn_walker->state == nat_connection_established;
-        }   
-        return 1;    */
-        return conn_walker;
-      }
-    
-    conn_walker = conn_walker->next;
+/* Tool function: the connection to ip_ext on the mapping, NULL if there
+   is none or the mapping has timed out since the caller looked it up.
+   Call with the lock held. */
+static struct sr_nat_connection *sr_nat_find_connection(struct sr_nat *nat,
+  struct sr_nat_mapping *mapping, uint32_t ip_ext) {
+  struct sr_nat_map_entry *entry = sr_nat_entry(nat, mapping->idx);
+  if (!entry->valid || entry->aux_ext != mapping->aux_ext || entry->type != mapping->type)
+    return NULL;
+  uint32_t idx = nat->map_cold[mapping->idx].conns;
+  while (idx != SR_SLAB_NIL) {
+    struct sr_nat_connection *conn_walker = sr_nat_conn(nat, idx);
+    if (conn_walker->ip_ext == ip_ext)
+      return conn_walker;
+    idx = conn_walker->next;
   }
   return NULL;
 }
-    
 
+/* lookup a connection to ip_ext in the connection list of the mapping,
+   return 1 if it exists, 0 if it doesn't */
+int sr_nat_lookup_connection(struct sr_nat *nat,
+  struct sr_nat_mapping* mapping, uint32_t ip_ext){
+  pthread_mutex_lock(&(nat->lock));
+  int found = (sr_nat_find_connection(nat, mapping, ip_ext) != NULL);
+  pthread_mutex_unlock(&(nat->lock));
+  return found;
+}
+
+int sr_nat_touch_connection(struct sr_nat *nat, struct sr_nat_mapping* mapping,
+  uint32_t ip_ext, sr_nat_connection_state new_state){
+  pthread_mutex_lock(&(nat->lock));
+  struct sr_nat_connection *conn = sr_nat_find_connection(nat, mapping, ip_ext);
+  if (conn == NULL) {
+    pthread_mutex_unlock(&(nat->lock));
+    return -1;
+  }
+  /* a connection only moves on from building, never back */
+  if (new_state == nat_connection_established)
+    conn->state = nat_connection_established;
+  conn->last_updated = (uint32_t)time(NULL);
+  pthread_mutex_unlock(&(nat->lock));
+  return 0;
+}
+
+int sr_nat_lookup_rewrite(struct sr_nat *nat, sr_nat_dir dir, uint32_t ip,
+  uint16_t aux, sr_nat_mapping_type type, uint32_t peer,
+  struct sr_nat_mapping *mapping, struct sr_nat_rewrite *rw) {
+  if ((dir == nat_dir_in) && !sr_nat_port_mapped(nat, ip, aux, type))
+    return -1;
 
+  pthread_mutex_lock(&(nat->lock));
 
+  uint32_t idx = sr_nat_find(nat, dir, ip, aux, type);
+  if (idx == SR_SLAB_NIL) {
+    pthread_mutex_unlock(&(nat->lock));
+    return -1;
+  }
+  uint32_t now = (uint32_t)time(NULL);
+  if (type == nat_mapping_tcp) {
+    /* only established connections skip the state tracking of the slow path */
+    uint32_t conn_idx = nat->map_cold[idx].conns;
+    struct sr_nat_connection *conn = NULL;
+    while (conn_idx != SR_SLAB_NIL) {
+      conn = sr_nat_conn(nat, conn_idx);
+      if (conn->ip_ext == peer)
+        break;
+      conn_idx = conn->next;
+    }
+    if ((conn_idx == SR_SLAB_NIL) || (conn->state != nat_connection_established)) {
+      pthread_mutex_unlock(&(nat->lock));
+      return -1;
+    }
+    conn->last_updated = now;
+  }
+  sr_nat_entry(nat, idx)->last_updated = now;
+  sr_nat_fill_mapping(nat, idx, mapping);
+  memcpy(rw, &(nat->map_cold[idx].rw[dir]), sizeof(struct sr_nat_rewrite));
+
+  pthread_mutex_unlock(&(nat->lock));
+  return 0;
+}
+
+void sr_nat_set_rewrite(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  sr_nat_dir dir, struct sr_nat_rewrite *rw) {
+  pthread_mutex_lock(&(nat->lock));
+
+  struct sr_nat_map_entry *entry = sr_nat_entry(nat, mapping->idx);
+  if (entry->valid && entry->aux_ext == mapping->aux_ext && entry->type == mapping->type)
+    memcpy(&(nat->map_cold[mapping->idx].rw[dir]), rw, sizeof(struct sr_nat_rewrite));
+
+  pthread_mutex_unlock(&(nat->lock));
+}
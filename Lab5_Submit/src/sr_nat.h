@@ -6,11 +6,34 @@
 #include <time.h>
 #include <pthread.h>
 
-#define SR_NATMAP_SZ    100
+#include "sr_protocol.h"
+#include "sr_slab.h"
+
 #define SR_NAT_VALID_PORT 1024
 #define SR_AUX_EXT_UPLIMIT 65535
 #define SR_NAT_UNSOSYN_TO 6
 
+/* Capacity of the fixed-size pools backing the nat tables, per address in
+   the external address pool, and the upper limit for the whole table. The
+   hash tables get one chain head per mapping, rounded up to a power of 2. */
+#define SR_NAT_MAPPINGS_MAX   (1 << 16)
+#define SR_NAT_CONNS_MAX      (1 << 18)
+#define SR_NAT_MAPPINGS_LIMIT (1 << 21)
+
+/* Maximum number of external addresses in the pool */
+#define SR_NAT_POOL_MAX 256
+
+/* Unsolicited SYNs are held in a fixed ring of SR_NAT_UNSOSYN_SZ entries,
+   hashed on the external port they were sent to. A held SYN keeps a
+   reference to the packet buffer it came in, so a full ring pins at most
+   SR_NAT_UNSOSYN_SZ buffers of the pool. */
+#define SR_NAT_UNSOSYN_SZ      256
+#define SR_NAT_UNSOSYN_BUCKETS 64
+
+/* Number of mapping types, the size of the per-type external port maps. */
+#define SR_NAT_MAPPING_TYPES 2
+#define SR_NAT_PORTMAP_WORDS ((SR_AUX_EXT_UPLIMIT + 1) / 64)
+
 typedef enum {
   nat_mapping_icmp,
   nat_mapping_tcp
@@ -22,15 +45,65 @@ typedef enum {
   nat_connection_established
 } sr_nat_connection_state;
 
+/* Direction of a packet through the nat, indexes sr_nat_map_cold.rw */
+typedef enum {
+  nat_dir_out, /* internal -> external */
+  nat_dir_in   /* external -> internal */
+} sr_nat_dir;
+
+/* A translation precomputed for one direction of a mapping. The router
+   builds it on the first packet of the direction that goes through the
+   slow path and then applies it as is to every later packet: rewrite one
+   address and one port (or icmp id), patch the checksums with the RFC 1624
+   deltas, which also cover the TTL decrement, and put on the ethernet
+   header of the next hop's adjacency. Ports, ids and addresses are in
+   network byte order. */
+struct sr_nat_rewrite {
+  uint32_t old_ip; /* ip_src (out) or ip_dst (in) the rewrite applies to */
+  uint32_t new_ip;
+  uint16_t old_aux; /* port or icmp id the rewrite applies to */
+  uint16_t new_aux;
+  uint32_t ip_delta; /* checksum delta for ip_sum */
+  uint32_t l4_delta; /* checksum delta for tcp_check or icmp_sum */
+  /* where the rewritten packet goes */
+  uint32_t dst; /* ip_dst after the rewrite, the route was looked up for it */
+  uint32_t adj; /* adjacency of the route (sr_adj.h) */
+  uint32_t fib_gen; /* sr_fib_gen when the route was looked up */
+};
+
+/* A TCP connection on a mapping, 16 bytes in the connection slab. The
+   internal end of the connection is the owning mapping's ip_int. */
 struct sr_nat_connection {
-  /* add TCP connection state data members here */
-  uint32_t ip_int;
   uint32_t ip_ext;
-  sr_nat_connection_state state; /* record connection state, building or established */
-  time_t last_updated; /* use to timeout connections */
-  struct sr_nat_connection *next;
+  uint32_t last_updated; /* use to timeout connections */
+  uint32_t next;  /* slab index of the next connection on the mapping */
+  uint8_t state;  /* sr_nat_connection_state, building or established */
+};
+
+/* Hot half of a mapping table entry: the lookup keys, the timestamp and the
+   hash chain links. Everything a lookup or the timeout sweep touches sits
+   in 32 bytes, so two entries share one cache line. */
+struct sr_nat_map_entry {
+  uint32_t ip_int; /* internal ip addr */
+  uint32_t ip_ext; /* external ip addr */
+  uint16_t aux_int; /* internal port or icmp id */
+  uint16_t aux_ext; /* external port or icmp id */
+  uint8_t type; /* sr_nat_mapping_type */
+  uint8_t valid; /* if one entry in the mapping table is valid */
+  uint16_t pool; /* index of ip_ext in the external address pool */
+  uint32_t last_updated; /* use to timeout mappings */
+  uint32_t next_int; /* next entry in the chain of hash_int */
+  uint32_t next_ext; /* next entry in the chain of hash_ext */
+} __attribute__ ((aligned (32)));
+
+/* Cold half of a mapping table entry, at the same index as the hot half. */
+struct sr_nat_map_cold {
+  uint32_t conns; /* head of the connection list. SR_SLAB_NIL for ICMP */
+  uint32_t created;
+  struct sr_nat_rewrite rw[2]; /* cached translation per sr_nat_dir */
 };
 
+/* A copy of a mapping table entry, returned by the lookup functions. */
 struct sr_nat_mapping {
   sr_nat_mapping_type type;
   uint32_t ip_int; /* internal ip addr */
@@ -39,25 +112,63 @@ struct sr_nat_mapping {
   uint16_t aux_ext; /* external port or icmp id */
   time_t last_updated; /* use to timeout mappings */
   int valid; /* if one entry in the mapping table is valid */
-  struct sr_nat_connection *conns; /* list of connections. null for ICMP */
-  struct sr_nat_mapping *next;
+  uint32_t idx; /* index of the table entry this is a copy of */
 };
 
 struct sr_nat_unsosyn {
-  uint8_t *packet;
-  unsigned int len;
-  char *iface;
-  time_t recv; /* time when the SYN received */
-  struct sr_nat_unsosyn * next;
+  uint8_t *packet; /* the SYN, from ethernet hdr, held by pb */
+  struct sr_pbuf *pb;
+  uint16_t len;
+  uint16_t aux_ext; /* external port the SYN was sent to, host order */
+  uint16_t sport; /* its source port, network order */
+  uint32_t ip_src; /* its addresses, taken from the parsed packet */
+  uint32_t ip_dst;
+  uint32_t recv; /* time when the SYN received */
+  uint32_t next; /* next entry in the bucket chain */
+  uint8_t valid; /* cleared when matched, the slot is reused once the ring
+                    head passes it */
+  char iface[sr_IFACE_NAMELEN];
 };
 
 struct sr_nat {
   /* add any fields here */
-  struct sr_nat_mapping *mappings;
+  /* mapping table, hot halves in map_slab and cold halves in map_cold */
+  struct sr_slab map_slab;
+  struct sr_nat_map_cold *map_cold;
+  uint32_t *hash_int; /* chain heads keyed on (ip_int, aux_int, type) */
+  uint32_t *hash_ext; /* chain heads keyed on (ip_ext, aux_ext, type) */
+  uint32_t hash_mask; /* number of chain heads - 1 */
+  struct sr_slab conn_slab;
   uint16_t aux_ext_valid;
+
+  /* external address pool, network order. Each internal host is pinned to
+     one address by a hash of its ip, so its mappings all share it, and
+     each address has the whole port range. Set before sr_nat_init and not
+     resized after. An empty pool gets one address, filled in with the
+     default route's interface address once the interfaces are known. */
+  uint32_t pool[SR_NAT_POOL_MAX];
+  uint32_t pool_sz;
+  uint16_t pool_hash[2 * SR_NAT_POOL_MAX]; /* pool index by address, open
+                                              addressing, 0xffff is empty */
+
+  /* one bit per external port (or icmp id) for each mapping type and pool
+     address, set while a mapping holds the port. Used to pick free ports on
+     insert and, read without the lock, to turn away inbound packets to ports
+     that are certainly unmapped. sr_nat_port_word gives the word of a port. */
+  uint64_t *ext_ports;
  
-  /* unsolicited SYN list */
-  struct sr_nat_unsosyn * unso_syn_list;
+  /* unsolicited SYNs, a ring in arrival order. All entries share one
+     timeout, so the ring is also the expiry timer queue: the sweep pops
+     from unso_syn_head while the oldest entry has expired. */
+  struct sr_nat_unsosyn unso_syn[SR_NAT_UNSOSYN_SZ];
+  uint32_t unso_syn_hash[SR_NAT_UNSOSYN_BUCKETS]; /* chain heads by aux_ext */
+  uint32_t unso_syn_head;
+  uint32_t unso_syn_count;
+  /* unsolicited SYN counters */
+  uint64_t unso_syn_held;
+  uint64_t unso_syn_matched;
+  uint64_t unso_syn_expired;
+  uint64_t unso_syn_drops; /* refused because the ring was full */
  
   /* timeout information */ 
   int icmp_to;
@@ -67,33 +178,108 @@ struct sr_nat {
   /* threading */
   pthread_mutex_t lock;
   pthread_mutexattr_t attr;
-  pthread_attr_t thread_attr;
-  pthread_t thread;
 };
 
+struct sr_instance;
+struct sr_pbuf;
+
 
 int   sr_nat_init(void *sr_ptr, struct sr_nat *nat);  /* Initializes the nat */
 int   sr_nat_destroy(struct sr_nat *nat);  /* Destroys the nat (free memory) */
-void *sr_nat_timeout(void *sr_ptr);  /* Periodic Timout */
+void  sr_nat_pool_rehash(struct sr_nat *nat);
+void  sr_nat_tick(struct sr_instance *sr);  /* Periodic Timout */
+
+/* Add a connection to the external host ip_ext on the mapping. */
+void sr_nat_insert_connection(struct sr_nat *nat, struct sr_nat_mapping* mapping,
+  uint32_t ip_ext, sr_nat_connection_state state);
+
+/* Returns 1 if the mapping has a connection to ip_ext, 0 if not. */
+int sr_nat_lookup_connection(struct sr_nat *nat,
+  struct sr_nat_mapping* mapping, uint32_t ip_ext);
+
+/* Marks the connection to ip_ext on the mapping as just used, and moves it
+   to new_state if that is established, under the nat's lock: the sweep
+   may free a connection at any time. Returns -1 if there is no such
+   connection (any more). */
+int sr_nat_touch_connection(struct sr_nat *nat, struct sr_nat_mapping* mapping,
+  uint32_t ip_ext, sr_nat_connection_state new_state);
+
+/* Hold the unsolicited SYN pk, sent to an external port of the pool
+   address in its ip_dst, for SR_NAT_UNSOSYN_TO seconds; packet is its
+   frame held by pb. Its addresses and ports are taken from pk, which was
+   parsed already (sr_pkt.h). Returns 0 if the SYN is held (or is a
+   retransmission of a held SYN), -1 if the table is full and the caller
+   should refuse the SYN right away. The reference to pb is given either
+   way. */
+struct sr_pkt;
+int sr_nat_hold_unsosyn(struct sr_nat *nat, const struct sr_pkt *pk,
+  uint8_t *packet, struct sr_pbuf *pb, char *iface);
+
+/* Index of address ip in the external address pool, -1 if ip is not in
+   the pool. Does not take the nat lock, the pool does not change. */
+static inline int sr_nat_pool_index(struct sr_nat *nat, uint32_t ip) {
+  if (nat->pool_sz == 1) /* the common single address case */
+    return (nat->pool[0] == ip) ? 0 : -1;
+  uint32_t h = (ip * 2654435761u) >> 16;
+  uint32_t i;
+  for (i = 0; i < 2 * SR_NAT_POOL_MAX; i++) {
+    uint16_t idx = nat->pool_hash[(h + i) & (2 * SR_NAT_POOL_MAX - 1)];
+    if (idx == 0xffff)
+      return -1;
+    if (nat->pool[idx] == ip)
+      return idx;
+  }
+  return -1;
+}
+
+#define sr_nat_port_word(nat, type, pool, aux_ext) \
+  (&(nat)->ext_ports[(((type) * (nat)->pool_sz + (pool)) * SR_NAT_PORTMAP_WORDS) + ((aux_ext) >> 6)])
+
+/* Check if any mapping of the type holds external (ip_ext, aux_ext). Does
+   not take the nat lock; a mapping inserted concurrently may not be seen
+   yet. */
+static inline int sr_nat_port_mapped(struct sr_nat *nat, uint32_t ip_ext,
+    uint16_t aux_ext, sr_nat_mapping_type type) {
+  int pool = sr_nat_pool_index(nat, ip_ext);
+  if (pool < 0)
+    return 0;
+  uint64_t word = __atomic_load_n(sr_nat_port_word(nat, type, pool, aux_ext), __ATOMIC_RELAXED);
+  return (word >> (aux_ext & 63)) & 1;
+}
 
-void sr_nat_insert_connection(struct sr_nat_mapping* mapping, uint32_t ipsrc, uint32_t ipdst, sr_nat_connection_state state);
+/* Get the mapping associated with given external address and port, copied
+   into the caller's *mapping. Ports with no mapping are rejected by
+   sr_nat_port_mapped before the lock is taken. Returns 0, or -1 if there
+   is no mapping; nothing is allocated, so that is the only failure. */
+int sr_nat_lookup_external(struct sr_nat *nat, uint32_t ip_ext,
+    uint16_t aux_ext, sr_nat_mapping_type type, struct sr_nat_mapping *mapping);
 
-struct sr_nat_connection* sr_nat_lookup_connection(struct sr_nat_mapping* mapping, uint32_t ipint, uint32_t ipext);
+/* Get the mapping associated with given internal (ip, port) pair, copied
+   into the caller's *mapping. Returns 0, or -1 if there is no mapping. */
+int sr_nat_lookup_internal(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *mapping);
 
-/* Get the mapping associated with given external port.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_external(struct sr_nat *nat,
-    uint16_t aux_ext, sr_nat_mapping_type type );
+/* Fast path lookup for a packet of an established flow. Finds the mapping
+   by internal (ip, aux) for nat_dir_out or external (ip, aux) for
+   nat_dir_in; for TCP the
+   mapping must also have an established connection to peer. Refreshes the
+   mapping and connection like the other lookups, copies the mapping into
+   *mapping and its cached rewrite for dir into *rw. Returns 0 on success,
+   -1 if the packet has to take the slow path. Nothing is malloc'd. */
+int sr_nat_lookup_rewrite(struct sr_nat *nat, sr_nat_dir dir, uint32_t ip,
+  uint16_t aux, sr_nat_mapping_type type, uint32_t peer,
+  struct sr_nat_mapping *mapping, struct sr_nat_rewrite *rw);
 
-/* Get the mapping associated with given internal (ip, port) pair.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_lookup_internal(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+/* Cache rw as the rewrite for direction dir of the mapping, unless the
+   mapping has timed out since it was looked up. */
+void sr_nat_set_rewrite(struct sr_nat *nat, struct sr_nat_mapping *mapping,
+  sr_nat_dir dir, struct sr_nat_rewrite *rw);
 
-/* Insert a new mapping into the nat's mapping table.
-   You must free the returned structure if it is not NULL. */
-struct sr_nat_mapping *sr_nat_insert_mapping(struct sr_nat *nat,
-  uint32_t ip_int, uint16_t aux_int, sr_nat_mapping_type type );
+/* Insert a new mapping into the nat's mapping table and copy it into the
+   caller's *mapping. Returns 0, or -1 if the mapping table or the external
+   port range is full. */
+int sr_nat_insert_mapping(struct sr_nat *nat, uint32_t ip_int,
+  uint16_t aux_int, sr_nat_mapping_type type, struct sr_nat_mapping *mapping);
 
 
 #endif
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "sr_pbuf.h"
+
+static __thread struct sr_pbuf_pool *sr_pbuf_tls;
+
+int sr_pbuf_pool_init(struct sr_pbuf_pool *pool, uint32_t count) {
+  assert(pool);
+  assert(sizeof(struct sr_pbuf) == SR_PBUF_SZ);
+
+  memset(pool, 0, sizeof(struct sr_pbuf_pool));
+  pthread_mutex_init(&(pool->lock), NULL);
+  /* without buffers every packet takes the copying paths */
+  if (sr_slab_init(&(pool->slab), sizeof(struct sr_pbuf), count) != 0) {
+    fprintf(stderr, "Error: out of memory (sr_pbuf_pool_init)\n");
+    return -1;
+  }
+  return 0;
+}
+
+void sr_pbuf_pool_destroy(struct sr_pbuf_pool *pool) {
+  sr_slab_destroy(&(pool->slab));
+  pthread_mutex_destroy(&(pool->lock));
+}
+
+void sr_pbuf_pool_print(struct sr_pbuf_pool *pool) {
+  pthread_mutex_lock(&(pool->lock));
+  fprintf(stderr, "pbuf: %" PRIu64 " allocated, %" PRIu64 " failed, %" PRIu64
+    " copied in, %u of %u in use, %u at most\n",
+    pool->allocs, pool->fails, pool->copies,
+    sr_slab_used(&(pool->slab)), pool->slab.capacity, pool->slab.hwm);
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+struct sr_pbuf *sr_pbuf_alloc(struct sr_pbuf_pool *pool, uint32_t len) {
+  uint32_t idx = SR_SLAB_NIL;
+
+  pthread_mutex_lock(&(pool->lock));
+  if (len <= SR_PBUF_DATA_MAX)
+    idx = sr_slab_alloc_dirty(&(pool->slab));
+  if (idx == SR_SLAB_NIL) {
+    pool->fails++;
+    pthread_mutex_unlock(&(pool->lock));
+    return NULL;
+  }
+  pool->allocs++;
+  pthread_mutex_unlock(&(pool->lock));
+
+  /* the frame is written by the caller, only the bookkeeping is set here */
+  struct sr_pbuf *pb = (struct sr_pbuf *)sr_slab_at(&(pool->slab), idx);
+  pb->refcnt = 1;
+  pb->idx = idx;
+  pb->pool = pool;
+  return pb;
+}
+
+void sr_pbuf_ref(struct sr_pbuf *pb) {
+  __atomic_add_fetch(&(pb->refcnt), 1, __ATOMIC_RELAXED);
+}
+
+void sr_pbuf_put(struct sr_pbuf *pb) {
+  if (pb == NULL)
+    return;
+  assert(__atomic_load_n(&(pb->refcnt), __ATOMIC_RELAXED) > 0);
+  if (__atomic_sub_fetch(&(pb->refcnt), 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  struct sr_pbuf_pool *pool = pb->pool;
+  pthread_mutex_lock(&(pool->lock));
+  sr_slab_free(&(pool->slab), pb->idx);
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+void sr_pbuf_bind(struct sr_pbuf_pool *pool) {
+  sr_pbuf_tls = pool;
+}
+
+struct sr_pbuf_pool *sr_pbuf_local(struct sr_pbuf_pool *shared) {
+  return sr_pbuf_tls ? sr_pbuf_tls : shared;
+}
+
+/* Tool function: the buffer of pool holding the byte at p, or NULL */
+static struct sr_pbuf *sr_pbuf_in(struct sr_pbuf_pool *pool, const void *p) {
+  const uint8_t *b = (const uint8_t *)p;
+  const uint8_t *objs = pool->slab.objs;
+  if ((objs == NULL) || (b < objs) ||
+      (b >= objs + (size_t)pool->slab.capacity * SR_PBUF_SZ))
+    return NULL;
+  return (struct sr_pbuf *)sr_slab_at(&(pool->slab), (b - objs) / SR_PBUF_SZ);
+}
+
+struct sr_pbuf *sr_pbuf_of(struct sr_pbuf_pool *pool, const void *p) {
+  struct sr_pbuf *pb = sr_pbuf_in(pool, p);
+  if ((pb == NULL) && sr_pbuf_tls && (sr_pbuf_tls != pool))
+    pb = sr_pbuf_in(sr_pbuf_tls, p);
+  return pb;
+}
+
+uint8_t *sr_pbuf_hold(struct sr_pbuf_pool *pool, uint8_t *data, uint32_t len,
+                      struct sr_pbuf **pb) {
+  *pb = sr_pbuf_of(pool, data);
+  if (*pb) {
+    sr_pbuf_ref(*pb);
+    return data;
+  }
+  pool = sr_pbuf_local(pool);
+  *pb = sr_pbuf_alloc(pool, len);
+  if (*pb == NULL)
+    return NULL;
+  memcpy(sr_pbuf_data(*pb), data, len);
+  __atomic_add_fetch(&(pool->copies), 1, __ATOMIC_RELAXED);
+  return sr_pbuf_data(*pb);
+}
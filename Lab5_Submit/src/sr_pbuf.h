@@ -0,0 +1,100 @@
+/* This file defines the packet buffer pool. Every frame the router receives,
+   builds or keeps for later lives in a buffer from this pool, so handling a
+   packet takes no malloc and moving it from one stage to the next takes no
+   copy:
+
+     - a received frame is put in a buffer once (the syscall backend reads
+       it straight into one) and handled there, in place;
+     - the ARP request queue and the unsolicited SYN ring keep a packet by
+       taking a reference to its buffer instead of copying it;
+     - ICMP and ARP replies are written directly into a new buffer;
+     - sr_send_packet writes the VNS header into the headroom in front of
+       the frame, so the command goes out as one contiguous piece. The
+       uring backend holds a reference until the kernel has sent it.
+
+   Buffers are fixed size and come from a slab allocated at start up. A
+   buffer is freed when the last reference to it is put. A buffer that is
+   queued, or handed to sr_send_packet, must not be written afterwards: the
+   holders of the other references still read it.
+
+   A worker thread (sr_worker.h) builds its packets in a pool of its own,
+   bound with sr_pbuf_bind, so the workers do not share the shared pool's
+   lock for them. A buffer still goes back to the pool it came from, on
+   whichever thread drops the last reference.
+
+   Frames that are not in a pool buffer (the pool ran dry, or a frame larger
+   than a buffer) are still handled; they are copied whenever they need to be
+   kept. */
+
+#ifndef SR_PBUF_H
+#define SR_PBUF_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include "sr_slab.h"
+
+#define SR_PBUF_SZ       2048  /* bytes per buffer, bookkeeping included */
+#define SR_PBUF_HEADROOM 64    /* room in front of the frame, must hold the
+                                  VNS packet header */
+#define SR_PBUF_COUNT    2048  /* buffers in the pool */
+
+struct sr_pbuf_pool;
+
+struct sr_pbuf {
+  uint32_t refcnt;
+  uint32_t idx;                /* index in the pool's slab */
+  struct sr_pbuf_pool *pool;
+  uint8_t pad[48];             /* the room starts on its own cache line */
+  uint8_t room[SR_PBUF_SZ - 64];
+};
+
+/* largest frame a buffer holds */
+#define SR_PBUF_DATA_MAX (SR_PBUF_SZ - 64 - SR_PBUF_HEADROOM)
+
+struct sr_pbuf_pool {
+  struct sr_slab slab;
+  pthread_mutex_t lock;        /* around slab alloc and free */
+
+  /* counters */
+  uint64_t allocs;
+  uint64_t fails;              /* pool empty or frame too large */
+  uint64_t copies;             /* frames copied in by sr_pbuf_hold */
+};
+
+/* The frame of a buffer starts past the headroom. */
+#define sr_pbuf_data(pb) ((pb)->room + SR_PBUF_HEADROOM)
+
+int  sr_pbuf_pool_init(struct sr_pbuf_pool *pool, uint32_t count);
+void sr_pbuf_pool_destroy(struct sr_pbuf_pool *pool);
+
+/* Prints the pool counters to stderr. */
+void sr_pbuf_pool_print(struct sr_pbuf_pool *pool);
+
+/* Returns a buffer for a frame of len bytes with one reference, or NULL if
+   the pool is empty or len does not fit. */
+struct sr_pbuf *sr_pbuf_alloc(struct sr_pbuf_pool *pool, uint32_t len);
+
+/* Takes and drops a reference. The buffer goes back to the pool when the
+   last one is dropped. */
+void sr_pbuf_ref(struct sr_pbuf *pb);
+void sr_pbuf_put(struct sr_pbuf *pb);
+
+/* Makes pool the calling thread's own. */
+void sr_pbuf_bind(struct sr_pbuf_pool *pool);
+
+/* The calling thread's own pool, or shared if it has none. */
+struct sr_pbuf_pool *sr_pbuf_local(struct sr_pbuf_pool *shared);
+
+/* Returns the buffer holding the byte at p, or NULL if p is neither in the
+   pool nor in the calling thread's own. */
+struct sr_pbuf *sr_pbuf_of(struct sr_pbuf_pool *pool, const void *p);
+
+/* Keeps the len bytes at data: takes a reference if they are in a buffer
+   already, otherwise copies them into a new one from the calling thread's
+   own pool, or pool. Returns where the kept
+   bytes are and sets *pb to the buffer to put when done with them, or
+   returns NULL if the pool is empty. */
+uint8_t *sr_pbuf_hold(struct sr_pbuf_pool *pool, uint8_t *data, uint32_t len,
+                      struct sr_pbuf **pb);
+
+#endif /* SR_PBUF_H */
@@ -0,0 +1,65 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "sr_pkt.h"
+
+void sr_pkt_parse(struct sr_pkt *pk, uint8_t *data, uint32_t len) {
+  const uint32_t l3 = sizeof(struct sr_ethernet_hdr);
+
+  memset(pk, 0, sizeof(struct sr_pkt));
+  pk->data = data;
+  pk->len = len;
+  pk->l3_off = pk->l4_off = l3;
+  if (len < l3)
+    return;
+  pk->ethertype = ntohs(sr_pkt_eth(pk)->ether_type);
+
+  if (pk->ethertype == ethertype_arp) {
+    if (len >= l3 + sizeof(struct sr_arp_hdr))
+      pk->flags |= SR_PKT_ARP;
+    return;
+  }
+  if ((pk->ethertype != ethertype_ip) || (len < l3 + sizeof(struct sr_ip_hdr)))
+    return;
+
+  struct sr_ip_hdr *iphdr = sr_pkt_ip(pk);
+  uint32_t hl = iphdr->ip_hl * 4;
+  uint32_t ip_len = ntohs(iphdr->ip_len);
+  if ((iphdr->ip_v != 4) || (hl < sizeof(struct sr_ip_hdr)) ||
+      (ip_len < hl) || (ip_len > len - l3))
+    return;
+  pk->flags |= SR_PKT_IP;
+  if (hl > sizeof(struct sr_ip_hdr))
+    pk->flags |= SR_PKT_OPT;
+  pk->ip_proto = iphdr->ip_p;
+  pk->l4_off = l3 + hl;
+  pk->l4_len = ip_len - hl;
+  if (ntohs(iphdr->ip_off) & IP_OFFMASK) {
+    pk->flags |= SR_PKT_FRAG;
+    return;
+  }
+
+  uint8_t *l4 = sr_pkt_l4(pk);
+  if (pk->ip_proto == ip_protocol_tcp) {
+    if (pk->l4_len < sizeof(struct sr_tcp_hdr))
+      return;
+    memcpy(&pk->sport, l4, 2);
+    memcpy(&pk->dport, l4 + 2, 2);
+    pk->tcp_flags = l4[13];
+  } else if (pk->ip_proto == ip_protocol_udp) {
+    if (pk->l4_len < 8)
+      return;
+    memcpy(&pk->sport, l4, 2);
+    memcpy(&pk->dport, l4 + 2, 2);
+  } else if (pk->ip_proto == ip_protocol_icmp) {
+    /* the echo id follows the type, code and checksum */
+    if (pk->l4_len < sizeof(struct sr_icmp_hdr) + 4)
+      return;
+    pk->icmp_type = l4[0];
+    pk->icmp_code = l4[1];
+    memcpy(&pk->sport, l4 + sizeof(struct sr_icmp_hdr), 2);
+  } else {
+    return;
+  }
+  pk->flags |= SR_PKT_L4;
+}
@@ -0,0 +1,80 @@
+/* This file defines the parsed packet descriptor. A received frame is
+   parsed once, by sr_pkt_parse, and every handler after it -- the filter,
+   the graph's nodes, the scalar handlers and the NAT -- works from the
+   descriptor instead of casting offsets of its own: where each header
+   starts, the protocol, the ports or ICMP id and the TCP flags, with the
+   lengths already checked.
+
+   The IP header's own length (ip_hl) places the transport header, so
+   options are stepped over rather than read as ports, and the IP total
+   length bounds the transport payload, so ethernet padding is not part of
+   it. The descriptor holds the fields as received; a handler that
+   rewrites the packet (NAT) changes the packet, not the descriptor. */
+
+#ifndef SR_PKT_H
+#define SR_PKT_H
+
+#include <inttypes.h>
+#include "sr_protocol.h"
+
+struct sr_if;
+
+/* flags */
+#define SR_PKT_IP   0x01  /* IPv4: version 4, ip_hl and ip_len within the frame */
+#define SR_PKT_ARP  0x02  /* the whole ARP header is there */
+#define SR_PKT_L4   0x04  /* the whole TCP, UDP or ICMP header is there,
+                             the ICMP echo id included */
+#define SR_PKT_OPT  0x08  /* the IP header has options */
+#define SR_PKT_FRAG 0x10  /* a fragment past the first, no transport header */
+
+/* tcp_flags */
+#define SR_TCP_FIN 0x01
+#define SR_TCP_SYN 0x02
+#define SR_TCP_RST 0x04
+#define SR_TCP_ACK 0x10
+
+struct sr_pkt {
+  uint8_t *data;           /* the frame, lent */
+  uint32_t len;            /* of the frame */
+  uint16_t flags;          /* SR_PKT_* */
+  uint16_t ethertype;      /* host order */
+  uint16_t l3_off;         /* IP or ARP header */
+  uint16_t l4_off;         /* transport header, past the IP options */
+  uint16_t l4_len;         /* transport header and payload, by ip_len */
+  uint8_t  ip_proto;
+  uint8_t  tcp_flags;      /* SR_TCP_* */
+  uint16_t sport;          /* network order; the echo id for ICMP */
+  uint16_t dport;          /* network order */
+  uint8_t  icmp_type;
+  uint8_t  icmp_code;
+  struct sr_if *ifp;       /* ingress, looked up once by the receive path;
+                              NULL from sr_pkt_parse */
+  uint64_t t_in;           /* stamped when received, 0 if not (sr_lat.h) */
+};
+
+/* Parses the len bytes at data into pk. Never fails: what is missing or
+   malformed just leaves its flag clear. */
+void sr_pkt_parse(struct sr_pkt *pk, uint8_t *data, uint32_t len);
+
+static inline struct sr_ethernet_hdr *sr_pkt_eth(const struct sr_pkt *pk) {
+  return (struct sr_ethernet_hdr *)pk->data;
+}
+
+static inline struct sr_ip_hdr *sr_pkt_ip(const struct sr_pkt *pk) {
+  return (struct sr_ip_hdr *)(pk->data + pk->l3_off);
+}
+
+static inline struct sr_arp_hdr *sr_pkt_arp(const struct sr_pkt *pk) {
+  return (struct sr_arp_hdr *)(pk->data + pk->l3_off);
+}
+
+static inline uint8_t *sr_pkt_l4(const struct sr_pkt *pk) {
+  return pk->data + pk->l4_off;
+}
+
+/* length of the IP header, options included */
+static inline unsigned int sr_pkt_iphl(const struct sr_pkt *pk) {
+  return pk->l4_off - pk->l3_off;
+}
+
+#endif /* SR_PKT_H */
@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "sr_punt.h"
+#include "sr_router.h"
+#include "sr_pkt.h"
+#include "sr_pbuf.h"
+#include "sr_ring.h"
+#include "sr_rcu.h"
+#include "sr_io.h"
+#include "sr_lat.h"
+
+/* the share of the queue each class may fill */
+static const struct {
+  const char *name;
+  uint32_t quota;
+} sr_punt_classes[SR_PUNT_CLASSES] = {
+  [sr_punt_arp]     = { "arp",      256 },
+  [sr_punt_arpmiss] = { "arp-miss", 256 },
+  [sr_punt_icmp]    = { "icmp",     128 },
+  [sr_punt_nat]     = { "nat",      256 },
+  [sr_punt_syn]     = { "syn",      128 },
+  [sr_punt_local]   = { "local",    128 },
+  [sr_punt_other]   = { "other",    64 },
+};
+
+/* an exception, any thread to the slow path */
+struct sr_punt_rx {
+  struct sr_pkt pk;             /* data points into pb */
+  struct sr_pbuf *pb;           /* the reference the slow path puts */
+  sr_punt_class cls;
+};
+
+/* a packet to send, slow path to I/O thread */
+struct sr_punt_tx {
+  struct sr_pbuf *pb;           /* the reference the I/O thread puts */
+  const void *cmd;              /* the server command, in pb */
+  uint32_t len;
+};
+
+struct sr_punt {
+  struct sr_instance *sr;
+  pthread_t thread;
+  int started;
+  int efd;                      /* wakes the I/O thread up */
+  int tx_kicked;                /* efd written and not read yet */
+  struct sr_ring tx;
+  struct sr_pbuf_pool pbufs;    /* what the slow path builds */
+
+  /* the queue, taken by whoever punts; a FIFO of size entries */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int running;
+  int sleeping;                 /* the slow path waits on cond */
+  struct sr_punt_rx *q;
+  uint32_t size;
+  uint32_t head;
+  uint32_t count;
+  uint32_t queued[SR_PUNT_CLASSES]; /* in the queue now, per class */
+
+  /* counters, under the lock */
+  uint64_t punted[SR_PUNT_CLASSES];
+  uint64_t dropped[SR_PUNT_CLASSES];
+  uint32_t hwm[SR_PUNT_CLASSES];
+  uint64_t batches;
+  uint64_t sleeps;
+  uint64_t wakeups;
+
+  /* the slow path's */
+  uint64_t sent __attribute__((aligned(64)));
+  uint64_t tx_waits;            /* send ring full */
+  uint64_t tx_dropped;          /* and stayed full */
+};
+
+static __thread struct sr_punt *sr_punt_tls;
+
+/* Tool function: add n to a counter of the slow path's own. The store is
+   atomic, so the loop can read it while the slow path runs */
+static inline void sr_punt_count(uint64_t *c, uint64_t n) {
+  __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+/* Tool function: read a counter of the slow path's from another thread */
+static inline uint64_t sr_punt_counter(const uint64_t *c) {
+  return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/* Tool function: tell the I/O thread there is something to send, unless
+   it was told already */
+static void sr_punt_kick_tx(struct sr_punt *p) {
+  uint64_t one = 1;
+  if (__atomic_exchange_n(&(p->tx_kicked), 1, __ATOMIC_ACQ_REL) == 0 &&
+      write(p->efd, &one, sizeof(one)) != sizeof(one))
+    perror("write(..):sr_punt.c::sr_punt_kick_tx");
+}
+
+/* Tool function: take up to max exceptions off the queue, sleeping while
+   it is empty; returns how many, 0 once stopped */
+static uint32_t sr_punt_take(struct sr_punt *p, struct sr_punt_rx *m, uint32_t max) {
+  uint32_t n = 0;
+
+  pthread_mutex_lock(&(p->lock));
+  if ((p->count == 0) && p->running) {
+    /* a sleeping reader would hold up the FIB's reclamation */
+    sr_rcu_unregister();
+    p->sleeping = 1;
+    while ((p->count == 0) && p->running) {
+      p->sleeps++;
+      pthread_cond_wait(&(p->cond), &(p->lock));
+    }
+    p->sleeping = 0;
+    pthread_mutex_unlock(&(p->lock));
+    sr_rcu_register();
+    pthread_mutex_lock(&(p->lock));
+  }
+  if (p->running) {
+    while ((n < max) && (p->count > 0)) {
+      m[n] = p->q[p->head];
+      p->queued[m[n].cls]--;
+      p->head = (p->head + 1 == p->size) ? 0 : p->head + 1;
+      p->count--;
+      n++;
+    }
+    p->batches++;
+  }
+  pthread_mutex_unlock(&(p->lock));
+  return n;
+}
+
+static void *sr_punt_main(void *arg) {
+  struct sr_punt *p = (struct sr_punt *)arg;
+  struct sr_instance *sr = p->sr;
+  struct sr_punt_rx m[SR_PUNT_BATCH];
+  uint32_t i, n;
+
+  sr_punt_tls = p;
+  sr_pbuf_bind(&(p->pbufs));
+  sr_rcu_register();
+  if (sr_lat_on)
+    sr_lat_register_slow();
+  /* the fast path gets the CPU first when they share one; the nice value
+     is per thread on Linux */
+  if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), SR_PUNT_NICE) != 0)
+    perror("setpriority(..):sr_punt.c::sr_punt_main");
+
+  while ((n = sr_punt_take(p, m, SR_PUNT_BATCH)) > 0) {
+    uint64_t sent = p->sent;
+    for (i = 0; i < n; i++) {
+      sr_handlepacket_slow(sr, &(m[i].pk), m[i].pk.ifp->name);
+      sr_pbuf_put(m[i].pb);
+    }
+    if (p->sent != sent)
+      sr_punt_kick_tx(p);
+    sr_rcu_quiescent();
+  }
+
+  sr_rcu_unregister();
+  return NULL;
+}
+
+struct sr_punt *sr_punt_start(struct sr_instance *sr) {
+  struct sr_punt *p;
+  sigset_t all, old;
+  uint32_t size = 0;
+  int cls;
+
+  for (cls = 0; cls < SR_PUNT_CLASSES; cls++)
+    size += sr_punt_classes[cls].quota;
+  if (posix_memalign((void **)&p, 64, sizeof(struct sr_punt)) != 0) {
+    fprintf(stderr, "Error: out of memory (sr_punt_start)\n");
+    return NULL;
+  }
+  memset(p, 0, sizeof(struct sr_punt));
+  p->sr = sr;
+  p->size = size;
+  p->running = 1;
+  pthread_mutex_init(&(p->lock), NULL);
+  pthread_cond_init(&(p->cond), NULL);
+  if ((p->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    perror("eventfd(..):sr_punt.c::sr_punt_start");
+    free(p);
+    return NULL;
+  }
+  if (((p->q = (struct sr_punt_rx *)malloc(size * sizeof(struct sr_punt_rx))) == NULL) ||
+      (sr_ring_init(&(p->tx), SR_PUNT_TXRING, sizeof(struct sr_punt_tx)) != 0) ||
+      (sr_pbuf_pool_init(&(p->pbufs), SR_PUNT_PBUFS) != 0)) {
+    fprintf(stderr, "Error: out of memory (sr_punt_start)\n");
+    sr_punt_stop(p);
+    return NULL;
+  }
+
+  /* the signals are the loop's (sr_loop.h), the thread inherits a mask
+     that blocks them all */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if (pthread_create(&(p->thread), NULL, sr_punt_main, p) != 0) {
+    fprintf(stderr, "Error: cannot start the slow path thread\n");
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    sr_punt_stop(p);
+    return NULL;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  p->started = 1;
+  return p;
+}
+
+void sr_punt_stop(struct sr_punt *p) {
+  struct sr_punt_tx t;
+
+  if (p == NULL)
+    return;
+  pthread_mutex_lock(&(p->lock));
+  p->running = 0;
+  pthread_cond_signal(&(p->cond));
+  pthread_mutex_unlock(&(p->lock));
+  if (p->started)
+    pthread_join(p->thread, NULL);
+
+  while (p->count > 0) {
+    sr_pbuf_put(p->q[p->head].pb);
+    p->head = (p->head + 1 == p->size) ? 0 : p->head + 1;
+    p->count--;
+  }
+  if (p->tx.slots) {
+    while (sr_ring_pop(&(p->tx), &t) == 0)
+      sr_pbuf_put(t.pb);
+  }
+  sr_ring_destroy(&(p->tx));
+  free(p->q);
+  p->q = NULL;
+  /* the io backend may still hold buffers of the pool (uring), so the
+     pool stays until the process exits, like the shared one */
+  close(p->efd);
+}
+
+int sr_punt_fd(const struct sr_punt *p) {
+  return p->efd;
+}
+
+int sr_punt_queue(struct sr_instance *sr, struct sr_pkt *pk,
+                  struct sr_pbuf *pb, sr_punt_class cls) {
+  struct sr_punt *p = sr->punt;
+  uint32_t tail;
+
+  pthread_mutex_lock(&(p->lock));
+  if (!p->running || (p->queued[cls] >= sr_punt_classes[cls].quota)) {
+    /* the class used up its share: dropped here, the others still get
+       theirs */
+    p->dropped[cls]++;
+    pthread_mutex_unlock(&(p->lock));
+    return -1;
+  }
+  sr_pbuf_ref(pb);
+  tail = p->head + p->count;
+  if (tail >= p->size)
+    tail -= p->size;
+  p->q[tail].pk = *pk;
+  p->q[tail].pb = pb;
+  p->q[tail].cls = cls;
+  p->count++;
+  p->punted[cls]++;
+  if (++(p->queued[cls]) > p->hwm[cls])
+    p->hwm[cls] = p->queued[cls];
+  pthread_mutex_unlock(&(p->lock));
+  return 0;
+}
+
+void sr_punt_kick(struct sr_instance *sr) {
+  struct sr_punt *p = sr->punt;
+
+  pthread_mutex_lock(&(p->lock));
+  if (p->sleeping && (p->count > 0)) {
+    p->wakeups++;
+    pthread_cond_signal(&(p->cond));
+  }
+  pthread_mutex_unlock(&(p->lock));
+}
+
+void sr_punt_tx(struct sr_instance *sr) {
+  struct sr_punt *p = sr->punt;
+  struct sr_punt_tx t;
+  uint64_t v;
+
+  /* cleared before the ring is drained, so a packet queued meanwhile
+     writes the eventfd again; called after every batch the I/O thread
+     reads, it only reads the eventfd if it was written */
+  if (__atomic_exchange_n(&(p->tx_kicked), 0, __ATOMIC_SEQ_CST) &&
+      (read(p->efd, &v, sizeof(v)) < 0)) {
+    /* not written yet, the ring is looked at anyway */
+  }
+
+  while (sr_ring_pop(&(p->tx), &t) == 0) {
+    if (sr_io_send_pbuf(sr, t.pb, t.cmd, t.len) != 0)
+      fprintf(stderr, "Error writing packet\n");
+    sr_pbuf_put(t.pb);
+  }
+}
+
+int sr_punt_self(void) {
+  return sr_punt_tls != NULL;
+}
+
+int sr_punt_send(struct sr_instance *sr, struct sr_pbuf *pb,
+                 const void *cmd, size_t len) {
+  struct sr_punt *p = sr_punt_tls;
+  struct sr_punt_tx t;
+  unsigned int spins = 0;
+
+  t.pb = pb;
+  t.cmd = cmd;
+  t.len = len;
+  sr_pbuf_ref(pb);
+  while (sr_ring_push(&(p->tx), &t) != 0) {
+    /* the I/O thread is behind: let it catch up, but not for ever, this
+       may hold a lock the I/O thread is waiting for (the ARP cache's) */
+    if (++spins > SR_PUNT_TXWAIT) {
+      sr_punt_count(&(p->tx_dropped), 1);
+      sr_pbuf_put(pb);
+      return -1;
+    }
+    sr_punt_count(&(p->tx_waits), 1);
+    sr_punt_kick_tx(p);
+    sched_yield();
+  }
+  sr_punt_count(&(p->sent), 1);
+  return 0;
+}
+
+void sr_punt_print(struct sr_punt *p) {
+  int cls;
+
+  if (p == NULL)
+    return;
+  pthread_mutex_lock(&(p->lock));
+  for (cls = 0; cls < SR_PUNT_CLASSES; cls++)
+    fprintf(stderr, "punt: %-8s %" PRIu64 " punted, %" PRIu64 " dropped, %u of %u"
+      " queued at most\n", sr_punt_classes[cls].name, p->punted[cls],
+      p->dropped[cls], p->hwm[cls], sr_punt_classes[cls].quota);
+  fprintf(stderr, "slow path: %" PRIu64 " batches, %" PRIu64 " sleeps, %" PRIu64
+    " wakeups, %" PRIu64 " sent (%" PRIu64 " waits, %" PRIu64 " dropped)\n",
+    p->batches, p->sleeps, p->wakeups,
+    sr_punt_counter(&(p->sent)), sr_punt_counter(&(p->tx_waits)),
+    sr_punt_counter(&(p->tx_dropped)));
+  pthread_mutex_unlock(&(p->lock));
+  fprintf(stderr, "slow path ");
+  sr_pbuf_pool_print(&(p->pbufs));
+}
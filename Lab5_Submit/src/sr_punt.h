@@ -0,0 +1,105 @@
+/* This file defines the slow path thread. With -e thread the packet path
+   is split in two: the graph (sr_graph.h), on the I/O thread or a worker,
+   is the fast path and only forwards and translates packets of established
+   flows whose next hop is resolved. Everything it punts -- ARP, packets
+   waiting for ARP, ICMP errors to build, new NAT flows and unsolicited
+   SYNs, packets for the router, malformed packets -- is queued to one slow
+   path thread, which runs the scalar handlers on it. An exception then
+   holds up the exceptions behind it, not the forwarded traffic: the ARP
+   cache and NAT locks are taken for the fast path's short lookups only,
+   and building and sending ARP requests and ICMP errors, creating NAT
+   mappings and holding SYNs happen on the slow path's time.
+
+   The punt queue is bounded, and each class of exception has a quota of
+   its own in it, so a storm of one class (ARP requests, new flows) fills
+   its own share and is dropped from there while the other classes still
+   get through. A packet travels through the queue by a reference to its
+   packet buffer.
+
+   Like a worker, the slow path thread builds its packets in a pool of its
+   own and hands what it sends to the I/O thread over a ring, waking it
+   through an eventfd the loop (sr_loop.h) watches. The ARP and NAT ticks
+   stay on the I/O thread.
+
+   The slow path thread runs at a nice value of SR_PUNT_NICE, so where it
+   shares a CPU with the fast path the fast path runs first. That does not
+   make the fast path's tail flat under a storm: it still receives and
+   classifies every packet of it, and sends what the slow path answers.
+
+   A packet punted can be overtaken by later packets of its flow that the
+   fast path handles, once the slow path set the flow up (a mapping
+   created, an ARP reply inserted). Packets waiting for the same next hop,
+   or the same NAT mapping, are all punted and keep their order.
+
+   The slow path thread takes its exceptions from the graph, so it needs
+   the vector path (-P vector); with the syscall backend each packet runs
+   through the graph as a vector of one. Without -e, or with -e inline,
+   the graph hands its punts to the scalar handler on its own thread, as
+   before. */
+
+#ifndef SR_PUNT_H
+#define SR_PUNT_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define SR_PUNT_BATCH  32    /* exceptions taken off the queue at once */
+#define SR_PUNT_TXRING 2048  /* packets to send queued */
+#define SR_PUNT_PBUFS  512   /* buffers in the slow path's own pool */
+#define SR_PUNT_TXWAIT 64    /* yields on a full send ring before a drop */
+#define SR_PUNT_NICE   19    /* the slow path thread's nice value */
+
+/* the classes of exceptions, each with its quota of the queue */
+typedef enum {
+  sr_punt_arp,      /* ARP received */
+  sr_punt_arpmiss,  /* next hop not resolved yet */
+  sr_punt_icmp,     /* ICMP errors: ttl expiry, no route */
+  sr_punt_nat,      /* new NAT flows from inside, closing or unknown ones */
+  sr_punt_syn,      /* TCP from outside without a flow, unsolicited SYNs */
+  sr_punt_local,    /* for the router: echo, ports nothing listens on */
+  sr_punt_other,    /* bad checksums, other protocols and ethertypes */
+  SR_PUNT_CLASSES
+} sr_punt_class;
+
+struct sr_instance;
+struct sr_pkt;
+struct sr_pbuf;
+struct sr_punt;
+
+/* Starts the slow path thread for sr; returns NULL on error. */
+struct sr_punt *sr_punt_start(struct sr_instance *sr);
+
+/* Stops and joins the slow path thread and drops what is still queued. */
+void sr_punt_stop(struct sr_punt *p);
+
+/* The eventfd that becomes readable when the slow path queued packets to
+   send. */
+int  sr_punt_fd(const struct sr_punt *p);
+
+/* Any thread: queues the parsed packet, which lies in the packet buffer
+   pb, to the slow path as an exception of class cls, taking a reference to
+   pb. Returns -1 if the class is over its quota and the packet was
+   dropped. The slow path is not woken up for it yet. */
+int  sr_punt_queue(struct sr_instance *sr, struct sr_pkt *pk,
+                   struct sr_pbuf *pb, sr_punt_class cls);
+
+/* Any thread: wakes the slow path up if it sleeps on a queue that is not
+   empty, once for all the packets just queued. */
+void sr_punt_kick(struct sr_instance *sr);
+
+/* I/O thread: sends what the slow path queued. */
+void sr_punt_tx(struct sr_instance *sr);
+
+/* Nonzero on the slow path thread. */
+int  sr_punt_self(void);
+
+/* Slow path: queues the server command of len bytes at cmd, which lies in
+   the packet buffer pb, for the I/O thread to send, taking a reference to
+   pb. Returns 0 on success. */
+int  sr_punt_send(struct sr_instance *sr, struct sr_pbuf *pb,
+                  const void *cmd, size_t len);
+
+/* Prints the slow path counters to stderr. */
+void sr_punt_print(struct sr_punt *p);
+
+#endif /* SR_PUNT_H */
@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "sr_rcu.h"
+
+struct sr_rcu_cb {
+  struct sr_rcu_cb *next;
+  uint64_t epoch;              /* epoch the data was retired in */
+  void (*fn)(void *);
+  void *arg;
+};
+
+/* the global epoch, bumped by every sr_rcu_defer */
+static uint64_t sr_rcu_epoch = 1;
+
+/* the epoch each registered thread saw at its last quiescent state, 0 for
+   a free slot */
+static uint64_t sr_rcu_seen[SR_RCU_THREADS];
+
+static __thread int sr_rcu_slot = -1;
+
+static pthread_mutex_t sr_rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sr_rcu_cb *sr_rcu_pending;
+static uint64_t sr_rcu_deferred;
+static uint64_t sr_rcu_reclaimed;
+
+int sr_rcu_register(void) {
+  int i;
+
+  if (sr_rcu_slot >= 0)
+    return 0;
+
+  pthread_mutex_lock(&sr_rcu_lock);
+  for (i = 0; i < SR_RCU_THREADS; i++) {
+    if (__atomic_load_n(&sr_rcu_seen[i], __ATOMIC_SEQ_CST) == 0) {
+      __atomic_store_n(&sr_rcu_seen[i],
+        __atomic_load_n(&sr_rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+      sr_rcu_slot = i;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sr_rcu_lock);
+
+  if (sr_rcu_slot < 0) {
+    fprintf(stderr, "rcu: no free reader slot\n");
+    return -1;
+  }
+  return 0;
+}
+
+void sr_rcu_unregister(void) {
+  if (sr_rcu_slot < 0)
+    return;
+  __atomic_store_n(&sr_rcu_seen[sr_rcu_slot], 0, __ATOMIC_SEQ_CST);
+  sr_rcu_slot = -1;
+}
+
+void sr_rcu_quiescent(void) {
+  if (sr_rcu_slot < 0)
+    return;
+  __atomic_store_n(&sr_rcu_seen[sr_rcu_slot],
+    __atomic_load_n(&sr_rcu_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/* Tool function: the oldest epoch a registered thread was quiescent in */
+static uint64_t sr_rcu_min_seen(void) {
+  uint64_t min = UINT64_MAX;
+  int i;
+
+  for (i = 0; i < SR_RCU_THREADS; i++) {
+    uint64_t seen = __atomic_load_n(&sr_rcu_seen[i], __ATOMIC_SEQ_CST);
+    if ((seen != 0) && (seen < min))
+      min = seen;
+  }
+  return min;
+}
+
+uint64_t sr_rcu_retire(void) {
+  /* a reader that saw this epoch or a later one loaded its pointers after
+     the memory was unlinked */
+  return __atomic_add_fetch(&sr_rcu_epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+int sr_rcu_passed(uint64_t gp) {
+  return sr_rcu_min_seen() >= gp;
+}
+
+void sr_rcu_defer(void (*fn)(void *), void *arg) {
+  struct sr_rcu_cb *cb = malloc(sizeof(struct sr_rcu_cb));
+  if (cb == NULL) {
+    /* there is no safe point to free it at, rather leak it */
+    fprintf(stderr, "Error: out of memory (sr_rcu_defer)\n");
+    return;
+  }
+  cb->fn = fn;
+  cb->arg = arg;
+  cb->epoch = sr_rcu_retire();
+
+  pthread_mutex_lock(&sr_rcu_lock);
+  cb->next = sr_rcu_pending;
+  sr_rcu_pending = cb;
+  sr_rcu_deferred++;
+  pthread_mutex_unlock(&sr_rcu_lock);
+}
+
+unsigned int sr_rcu_reclaim(void) {
+  struct sr_rcu_cb *done = NULL;
+  struct sr_rcu_cb **pp;
+  uint64_t min = sr_rcu_min_seen();
+  unsigned int n = 0;
+
+  pthread_mutex_lock(&sr_rcu_lock);
+  pp = &sr_rcu_pending;
+  while (*pp) {
+    struct sr_rcu_cb *cb = *pp;
+    if (cb->epoch <= min) {
+      *pp = cb->next;
+      cb->next = done;
+      done = cb;
+      n++;
+    } else {
+      pp = &(cb->next);
+    }
+  }
+  sr_rcu_reclaimed += n;
+  pthread_mutex_unlock(&sr_rcu_lock);
+
+  /* the callbacks may defer again, so they run without the lock */
+  while (done) {
+    struct sr_rcu_cb *next = done->next;
+    done->fn(done->arg);
+    free(done);
+    done = next;
+  }
+  return n;
+}
+
+void sr_rcu_print(void) {
+  pthread_mutex_lock(&sr_rcu_lock);
+  fprintf(stderr, "rcu: %" PRIu64 " deferred, %" PRIu64 " reclaimed\n",
+    sr_rcu_deferred, sr_rcu_reclaimed);
+  pthread_mutex_unlock(&sr_rcu_lock);
+}
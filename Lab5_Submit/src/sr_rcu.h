@@ -0,0 +1,45 @@
+/* This file defines quiescent-state based reclamation for data that the
+   packet path reads without locks, the FIB (sr_fib.h) for one. A writer
+   replaces such data by swapping a pointer and hands the old copy to
+   sr_rcu_defer; it is freed once every registered thread has passed a
+   quiescent state after the swap, that is a point where it holds no
+   pointer into the shared data, typically between two packets.
+
+   Readers only ever store their epoch, they never wait and never lock.
+   A thread that reads the shared data registers once; a thread that
+   blocks for a long time should pass a quiescent state before it does,
+   or reclamation waits until it wakes up. */
+
+#ifndef SR_RCU_H
+#define SR_RCU_H
+
+#include <inttypes.h>
+
+#define SR_RCU_THREADS 32 /* threads that can be registered at once */
+
+/* Registers the calling thread as a reader; returns -1 if all slots are
+   taken. */
+int sr_rcu_register(void);
+void sr_rcu_unregister(void);
+
+/* The calling thread holds no pointer into RCU protected data. */
+void sr_rcu_quiescent(void);
+
+/* Calls fn(arg) once every registered thread has been quiescent. Call it
+   after the pointer to arg has been replaced. */
+void sr_rcu_defer(void (*fn)(void *), void *arg);
+
+/* For a writer that recycles retired memory itself instead of freeing it
+   through sr_rcu_defer: sr_rcu_retire starts a grace period after the
+   memory has been unlinked and returns it, sr_rcu_passed tells whether
+   every registered thread has been quiescent since. */
+uint64_t sr_rcu_retire(void);
+int sr_rcu_passed(uint64_t gp);
+
+/* Runs the deferred calls whose grace period is over, returns how many. */
+unsigned int sr_rcu_reclaim(void);
+
+/* Prints the deferred and reclaimed counts to stderr. */
+void sr_rcu_print(void);
+
+#endif /* SR_RCU_H */
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "sr_reload.h"
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_fib.h"
+
+/* a route as compared between the two tables */
+struct sr_reload_key {
+  uint32_t dest;                /* masked */
+  uint32_t mask;
+  uint32_t gw;
+  char iface[sr_IFACE_NAMELEN]; /* zero padded */
+};
+
+/* Only the loop thread starts and finishes a reload, the reload thread
+   fills in the result in between and then signals efd. */
+struct sr_reload {
+  int efd;
+  int busy;                     /* started and not finished yet */
+  struct sr_instance *sr;
+
+  /* result */
+  int ok;
+  int inplace;                  /* the published FIB was changed */
+  int partial;                  /* ... and the change failed part way */
+  struct sr_rt *rib;
+  struct sr_fib *fib;           /* NULL if nothing changed or inplace; if
+                                   partial, built from the old table */
+  uint32_t added;
+  uint32_t removed;
+  uint32_t kept;
+  uint64_t read_us;
+  uint64_t diff_us;
+  uint64_t build_us;
+};
+
+static struct sr_reload sr_reload_st = { .efd = -1 };
+
+/* a change to at most 1/SR_RELOAD_INPLACE of the routes is made to the
+   published FIB in place, a bigger one is compiled into a FIB of its own */
+#define SR_RELOAD_INPLACE 8
+
+/* Tool function: monotonic clock in microseconds */
+static uint64_t sr_reload_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int sr_reload_key_cmp(const void *a, const void *b) {
+  return memcmp(a, b, sizeof(struct sr_reload_key));
+}
+
+/* Tool function: the routes of list as sorted keys, *n of them */
+static struct sr_reload_key *sr_reload_keys(struct sr_rt *list, size_t *n) {
+  struct sr_reload_key *keys;
+  struct sr_rt *rt;
+  size_t i = 0;
+
+  for (*n = 0, rt = list; rt; rt = rt->next)
+    (*n)++;
+  keys = calloc(*n ? *n : 1, sizeof(struct sr_reload_key));
+  if (keys == NULL)
+    return NULL;
+  for (rt = list; rt; rt = rt->next, i++) {
+    keys[i].dest = rt->dest.s_addr & rt->mask.s_addr;
+    keys[i].mask = rt->mask.s_addr;
+    keys[i].gw = rt->gw.s_addr;
+    strncpy(keys[i].iface, rt->interface, sr_IFACE_NAMELEN - 1);
+  }
+  qsort(keys, *n, sizeof(struct sr_reload_key), sr_reload_key_cmp);
+  return keys;
+}
+
+/* Tool function: count the routes only in old, only in new and in both */
+static int sr_reload_diff(struct sr_rt *old, struct sr_rt *new, struct sr_reload *st) {
+  size_t nold, nnew, i = 0, j = 0;
+  struct sr_reload_key *kold = sr_reload_keys(old, &nold);
+  struct sr_reload_key *knew = sr_reload_keys(new, &nnew);
+
+  if ((kold == NULL) || (knew == NULL)) {
+    free(kold);
+    free(knew);
+    return -1;
+  }
+  st->added = st->removed = st->kept = 0;
+  while ((i < nold) || (j < nnew)) {
+    int c = (i == nold) ? 1 : (j == nnew) ? -1 : sr_reload_key_cmp(&kold[i], &knew[j]);
+    if (c < 0) {
+      st->removed++;
+      i++;
+    } else if (c > 0) {
+      st->added++;
+      j++;
+    } else {
+      st->kept++;
+      i++;
+      j++;
+    }
+  }
+  free(kold);
+  free(knew);
+  return 0;
+}
+
+static void *sr_reload_thread(void *arg) {
+  struct sr_reload *st = arg;
+  struct sr_instance *sr = st->sr;
+  struct sr_rt *rt;
+  uint64_t t0, t1, t2, one = 1;
+  int withdrawn;
+
+  t0 = sr_reload_now_us();
+  if (sr_load_rt_list(sr->rtable, &(st->rib)) != 0) {
+    fprintf(stderr, "reload: cannot read %s\n", sr->rtable);
+    goto done;
+  }
+  for (rt = st->rib; rt; rt = rt->next) {
+    if (sr_get_interface(sr, rt->interface) == NULL) {
+      fprintf(stderr, "reload: %s: no interface %s\n", sr->rtable, rt->interface);
+      goto done;
+    }
+  }
+  t1 = sr_reload_now_us();
+  st->read_us = t1 - t0;
+
+  /* sr->routing_table is only replaced by sr_reload_finish, which waits
+     for this thread */
+  if (sr_reload_diff(sr->routing_table, st->rib, st) != 0) {
+    fprintf(stderr, "Error: out of memory (sr_reload_diff)\n");
+    goto done;
+  }
+  t2 = sr_reload_now_us();
+  st->diff_us = t2 - t1;
+
+  /* a withdrawn FIB (see below) is built again even for the same routes,
+     and never changed in place */
+  withdrawn = (sr_fib_deref(sr->fib) == NULL);
+  if (st->added || st->removed || withdrawn) {
+    if (!withdrawn &&
+        ((st->added + st->removed) * SR_RELOAD_INPLACE <= st->added + st->kept)) {
+      if (sr_fib_update(sr, st->rib) >= 0) {
+        st->inplace = 1;
+        goto built;
+      }
+      /* the published FIB is part way: the FIB built from the new table
+         replaces it, or else one built from the table in use */
+      st->partial = 1;
+    }
+    if ((st->fib = sr_fib_build(st->rib)) == NULL) {
+      if (st->partial)
+        st->fib = sr_fib_build(sr->routing_table);
+      goto done;
+    }
+    st->partial = 0;
+built:
+    st->build_us = sr_reload_now_us() - t2;
+  }
+  st->ok = 1;
+
+done:
+  if (write(st->efd, &one, sizeof(one)) != sizeof(one))
+    perror("write(..):sr_reload.c::sr_reload_thread");
+  return NULL;
+}
+
+int sr_reload_init(struct sr_instance *sr) {
+  sr_reload_st.sr = sr;
+  sr_reload_st.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (sr_reload_st.efd < 0)
+    perror("eventfd(..):sr_reload.c::sr_reload_init");
+  return sr_reload_st.efd;
+}
+
+void sr_reload_destroy(void) {
+  /* a reload still running keeps the descriptor, it is left to exit */
+  if ((sr_reload_st.efd >= 0) && !sr_reload_st.busy) {
+    close(sr_reload_st.efd);
+    sr_reload_st.efd = -1;
+  }
+}
+
+int sr_reload_start(struct sr_instance *sr) {
+  struct sr_reload *st = &sr_reload_st;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int err;
+
+  if (st->busy) {
+    fprintf(stderr, "reload: already running, ignored\n");
+    return -1;
+  }
+  if (sr->rtable[0] == 0) {
+    fprintf(stderr, "reload: no routing table file\n");
+    return -1;
+  }
+
+  st->sr = sr;
+  st->ok = 0;
+  st->inplace = 0;
+  st->partial = 0;
+  st->rib = NULL;
+  st->fib = NULL;
+  st->added = st->removed = st->kept = 0;
+  st->read_us = st->diff_us = st->build_us = 0;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  err = pthread_create(&thread, &attr, sr_reload_thread, st);
+  pthread_attr_destroy(&attr);
+  if (err != 0) {
+    fprintf(stderr, "reload: cannot start thread (%s)\n", strerror(err));
+    return -1;
+  }
+  st->busy = 1;
+  fprintf(stderr, "reload: reading %s\n", sr->rtable);
+  return 0;
+}
+
+void sr_reload_finish(struct sr_instance *sr) {
+  struct sr_reload *st = &sr_reload_st;
+  uint64_t v, t0, swap_us = 0;
+
+  if (read(st->efd, &v, sizeof(v)) != sizeof(v) || !st->busy)
+    return;
+  st->busy = 0;
+
+  if (!st->ok) {
+    sr_free_rt_list(st->rib);
+    if (!st->partial) {
+      sr_fib_free(st->fib);
+      fprintf(stderr, "reload: failed, routing table unchanged\n");
+    } else if (st->fib) {
+      sr_fib_swap(sr, st->fib);
+      fprintf(stderr, "reload: failed part way, FIB rebuilt from the routing table in use\n");
+    } else {
+      /* neither table could be compiled: a FIB mixing the two is worse
+         than none */
+      sr_fib_withdraw(sr);
+      fprintf(stderr, "reload: failed part way, FIB withdrawn; nothing is forwarded "
+        "until a reload succeeds\n");
+    }
+    return;
+  }
+  if (st->inplace) {
+    /* the FIB has the new routes already, the RIB follows */
+    struct sr_rt *old = sr->routing_table;
+    sr->routing_table = st->rib;
+    sr_free_rt_list(old);
+    fprintf(stderr, "reload: %u added, %u removed, %u kept; read %" PRIu64
+      " ms, diff %" PRIu64 " ms, changed in place in %" PRIu64 " ms\n",
+      st->added, st->removed, st->kept, st->read_us / 1000, st->diff_us / 1000,
+      st->build_us / 1000);
+    return;
+  }
+  if (st->fib == NULL) {
+    sr_free_rt_list(st->rib);
+    fprintf(stderr, "reload: %u routes, no change\n", st->kept);
+    return;
+  }
+
+  /* the RIB is only read on this thread, the FIB goes through RCU */
+  t0 = sr_reload_now_us();
+  struct sr_rt *old = sr->routing_table;
+  sr->routing_table = st->rib;
+  sr_fib_swap(sr, st->fib);
+  swap_us = sr_reload_now_us() - t0;
+  sr_free_rt_list(old);
+
+  fprintf(stderr, "reload: %u added, %u removed, %u kept; read %" PRIu64
+    " ms, diff %" PRIu64 " ms, build %" PRIu64 " ms, swap %" PRIu64 " us\n",
+    st->added, st->removed, st->kept, st->read_us / 1000, st->diff_us / 1000,
+    st->build_us / 1000, swap_us);
+}
@@ -0,0 +1,34 @@
+/* This file defines the routing table reload. SIGHUP makes the event loop
+   call sr_reload_start, which reads the rtable file the router was started
+   with on a thread of its own, compares it with the routing table in use
+   and compiles the FIB for it (sr_fib.h); the loop keeps forwarding with
+   the old FIB meanwhile. When the thread is done it signals the eventfd
+   sr_reload_init returned, and sr_reload_finish, on the loop, swaps the
+   new routing table and FIB in. The ARP cache, the adjacencies and the NAT
+   mappings are kept, and packets are never held up by the reload: the
+   swap is one pointer exchange, the old FIB is reclaimed through RCU.
+   When only a small part of the routes changed, the thread makes the
+   change to the published FIB in place instead (sr_fib_update) and only
+   the routing table is swapped.
+
+   A file that cannot be read, or that names an interface the router does
+   not have, leaves the routing table as it is. */
+
+#ifndef SR_RELOAD_H
+#define SR_RELOAD_H
+
+struct sr_instance;
+
+/* Returns the eventfd that becomes readable when a reload is ready for
+   sr_reload_finish, or -1. */
+int  sr_reload_init(struct sr_instance *sr);
+void sr_reload_destroy(void);
+
+/* Starts reloading sr->rtable unless a reload is running already; returns
+   0 if started. */
+int  sr_reload_start(struct sr_instance *sr);
+
+/* Swaps in what the reload thread built, on the thread that forwards. */
+void sr_reload_finish(struct sr_instance *sr);
+
+#endif /* SR_RELOAD_H */
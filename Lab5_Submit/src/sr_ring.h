@@ -0,0 +1,86 @@
+/* This file defines a single producer, single consumer ring of fixed size
+   slots, the queue between the I/O thread and a worker (sr_worker.h). One
+   thread pushes and one thread pops, so neither needs a lock: the producer
+   owns head, the consumer owns tail, and each publishes its index with a
+   release store that the other reads with an acquire load. The two indices
+   are on cache lines of their own, and each side keeps the last value it
+   read of the other's index, so the line only moves between the cores when
+   the ring looks full (or empty) from the side's copy.
+
+   The indices run freely and are masked on use; the ring holds size slots,
+   size a power of two. */
+
+#ifndef SR_RING_H
+#define SR_RING_H
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct sr_ring {
+  uint8_t *slots;
+  uint32_t mask;               /* size - 1 */
+  uint32_t slot_sz;
+
+  /* producer */
+  uint32_t head __attribute__((aligned(64)));
+  uint32_t tail_seen;
+
+  /* consumer */
+  uint32_t tail __attribute__((aligned(64)));
+  uint32_t head_seen;
+} __attribute__((aligned(64)));
+
+/* Returns 0, or -1 if out of memory. size is rounded up to a power of 2. */
+static inline int sr_ring_init(struct sr_ring *r, uint32_t size, uint32_t slot_sz) {
+  uint32_t n = 1;
+  while (n < size)
+    n <<= 1;
+  memset(r, 0, sizeof(struct sr_ring));
+  if (posix_memalign((void **)&(r->slots), 64, (size_t)n * slot_sz) != 0) {
+    r->slots = NULL;
+    return -1;
+  }
+  r->mask = n - 1;
+  r->slot_sz = slot_sz;
+  return 0;
+}
+
+static inline void sr_ring_destroy(struct sr_ring *r) {
+  free(r->slots);
+  r->slots = NULL;
+}
+
+/* Producer: copies the slot at p in; returns -1 if the ring is full. */
+static inline int sr_ring_push(struct sr_ring *r, const void *p) {
+  uint32_t head = r->head;
+  if (head - r->tail_seen > r->mask) {
+    r->tail_seen = __atomic_load_n(&(r->tail), __ATOMIC_ACQUIRE);
+    if (head - r->tail_seen > r->mask)
+      return -1;
+  }
+  memcpy(r->slots + (size_t)(head & r->mask) * r->slot_sz, p, r->slot_sz);
+  __atomic_store_n(&(r->head), head + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Consumer: copies the oldest slot out to p; returns -1 if the ring is
+   empty. */
+static inline int sr_ring_pop(struct sr_ring *r, void *p) {
+  uint32_t tail = r->tail;
+  if (tail == r->head_seen) {
+    r->head_seen = __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+    if (tail == r->head_seen)
+      return -1;
+  }
+  memcpy(p, r->slots + (size_t)(tail & r->mask) * r->slot_sz, r->slot_sz);
+  __atomic_store_n(&(r->tail), tail + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Consumer: nonzero if there is nothing to pop. */
+static inline int sr_ring_empty(struct sr_ring *r) {
+  return r->tail == __atomic_load_n(&(r->head), __ATOMIC_ACQUIRE);
+}
+
+#endif /* SR_RING_H */
@@ -15,6 +15,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stddef.h>
 
 
 #include "sr_if.h"
@@ -24,6 +25,10 @@
 #include "sr_arpcache.h"
 #include "sr_utils.h"
 #include "sr_nat.h"
+#include "sr_graph.h"
+#include "sr_pkt.h"
+#include "sr_stats.h"
+#include "sr_lat.h"
 
 /*---------------------------------------------------------------------
  * Method: sr_init(void)
@@ -38,16 +43,12 @@ void sr_init(struct sr_instance* sr)
   /* REQUIRES */
   assert(sr);
 
-  /* Initialize cache and cache cleanup thread */
+  /* Initialize cache; its cleanup runs from the event loop's timer */
   sr_arpcache_init(&(sr->cache));
 
-  pthread_attr_init(&(sr->attr));
-  pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
-  pthread_t thread;
-
-  pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+  /* Packets are received into, queued in and built in buffers of this
+     pool, see sr_pbuf.h */
+  sr_pbuf_pool_init(&(sr->pbufs), SR_PBUF_COUNT);
 
   /* Add initialization code here! */
 
@@ -58,13 +59,80 @@ void sr_init(struct sr_instance* sr)
     sr->routing_nat->icmp_to = sr->nat_icmp_timeout;
     sr->routing_nat->tcp_estab_to = sr->nat_tcp_estab_timeout;
     sr->routing_nat->tcp_transit_to = sr->nat_tcp_transit_timeout;
-    sr->routing_nat->mappings = NULL;
+
+    /* the external address pool given with -x, see sr_nat_default_pool */
+    memcpy(sr->routing_nat->pool, sr->nat_pool, sizeof(sr->nat_pool));
+    sr->routing_nat->pool_sz = sr->nat_pool_sz;
     
     /* Initialize nat and thread */
     sr_nat_init(sr, sr->routing_nat);  
   }
 } /* -- sr_init -- */
 
+/*---------------------------------------------------------------------
+ * Method: sr_nat_default_pool(struct sr_instance*)
+ * Scope:  Global
+ *
+ * Without -x the nat translates to the address of the interface the
+ * default route goes out of. The interfaces are only known once the
+ * server sent the hardware info, which is after sr_init, so this is
+ * called from there.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_nat_default_pool(struct sr_instance* sr)
+{
+  struct sr_rt* rt_walker = sr->routing_table;
+  struct sr_if* ext_intf;
+
+  if(!sr->nat_enabled || (sr->nat_pool_sz != 0)){
+    return;
+  }
+  while(rt_walker && (rt_walker->mask.s_addr != 0)){
+    rt_walker = rt_walker->next;
+  }
+  ext_intf = rt_walker ? sr_get_interface(sr, rt_walker->interface) : NULL;
+  if(ext_intf == NULL){
+    fprintf(stderr, "nat: no default route, no external address\n");
+    return;
+  }
+
+  pthread_mutex_lock(&(sr->routing_nat->lock));
+  sr->routing_nat->pool[0] = ext_intf->ip;
+  sr_nat_pool_rehash(sr->routing_nat);
+  pthread_mutex_unlock(&(sr->routing_nat->lock));
+} /* -- sr_nat_default_pool -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_init_roles(struct sr_instance*)
+ * Scope:  Global
+ *
+ * Gives each interface its role (sr_if.h): with the nat, eth0 is the
+ * inside and the others the outside. Every packet is then handled by the
+ * row of the dispatch table for the role of the interface it came in on,
+ * so the nat and the direction are not looked at again per packet. The
+ * inside interface is kept in sr->nat_inside. Like sr_nat_default_pool,
+ * called once the server sent the hardware info.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_init_roles(struct sr_instance* sr)
+{
+  struct sr_if* if_walker;
+
+  sr->nat_inside = 0;
+  for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next){
+    if(!sr->nat_enabled){
+      if_walker->role = if_role_router;
+    }else if(strncmp(if_walker->name, "eth0", 4) == 0){
+      if_walker->role = if_role_nat_inside;
+      sr->nat_inside = if_walker;
+    }else{
+      if_walker->role = if_role_nat_outside;
+    }
+  }
+} /* -- sr_init_roles -- */
+
 
 
 /*---------------------------------------------------------------------
@@ -77,9 +145,11 @@ void sr_init(struct sr_instance* sr)
  * ethernet headers.
  *
  * Note: Both the packet buffer and the character's memory are handled
- * by sr_vns_comm.c that means do NOT delete either.  Make a copy of the
- * packet instead if you intend to keep it around beyond the scope of
- * the method call.
+ * by sr_vns_comm.c that means do NOT delete either.  Hold the packet
+ * with sr_pbuf_hold instead if you intend to keep it around beyond the
+ * scope of the method call. Do not write the interface name either:
+ * with workers (sr_worker.h) it is the interface's own, read by every
+ * thread.
  *
  *---------------------------------------------------------------------*/
 
@@ -99,325 +169,625 @@ unsigned int sr_ip_equal(struct sr_instance* sr,
     }
     if_walker = if_walker->next;
   }
+  // the addresses of the nat's external address pool are the router's too
+  if(sr->nat_enabled && (sr_nat_pool_index(sr->routing_nat, pkt_ip) >= 0)){
+    return 1;
+  }
   return 0;
 }
 
-void sr_handlepacket(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
-        char* interface/* lent */)
-{
-  /* REQUIRES */
-  assert(sr);
-  assert(packet);
-  assert(interface);
+/* Classes of the dispatch table: the ethertype and, for IP, the protocol */
+enum {
+  SR_CLASS_IP,    /* another protocol, or a header that does not parse */
+  SR_CLASS_ICMP,
+  SR_CLASS_TCP,
+  SR_CLASS_UDP,
+  SR_CLASS_ARP,
+  SR_CLASS_OTHER,
+  SR_CLASSES
+};
 
-  printf("*** -> Received packet of length %d \n",len);
-  struct  sr_ethernet_hdr* ehdr = (struct sr_ethernet_hdr *)packet;
-  struct  sr_arp_hdr*      ahdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-  struct  sr_ip_hdr*       iphdr = (struct sr_ip_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-  struct  sr_if* iface = sr_get_interface(sr, interface);
-  int minlength = sizeof(sr_ethernet_hdr_t);
+static const uint8_t sr_ip_class[256] = {
+  [ip_protocol_icmp] = SR_CLASS_ICMP,
+  [ip_protocol_tcp]  = SR_CLASS_TCP,
+  [ip_protocol_udp]  = SR_CLASS_UDP,
+};
 
+static inline int sr_pkt_class(const struct sr_pkt* pk)
+{
+  if(pk->ethertype == ethertype_ip){
+    return sr_ip_class[pk->ip_proto];
+  }
+  return (pk->ethertype == ethertype_arp) ? SR_CLASS_ARP : SR_CLASS_OTHER;
+}
+
+/* Tool function: handle an IP packet of class cls received on an
+   interface of the given role. Written once, the dispatch table below
+   holds a copy of it for each role and class with both constant, so each
+   copy only has the branches that apply to it. */
+static inline __attribute__((always_inline)) void sr_handlepacket_ip(struct sr_instance* sr,
+        struct sr_pkt* pk/* lent */,
+        char* interface/* lent */,
+        const sr_if_role role,
+        const int cls)
+{
+  uint8_t* packet = pk->data;
+  unsigned int len = pk->len;
+  struct  sr_ip_hdr*       iphdr = sr_pkt_ip(pk);
   uint16_t r_cksum = 0, cksum_tmp = 0;
-  if (len < minlength) {
-    fprintf(stderr, "Failed to process ETHERNET header, insufficient length\n");
+
+  /* the parser checked the lengths, check the cksum of ip */
+  if (!(pk->flags & SR_PKT_IP)) {
+    fprintf(stderr, "Failed to process IP header, insufficient length\n");
+    sr_stats_count(sr_stat_dropped);
     return;
   }
+  r_cksum = iphdr->ip_sum;
+  cksum_tmp = 0;
+  iphdr->ip_sum = htons(0);
+  cksum_tmp = cksum(iphdr, sr_pkt_iphl(pk));
+  if (r_cksum != cksum_tmp){
+    fprintf(stderr, "ERROR: data packet error detected, ip packet cksum incorrect.\n");
+    sr_stats_count(sr_stat_dropped);
+    return;
+  }
+  // put the cksum back into the ip packet
+  iphdr->ip_sum = cksum_tmp;
 
-  if(ehdr->ether_type == htons(ethertype_ip)) { //IP
-      
-      /* Check the minlength and the cksum of ip */
-      minlength += sizeof(sr_ip_hdr_t);
-      if (len < minlength) {
-        fprintf(stderr, "Failed to process IP header, insufficient length\n");
-        return;
-      }
-      r_cksum = iphdr->ip_sum;
-      cksum_tmp = 0;
-      iphdr->ip_sum = htons(0);
-      cksum_tmp = cksum(iphdr, sizeof(struct sr_ip_hdr));
+  if(sr_ip_equal(sr, iphdr->ip_dst)){  // IP (target to router) 
+    // if the ttl of packet is 0, drop the packet        
+    if(iphdr->ip_ttl == 0) {
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 11, 0);
+    }
+    if(cls == SR_CLASS_ICMP) { // ICMP
+      struct  sr_icmp_hdr*     icmphdr = (struct sr_icmp_hdr*)sr_pkt_l4(pk);
+
+      /* Check the cksum of icmp */
+      uint16_t r_cksum = 0, cksum_tmp = 0;
+      r_cksum = icmphdr->icmp_sum;
+      icmphdr->icmp_sum = htons(0);
+      cksum_tmp = cksum(icmphdr, pk->l4_len);
       if (r_cksum != cksum_tmp){
-        fprintf(stderr, "ERROR: data packet error detected, ip packet cksum incorrect.\n");
+        fprintf(stderr, "ERROR: data packet error detected, icmp packet cksum incorrect.\n");
         return;
       }
-      // put the cksum back into the ip packet
-      iphdr->ip_sum = cksum_tmp;
-     
-      uint8_t ip_proto = ip_protocol(packet + sizeof(sr_ethernet_hdr_t)); 
-      if(sr_ip_equal(sr, iphdr->ip_dst)){  // IP (target to router) 
-        // if the ttl of packet is 0, drop the packet        
-        if(iphdr->ip_ttl == 0) {
-          sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 11, 0);
-        }
-        if(ip_proto == ip_protocol_icmp) { // ICMP
-          struct  sr_icmp_hdr*     icmphdr = (struct sr_icmp_hdr*)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
-
-          /* Check the cksum of icmp */
-          uint16_t r_cksum = 0, cksum_tmp = 0;
-          r_cksum = icmphdr->icmp_sum;
-          icmphdr->icmp_sum = htons(0);
-          unsigned int icmp_len = len - sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr);
-          cksum_tmp = cksum(icmphdr, icmp_len);
-          if (r_cksum != cksum_tmp){
-            fprintf(stderr, "ERROR: data packet error detected, icmp packet cksum incorrect.\n");
-            return;
-          }
-          icmphdr->icmp_sum = cksum_tmp;
-
-          /* handle icmp request -- reply, revised to add nat function*/
-          sr_handlepacket_icmpEcho(sr, packet, len, interface);
-        }
-
-        if(ip_proto == 6){  // TCP
-          /* handle received tcp packets, connection initication to internal node*/
-          sr_handlepacket_tcp(sr, packet, len, interface);
-        }
-        if(ip_proto == 17){  // UDP
-          sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-        }
-
-      }else{  // IP Forwarding
-          if(iphdr->ip_ttl <= 1) {
-            sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 11, 0);
-          }
-	        if(sr->nat_enabled){
-            if(ip_proto == 6){ // TCP
-              sr_handle_forwardtcp_nat(sr, packet, len, interface);
-            }else{
-	  	        sr_handle_forwardicmp_nat(sr, sr->routing_nat, packet, len, interface);
-            }
-	        }else{
-          	sr_handlepacket_forwarding(sr, packet, len, interface, 0);
-	        }
+      icmphdr->icmp_sum = cksum_tmp;
+
+      /* an echo from outside goes to the nat mapping, the others are
+         answered */
+      if(role == if_role_nat_outside){
+        sr_handlepacket_icmpEcho_nat(sr, pk, interface);
+      }else{
+        sr_handlepacket_icmpEcho(sr, pk, interface);
       }
-  }
-  
-  if(ehdr->ether_type == htons(ethertype_arp)){  // ARP
+    }
 
-   //Check the minlength and the cksum
-      minlength += sizeof(struct sr_arp_hdr);
-      if (len < minlength) {
-        fprintf(stderr, "Failed to process ARP header, insufficient length\n");
-        return;
+    if((cls == SR_CLASS_TCP) && (pk->flags & SR_PKT_L4)){  // TCP
+      if(role == if_role_router){
+        // no nat, nothing listens
+        sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
+      }else{
+        /* handle received tcp packets, connection initication to internal node*/
+        sr_handlepacket_tcp(sr, pk, interface);
       }
+    }
+    if(cls == SR_CLASS_UDP){  // UDP
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
+    }
 
-    if((ahdr->ar_op   == htons(arp_op_request)) &&
-      (ahdr->ar_tip  == iface->ip)) {  // ARP Receive Request
-        sr_handlepacket_arpreq(sr, packet, len, interface);
-      }else if((ahdr->ar_op   == htons(arp_op_reply)) &&
-              (ahdr->ar_tip  == iface->ip)) {  //ARP Receive Reply
-        sr_handlepacket_arpreply(sr, packet, len, interface);
+  }else{  // IP Forwarding
+    // an expired packet is dropped, whether its error is sent or suppressed
+    if(iphdr->ip_ttl <= 1) {
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 11, 0);
+      return;
+    }
+    if(role == if_role_router){
+      sr_handlepacket_forwarding(sr, pk, interface, 0);
+    }else if(cls == SR_CLASS_TCP){ // TCP
+      if(role == if_role_nat_inside){
+        sr_handle_forwardtcp_nat(sr, pk, interface);
+      }else{
+        // TCP packet from external, forward directly
+        sr_handlepacket_forwarding(sr, pk, interface, 0);
+      }
+    }else if(cls == SR_CLASS_ICMP){
+      if(role == if_role_nat_inside){
+        sr_handle_forwardicmp_nat_out(sr, pk, interface);
+      }else{
+        sr_handle_forwardicmp_nat_in(sr, pk, interface);
       }
+    }
   }
 }
-/* Tool function: used to calculate tcp packet cksum */
+
+/* Tool function: handle an ARP packet received on an interface of the
+   given role, the dispatch table's copy for the role */
+static inline __attribute__((always_inline)) void sr_handlepacket_arp(struct sr_instance* sr,
+        struct sr_pkt* pk/* lent */,
+        char* interface/* lent */,
+        const sr_if_role role)
+{
+  struct  sr_if* iface = pk->ifp;
+
+  //Check the minlength
+  if (!(pk->flags & SR_PKT_ARP)) {
+    fprintf(stderr, "Failed to process ARP header, insufficient length\n");
+    return;
+  }
+  struct  sr_arp_hdr*      ahdr = sr_pkt_arp(pk);
+
+  /* the nat's external addresses are answered for on the outside */
+  if((ahdr->ar_op   == htons(arp_op_request)) &&
+     ((ahdr->ar_tip  == iface->ip) ||
+      ((role == if_role_nat_outside) && (sr_nat_pool_index(sr->routing_nat, ahdr->ar_tip) >= 0)))) {  // ARP Receive Request
+    sr_handlepacket_arpreq(sr, pk, interface);
+  }else if((ahdr->ar_op   == htons(arp_op_reply)) &&
+          (ahdr->ar_tip  == iface->ip)) {  //ARP Receive Reply
+    sr_handlepacket_arpreply(sr, pk, interface);
+  }
+}
+
+typedef void (*sr_pkt_handler)(struct sr_instance*, struct sr_pkt*, char*);
+
+/* the copies, named role_class */
+#define SR_HANDLER_IP(name, role, cls) \
+  static void name(struct sr_instance* sr, struct sr_pkt* pk, char* interface) \
+  { sr_handlepacket_ip(sr, pk, interface, role, cls); }
+#define SR_HANDLER_ARP(name, role) \
+  static void name(struct sr_instance* sr, struct sr_pkt* pk, char* interface) \
+  { sr_handlepacket_arp(sr, pk, interface, role); }
+
+SR_HANDLER_IP(sr_router_ip,       if_role_router,      SR_CLASS_IP)
+SR_HANDLER_IP(sr_router_icmp,     if_role_router,      SR_CLASS_ICMP)
+SR_HANDLER_IP(sr_router_tcp,      if_role_router,      SR_CLASS_TCP)
+SR_HANDLER_IP(sr_router_udp,      if_role_router,      SR_CLASS_UDP)
+SR_HANDLER_ARP(sr_router_arp,     if_role_router)
+SR_HANDLER_IP(sr_inside_ip,       if_role_nat_inside,  SR_CLASS_IP)
+SR_HANDLER_IP(sr_inside_icmp,     if_role_nat_inside,  SR_CLASS_ICMP)
+SR_HANDLER_IP(sr_inside_tcp,      if_role_nat_inside,  SR_CLASS_TCP)
+SR_HANDLER_IP(sr_inside_udp,      if_role_nat_inside,  SR_CLASS_UDP)
+SR_HANDLER_ARP(sr_inside_arp,     if_role_nat_inside)
+SR_HANDLER_IP(sr_outside_ip,      if_role_nat_outside, SR_CLASS_IP)
+SR_HANDLER_IP(sr_outside_icmp,    if_role_nat_outside, SR_CLASS_ICMP)
+SR_HANDLER_IP(sr_outside_tcp,     if_role_nat_outside, SR_CLASS_TCP)
+SR_HANDLER_IP(sr_outside_udp,     if_role_nat_outside, SR_CLASS_UDP)
+SR_HANDLER_ARP(sr_outside_arp,    if_role_nat_outside)
+
+/* other ethertypes are dropped */
+static void sr_handlepacket_other(struct sr_instance* sr, struct sr_pkt* pk, char* interface)
+{
+}
+
+/* The dispatch table: one indexed call per packet, by the role of the
+   interface it came in on (sr_init_roles) and its class */
+static const sr_pkt_handler sr_dispatch[SR_IF_ROLES][SR_CLASSES] = {
+  [if_role_router] = {
+    [SR_CLASS_IP] = sr_router_ip, [SR_CLASS_ICMP] = sr_router_icmp,
+    [SR_CLASS_TCP] = sr_router_tcp, [SR_CLASS_UDP] = sr_router_udp,
+    [SR_CLASS_ARP] = sr_router_arp, [SR_CLASS_OTHER] = sr_handlepacket_other },
+  [if_role_nat_inside] = {
+    [SR_CLASS_IP] = sr_inside_ip, [SR_CLASS_ICMP] = sr_inside_icmp,
+    [SR_CLASS_TCP] = sr_inside_tcp, [SR_CLASS_UDP] = sr_inside_udp,
+    [SR_CLASS_ARP] = sr_inside_arp, [SR_CLASS_OTHER] = sr_handlepacket_other },
+  [if_role_nat_outside] = {
+    [SR_CLASS_IP] = sr_outside_ip, [SR_CLASS_ICMP] = sr_outside_icmp,
+    [SR_CLASS_TCP] = sr_outside_tcp, [SR_CLASS_UDP] = sr_outside_udp,
+    [SR_CLASS_ARP] = sr_outside_arp, [SR_CLASS_OTHER] = sr_handlepacket_other },
+};
+
+static void sr_handlepacket_frame(struct sr_instance* sr,
+        struct sr_pkt* pk/* lent */,
+        char* interface/* lent */)
+{
+  /* REQUIRES */
+  assert(sr);
+  assert(pk);
+  assert(pk->ifp);
+  assert(interface);
+
+  if (pk->len < sizeof(sr_ethernet_hdr_t)) {
+    fprintf(stderr, "Failed to process ETHERNET header, insufficient length\n");
+    return;
+  }
+  sr_dispatch[pk->ifp->role][sr_pkt_class(pk)](sr, pk, interface);
+}
+
+void sr_handlepacket(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        char* interface/* lent */)
+{
+  struct sr_pkt pk;
+  sr_pkt_parse(&pk, packet, len);
+  sr_handlepacket_pkt(sr, &pk, interface);
+} /* -- sr_handlepacket -- */
+
+/* sr_handlepacket for a packet parsed already, see sr_pkt.h */
+void sr_handlepacket_pkt(struct sr_instance* sr,
+        struct sr_pkt* pk/* lent */,
+        char* interface/* lent */)
+{
+  printf("*** -> Received packet of length %d \n",pk->len);
+  if(pk->ifp == NULL){
+    pk->ifp = sr_get_interface(sr, interface);
+    if(pk->ifp == NULL){
+      fprintf(stderr, "Packet on unknown interface %s, dropped.\n", interface);
+      return;
+    }
+  }
+  /* packets received together go through the graph as a vector, see
+     sr_graph.h */
+  if(sr->graph && (sr_graph_enqueue(sr, pk, interface) == 0)){
+    return;
+  }
+  sr_lat_mark(sr_lat_parse, pk->t_in);
+  sr_handlepacket_slow(sr, pk, interface);
+}
+
+/* Handles one packet on its own: the scalar path, and the graph's punt */
+void sr_handlepacket_slow(struct sr_instance* sr,
+        struct sr_pkt* pk/* lent */,
+        char* interface/* lent */)
+{
+  /* its stamp, for what it sends and queues on ARP */
+  sr_lat_in = pk->t_in;
+  sr_handlepacket_frame(sr, pk, interface);
+  sr_lat_in = 0;
+}
+/* Tool function: used to calculate tcp packet cksum. The pseudo header
+   is added to the sum of the segment rather than copied in front of it. */
 uint16_t cksum_tcp(uint8_t* pkt, uint16_t len, struct sr_tcp_hdr* tcphdr){
   struct  sr_ip_hdr* iphdr = (struct sr_ip_hdr*)(pkt + sizeof(struct sr_ethernet_hdr));
 
-  struct tcp_pseudohdr* phdr;
-  phdr = (struct tcp_pseudohdr*)malloc(sizeof(struct tcp_pseudohdr));
-  phdr->ip_src = iphdr->ip_src;
-  phdr->ip_dst = iphdr->ip_dst;
-  //print_addr_ip_int(phdr->ip_src);
-  //print_addr_ip_int(phdr->ip_dst);
-  memset(&phdr->res, 0, sizeof(uint8_t));
-  phdr->ip_proto = iphdr->ip_p;
-  //fprintf(stderr, "%d \n", phdr->ip_proto);
-  uint16_t tcp_len = (uint16_t)(ntohs(iphdr->ip_len) - sizeof(struct sr_ip_hdr));
-  phdr->tcp_len = htons(tcp_len);
-  uint8_t* cksum_pkt = (uint8_t*)malloc(sizeof(struct tcp_pseudohdr)+tcp_len);
-  uint16_t cksum_pkt_len = sizeof(struct tcp_pseudohdr)+tcp_len;
-  memcpy(cksum_pkt, phdr, sizeof(struct tcp_pseudohdr));
-  memcpy(cksum_pkt+sizeof(struct tcp_pseudohdr), tcphdr, tcp_len);
-  /* DEBUG */
-  // struct  sr_tcp_hdr* tcphdr_cksum = (struct  sr_tcp_hdr*)(cksum_pkt+sizeof(struct tcp_pseudohdr));
-  // fprintf(stderr, "tcp_src %d %d", tcphdr->tcp_src, tcphdr_cksum->tcp_src);
-  // fprintf(stderr, "tcp_dst %d %d", tcphdr->tcp_dest, tcphdr_cksum->tcp_dest);
-
-  uint16_t sum;
-  sum = cksum(cksum_pkt, (sizeof(struct tcp_pseudohdr)+tcp_len));
-  //fprintf(stderr, "TCP cksum: len %d tcp_len %d phdr len %d, ckpkt_len %d, sum %d \n", len, tcp_len, (uint16_t)sizeof(struct tcp_pseudohdr), cksum_pkt_len, sum);
-
-  return sum;
+  struct tcp_pseudohdr phdr;
+  phdr.ip_src = iphdr->ip_src;
+  phdr.ip_dst = iphdr->ip_dst;
+  phdr.res = 0;
+  phdr.ip_proto = iphdr->ip_p;
+  uint16_t tcp_len = (uint16_t)(ntohs(iphdr->ip_len) - iphdr->ip_hl * 4);
+  phdr.tcp_len = htons(tcp_len);
+
+  /* the pseudo header is folded into the sum of the segment rather than
+     copied in front of it; it is read as words through a copy so the
+     stores above are not reordered past the reads */
+  uint16_t phdr_word[sizeof(struct tcp_pseudohdr) / 2];
+  memcpy(phdr_word, &phdr, sizeof(phdr_word));
+  uint32_t delta = 0;
+  unsigned int i;
+  for(i = 0; i < sizeof(phdr_word) / 2; i++){
+    delta = cksum_delta16(delta, 0, phdr_word[i]);
+  }
+  uint16_t sum = cksum_adjust(cksum(tcphdr, tcp_len), delta);
+  return sum ? sum : 0xffff;
 }
 
 void sr_handlepacket_tcp(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
+        struct sr_pkt* pk/* lent */,
         char* interface/* lent */)
 {
-  struct  sr_ip_hdr* iphdr = (struct sr_ip_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-  struct  sr_tcp_hdr*     tcphdr = (struct sr_tcp_hdr*)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+  uint8_t* packet = pk->data;
+  unsigned int len = pk->len;
+  struct  sr_ip_hdr* iphdr = sr_pkt_ip(pk);
+  struct  sr_tcp_hdr*     tcphdr = (struct sr_tcp_hdr*)sr_pkt_l4(pk);
+  int syn = (pk->tcp_flags & SR_TCP_SYN) != 0;
+  int ack = (pk->tcp_flags & SR_TCP_ACK) != 0;
 
   fprintf(stderr, "Handle Packet TCP.\n");
-  if(sr->nat_enabled){
-    
-    struct sr_nat_mapping* entry;
-    entry = sr_nat_lookup_external(sr->routing_nat, ntohs(tcphdr->tcp_dest), nat_mapping_tcp);
+  if(sr_handlepacket_natfast(sr, pk, nat_dir_in) == 0){
+    return;
+  }
   
-    if((!entry)&&(tcphdr->tcp_syn)&&(!tcphdr->tcp_ack)){
-      fprintf(stderr, "Unsolicited SYN from external. \n");
-      struct sr_nat *nat = sr->routing_nat;
-      struct sr_nat_unsosyn *unsosyn;
-      unsosyn = (struct sr_nat_unsosyn *)malloc(sizeof(struct sr_nat_unsosyn));
-      /* create the unsosyn and add it to the list in nat */
-      unsosyn->packet = (uint8_t*) malloc(len); 
-      memcpy(unsosyn->packet, packet, len);
-      unsosyn->len = len;
-      unsosyn->iface = (char *)malloc(sr_IFACE_NAMELEN);
-      memcpy(unsosyn->iface, interface, sr_IFACE_NAMELEN);
-      unsosyn->next = NULL;
-      unsosyn->recv = time(NULL);
-
-      if(nat->unso_syn_list == NULL){
-        nat->unso_syn_list = unsosyn;
-      }else{
-        fprintf(stderr, "Add one more unsolicited SYN. \n");
-        unsosyn->next = nat->unso_syn_list;
-        nat->unso_syn_list = unsosyn;
-      }
-      return; 
-      // hold the packet for 6 sec, then check if connection is initiated from internal ip  FIXME
+  struct sr_nat_mapping mapping;
+  struct sr_nat_mapping* entry = 0;
+  if(sr_nat_lookup_external(sr->routing_nat, iphdr->ip_dst, ntohs(pk->dport), nat_mapping_tcp, &mapping) == 0){
+    entry = &mapping;
+  }
+
+  if((!entry)&&syn&&(!ack)){
+    fprintf(stderr, "Unsolicited SYN from external. \n");
+    /* hold the SYN for SR_NAT_UNSOSYN_TO sec in case the internal node
+       opens the connection too, refuse it right away if there is no room */
+    struct sr_pbuf* pb = 0;
+    uint8_t* held = sr_pbuf_hold(&sr->pbufs, packet, len, &pb);
+    if((held == NULL) ||
+       (sr_nat_hold_unsosyn(sr->routing_nat, pk, held, pb, interface) != 0)){
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
     }
-      
-    // struct sr_nat_mapping* entry;
-    // entry = sr_nat_lookup_external(sr->routing_nat, ntohs(tcphdr->tcp_dest), nat_mapping_tcp);
-    if(entry){
-      struct sr_nat_connection* has_connect = 0;
-      has_connect = sr_nat_lookup_connection(entry, entry->ip_int, iphdr->ip_src);
-      if(has_connect == NULL){
-        if((tcphdr->tcp_syn)&&(!tcphdr->tcp_ack)){
-          sr_nat_insert_connection(entry, entry->ip_int, iphdr->ip_src, nat_connection_building);
-          iphdr->ip_dst = entry->ip_int;
-          strncpy(interface, "eth0", 4);
-          tcphdr->tcp_dest = entry->aux_int;
-          tcphdr->tcp_check = htons(0);
-          tcphdr->tcp_check = cksum_tcp(packet, len, tcphdr);
-          sr_handlepacket_forwarding(sr, packet, len, interface, 0);
-          return;
-        }else{
-          sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-          return;
-        }
-      }
-      if((has_connect->state == nat_connection_building)&&(!tcphdr->tcp_syn)&&(tcphdr->tcp_ack)){
-        has_connect->state = nat_connection_established;
-        fprintf(stderr, "lookup connection: ");
-        //print_addr_ip_int(entry->ip_int);
-        //print_addr_ip_int(entry->ip_ext);
+    return; 
+  }
+    
+  // struct sr_nat_mapping* entry;
+  // entry = sr_nat_lookup_external(sr->routing_nat, ntohs(tcphdr->tcp_dest), nat_mapping_tcp);
+  if(entry){
+    // a SYN-less ACK completes the handshake of a connection being built
+    sr_nat_connection_state state = ((!syn) && ack) ?
+      nat_connection_established : nat_connection_building;
+    if(sr_nat_touch_connection(sr->routing_nat, entry, iphdr->ip_src, state) != 0){
+      if(syn&&(!ack)){
+        sr_nat_insert_connection(sr->routing_nat, entry, iphdr->ip_src, nat_connection_building);
+        iphdr->ip_dst = entry->ip_int;
+        tcphdr->tcp_dest = entry->aux_int;
+        tcphdr->tcp_check = htons(0);
+        tcphdr->tcp_check = cksum_tcp(packet, len, tcphdr);
+        sr_stats_count(sr_stat_nat_in);
+        sr_lat_mark(sr_lat_nat, pk->t_in);
+        sr_handlepacket_forwarding(sr, pk, interface, 0);
+        return;
+      }else{
+        sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
+        return;
       }
-      has_connect->last_updated = time(NULL);
-      iphdr->ip_dst = entry->ip_int;
-      strncpy(interface, "eth0", 4);
-      // print_addr_ip_int(iphdr->ip_src);
-      // print_addr_ip_int(iphdr->ip_dst);
-      // fprintf(stderr, "%d\n", iphdr->ip_p);
-      tcphdr->tcp_dest = entry->aux_int;
-      tcphdr->tcp_check = htons(0);
-      tcphdr->tcp_check = cksum_tcp(packet, len, tcphdr); 
-      sr_handlepacket_forwarding(sr, packet, len, interface, 0);
-      return;
-    }else{
-      // if no entry exist, reply icmp unreachable  
-      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-      return;
     }
+    iphdr->ip_dst = entry->ip_int;
+    // print_addr_ip_int(iphdr->ip_src);
+    // print_addr_ip_int(iphdr->ip_dst);
+    // fprintf(stderr, "%d\n", iphdr->ip_p);
+    tcphdr->tcp_dest = entry->aux_int;
+    tcphdr->tcp_check = htons(0);
+    tcphdr->tcp_check = cksum_tcp(packet, len, tcphdr); 
+    sr_stats_count(sr_stat_nat_in);
+    sr_lat_mark(sr_lat_nat, pk->t_in);
+    sr_handlepacket_forwarding(sr, pk, interface, 0);
+    return;
   }else{
-    // if nat is not enabled
+    // if no entry exist, reply icmp unreachable  
     sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-    return;      
+    return;
   }
-  return;
 }
-
+/* TCP from the inside forwarded through the nat; TCP from the outside is
+   forwarded as it is */
 void sr_handle_forwardtcp_nat(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
+        struct sr_pkt* pk/* lent */,
         char* interface/* lent */){
-  struct  sr_ip_hdr* iphdr = (struct sr_ip_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-  struct  sr_tcp_hdr*     tcphdr = (struct sr_tcp_hdr*)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
-
-  if(strncmp(interface, "eth0", 4) == 0){
-    // TCP packet from internal -> nat
-    struct sr_nat_mapping* entry;
-    entry = sr_nat_lookup_internal(sr->routing_nat, iphdr->ip_src, tcphdr->tcp_src, nat_mapping_tcp);
-    if(tcphdr->tcp_syn){
-      // The packet initiate the SYN from inside 
-      if(entry == NULL){
-        entry = sr_nat_insert_mapping(sr->routing_nat, iphdr->ip_src, tcphdr->tcp_src, nat_mapping_tcp);
-      }
-      sr_nat_insert_connection(entry, iphdr->ip_src, iphdr->ip_dst, nat_connection_building);
-      tcphdr->tcp_src = htons(entry->aux_ext); 
-      // tcphdr->tcp_check = htons(0);
-      // tcphdr->tcp_check = cksum_tcp(packet, len, tcphdr);
-      sr_handlepacket_forwarding(sr, packet, len, interface, 1);
-      return;
-    }else{
-      if(entry == NULL){
-        sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-        return;
-      }
-      struct sr_nat_connection* has_connect = 0;
-      has_connect = sr_nat_lookup_connection(entry, iphdr->ip_src, iphdr->ip_dst);
-      
-      fprintf(stderr, "lookup connection: ");
-      // print_addr_ip_int(iphdr->ip_src);
-      // print_addr_ip_int(iphdr->ip_dst);
-      // The packet is the ACK packet
-      if(has_connect == NULL){
-        // fprintf(stderr, "No Connection! \n");
-        sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
+  uint8_t* packet = pk->data;
+  unsigned int len = pk->len;
+  struct  sr_ip_hdr* iphdr = sr_pkt_ip(pk);
+  struct  sr_tcp_hdr*     tcphdr = (struct sr_tcp_hdr*)sr_pkt_l4(pk);
+
+  // TCP packet from internal -> nat, it needs its ports
+  if(!(pk->flags & SR_PKT_L4)){
+    return;
+  }
+  if(sr_handlepacket_natfast(sr, pk, nat_dir_out) == 0){
+    return;
+  }
+  struct sr_nat_mapping mapping;
+  struct sr_nat_mapping* entry = 0;
+  if(sr_nat_lookup_internal(sr->routing_nat, iphdr->ip_src, pk->sport, nat_mapping_tcp, &mapping) == 0){
+    entry = &mapping;
+  }
+  if(pk->tcp_flags & SR_TCP_SYN){
+    // The packet initiate the SYN from inside 
+    if(entry == NULL){
+      if(sr_nat_insert_mapping(sr->routing_nat, iphdr->ip_src, tcphdr->tcp_src, nat_mapping_tcp, &mapping) != 0){
         return;
       }
-      if((has_connect->state == nat_connection_building)&&(!tcphdr->tcp_syn)&&(tcphdr->tcp_ack)){
-        has_connect->state = nat_connection_established;
-      }
-      has_connect->last_updated = time(NULL);
-      tcphdr->tcp_src = htons(entry->aux_ext);
-      iphdr->ip_src = entry->ip_ext;
-      sr_handlepacket_forwarding(sr, packet, len, interface, 1);
+      entry = &mapping;
+    }
+    if(!sr_nat_lookup_connection(sr->routing_nat, entry, iphdr->ip_dst)){
+      sr_nat_insert_connection(sr->routing_nat, entry, iphdr->ip_dst, nat_connection_building);
+    }
+    tcphdr->tcp_src = htons(entry->aux_ext); 
+    iphdr->ip_src = entry->ip_ext;
+    // tcphdr->tcp_check = htons(0);
+    // tcphdr->tcp_check = cksum_tcp(packet, len, tcphdr);
+    sr_handlepacket_forwarding(sr, pk, interface, 1);
+    return;
+  }else{
+    if(entry == NULL){
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
       return;
     }
-  
-/*      fprintf(stderr, "*******************Data*************\n")
-      if(entry == NULL){
-        fprintf(stderr, "No Entry -- Data.\n");
-        sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-        return;
-      }else{
-        unsigned has_connect = 0;
-        has_connect = sr_nat_lookup_connection(entry, iphdr->ip_src, iphdr->ip_dst, nat_connection_established, 0);
-
-      fprintf(stderr, "lookup connection -- Data: ");
-      print_addr_ip_int(iphdr->ip_src);
-      print_addr_ip_int(iphdr->ip_dst);
-      // The packet is the ACK packet
-      if(!has_connect){
-        fprintf(stderr, "No Connection -- Data! \n");
-        sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-        return;
-      }
-      tcphdr->tcp_src = htons(entry->aux_ext);
-      iphdr->ip_src = entry->ip_ext;
-      sr_handlepacket_forwarding(sr, packet, len, interface, 1);
+    sr_nat_connection_state state = (pk->tcp_flags & SR_TCP_ACK) ?
+      nat_connection_established : nat_connection_building;
+    
+    fprintf(stderr, "lookup connection: ");
+    // print_addr_ip_int(iphdr->ip_src);
+    // print_addr_ip_int(iphdr->ip_dst);
+    // The packet is the ACK packet
+    if(sr_nat_touch_connection(sr->routing_nat, entry, iphdr->ip_dst, state) != 0){
+      // fprintf(stderr, "No Connection! \n");
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
       return;
-      }  */
-  }else{
-    // TCP packet from external, forward directly
-    sr_handlepacket_forwarding(sr, packet, len, interface, 0);
+    }
+    tcphdr->tcp_src = htons(entry->aux_ext);
+    iphdr->ip_src = entry->ip_ext;
+    sr_handlepacket_forwarding(sr, pk, interface, 1);
+    return;
   }
+
+/*      fprintf(stderr, "*******************Data*************\n")
+    if(entry == NULL){
+      fprintf(stderr, "No Entry -- Data.\n");
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
+      return;
+    }else{
+      unsigned has_connect = 0;
+      has_connect = sr_nat_lookup_connection(entry, iphdr->ip_src, iphdr->ip_dst, nat_connection_established, 0);
+
+    fprintf(stderr, "lookup connection -- Data: ");
+    print_addr_ip_int(iphdr->ip_src);
+    print_addr_ip_int(iphdr->ip_dst);
+    // The packet is the ACK packet
+    if(!has_connect){
+      fprintf(stderr, "No Connection -- Data! \n");
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
+      return;
+    }
+    tcphdr->tcp_src = htons(entry->aux_ext);
+    iphdr->ip_src = entry->ip_ext;
+    sr_handlepacket_forwarding(sr, packet, len, interface, 1);
+    return;
+    }  */
   return;
 } 
 
-/* function used to create a ethernet hdr for a packet
+/* Tool function: build the rewrite for direction dir of the mapping from
+   the packet, before it is translated. Resolves the route and the nexthop
+   MAC; returns -1 if the MAC is not in the arp cache yet, the slow path then
+   queues the packet on an arp request. */
+int sr_nat_build_rewrite(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        sr_nat_dir dir,
+        struct sr_nat_mapping* mapping,
+        struct sr_nat_rewrite* rw)
+{
+  struct  sr_ip_hdr* iphdr = (struct sr_ip_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
+  uint32_t dst = (dir == nat_dir_out) ? iphdr->ip_dst : mapping->ip_int;
+
+  /* read before the lookup: a route changed meanwhile leaves the rewrite
+     stale, and the next packet builds it again */
+  uint32_t fib_gen = sr_fib_gen(sr);
+  struct sr_fib_nh* nh = sr_fib_lookup(sr_fib_deref(sr->fib), dst);
+  if(nh == NULL){
+    return -1;
+  }
+  uint32_t adj = sr_fib_nh_adj(sr, nh);
+  if(adj >= SR_ADJ_MAX){
+    return -1;
+  }
+
+  memset(rw, 0, sizeof(struct sr_nat_rewrite));
+  if(dir == nat_dir_out){
+    rw->old_ip = iphdr->ip_src;
+    rw->new_ip = mapping->ip_ext;
+  }else{
+    rw->old_ip = iphdr->ip_dst;
+    rw->new_ip = mapping->ip_int;
+  }
+  if(iphdr->ip_p == ip_protocol_icmp){
+    rw->old_aux = htons((dir == nat_dir_out) ? mapping->aux_int : mapping->aux_ext);
+    rw->new_aux = htons((dir == nat_dir_out) ? mapping->aux_ext : mapping->aux_int);
+  }else{
+    /* the internal tcp port is kept in network order */
+    rw->old_aux = (dir == nat_dir_out) ? mapping->aux_int : htons(mapping->aux_ext);
+    rw->new_aux = (dir == nat_dir_out) ? htons(mapping->aux_ext) : mapping->aux_int;
+  }
+  rw->ip_delta = cksum_delta32(0, rw->old_ip, rw->new_ip);
+  rw->l4_delta = cksum_delta16(0, rw->old_aux, rw->new_aux);
+  if(iphdr->ip_p == 6){
+    // the tcp checksum covers the addresses in the pseudo header
+    rw->l4_delta = cksum_delta32(rw->l4_delta, rw->old_ip, rw->new_ip);
+  }
+  rw->dst = dst;
+  rw->adj = adj;
+  rw->fib_gen = fib_gen;
+  return 0;
+}
+
+/* NAT fast path, first half: find the rewrite cached on the mapping of the
+   established flow the TCP or ICMP packet belongs to, and where in the
+   packet it goes. One nat lookup, no mallocs. Returns -1 if the packet has
+   to take the slow path (new or closing flows, a rewrite that cannot be
+   built before the next hop is resolved, ttl expiry). */
+int sr_natfast_lookup(struct sr_instance* sr,
+        struct sr_pkt* pk/* lent */,
+        sr_nat_dir dir,
+        struct sr_natfast* fast)
+{
+  uint8_t* packet = pk->data;
+  struct  sr_ip_hdr* iphdr = sr_pkt_ip(pk);
+  uint8_t* l4hdr = sr_pkt_l4(pk);
+  sr_nat_mapping_type type;
+  uint16_t* aux_n;
+
+  if((iphdr->ip_ttl <= 1) || !(pk->flags & SR_PKT_L4)){
+    return -1;
+  }
+  if(pk->ip_proto == ip_protocol_tcp){
+    if(pk->tcp_flags & SR_TCP_SYN){
+      return -1;
+    }
+    type = nat_mapping_tcp;
+    aux_n = (uint16_t*)(l4hdr + ((dir == nat_dir_out) ? offsetof(struct sr_tcp_hdr, tcp_src) :
+                                                        offsetof(struct sr_tcp_hdr, tcp_dest)));
+    fast->l4_sum = (uint16_t*)(l4hdr + offsetof(struct sr_tcp_hdr, tcp_check));
+  }else if(pk->ip_proto == ip_protocol_icmp){
+    type = nat_mapping_icmp;
+    aux_n = (uint16_t*)(l4hdr + sizeof(struct sr_icmp_hdr));
+    fast->l4_sum = (uint16_t*)(l4hdr + offsetof(struct sr_icmp_hdr, icmp_sum));
+  }else{
+    return -1;
+  }
+  fast->dir = dir;
+  fast->aux_n = aux_n;
+
+  /* the internal tcp port is the key as is, icmp ids and external ports
+     are keyed in host order */
+  uint16_t aux = ((dir == nat_dir_out) && (type == nat_mapping_tcp)) ? *aux_n : ntohs(*aux_n);
+  uint32_t old_ip = (dir == nat_dir_out) ? iphdr->ip_src : iphdr->ip_dst;
+  uint32_t peer = (dir == nat_dir_out) ? iphdr->ip_dst : iphdr->ip_src;
+  struct sr_nat_mapping mapping;
+  if(sr_nat_lookup_rewrite(sr->routing_nat, dir, old_ip, aux, type, peer, &mapping, &fast->rw) != 0){
+    return -1;
+  }
+  uint32_t dst = (dir == nat_dir_out) ? iphdr->ip_dst : mapping.ip_int;
+  /* a reload or route change since the rewrite was built may have moved
+     its next hop */
+  if((fast->rw.dst != dst) || (fast->rw.fib_gen != sr_fib_gen(sr)) ||
+     (fast->rw.old_ip != old_ip) || (fast->rw.old_aux != *aux_n)){
+    if(sr_nat_build_rewrite(sr, packet, dir, &mapping, &fast->rw) != 0){
+      return -1;
+    }
+    sr_nat_set_rewrite(sr->routing_nat, &mapping, dir, &fast->rw);
+  }
+  return 0;
+}
+
+/* NAT fast path, second half: apply the rewrite sr_natfast_lookup found.
+   The ttl decrement goes into the ip checksum delta, no full checksums. */
+void sr_natfast_apply(struct sr_pkt* pk/* lent */,
+        struct sr_natfast* fast)
+{
+  struct  sr_ip_hdr* iphdr = sr_pkt_ip(pk);
+  uint16_t* ttl_word = (uint16_t*)((uint8_t*)iphdr + offsetof(struct sr_ip_hdr, ip_ttl));
+  uint16_t ttl_old = *ttl_word;
+  iphdr->ip_ttl--;
+  if(fast->dir == nat_dir_out){
+    iphdr->ip_src = fast->rw.new_ip;
+    sr_stats_count(sr_stat_nat_out);
+  }else{
+    iphdr->ip_dst = fast->rw.new_ip;
+    sr_stats_count(sr_stat_nat_in);
+  }
+  iphdr->ip_sum = cksum_adjust(iphdr->ip_sum, cksum_delta16(fast->rw.ip_delta, ttl_old, *ttl_word));
+  *fast->aux_n = fast->rw.new_aux;
+  *fast->l4_sum = cksum_adjust(*fast->l4_sum, fast->rw.l4_delta);
+}
+
+/* NAT fast path: translate a TCP or ICMP packet of an established flow with
+   the rewrite cached on its mapping and send it. Returns 0 if the packet was
+   sent, -1 if it has to take the slow path (new or closing flows, arp
+   misses, ttl expiry). */
+int sr_handlepacket_natfast(struct sr_instance* sr,
+        struct sr_pkt* pk/* lent */,
+        sr_nat_dir dir)
+{
+  struct sr_natfast fast;
+  if(sr_natfast_lookup(sr, pk, dir, &fast) != 0){
+    return -1;
+  }
+
+  /* the next hop's ethernet header goes on first: an unresolved next hop
+     leaves the rest of the packet to the slow path untouched */
+  struct sr_if* egress = sr_adj_write_hdr(&sr->cache, fast.rw.adj, pk->data);
+  if(egress == NULL){
+    return -1;
+  }
+  sr_natfast_apply(pk, &fast);
+  sr_lat_mark(sr_lat_nat, pk->t_in);
+  sr_send_packet(sr, pk->data, pk->len, egress->name);
+  sr_stats_count(sr_stat_forwarded);
+  return 0;
+}
+
+/* function used to create a ethernet hdr for a packet at reply_ehdr, usually
+  in a packet buffer; reply_ehdr must not overlap ehdr
   if ehdr is not NULL, the function copy ehdr into the new ethernet hdr and modify it
   based on input shost, dhost and type (if any of them is NULL, keep what is there in ehdr)
   if ehdr is NULL, create the new hdr according to shost, dhost and type */
-struct sr_ethernet_hdr* create_eth_hdr(struct sr_ethernet_hdr* ehdr, uint8_t* shost, uint8_t* dhost, uint16_t type){
-  struct sr_ethernet_hdr* reply_ehdr = 0;
-  reply_ehdr = (struct sr_ethernet_hdr*) malloc(sizeof(struct sr_ethernet_hdr));
-  
+struct sr_ethernet_hdr* create_eth_hdr(struct sr_ethernet_hdr* reply_ehdr, struct sr_ethernet_hdr* ehdr, uint8_t* shost, uint8_t* dhost, uint16_t type){
   if(ehdr){
     memcpy(reply_ehdr, ehdr, sizeof(struct sr_ethernet_hdr));
   }
@@ -433,14 +803,12 @@ struct sr_ethernet_hdr* create_eth_hdr(struct sr_ethernet_hdr* ehdr, uint8_t* sh
   return reply_ehdr;
 }
 
-/* function used to create an ip hdr for a packet
+/* function used to create an ip hdr for a packet at reply_iphdr
   if iphdr is not NULL, the function copy iphdr into the new ip hdr and modify it
   based on input information (if any of them is NULL, keep what is there in iphdr)
   if iphdr is NULL, create the new hdr according to input parameters 
   ip_src, ip_dst, ip_p and ip_ttl are required parameters */
-struct sr_ip_hdr* create_ip_hdr(struct sr_ip_hdr* iphdr, uint32_t ip_src, uint32_t ip_dst, uint8_t ip_p, uint8_t ip_ttl){
-  struct sr_ip_hdr* reply_iphdr = 0;
-  reply_iphdr = (struct sr_ip_hdr*) malloc(sizeof(struct sr_ip_hdr));
+struct sr_ip_hdr* create_ip_hdr(struct sr_ip_hdr* reply_iphdr, struct sr_ip_hdr* iphdr, uint32_t ip_src, uint32_t ip_dst, uint8_t ip_p, uint8_t ip_ttl){
   if(iphdr){
     memcpy(reply_iphdr, iphdr, sizeof(struct sr_ip_hdr));
   }
@@ -453,13 +821,11 @@ struct sr_ip_hdr* create_ip_hdr(struct sr_ip_hdr* iphdr, uint32_t ip_src, uint32
   return reply_iphdr;
 }
 
-/* function used to create an arp hdr for a packet
+/* function used to create an arp hdr for a packet at reply_ahdr
   if ahdr is not NULL, the function copy ahdr into the new arp hdr and modify it
   based on input information (if any of them is NULL, keep what is there in iphdr)
   if ahdr is NULL, create the new hdr according to input parameters */
-struct sr_arp_hdr* create_arp_hdr(struct sr_arp_hdr* ahdr, uint16_t ar_op, uint8_t* ar_sha, uint32_t ar_sip, uint8_t* ar_tha, uint32_t ar_tip, uint16_t ar_hrd, uint16_t ar_pro, uint8_t ar_hln, uint8_t ar_pln){
-  struct sr_arp_hdr* reply_ahdr = 0;
-  reply_ahdr = (struct sr_arp_hdr*) malloc(sizeof(struct sr_arp_hdr));
+struct sr_arp_hdr* create_arp_hdr(struct sr_arp_hdr* reply_ahdr, struct sr_arp_hdr* ahdr, uint16_t ar_op, uint8_t* ar_sha, uint32_t ar_sip, uint8_t* ar_tha, uint32_t ar_tip, uint16_t ar_hrd, uint16_t ar_pro, uint8_t ar_hln, uint8_t ar_pln){
   if(ahdr){
     memcpy(reply_ahdr, ahdr, sizeof(struct sr_arp_hdr));
   }
@@ -479,15 +845,13 @@ struct sr_arp_hdr* create_arp_hdr(struct sr_arp_hdr* ahdr, uint16_t ar_op, uint8
   return reply_ahdr;
 }
 
-/* function used to create an icmp hdr for a packet
+/* function used to create an icmp hdr for a packet at reply_icmphdr
   if icmphdr is not NULL, the function copy icmphdr into the new icmp hdr and modify it
   based on input information (if any of them is NULL, keep what is there in icmphdr)
   if icmphdr is NULL, create the new hdr according to input parameters 
   type and code are required input*/
-struct sr_icmp_hdr* create_icmp_hdr(struct sr_icmp_hdr* icmphdr, uint8_t type, uint8_t code){
-  struct sr_icmp_hdr* reply_icmphdr = 0;
+struct sr_icmp_hdr* create_icmp_hdr(struct sr_icmp_hdr* reply_icmphdr, struct sr_icmp_hdr* icmphdr, uint8_t type, uint8_t code){
   size_t icmp_len = sizeof(struct sr_icmp_hdr);
-  reply_icmphdr = (struct sr_icmp_hdr *)malloc(icmp_len);
   if(icmphdr){
     memcpy(reply_icmphdr, icmphdr, icmp_len);
   }
@@ -498,89 +862,111 @@ struct sr_icmp_hdr* create_icmp_hdr(struct sr_icmp_hdr* icmphdr, uint8_t type, u
   return reply_icmphdr;
 }
 
-/* handle packet for icmp echo request and reply */
+/* Tool function: turn the echo request pk into its reply in place. The
+   addresses are swapped, which leaves the ip checksum as it is; the ttl and
+   the icmp type are rewritten and both checksums patched for them. The
+   reply goes without ip options: the headers move up over them, and pk
+   then describes the reply. */
+void sr_icmp_echo_inplace(struct sr_pkt* pk/* lent */)
+{
+  struct  sr_ethernet_hdr* ehdr = sr_pkt_eth(pk);
+  struct  sr_ip_hdr*       iphdr = sr_pkt_ip(pk);
+  struct  sr_icmp_hdr*     icmphdr = (struct sr_icmp_hdr*)sr_pkt_l4(pk);
+  uint16_t* ttl_word = (uint16_t*)((uint8_t*)iphdr + offsetof(struct sr_ip_hdr, ip_ttl));
+  uint16_t* type_word = (uint16_t*)sr_pkt_l4(pk);
+  unsigned int opt = sr_pkt_iphl(pk) - sizeof(struct sr_ip_hdr);
+  uint8_t mac[ETHER_ADDR_LEN];
+  uint32_t ip;
+  uint16_t old;
+
+  memcpy(mac, ehdr->ether_dhost, ETHER_ADDR_LEN);
+  memcpy(ehdr->ether_dhost, ehdr->ether_shost, ETHER_ADDR_LEN);
+  memcpy(ehdr->ether_shost, mac, ETHER_ADDR_LEN);
+  ip = iphdr->ip_src;
+  iphdr->ip_src = iphdr->ip_dst;
+  iphdr->ip_dst = ip;
+  old = *ttl_word;
+  iphdr->ip_ttl = 61;
+  iphdr->ip_sum = cksum_adjust(iphdr->ip_sum, cksum_delta16(0, old, *ttl_word));
+  old = *type_word;
+  icmphdr->icmp_type = 0;
+  icmphdr->icmp_code = 0;
+  icmphdr->icmp_sum = cksum_adjust(icmphdr->icmp_sum, cksum_delta16(0, old, *type_word));
+
+  if(opt){
+    memmove(pk->data + opt, pk->data, sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+    pk->data += opt;
+    pk->l4_off -= opt;
+    pk->flags &= ~SR_PKT_OPT;
+    iphdr = sr_pkt_ip(pk);
+    iphdr->ip_hl = 5;
+    iphdr->ip_len = htons(sizeof(struct sr_ip_hdr) + pk->l4_len);
+    iphdr->ip_sum = htons(0);
+    iphdr->ip_sum = cksum(iphdr, sizeof(struct sr_ip_hdr));
+  }
+  // ethernet padding is left out
+  pk->len = pk->l4_off + pk->l4_len;
+  sr_stats_count(sr_stat_echo);
+}
+
+/* handle an icmp echo request to the router: the reply is the request,
+   rewritten in place and sent back; other icmp to the router is dropped */
 void sr_handlepacket_icmpEcho(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
+        struct sr_pkt* pk/* lent */,
         char* interface/* lent */)
 {
-  struct  sr_ethernet_hdr* ehdr = (struct sr_ethernet_hdr *)packet;
-  struct  sr_ip_hdr*       iphdr = (struct sr_ip_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-  struct  sr_icmp_hdr*     icmphdr = (struct sr_icmp_hdr*)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
-  
-  // the icmp is the rest of the packet except ip and ethernet hdr
-  size_t  icmp_len = len - sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr);  
+  /* from outside through the nat it goes to sr_handlepacket_icmpEcho_nat
+     instead */
+  if(!(pk->flags & SR_PKT_L4) || (pk->icmp_type != 8)){
+    return;
+  }
+  sr_icmp_echo_inplace(pk);
+  sr_send_packet(sr, pk->data, pk->len, interface);
+}
 
-  /* create a new reply packet */
-  uint8_t* reply_pkt = 0;
-  struct sr_ethernet_hdr* reply_ehdr = 0;
-  struct sr_ip_hdr* reply_iphdr = 0;
-  struct sr_icmp_hdr* reply_icmphdr = 0; 
-  
-  /* check if nat and handle nat */
-  if(sr->nat_enabled){
-    // if nat is enabled
-    if(strcmp(interface, "eth0") == 0){
-      // if the icmp request is from internal->router, reply directly
-      uint32_t ip_tmp = iphdr->ip_src;
-      iphdr->ip_src = iphdr->ip_dst;
-      iphdr->ip_dst = ip_tmp;
-    }else{
-      // if the icmp request is from external->router, check nat mapping
-      struct sr_nat_mapping* entry;
-      uint16_t icmp_id;
-      uint16_t* icmp_id_n = (uint16_t*)(icmphdr+sizeof(struct sr_icmp_hdr));
-      icmp_id = ntohs(*icmp_id_n);
-      // fprintf(stderr, "icmp ext->int Echo id: %d \n", icmp_id);
-      entry = sr_nat_lookup_external(sr->routing_nat, icmp_id, nat_mapping_icmp);
-      if(entry){
-        // found entry, change into internal ip and send packet
-        iphdr->ip_dst = entry->ip_int;
-        strncpy(interface, "eth0", 4);
-        *icmp_id_n = htons(entry->aux_int);
-	// recalculate the cksum
-        icmphdr->icmp_sum = htons(0);
-        icmphdr->icmp_sum = cksum(icmphdr, icmp_len);
-        iphdr->ip_sum = htons(0);
-        iphdr->ip_sum = cksum(iphdr, sizeof(struct sr_ip_hdr));
-	
-	      sr_handlepacket_forwarding(sr, packet, len, interface, 0);
-  	    return;
-      }else{
-        // cannot find entry, send icmp unreachable pkt
-        sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-        return;
-      }
-    }
+/* handle an icmp echo request from external->router: the nat mapping of its
+   id forwards it to the internal node */
+void sr_handlepacket_icmpEcho_nat(struct sr_instance* sr,
+        struct sr_pkt* pk/* lent */,
+        char* interface/* lent */)
+{
+  uint8_t* packet = pk->data;
+  unsigned int len = pk->len;
+  struct  sr_ip_hdr*       iphdr = sr_pkt_ip(pk);
+  struct  sr_icmp_hdr*     icmphdr = (struct sr_icmp_hdr*)sr_pkt_l4(pk);
+  size_t  icmp_len = pk->l4_len;
+
+  if(sr_handlepacket_natfast(sr, pk, nat_dir_in) == 0){
+    return;
+  }
+  if(!(pk->flags & SR_PKT_L4)){
+    return;
+  }
+  struct sr_nat_mapping mapping;
+  struct sr_nat_mapping* entry = &mapping;
+  uint16_t icmp_id;
+  uint16_t* icmp_id_n = (uint16_t*)((uint8_t*)icmphdr+sizeof(struct sr_icmp_hdr));
+  icmp_id = ntohs(pk->sport);
+  // fprintf(stderr, "icmp ext->int Echo id: %d \n", icmp_id);
+  if(sr_nat_lookup_external(sr->routing_nat, iphdr->ip_dst, icmp_id, nat_mapping_icmp, &mapping) == 0){
+    // found entry, change into internal ip and send packet
+    iphdr->ip_dst = entry->ip_int;
+    *icmp_id_n = htons(entry->aux_int);
+    // recalculate the cksum
+    icmphdr->icmp_sum = htons(0);
+    icmphdr->icmp_sum = cksum(icmphdr, icmp_len);
+    iphdr->ip_sum = htons(0);
+    iphdr->ip_sum = cksum(iphdr, sr_pkt_iphl(pk));
+
+    sr_stats_count(sr_stat_nat_in);
+    sr_lat_mark(sr_lat_nat, pk->t_in);
+    sr_handlepacket_forwarding(sr, pk, interface, 0);
+    return;
   }else{
-    // if nat is not enabled, reply icmp request directly
-    uint32_t ip_tmp = iphdr->ip_src;
-    iphdr->ip_src = iphdr->ip_dst;
-    iphdr->ip_dst = ip_tmp;
-
-  }  
-
-  /* create the ethernet hdr, ip hdr and icmp hdr for reply packet */
-  reply_ehdr = create_eth_hdr(ehdr, ehdr->ether_dhost, ehdr->ether_shost, 0);
-  reply_iphdr = create_ip_hdr(iphdr, (uint32_t)iphdr->ip_src, (uint32_t)iphdr->ip_dst, 0x0001, 61);
-  reply_icmphdr = (struct sr_icmp_hdr*) malloc(icmp_len);
-  memcpy(reply_icmphdr, icmphdr, icmp_len);
-  /* change icmp type into reply */
-  reply_icmphdr->icmp_type = htons(0);
-  reply_icmphdr->icmp_code = htons(0);
-  
-  /* recalculate icmp cksum for the reply packet */
-  reply_icmphdr->icmp_sum = htons(0);
-  reply_icmphdr->icmp_sum = cksum(reply_icmphdr, icmp_len);
-  
-  reply_pkt =  (uint8_t*) malloc(len);
-  memcpy(reply_pkt, (uint8_t*) reply_ehdr, sizeof(struct sr_ethernet_hdr));
-  memcpy(reply_pkt+sizeof(sr_ethernet_hdr_t), (uint8_t*) reply_iphdr,sizeof(struct sr_ip_hdr));
-  memcpy(reply_pkt+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t), (uint8_t*) reply_icmphdr, icmp_len);
-  
-  sr_send_packet(sr, reply_pkt, len, interface);
-    
-  return; 
+    // cannot find entry, send icmp unreachable pkt
+    sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
+    return;
+  }
 }
 
 /* handle packet for icmp unreachable and icmp time exceeded */
@@ -593,96 +979,145 @@ void sr_handlepacket_icmpUnreachable(struct sr_instance* sr,
 {
   struct  sr_ethernet_hdr* ehdr = (struct sr_ethernet_hdr *)packet;
   struct  sr_ip_hdr*       iphdr = (struct sr_ip_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-  uint8_t*  ipload = (uint8_t*)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+  // no error about an icmp error (RFC 1122 3.2.2), so one the router
+  // cannot route back does not make another
+  if((iphdr->ip_p == ip_protocol_icmp) &&
+     (len > sizeof(struct sr_ethernet_hdr) + iphdr->ip_hl * 4)){
+    uint8_t icmp_type = packet[sizeof(struct sr_ethernet_hdr) + iphdr->ip_hl * 4];
+    if((icmp_type == 3) || (icmp_type == 4) || (icmp_type == 5) ||
+       (icmp_type == 11) || (icmp_type == 12)){
+      return;
+    }
+  }
+  // errors are rate limited, see sr_icmplim.h; a suppressed one is not
+  // built at all
+  if(!sr_icmplim_allow(&(sr->icmplim), type, code, iphdr->ip_src)){
+    return;
+  }
+  // the old ip hdr is quoted with its options, if the packet has them all
+  unsigned int iphl = iphdr->ip_hl * 4;
+  if((iphl < sizeof(struct sr_ip_hdr)) || (len < sizeof(struct sr_ethernet_hdr) + iphl + 8)){
+    iphl = sizeof(struct sr_ip_hdr);
+  }
+  uint8_t*  ipload = (uint8_t*)(packet + sizeof(struct sr_ethernet_hdr) + iphl);
   
   /*  The reply packet has ethernet hdr + ip hdr + icmp hdr + 
       4B reserved space + old ip hdr + 8B ip payload */
   uint8_t* reply_pkt = 0;
-  struct sr_ethernet_hdr* reply_ehdr = 0;
-  struct sr_ip_hdr* reply_iphdr = 0;
   uint8_t* reply_icmphdr = 0;
   // Calculate the total length of the icmp packet
-  unsigned int icmp_len = sizeof(struct sr_icmp_hdr)+4*sizeof(uint8_t)+sizeof(struct sr_ip_hdr)+8*sizeof(uint8_t);
-  iphdr->ip_len = htons(sizeof(struct sr_ip_hdr) + icmp_len);
+  unsigned int icmp_len = sizeof(struct sr_icmp_hdr)+4*sizeof(uint8_t)+iphl+8*sizeof(uint8_t);
 
   // lenth is the total length of the reply packet
   size_t lenth = sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr) + icmp_len;
-  reply_ehdr = create_eth_hdr(ehdr, ehdr->ether_dhost, ehdr->ether_shost, 0);
-  reply_iphdr = create_ip_hdr(iphdr, (uint32_t)iphdr->ip_dst, (uint32_t)iphdr->ip_src, 0x0001, 61);
+  struct sr_pbuf* pb = sr_pbuf_alloc(sr_pbuf_local(&sr->pbufs), lenth);
+  if(pb == NULL){
+    fprintf(stderr, "No packet buffer for the icmp error, dropped.\n");
+    return;
+  }
+  sr_stats_count(sr_stat_icmp_error);
+  reply_pkt = sr_pbuf_data(pb);
+  create_eth_hdr((struct sr_ethernet_hdr*)reply_pkt, ehdr, ehdr->ether_dhost, ehdr->ether_shost, 0);
+  struct sr_ip_hdr* reply_iphdr = create_ip_hdr((struct sr_ip_hdr*)(reply_pkt+sizeof(sr_ethernet_hdr_t)), iphdr, (uint32_t)iphdr->ip_dst, (uint32_t)iphdr->ip_src, 0x0001, 61);
+  // the reply has no ip options and a length of its own; the packet is
+  // lent and keeps its header as it is
+  reply_iphdr->ip_hl = 5;
+  reply_iphdr->ip_len = htons(sizeof(struct sr_ip_hdr) + icmp_len);
+  reply_iphdr->ip_sum = htons(0);
+  reply_iphdr->ip_sum = cksum(reply_iphdr, sizeof(struct sr_ip_hdr));
   //print_hdr_ip((uint8_t*)reply_iphdr);
-  reply_pkt =  (uint8_t*) malloc(lenth);
-  memcpy(reply_pkt, (uint8_t*) reply_ehdr, sizeof(struct sr_ethernet_hdr));
-  memcpy(reply_pkt+sizeof(sr_ethernet_hdr_t), (uint8_t*) reply_iphdr, sizeof(struct sr_ip_hdr));
-  reply_icmphdr = (uint8_t*) malloc(icmp_len);
+  reply_icmphdr = reply_pkt+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t);
   struct sr_icmp_hdr* reply_icmphdr_sec = (struct sr_icmp_hdr*)reply_icmphdr;
   reply_icmphdr_sec->icmp_type = type;
   reply_icmphdr_sec->icmp_code = code;
   reply_icmphdr_sec->icmp_sum = htons(0);
   // set the 4B reserved space
   memset(reply_icmphdr+sizeof(struct sr_icmp_hdr), 0, 4);
-  // set the old ip hdr
-  iphdr = (struct sr_ip_hdr*)(packet+sizeof(struct sr_ethernet_hdr));
-  iphdr->ip_sum = htons(0);
-  iphdr->ip_sum = cksum(iphdr, sizeof(struct sr_ip_hdr));
-  memcpy(reply_icmphdr+sizeof(struct sr_icmp_hdr)+4*sizeof(uint8_t), iphdr, sizeof(struct sr_ip_hdr));
+  // set the old ip hdr, summed again in the copy since the nat may have
+  // rewritten it
+  struct sr_ip_hdr* quoted = (struct sr_ip_hdr*)(reply_icmphdr+sizeof(struct sr_icmp_hdr)+4*sizeof(uint8_t));
+  memcpy(quoted, iphdr, iphl);
+  quoted->ip_sum = htons(0);
+  quoted->ip_sum = cksum(quoted, iphl);
   // set the 8B of the old ip payload
-  memcpy(reply_icmphdr+sizeof(struct sr_icmp_hdr)+4*sizeof(uint8_t)+sizeof(struct sr_ip_hdr), ipload, 8*sizeof(uint8_t));
+  memcpy(reply_icmphdr+sizeof(struct sr_icmp_hdr)+4*sizeof(uint8_t)+iphl, ipload, 8*sizeof(uint8_t));
   // calculate the new cksum
   reply_icmphdr_sec->icmp_sum = cksum(reply_icmphdr, icmp_len);
-  memcpy(reply_pkt+sizeof(sr_ethernet_hdr_t)+sizeof(sr_ip_hdr_t), (uint8_t*) reply_icmphdr, icmp_len);
   
-  sr_handlepacket_forwarding(sr, reply_pkt, lenth, interface, 0);
+  struct sr_pkt reply;
+  sr_pkt_parse(&reply, reply_pkt, lenth);
+  sr_handlepacket_forwarding(sr, &reply, interface, 0);
+  sr_pbuf_put(pb);
   return;
 }
 
 
+/* Tool function: check if the router should answer an arp request for ip
+   on the interface because ip is in the nat's external address pool. The
+   pool is announced on the outside only. */
+unsigned int sr_nat_pool_arp(struct sr_instance* sr, uint32_t ip, struct sr_if* iface){
+  if(iface->role != if_role_nat_outside){
+    return 0;
+  }
+  return sr_nat_pool_index(sr->routing_nat, ip) >= 0;
+}
+
 /* handle the arp request packets */
 void sr_handlepacket_arpreq(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
+        struct sr_pkt* pk/* lent */,
         char* interface/* lent */)
 {
-  struct  sr_ethernet_hdr* ehdr = (struct sr_ethernet_hdr *)packet;
-  struct  sr_arp_hdr*      ahdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
+  struct  sr_ethernet_hdr* ehdr = sr_pkt_eth(pk);
+  struct  sr_arp_hdr*      ahdr = sr_pkt_arp(pk);
   struct  sr_if* iface = sr_get_interface(sr, interface); 
   unsigned int lenth = sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr);
   uint8_t* reply_pkt = 0;
-  struct sr_ethernet_hdr* reply_ehdr = 0;
-  struct sr_arp_hdr* reply_ahdr = 0;
-  reply_ehdr = create_eth_hdr(ehdr, (uint8_t*)iface->addr, (uint8_t*)ehdr->ether_shost, 0);
+  struct sr_pbuf* pb = sr_pbuf_alloc(sr_pbuf_local(&sr->pbufs), lenth);
+  if(pb == NULL){
+    fprintf(stderr, "No packet buffer for the arp reply, dropped.\n");
+    return;
+  }
+  reply_pkt = sr_pbuf_data(pb);
+  create_eth_hdr((struct sr_ethernet_hdr*)reply_pkt, ehdr, (uint8_t*)iface->addr, (uint8_t*)ehdr->ether_shost, 0);
   uint16_t ar_op = htons(arp_op_reply);
   // create an arp reply packet
-  reply_ahdr = create_arp_hdr(ahdr, ar_op, (uint8_t*)iface->addr, ahdr->ar_tip, ahdr->ar_sha, ahdr->ar_sip, 0, 0, 0, 0);
+  create_arp_hdr((struct sr_arp_hdr*)(reply_pkt+sizeof(sr_ethernet_hdr_t)), ahdr, ar_op, (uint8_t*)iface->addr, ahdr->ar_tip, ahdr->ar_sha, ahdr->ar_sip, 0, 0, 0, 0);
   
-  reply_pkt =  (uint8_t*) malloc(len);
-  memcpy(reply_pkt, (uint8_t*) reply_ehdr, sizeof(sr_ethernet_hdr_t));
-  memcpy(reply_pkt+sizeof(sr_ethernet_hdr_t), (uint8_t*) reply_ahdr, sizeof(sr_arp_hdr_t));
   sr_send_packet(sr, reply_pkt, lenth, interface);
+  sr_stats_count(sr_stat_arp_request);
+  sr_pbuf_put(pb);
   return;
 }
 
 /* handle the arp reply packet */
 void sr_handlepacket_arpreply(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
+        struct sr_pkt* pk/* lent */,
         char* interface/* lent */)
 {
-  struct  sr_ethernet_hdr* ehdr = (struct sr_ethernet_hdr *)packet;
-  struct  sr_arp_hdr*       ahdr = (struct sr_arp_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-  uint8_t* reply_mac = 0;
+  struct  sr_ethernet_hdr* ehdr = sr_pkt_eth(pk);
+  struct  sr_arp_hdr*       ahdr = sr_pkt_arp(pk);
+  uint8_t* reply_mac = ehdr->ether_shost;
   uint32_t reply_ip = 0;
-  reply_mac = (uint8_t*)malloc(ETHER_ADDR_LEN*sizeof(uint8_t));
-  memcpy(reply_mac, ehdr->ether_shost, ETHER_ADDR_LEN);
   reply_ip = ahdr->ar_sip;
-  // Find the reqest corresponding to the arp reply
+  sr_stats_count(sr_stat_arp_reply);
+  // Find the reqest corresponding to the arp reply; the lock (recursive)
+  // keeps another thread off the request until it is destroyed
   struct sr_arpreq *req;
+  pthread_mutex_lock(&(sr->cache.lock));
   req = sr_arpcache_insert(&sr->cache, reply_mac, reply_ip);
   // debug_arpque_print(&sr->cache);
-  if (!req)
+  if (!req){
+    pthread_mutex_unlock(&(sr->cache.lock));
     return;
+  }
   struct sr_packet* pkt_walker = 0;
+  // the held packets are timed on their own, not as sends of this reply
+  uint64_t now = sr_lat_stamp();
+  sr_lat_in = 0;
   // Walk through the packet linked to the request, send them according to the arp reply
   for(pkt_walker = req->packets; pkt_walker != NULL; pkt_walker = pkt_walker->next){
+    sr_lat_record(sr_lat_arp_wait, pkt_walker->queued, now);
+    sr_lat_record(sr_lat_arp_send, pkt_walker->t_in, now);
     struct  sr_ethernet_hdr* pkt_ehdr = (struct sr_ethernet_hdr *)pkt_walker->buf;
     memcpy(pkt_ehdr->ether_dhost, reply_mac, ETHER_ADDR_LEN);
     memcpy(pkt_ehdr->ether_shost, ehdr->ether_dhost, ETHER_ADDR_LEN);
@@ -691,10 +1126,12 @@ void sr_handlepacket_arpreply(struct sr_instance* sr,
     // TTL reduce 1 and recalculate the checksum
     pkt_iphdr->ip_ttl = pkt_iphdr->ip_ttl - 1;
     pkt_iphdr->ip_sum = htons(0);
-    pkt_iphdr->ip_sum = cksum(pkt_iphdr, sizeof(struct sr_ip_hdr));
+    pkt_iphdr->ip_sum = cksum(pkt_iphdr, pkt_iphdr->ip_hl * 4);
     sr_send_packet(sr, (uint8_t*)pkt_walker->buf, pkt_walker->len, pkt_walker->iface);
   } 
+  sr_lat_in = pk->t_in;
   sr_arpreq_destroy(&sr->cache, req);
+  pthread_mutex_unlock(&(sr->cache.lock));
   return; 
 }
 
@@ -708,82 +1145,104 @@ void print_nat_ip(uint32_t address) {
 }
 
 void print_nat_mapping(struct sr_nat* nat){
-  struct sr_nat_mapping* map_walker = nat->mappings;
-  int counter = 0;
-  while(map_walker) {
+  uint32_t counter = 0;
+  for(counter = 0; counter < nat->map_slab.hwm; counter++) {
+	struct sr_nat_map_entry* map_walker = (struct sr_nat_map_entry*)sr_slab_at(&nat->map_slab, counter);
+	if(!map_walker->valid)
+	  continue;
 	// fprintf(stderr, "Entry: %d -------- \n ", counter);
 	print_nat_ip(map_walker->ip_int);
 	print_nat_ip(map_walker->ip_ext);
 	// fprintf(stderr, "icmp_id / port : %d  %d  \n", map_walker->aux_int, map_walker->aux_ext);
-  map_walker = map_walker->next;
   }
   return;
 }
 
-void sr_handle_forwardicmp_nat(struct sr_instance* sr,
-	struct sr_nat* nat, 
-	uint8_t * packet/* lent */,
-        unsigned int len,
-        char* interface/* lent */)
+/* ICMP query forwarded from the inside through the nat */
+void sr_handle_forwardicmp_nat_out(struct sr_instance* sr,
+	struct sr_pkt* pk/* lent */,
+	char* interface/* lent */)
 {
-	// fprintf(stderr, "Forwarding NAT. \n");
-	struct  sr_ip_hdr* iphdr = (struct sr_ip_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-	struct  sr_icmp_hdr*     icmphdr = (struct sr_icmp_hdr*)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
-	unsigned int icmp_len = len - sizeof(struct sr_ethernet_hdr) - sizeof(struct sr_ip_hdr);
-
-	if(strncmp(interface, "eth0", 4) == 0){
-	// the packet is internal -> external
-		struct sr_nat_mapping* entry;
-		uint16_t icmp_id;
-		uint16_t* icmp_id_n;
-		icmp_id_n = (uint16_t*)(icmphdr+sizeof(struct sr_icmp_hdr));
-                icmp_id = ntohs(*icmp_id_n);
-		fprintf(stderr, "icmp id: %d \n", icmp_id);
-                entry = sr_nat_lookup_internal(sr->routing_nat, iphdr->ip_src, icmp_id, nat_mapping_icmp);
-                if(entry){
-			*icmp_id_n = htons(entry->aux_ext);
-			// recalculate the cksum
-			icmphdr->icmp_sum = htons(0);
-			icmphdr->icmp_sum = cksum(icmphdr, icmp_len);
-		}else{
+	struct  sr_ip_hdr* iphdr = sr_pkt_ip(pk);
+	struct  sr_icmp_hdr*     icmphdr = (struct sr_icmp_hdr*)sr_pkt_l4(pk);
+	unsigned int icmp_len = pk->l4_len;
+
+	if(!(pk->flags & SR_PKT_L4)){
+		// no icmp id to translate
+		return;
+	}
+	if(sr_handlepacket_natfast(sr, pk, nat_dir_out) == 0){
+		return;
+	}
+	struct sr_nat_mapping mapping;
+	struct sr_nat_mapping* entry = &mapping;
+	uint16_t icmp_id;
+	uint16_t* icmp_id_n;
+	icmp_id_n = (uint16_t*)((uint8_t*)icmphdr+sizeof(struct sr_icmp_hdr));
+	icmp_id = ntohs(pk->sport);
+	fprintf(stderr, "icmp id: %d \n", icmp_id);
+	if(sr_nat_lookup_internal(sr->routing_nat, iphdr->ip_src, icmp_id, nat_mapping_icmp, &mapping) != 0){
 		// insert a new entry into nat mapping
-			entry = sr_nat_insert_mapping(sr->routing_nat, iphdr->ip_src, icmp_id, nat_mapping_icmp);
-			*icmp_id_n = htons(entry->aux_ext);
-                        // recalculate the cksum
-                        icmphdr->icmp_sum = htons(0);
-                        icmphdr->icmp_sum = cksum(icmphdr, icmp_len);
-
-			// fprintf(stderr, "New entry added to nat mapping. \n");
-      // print_nat_mapping(sr->routing_nat);
-		}
-		sr_handlepacket_forwarding(sr, packet, len, interface, 1);
-		/* FIXME: the ip and interface need to be found from routing table */	
-	}else{
-	// the packeet is external -> internal
-		struct sr_nat_mapping* entry;
-      		uint16_t icmp_id;
-		uint16_t* icmp_id_n;
-		icmp_id_n = (uint16_t*)(icmphdr+sizeof(struct sr_icmp_hdr));
-      		icmp_id = ntohs(*icmp_id_n);
-		fprintf(stderr, "icmp ext->int id: %d \n", icmp_id);
-      		entry = sr_nat_lookup_external(sr->routing_nat, icmp_id, nat_mapping_icmp);
-      		if(entry){
-		// found entry, change dst ip and icmp id
-        		iphdr->ip_dst = entry->ip_int;
-        		strncpy(interface, "eth0", 4);
-        		*icmp_id_n = htons(entry->aux_int);
-			// recalculate the cksum
-			icmphdr->icmp_sum = htons(0);
-                        icmphdr->icmp_sum = cksum(icmphdr, icmp_len);
-			iphdr->ip_sum = htons(0);
-                        iphdr->ip_sum = cksum(iphdr, sizeof(struct sr_ip_hdr));
-			// change the packet and send out to internal nodes
-			sr_send_packet(sr, packet, len, interface);	
-		}else{
-			sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
-		        return;
+		if(sr_nat_insert_mapping(sr->routing_nat, iphdr->ip_src, icmp_id, nat_mapping_icmp, &mapping) != 0){
+			return;
 		}
+		// print_nat_mapping(sr->routing_nat);
+	}
+	*icmp_id_n = htons(entry->aux_ext);
+	iphdr->ip_src = entry->ip_ext;
+	// recalculate the cksum
+	icmphdr->icmp_sum = htons(0);
+	icmphdr->icmp_sum = cksum(icmphdr, icmp_len);
+	sr_handlepacket_forwarding(sr, pk, interface, 1);
+	return;
+}
+
+/* ICMP reply forwarded from the outside through the nat */
+void sr_handle_forwardicmp_nat_in(struct sr_instance* sr,
+	struct sr_pkt* pk/* lent */,
+	char* interface/* lent */)
+{
+	uint8_t* packet = pk->data;
+	unsigned int len = pk->len;
+	struct  sr_ip_hdr* iphdr = sr_pkt_ip(pk);
+	struct  sr_icmp_hdr*     icmphdr = (struct sr_icmp_hdr*)sr_pkt_l4(pk);
+	unsigned int icmp_len = pk->l4_len;
+
+	if(!(pk->flags & SR_PKT_L4)){
+		// no icmp id to translate
+		return;
 	}
+	if(sr_handlepacket_natfast(sr, pk, nat_dir_in) == 0){
+		return;
+	}
+	struct sr_nat_mapping mapping;
+	struct sr_nat_mapping* entry = &mapping;
+	uint16_t icmp_id;
+	uint16_t* icmp_id_n;
+	icmp_id_n = (uint16_t*)((uint8_t*)icmphdr+sizeof(struct sr_icmp_hdr));
+	icmp_id = ntohs(pk->sport);
+	fprintf(stderr, "icmp ext->int id: %d \n", icmp_id);
+	if(sr_nat_lookup_external(sr->routing_nat, iphdr->ip_dst, icmp_id, nat_mapping_icmp, &mapping) != 0){
+		sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 3);
+		return;
+	}
+	// found entry, change dst ip and icmp id
+	iphdr->ip_dst = entry->ip_int;
+	*icmp_id_n = htons(entry->aux_int);
+	// recalculate the cksum
+	icmphdr->icmp_sum = htons(0);
+	icmphdr->icmp_sum = cksum(icmphdr, icmp_len);
+	iphdr->ip_sum = htons(0);
+	iphdr->ip_sum = cksum(iphdr, sr_pkt_iphl(pk));
+	// change the packet and send out to internal nodes, on the inside
+	// interface; the ingress name is lent and not written
+	if(sr->nat_inside == NULL){
+		return;
+	}
+	sr_lat_mark(sr_lat_nat, pk->t_in);
+	sr_send_packet(sr, packet, len, sr->nat_inside->name);
+	sr_stats_count(sr_stat_nat_in);
+	sr_stats_count(sr_stat_forwarded);
 	return;
 }
 
@@ -791,104 +1250,87 @@ void sr_handle_forwardicmp_nat(struct sr_instance* sr,
 
 /* handle the ip forwarding situation */ 
 void sr_handlepacket_forwarding(struct sr_instance* sr,
-        uint8_t * packet/* lent */,
-        unsigned int len,
+        struct sr_pkt* pk/* lent */,
         char* interface/* lent */, 
 	int nat_enabled)
 {
-  struct  sr_ip_hdr* iphdr = (struct sr_ip_hdr*)(packet + sizeof(struct sr_ethernet_hdr));
-  struct sr_rt* ip_match = 0;
-  // look up the routing table and find the entry with maximum prefix match
-  ip_match = rt_prefix_match(sr, iphdr->ip_dst);
-  // print_addr_ip_int(ntohl(iphdr->ip_dst));
-  // Get the nexthop ip and corresponding interface from the routing table
-  uint32_t nexthop_ip = ip_match->gw.s_addr;
-  // print_addr_ip_int(ntohl(nexthop_ip));
-  char nexthop_iface[sr_IFACE_NAMELEN];
-  memcpy(nexthop_iface, ip_match->interface, sr_IFACE_NAMELEN);
+  uint8_t* packet = pk->data;
+  unsigned int len = pk->len;
+  unsigned int iphl = sr_pkt_iphl(pk);
+  struct  sr_ip_hdr* iphdr = sr_pkt_ip(pk);
   if(nat_enabled){
-    struct sr_if* ext_intf = sr_get_interface(sr, nexthop_iface);
-    iphdr->ip_src = ext_intf->ip;
-	  // modify the ip address, recalculate the cksum
+    // the caller put the mapping's external address into ip_src,
+    // recalculate the cksum
 	  iphdr->ip_sum = htons(0);
-    iphdr->ip_sum = cksum(iphdr, sizeof(struct sr_ip_hdr));
+    iphdr->ip_sum = cksum(iphdr, iphl);
     
-    uint8_t ip_proto = ip_protocol(packet + sizeof(sr_ethernet_hdr_t));
-    if(ip_proto == 6){ // if TCP, need to modify tcp checksum
-      struct  sr_tcp_hdr*     tcphdr = (struct sr_tcp_hdr*)(packet + sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_ip_hdr));
+    if((pk->ip_proto == ip_protocol_tcp) && (pk->flags & SR_PKT_L4)){ // if TCP, need to modify tcp checksum
+      struct  sr_tcp_hdr*     tcphdr = (struct sr_tcp_hdr*)sr_pkt_l4(pk);
       tcphdr->tcp_check = htons(0);
       tcphdr->tcp_check = cksum_tcp(packet, len, tcphdr);
     }
-    
+    sr_stats_count(sr_stat_nat_out);
+    sr_lat_mark(sr_lat_nat, pk->t_in);
   }
-  uint8_t*  nexthop_mac = 0;
-  nexthop_mac = (uint8_t*)malloc(6*sizeof(unsigned char));
-  // lookup the nexthop_ip in the arp cache
-  struct sr_arpentry* arp_entry = sr_arpcache_lookup(&sr->cache, nexthop_ip);
-  struct sr_arpreq* arp_req = 0;
-  /* if the nexthop_ip is found in the arp cache
-  use it directly to generate the reply packet */
-  if(arp_entry){
-    memcpy(nexthop_mac, arp_entry->mac, 6);
-    uint8_t* reply_pkt;
-    reply_pkt = (uint8_t*)malloc(len);
-    memcpy(reply_pkt, packet, len);
-    struct  sr_ethernet_hdr* reply_ehdr = (struct sr_ethernet_hdr *)reply_pkt;
-    struct sr_if* if_struct = 0;
-    // The source address should be the MAC of the interface sending the packet
-    if_struct = sr_get_interface(sr, nexthop_iface);
-    memcpy(reply_ehdr->ether_shost, if_struct->addr, ETHER_ADDR_LEN);
-    memcpy(reply_ehdr->ether_dhost, nexthop_mac, ETHER_ADDR_LEN);
-    reply_ehdr->ether_type = htons(ethertype_ip);
-    // print_hdr_eth((uint8_t*)reply_ehdr);
-    struct  sr_ip_hdr*       pkt_iphdr = (struct sr_ip_hdr*)(reply_pkt + sizeof(struct sr_ethernet_hdr));
+  struct sr_if* egress = 0;
+  // look up the forwarding table and find the entry with maximum prefix match
+  struct sr_fib_nh* nh = sr_fib_lookup(sr_fib_deref(sr->fib), iphdr->ip_dst);
+  if(nh == NULL){
+    // no route: net unreachable, unless the source is already translated
+    if(!nat_enabled){
+      sr_handlepacket_icmpUnreachable(sr, packet, len, interface, 3, 0);
+    }
+    return;
+  }
+  sr_lat_mark(sr_lat_lookup, pk->t_in);
+  // print_addr_ip_int(ntohl(iphdr->ip_dst));
+  // Get the nexthop ip and corresponding interface from the forwarding table
+  uint32_t nexthop_ip = nh->gw;
+  // print_addr_ip_int(ntohl(nexthop_ip));
+  char nexthop_iface[sr_IFACE_NAMELEN];
+  memcpy(nexthop_iface, nh->interface, sr_IFACE_NAMELEN);
+  /* counted when routed, sent now or held for ARP */
+  sr_stats_count(sr_stat_forwarded);
+  /* the route's adjacency holds the whole ethernet header for the next hop:
+  if it is resolved the header is copied over the packet in place and the
+  packet is sent (from the arp cache, if the adjacency table is full) */
+  egress = sr_fib_nh_write_hdr(sr, nh, packet);
+  if(egress){
+    struct  sr_ip_hdr*       pkt_iphdr = iphdr;
     // TTL reduce 1 and recalculate the checksum
     pkt_iphdr->ip_ttl = pkt_iphdr->ip_ttl - 1;
     pkt_iphdr->ip_sum = htons(0);
-    pkt_iphdr->ip_sum = cksum(pkt_iphdr, sizeof(struct sr_ip_hdr));
-    sr_send_packet(sr, (uint8_t*)reply_pkt, len, nexthop_iface);
-  /* if the nexthop_ip is not found in the arp cache
+    pkt_iphdr->ip_sum = cksum(pkt_iphdr, iphl);
+    sr_send_packet(sr, packet, len, egress->name);
+  /* if the nexthop_ip is not resolved yet
   add a new entry into the arp reqest queue and send the arp request packet */
   }else{
-    arp_req = sr_arpcache_queuereq(&sr->cache, nexthop_ip, packet, len, nexthop_iface);
-    sr_arpreq_handlereq(sr, arp_req);   
+    sr_handlepacket_arpqueue(sr, packet, len, nexthop_ip, nexthop_iface);
   }    
   return;
 }
 /* end sr_ForwardPacket */
 
-/* the function used to find the maximum prefix matching from the routing table */
-struct sr_rt* rt_prefix_match(struct sr_instance* sr, uint32_t ip_addr){
-  struct sr_rt* rt_walker = 0;
-  struct sr_rt* largest_prefix_entry = 0;
-  uint32_t largest_prefix = 0;
-  
-  rt_walker = sr->routing_table;
-  while(rt_walker){
-    uint32_t prefix_rt = 0, prefix_in = 0;
-    // AND the input ip and the dest ip in the routing table with the mask
-    prefix_rt = rt_walker->mask.s_addr & rt_walker->dest.s_addr;
-    prefix_in = rt_walker->mask.s_addr & ip_addr;
-    
-    // fprintf(stderr, "Print:routing table:\n");
-    // print_addr_ip_int(ntohl(prefix_rt));
-    // print_addr_ip_int(ntohl(prefix_in));
- 
-    // check if the prefix is the same
-    if(prefix_rt == prefix_in){
-      // if there isn't any prefix match found, record it
-      if(!largest_prefix_entry){
-          largest_prefix = prefix_rt;
-          largest_prefix_entry = rt_walker;
-      // if there are some prefix matches found, check if the new one is the longest
-      }else if(prefix_rt > largest_prefix){
-          largest_prefix = prefix_rt;
-          largest_prefix_entry = rt_walker;
-      }
-    }
-    rt_walker = rt_walker->next;
+/* Tool function: keep a packet whose next hop is not resolved yet on the
+   arp request for it, and send the request */
+void sr_handlepacket_arpqueue(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        uint32_t nexthop_ip,
+        char* nexthop_iface)
+{
+  struct sr_pbuf* pb = 0;
+  uint8_t* held = sr_pbuf_hold(&sr->pbufs, packet, len, &pb);
+  if(held == NULL){
+    fprintf(stderr, "No packet buffer to queue the packet for arp, dropped.\n");
+    return;
   }
-  return largest_prefix_entry;
+  /* the request may be answered or given up on another thread (workers,
+  the tick) as soon as the lock is let go, so it is held across both */
+  pthread_mutex_lock(&(sr->cache.lock));
+  struct sr_arpreq* arp_req = sr_arpcache_queuereq(&sr->cache, nexthop_ip, held, pb, len, nexthop_iface);
+  sr_arpreq_handlereq(sr, arp_req);
+  pthread_mutex_unlock(&(sr->cache.lock));
 }
 
 /* function handle arp request */
@@ -903,6 +1345,7 @@ void sr_arpreq_handlereq(struct sr_instance* sr,
       struct sr_packet* pkt_walker = 0;
       for(pkt_walker = arp_req->packets; pkt_walker != NULL; pkt_walker = pkt_walker->next){
         sr_handlepacket_icmpUnreachable(sr, pkt_walker->buf, pkt_walker->len, pkt_walker->iface, 3, 3);
+        sr_stats_count(sr_stat_dropped);
       }
       sr_arpreq_destroy(&sr->cache, arp_req);
     }else{
@@ -918,15 +1361,13 @@ void sr_arpreq_handlereq(struct sr_instance* sr,
 void sr_arpreq_sendreq(struct sr_instance* sr,
                       struct sr_arpreq* arp_req)
 {
-  uint8_t* eth_shost;
-  uint8_t* eth_dhost;
+  uint8_t eth_shost[ETHER_ADDR_LEN];
+  uint8_t eth_dhost[ETHER_ADDR_LEN];
   char iface[sr_IFACE_NAMELEN];
   memcpy(iface, arp_req->packets->iface, sr_IFACE_NAMELEN);
   struct sr_if* if_struct = 0;
   if_struct = sr_get_interface(sr, iface);
   // create the ethernet hdr
-  eth_shost = (uint8_t*)malloc(ETHER_ADDR_LEN*sizeof(uint8_t));
-  eth_dhost = (uint8_t*)malloc(ETHER_ADDR_LEN*sizeof(uint8_t));
   memcpy(eth_shost, if_struct->addr, ETHER_ADDR_LEN);
   memset(eth_dhost, 0xff, ETHER_ADDR_LEN);
   uint16_t eth_type = htons(ethertype_arp);
@@ -935,15 +1376,18 @@ void sr_arpreq_sendreq(struct sr_instance* sr,
   uint32_t ar_sip = if_struct->ip;
   uint32_t ar_tip = arp_req->ip;  
   uint8_t* reply_pkt = 0;
-  struct sr_ethernet_hdr* reply_ehdr = 0;
-  struct sr_arp_hdr* reply_ahdr = 0;
-  reply_ehdr = create_eth_hdr(NULL, (uint8_t*)eth_shost, (uint8_t*)eth_dhost, eth_type);
-  reply_ahdr = create_arp_hdr(NULL, ar_op, (uint8_t*)eth_shost, ar_sip, (uint8_t*)eth_dhost, ar_tip, htons(1), htons(0x800), 0, 0);
   unsigned int lenth = sizeof(struct sr_ethernet_hdr) + sizeof(struct sr_arp_hdr);
-  reply_pkt =  (uint8_t*) malloc(lenth);
-  memcpy(reply_pkt, (uint8_t*) reply_ehdr, sizeof(sr_ethernet_hdr_t));
-  memcpy(reply_pkt+sizeof(sr_ethernet_hdr_t), (uint8_t*) reply_ahdr, sizeof(sr_arp_hdr_t));
+  struct sr_pbuf* pb = sr_pbuf_alloc(sr_pbuf_local(&sr->pbufs), lenth);
+  if(pb == NULL){
+    fprintf(stderr, "No packet buffer for the arp request, not sent.\n");
+    return;
+  }
+  reply_pkt = sr_pbuf_data(pb);
+  create_eth_hdr((struct sr_ethernet_hdr*)reply_pkt, NULL, (uint8_t*)eth_shost, (uint8_t*)eth_dhost, eth_type);
+  create_arp_hdr((struct sr_arp_hdr*)(reply_pkt+sizeof(sr_ethernet_hdr_t)), NULL, ar_op, (uint8_t*)eth_shost, ar_sip, (uint8_t*)eth_dhost, ar_tip, htons(1), htons(0x800), 0, 0);
   sr_send_packet(sr, reply_pkt, lenth, iface);
+  sr_stats_count(sr_stat_arp_sent);
+  sr_pbuf_put(pb);
   return;
 }
 
@@ -15,6 +15,10 @@
 
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
+#include "sr_nat.h"
+#include "sr_pbuf.h"
+#include "sr_fib.h"
+#include "sr_icmplim.h"
 
 /* we dont like this debug , but what to do for varargs ? */
 #ifdef _DEBUG_
@@ -33,6 +37,10 @@
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_graph;
+struct sr_workers;
+struct sr_punt;
+struct sr_pkt;
 
 struct vns_filter {
   struct in_addr addr;
@@ -58,18 +66,32 @@ struct sr_instance
   int  nat_icmp_timeout;
   int  nat_tcp_estab_timeout;
   int  nat_tcp_transit_timeout;
+  uint32_t nat_pool[SR_NAT_POOL_MAX]; /* external addresses given with -x */
+  uint32_t nat_pool_sz;
 
   char user[32]; /* user name */
   char host[32]; /* host name */
   char template[30]; /* template name if any */
+  char rtable[256]; /* file the routing table was loaded from */
   unsigned short topo_id;
   struct sockaddr_in sr_addr; /* address to server */
   struct vns_filter *filter_list; /* address filter */
   struct sr_if* if_list; /* list of interfaces */
-  struct sr_rt* routing_table; /* routing table */
+  struct sr_rt* routing_table; /* routing table, the RIB */
+  struct sr_fib* fib; /* forwarding table compiled from it, see sr_fib.h */
+  uint32_t fib_gen; /* bumped each time the FIB's routes change */
   struct sr_nat* routing_nat; /* nat mapping */
   struct sr_arpcache cache;   /* ARP cache */
-  pthread_attr_t attr;
+  struct sr_io* io; /* packet phase socket backend, see sr_io.h */
+  struct sr_pbuf_pool pbufs; /* packet buffers, see sr_pbuf.h */
+  struct sr_graph* graph; /* vector packet path, see sr_graph.h; NULL
+                             handles every packet on its own */
+  struct sr_workers* workers; /* worker threads, see sr_worker.h; NULL
+                                 handles every packet on the loop */
+  struct sr_punt* punt; /* slow path thread, see sr_punt.h; NULL handles
+                           exceptions where they are found */
+  struct sr_icmplim icmplim; /* ICMP error rate limit, see sr_icmplim.h */
+  struct sr_if* nat_inside; /* set by sr_init_roles */
   FILE* logfile;
 };
 
@@ -89,30 +111,55 @@ int sr_verify_routing_table(struct sr_instance* sr);
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_handle_server_msg(struct sr_instance* , uint8_t* , uint32_t , int );
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
+void sr_nat_default_pool(struct sr_instance* );
+void sr_init_roles(struct sr_instance* );
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
-void sr_handlepacket_icmpEcho(struct sr_instance* , uint8_t * , unsigned int , char*);
+void sr_handlepacket_pkt(struct sr_instance* , struct sr_pkt* , char* );
+void sr_handlepacket_slow(struct sr_instance* , struct sr_pkt* , char* );
+void sr_handlepacket_icmpEcho(struct sr_instance* , struct sr_pkt* , char*);
+void sr_icmp_echo_inplace(struct sr_pkt* );
+void sr_handlepacket_icmpEcho_nat(struct sr_instance* , struct sr_pkt* , char*);
 void sr_handlepacket_icmpUnreachable(struct sr_instance* , uint8_t * , unsigned int , char*, uint8_t, uint8_t);
-void sr_handlepacket_arpreq(struct sr_instance* , uint8_t * , unsigned int , char* );
-void sr_handlepacket_arpreply(struct sr_instance* , uint8_t * , unsigned int , char* );
+void sr_handlepacket_arpreq(struct sr_instance* , struct sr_pkt* , char* );
+void sr_handlepacket_arpreply(struct sr_instance* , struct sr_pkt* , char* );
 
 uint16_t cksum_tcp(uint8_t* pkt, uint16_t len, struct sr_tcp_hdr* tcphdr);
-void sr_handlepacket_tcp(struct sr_instance*, uint8_t *, unsigned int, char*);
-
-void sr_handle_forwardicmp_nat(struct sr_instance*, struct sr_nat* , uint8_t * , unsigned int , char*);
-void sr_handle_forwardtcp_nat(struct sr_instance*, uint8_t * , unsigned int , char*);
-void sr_handlepacket_forwarding(struct sr_instance* , uint8_t * , unsigned int , char*, int );
+void sr_handlepacket_tcp(struct sr_instance*, struct sr_pkt*, char*);
+
+void sr_handle_forwardicmp_nat_out(struct sr_instance*, struct sr_pkt* , char*);
+void sr_handle_forwardicmp_nat_in(struct sr_instance*, struct sr_pkt* , char*);
+void sr_handle_forwardtcp_nat(struct sr_instance*, struct sr_pkt* , char*);
+void sr_handlepacket_forwarding(struct sr_instance* , struct sr_pkt* , char*, int );
+int sr_nat_build_rewrite(struct sr_instance*, uint8_t *, sr_nat_dir, struct sr_nat_mapping*, struct sr_nat_rewrite*);
+int sr_handlepacket_natfast(struct sr_instance*, struct sr_pkt*, sr_nat_dir);
+void sr_handlepacket_arpqueue(struct sr_instance*, uint8_t *, unsigned int, uint32_t, char*);
+
+/* The NAT fast path in two halves, so the graph (sr_graph.h) can resolve
+   the next hop in between: sr_natfast_lookup finds the rewrite of the
+   packet's established flow, the adjacency to send it to is rw.adj, and
+   sr_natfast_apply translates the packet. */
+struct sr_natfast
+{
+  sr_nat_dir dir;
+  struct sr_nat_rewrite rw;
+  uint16_t* aux_n;  /* the port or icmp id rewritten */
+  uint16_t* l4_sum; /* the tcp or icmp checksum */
+};
+int sr_natfast_lookup(struct sr_instance*, struct sr_pkt*, sr_nat_dir, struct sr_natfast*);
+void sr_natfast_apply(struct sr_pkt*, struct sr_natfast*);
 
-struct sr_ethernet_hdr* create_eth_hdr(struct sr_ethernet_hdr*, uint8_t*, uint8_t*, uint16_t);
-struct sr_ip_hdr* create_ip_hdr(struct sr_ip_hdr*, uint32_t, uint32_t, uint8_t, uint8_t);
-struct sr_arp_hdr* create_arp_hdr(struct sr_arp_hdr*, uint16_t, uint8_t*, uint32_t, uint8_t*, uint32_t, uint16_t, uint16_t, uint8_t, uint8_t);
-struct sr_icmp_hdr* create_icmp_hdr(struct sr_icmp_hdr*, uint8_t, uint8_t);
-struct sr_rt* rt_prefix_match(struct sr_instance*, uint32_t);
+struct sr_ethernet_hdr* create_eth_hdr(struct sr_ethernet_hdr*, struct sr_ethernet_hdr*, uint8_t*, uint8_t*, uint16_t);
+struct sr_ip_hdr* create_ip_hdr(struct sr_ip_hdr*, struct sr_ip_hdr*, uint32_t, uint32_t, uint8_t, uint8_t);
+struct sr_arp_hdr* create_arp_hdr(struct sr_arp_hdr*, struct sr_arp_hdr*, uint16_t, uint8_t*, uint32_t, uint8_t*, uint32_t, uint16_t, uint16_t, uint8_t, uint8_t);
+struct sr_icmp_hdr* create_icmp_hdr(struct sr_icmp_hdr*, struct sr_icmp_hdr*, uint8_t, uint8_t);
 void sr_arpreq_handlereq(struct sr_instance*, struct sr_arpreq*);
 void sr_arpreq_sendreq(struct sr_instance*, struct sr_arpreq*);
 unsigned int sr_ip_equal(struct sr_instance*, uint32_t);
+unsigned int sr_nat_pool_arp(struct sr_instance*, uint32_t, struct sr_if*);
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
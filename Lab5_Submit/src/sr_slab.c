@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "sr_slab.h"
+
+/* Initialize the slab, every object starts on the free stack. Returns 0 on
+   success. */
+int sr_slab_init(struct sr_slab *slab, uint32_t obj_size, uint32_t capacity) {
+  assert(slab);
+  assert(obj_size > 0);
+
+  memset(slab, 0, sizeof(struct sr_slab));
+  void *objs = NULL;
+  if (posix_memalign(&objs, 64, (size_t)obj_size * capacity) != 0)
+    return -1;
+  slab->free_stk = (uint32_t *)malloc(sizeof(uint32_t) * capacity);
+  if (slab->free_stk == NULL) {
+    free(objs);
+    return -1;
+  }
+  memset(objs, 0, (size_t)obj_size * capacity);
+  slab->objs = (uint8_t *)objs;
+  slab->obj_size = obj_size;
+  slab->capacity = capacity;
+
+  /* push in reverse so that index 0 is popped first */
+  uint32_t i;
+  for (i = 0; i < capacity; i++) {
+    slab->free_stk[i] = capacity - 1 - i;
+  }
+  slab->nfree = capacity;
+  slab->hwm = 0;
+  return 0;
+}
+
+void sr_slab_destroy(struct sr_slab *slab) {
+  free(slab->objs);
+  free(slab->free_stk);
+  slab->objs = NULL;
+  slab->free_stk = NULL;
+  slab->nfree = 0;
+  slab->capacity = 0;
+  slab->hwm = 0;
+}
+
+uint32_t sr_slab_alloc_dirty(struct sr_slab *slab) {
+  if (slab->nfree == 0)
+    return SR_SLAB_NIL;
+
+  uint32_t idx = slab->free_stk[--slab->nfree];
+  if (idx >= slab->hwm)
+    slab->hwm = idx + 1;
+  return idx;
+}
+
+uint32_t sr_slab_alloc(struct sr_slab *slab) {
+  uint32_t idx = sr_slab_alloc_dirty(slab);
+  if (idx != SR_SLAB_NIL)
+    memset(sr_slab_at(slab, idx), 0, slab->obj_size);
+  return idx;
+}
+
+void sr_slab_free(struct sr_slab *slab, uint32_t idx) {
+  assert(idx < slab->capacity);
+  assert(slab->nfree < slab->capacity);
+  slab->free_stk[slab->nfree++] = idx;
+}
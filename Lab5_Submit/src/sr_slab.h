@@ -0,0 +1,57 @@
+/* This file defines a slab: a fixed-capacity pool of equally sized objects
+   allocated once, up front, in one contiguous block. Objects are named by
+   32-bit indices rather than pointers, so tables built on top of a slab can
+   link their entries with 4-byte indices instead of 8-byte next pointers,
+   and neighbouring entries share cache lines instead of being scattered
+   across the heap.
+
+   Free objects are kept on a stack of indices. The stack is filled so the
+   lowest indices are handed out first, which keeps the used part of the
+   slab dense; 'hwm' records one past the highest index ever handed out so
+   a periodic sweep only needs to scan [0, hwm).
+
+   A slab does no locking of its own; the owner of the slab is expected to
+   hold its own lock around alloc and free. */
+
+#ifndef SR_SLAB_H
+#define SR_SLAB_H
+
+#include <inttypes.h>
+
+#define SR_SLAB_NIL 0xffffffffu
+
+struct sr_slab {
+  uint8_t  *objs;       /* capacity * obj_size bytes, cache line aligned */
+  uint32_t *free_stk;   /* indices of free objects */
+  uint32_t  nfree;      /* number of entries on free_stk */
+  uint32_t  hwm;        /* one past the highest index ever handed out */
+  uint32_t  capacity;
+  uint32_t  obj_size;
+};
+
+/* Allocates the backing memory for 'capacity' objects of 'obj_size' bytes.
+   All objects start zeroed. Returns 0 on success. */
+int  sr_slab_init(struct sr_slab *slab, uint32_t obj_size, uint32_t capacity);
+
+/* Frees the backing memory. Indices handed out become invalid. */
+void sr_slab_destroy(struct sr_slab *slab);
+
+/* Returns the index of a free object, or SR_SLAB_NIL if the slab is full.
+   The object is zeroed. */
+uint32_t sr_slab_alloc(struct sr_slab *slab);
+
+/* As sr_slab_alloc, but the object is not zeroed. For large objects the
+   caller fills in anyway. */
+uint32_t sr_slab_alloc_dirty(struct sr_slab *slab);
+
+/* Returns an object to the slab. */
+void sr_slab_free(struct sr_slab *slab, uint32_t idx);
+
+/* Number of objects currently handed out. */
+#define sr_slab_used(slab) ((slab)->capacity - (slab)->nfree)
+
+/* Address of the object at 'idx'. */
+#define sr_slab_at(slab, idx) \
+  ((void *)((slab)->objs + (size_t)(idx) * (slab)->obj_size))
+
+#endif
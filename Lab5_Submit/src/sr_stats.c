@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sr_stats.h"
+#include "sr_router.h"
+#include "sr_if.h"
+
+static const char *sr_stat_names[SR_STAT_PATHS] = {
+  [sr_stat_forwarded]   = "forwarded",
+  [sr_stat_nat_out]     = "nat-out",
+  [sr_stat_nat_in]      = "nat-in",
+  [sr_stat_echo]        = "echo",
+  [sr_stat_arp_request] = "arp-request",
+  [sr_stat_arp_reply]   = "arp-reply",
+  [sr_stat_arp_sent]    = "arp-sent",
+  [sr_stat_icmp_error]  = "icmp-error",
+  [sr_stat_dropped]     = "dropped",
+};
+
+__thread struct sr_stats_thread *sr_stats_tls;
+
+/* the blocks handed out, published in order; never freed, a thread's
+   counts outlive it */
+static struct sr_stats_thread *sr_stats_threads[SR_STATS_THREADS];
+static uint32_t sr_stats_nthreads;
+
+/* the block the threads past SR_STATS_THREADS share; their counts can
+   race, so they are only about right */
+static struct sr_stats_thread sr_stats_shared;
+
+struct sr_stats_thread *sr_stats_register(void) {
+  struct sr_stats_thread *t = NULL;
+  uint32_t slot = __atomic_fetch_add(&sr_stats_nthreads, 1, __ATOMIC_RELAXED);
+
+  if ((slot < SR_STATS_THREADS) &&
+      (posix_memalign((void **)&t, 64, sizeof(*t)) == 0)) {
+    memset(t, 0, sizeof(*t));
+    __atomic_store_n(&(sr_stats_threads[slot]), t, __ATOMIC_RELEASE);
+  } else {
+    t = &sr_stats_shared;
+  }
+  sr_stats_tls = t;
+  return t;
+}
+
+/* Tool function: adds the counters of t to sum */
+static void sr_stats_sum_one(struct sr_stats_thread *sum,
+                             struct sr_stats_thread *t) {
+  int i;
+  for (i = 0; i < SR_STATS_IFACES; i++) {
+    sum->ifs[i].rx_pkts += __atomic_load_n(&(t->ifs[i].rx_pkts), __ATOMIC_RELAXED);
+    sum->ifs[i].rx_bytes += __atomic_load_n(&(t->ifs[i].rx_bytes), __ATOMIC_RELAXED);
+    sum->ifs[i].tx_pkts += __atomic_load_n(&(t->ifs[i].tx_pkts), __ATOMIC_RELAXED);
+    sum->ifs[i].tx_bytes += __atomic_load_n(&(t->ifs[i].tx_bytes), __ATOMIC_RELAXED);
+  }
+  for (i = 0; i < SR_STAT_PATHS; i++) {
+    sum->paths[i] += __atomic_load_n(&(t->paths[i]), __ATOMIC_RELAXED);
+  }
+}
+
+void sr_stats_sum(struct sr_stats_thread *sum) {
+  uint32_t n = __atomic_load_n(&sr_stats_nthreads, __ATOMIC_RELAXED);
+  uint32_t i;
+
+  memset(sum, 0, sizeof(*sum));
+  if (n > SR_STATS_THREADS) {
+    n = SR_STATS_THREADS;
+  }
+  for (i = 0; i < n; i++) {
+    /* a slot taken and not published yet has counted nothing */
+    struct sr_stats_thread *t = __atomic_load_n(&(sr_stats_threads[i]), __ATOMIC_ACQUIRE);
+    if (t) {
+      sr_stats_sum_one(sum, t);
+    }
+  }
+  sr_stats_sum_one(sum, &sr_stats_shared);
+}
+
+void sr_stats_print(struct sr_instance *sr) {
+  struct sr_stats_thread sum;
+  struct sr_if *ifp;
+  int i;
+
+  sr_stats_sum(&sum);
+  for (ifp = sr->if_list; ifp; ifp = ifp->next) {
+    struct sr_stats_if *s = &(sum.ifs[(ifp->idx < SR_STATS_IFACES) ? ifp->idx : SR_STATS_IFACES - 1]);
+    fprintf(stderr, "stats: %s rx %" PRIu64 " pkts %" PRIu64 " bytes, tx %"
+            PRIu64 " pkts %" PRIu64 " bytes\n", ifp->name, s->rx_pkts,
+            s->rx_bytes, s->tx_pkts, s->tx_bytes);
+  }
+  fprintf(stderr, "stats:");
+  for (i = 0; i < SR_STAT_PATHS; i++) {
+    fprintf(stderr, " %s %" PRIu64 "%s", sr_stat_names[i], sum.paths[i],
+            (i < SR_STAT_PATHS - 1) ? "," : "\n");
+  }
+}
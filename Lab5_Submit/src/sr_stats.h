@@ -0,0 +1,104 @@
+/* This file defines the packet counters: frames and bytes received and sent
+   per interface, and packets per path through the router (forwarded,
+   translated, answered, generated, dropped).
+
+   Each thread that counts gets a block of counters of its own, on its own
+   cache lines, the first time it counts; only that thread writes it, so a
+   count is a plain add with no lock and no atomic read-modify-write, and
+   the threads never share a line. A reader sums the blocks of every thread
+   without a lock. Each counter is stored and loaded whole, so a sum may
+   lag a packet or two behind but is never torn.
+
+   The counters are always on. Suppressed ICMP errors (sr_icmplim.h) and
+   exceptions dropped over their quota (sr_punt.h) are counted there. */
+
+#ifndef SR_STATS_H
+#define SR_STATS_H
+
+#include <inttypes.h>
+#include "sr_if.h"
+
+#define SR_STATS_IFACES  16  /* interfaces counted, later ones share the last */
+#define SR_STATS_THREADS 64  /* threads with a block; later ones share one */
+
+/* the paths through the router */
+typedef enum {
+  sr_stat_forwarded,    /* forwarded, translated or not */
+  sr_stat_nat_out,      /* translated inside to outside */
+  sr_stat_nat_in,       /* translated outside to inside */
+  sr_stat_echo,         /* echo requests to the router answered */
+  sr_stat_arp_request,  /* ARP requests for the router answered */
+  sr_stat_arp_reply,    /* ARP replies received */
+  sr_stat_arp_sent,     /* ARP requests sent */
+  sr_stat_icmp_error,   /* ICMP errors sent */
+  sr_stat_dropped,      /* filtered, malformed, bad checksum, or given up
+                           on waiting for ARP */
+  SR_STAT_PATHS
+} sr_stat_path;
+
+struct sr_stats_if {
+  uint64_t rx_pkts;
+  uint64_t rx_bytes;
+  uint64_t tx_pkts;
+  uint64_t tx_bytes;
+};
+
+struct sr_stats_thread {
+  struct sr_stats_if ifs[SR_STATS_IFACES];
+  uint64_t paths[SR_STAT_PATHS];
+} __attribute__((aligned(64)));
+
+struct sr_instance;
+
+extern __thread struct sr_stats_thread *sr_stats_tls;
+
+/* Gives the calling thread its block; use sr_stats_local. */
+struct sr_stats_thread *sr_stats_register(void);
+
+/* The calling thread's block. */
+static inline struct sr_stats_thread *sr_stats_local(void) {
+  struct sr_stats_thread *t = sr_stats_tls;
+  return t ? t : sr_stats_register();
+}
+
+/* Tool function: only the owner writes c, so it is added to and stored
+   whole rather than incremented atomically. */
+static inline void sr_stats_add(uint64_t *c, uint64_t v) {
+  __atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+/* Counts n packets on path. */
+static inline void sr_stats_count_n(sr_stat_path path, uint64_t n) {
+  sr_stats_add(&(sr_stats_local()->paths[path]), n);
+}
+
+static inline void sr_stats_count(sr_stat_path path) {
+  sr_stats_count_n(path, 1);
+}
+
+/* Tool function: the counters of interface ifp */
+static inline struct sr_stats_if *sr_stats_if(const struct sr_if *ifp) {
+  uint32_t i = (ifp->idx < SR_STATS_IFACES) ? ifp->idx : SR_STATS_IFACES - 1;
+  return &(sr_stats_local()->ifs[i]);
+}
+
+/* Counts a frame of len bytes received on, or sent out of, ifp. */
+static inline void sr_stats_rx(const struct sr_if *ifp, uint32_t len) {
+  struct sr_stats_if *s = sr_stats_if(ifp);
+  sr_stats_add(&(s->rx_pkts), 1);
+  sr_stats_add(&(s->rx_bytes), len);
+}
+
+static inline void sr_stats_tx(const struct sr_if *ifp, uint32_t len) {
+  struct sr_stats_if *s = sr_stats_if(ifp);
+  sr_stats_add(&(s->tx_pkts), 1);
+  sr_stats_add(&(s->tx_bytes), len);
+}
+
+/* Sums every thread's counters into sum, without a lock. */
+void sr_stats_sum(struct sr_stats_thread *sum);
+
+/* Prints the sums, per interface of sr and per path, to stderr. */
+void sr_stats_print(struct sr_instance *sr);
+
+#endif /* SR_STATS_H */
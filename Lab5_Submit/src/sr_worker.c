@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+
+#include "sr_worker.h"
+#include "sr_router.h"
+#include "sr_pkt.h"
+#include "sr_pbuf.h"
+#include "sr_ring.h"
+#include "sr_graph.h"
+#include "sr_rcu.h"
+#include "sr_io.h"
+#include "sr_punt.h"
+
+/* a received packet, I/O thread to worker */
+struct sr_worker_rx {
+  struct sr_pkt pk;             /* data points into pb */
+  struct sr_pbuf *pb;           /* the reference the worker puts */
+};
+
+/* a packet to send, worker to I/O thread */
+struct sr_worker_tx {
+  struct sr_pbuf *pb;           /* the reference the I/O thread puts */
+  const void *cmd;              /* the server command, in pb */
+  uint32_t len;
+};
+
+struct sr_worker {
+  struct sr_ring rx;
+  struct sr_ring tx;
+  struct sr_workers *ws;
+  unsigned int id;
+  pthread_t thread;
+  int efd;                      /* wakes the worker up */
+  int sleeping;                 /* set while it waits on efd */
+  int started;
+  struct sr_pbuf_pool pbufs;    /* what the worker builds */
+  struct sr_graph *graph;       /* NULL with -P scalar */
+
+  /* counters, the I/O thread's and the worker's on lines of their own */
+  uint64_t queued __attribute__((aligned(64)));
+  uint64_t dropped;             /* no packet buffer */
+  uint64_t stalls;              /* waits for a buffer or ring slot */
+  uint64_t wakeups;
+  uint64_t sent;
+  uint64_t handled __attribute__((aligned(64)));
+  uint64_t batches;
+  uint64_t sleeps;
+  uint64_t tx_waits;            /* send ring full */
+  uint64_t tx_dropped;          /* and stayed full */
+};
+
+struct sr_workers {
+  struct sr_instance *sr;
+  unsigned int n;
+  int running;
+  int efd;                      /* wakes the I/O thread up */
+  int tx_kicked;                /* efd written and not read yet */
+  struct sr_worker *w;
+};
+
+static __thread struct sr_worker *sr_worker_tls;
+
+/* Tool function: the worker for the packet, by its 5-tuple */
+static inline unsigned int sr_worker_pick(const struct sr_workers *ws,
+                                          const struct sr_pkt *pk) {
+  if (!(pk->flags & SR_PKT_IP))
+    return 0;
+
+  const struct sr_ip_hdr *iphdr = sr_pkt_ip(pk);
+  uint32_t h = iphdr->ip_src;
+  h = (h * 0x9e3779b1u) ^ iphdr->ip_dst;
+  h = (h * 0x9e3779b1u) ^ pk->ip_proto;
+  /* every fragment has to take the first one's way */
+  if ((pk->flags & SR_PKT_L4) && !(ntohs(iphdr->ip_off) & IP_MF))
+    h = (h * 0x9e3779b1u) ^ (((uint32_t)pk->sport << 16) | pk->dport);
+  h *= 0x9e3779b1u;
+  h ^= h >> 16;
+  /* the range reduction needs no division */
+  return (unsigned int)(((uint64_t)h * ws->n) >> 32);
+}
+
+/* Tool function: add n to a counter of the calling thread's own. The
+   store is atomic, so the loop can read it while the worker runs */
+static inline void sr_worker_count(uint64_t *c, uint64_t n) {
+  __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+/* Tool function: read a worker's counter from another thread */
+static inline uint64_t sr_worker_counter(const uint64_t *c) {
+  return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/* Tool function: write 1 to an eventfd */
+static inline void sr_worker_kick(int efd) {
+  uint64_t one = 1;
+  if (write(efd, &one, sizeof(one)) != sizeof(one))
+    perror("write(..):sr_worker.c::sr_worker_kick");
+}
+
+/* Tool function: tell the I/O thread there is something to send, unless
+   it was told already */
+static void sr_worker_kick_tx(struct sr_workers *ws) {
+  if (__atomic_exchange_n(&(ws->tx_kicked), 1, __ATOMIC_ACQ_REL) == 0)
+    sr_worker_kick(ws->efd);
+}
+
+/* Tool function: handle up to one vector of received packets; returns how
+   many */
+static uint32_t sr_worker_batch(struct sr_instance *sr, struct sr_worker *w) {
+  struct sr_worker_rx m;
+  uint32_t n = 0;
+
+  sr_graph_begin(sr);
+  while ((n < SR_GRAPH_VEC) && (sr_ring_pop(&(w->rx), &m) == 0)) {
+    sr_handlepacket_pkt(sr, &(m.pk), m.pk.ifp->name);
+    /* the graph took a reference of its own */
+    sr_pbuf_put(m.pb);
+    n++;
+  }
+  sr_graph_end(sr);
+  return n;
+}
+
+static void *sr_worker_main(void *arg) {
+  struct sr_worker *w = (struct sr_worker *)arg;
+  struct sr_workers *ws = w->ws;
+  struct sr_instance *sr = ws->sr;
+
+  sr_worker_tls = w;
+  sr_pbuf_bind(&(w->pbufs));
+  sr_graph_bind(w->graph);
+  sr_rcu_register();
+
+  while (__atomic_load_n(&(ws->running), __ATOMIC_ACQUIRE)) {
+    uint64_t sent = w->sent;
+    uint32_t n = sr_worker_batch(sr, w);
+    if (n > 0) {
+      sr_worker_count(&(w->handled), n);
+      sr_worker_count(&(w->batches), 1);
+      if (w->sent != sent)
+        sr_worker_kick_tx(ws);
+      sr_rcu_quiescent();
+      continue;
+    }
+
+    /* out of packets: sleep until the I/O thread queues one. The flag is
+       set before the ring is looked at again, so either the I/O thread
+       sees it or this sees the packet */
+    __atomic_store_n(&(w->sleeping), 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!sr_ring_empty(&(w->rx)) &&
+        __atomic_exchange_n(&(w->sleeping), 0, __ATOMIC_SEQ_CST))
+      continue;
+    /* a sleeping reader would hold up the FIB's reclamation */
+    sr_rcu_unregister();
+    uint64_t v;
+    if (read(w->efd, &v, sizeof(v)) < 0)
+      perror("read(..):sr_worker.c::sr_worker_main");
+    sr_rcu_register();
+    sr_worker_count(&(w->sleeps), 1);
+  }
+
+  sr_rcu_unregister();
+  /* the counters of what is the worker's own, printed on its thread */
+  fprintf(stderr, "worker %u: ", w->id);
+  sr_graph_print(w->graph);
+  return NULL;
+}
+
+struct sr_workers *sr_workers_start(struct sr_instance *sr, unsigned int n) {
+  struct sr_workers *ws;
+  sigset_t all, old;
+  unsigned int i;
+
+  if ((n == 0) || (n > SR_WORKERS_MAX)) {
+    fprintf(stderr, "Error: between 1 and %d workers\n", SR_WORKERS_MAX);
+    return NULL;
+  }
+  if ((ws = (struct sr_workers *)calloc(1, sizeof(struct sr_workers))) == NULL ||
+      posix_memalign((void **)&(ws->w), 64, n * sizeof(struct sr_worker)) != 0) {
+    fprintf(stderr, "Error: out of memory (sr_workers_start)\n");
+    free(ws);
+    return NULL;
+  }
+  memset(ws->w, 0, n * sizeof(struct sr_worker));
+  ws->sr = sr;
+  ws->n = n;
+  ws->running = 1;
+  if ((ws->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    perror("eventfd(..):sr_worker.c::sr_workers_start");
+    free(ws->w);
+    free(ws);
+    return NULL;
+  }
+
+  /* the signals are the loop's (sr_loop.h), the workers inherit a mask
+     that blocks them all */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  for (i = 0; i < n; i++) {
+    struct sr_worker *w = &(ws->w[i]);
+    w->ws = ws;
+    w->id = i;
+    w->efd = eventfd(0, EFD_CLOEXEC);
+    if ((w->efd < 0) ||
+        (sr_ring_init(&(w->rx), SR_WORKER_RING, sizeof(struct sr_worker_rx)) != 0) ||
+        (sr_ring_init(&(w->tx), SR_WORKER_TXRING, sizeof(struct sr_worker_tx)) != 0) ||
+        (sr_pbuf_pool_init(&(w->pbufs), SR_WORKER_PBUFS) != 0) ||
+        (sr->graph && ((w->graph = sr_graph_create()) == NULL)) ||
+        (pthread_create(&(w->thread), NULL, sr_worker_main, w) != 0)) {
+      fprintf(stderr, "Error: cannot start worker %u\n", i);
+      pthread_sigmask(SIG_SETMASK, &old, NULL);
+      ws->n = i + 1;
+      sr_workers_stop(ws);
+      return NULL;
+    }
+    w->started = 1;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  fprintf(stderr, "workers: %u started; experimental, see sr_worker.h\n", n);
+  return ws;
+}
+
+void sr_workers_stop(struct sr_workers *ws) {
+  struct sr_worker_rx m;
+  struct sr_worker_tx t;
+  unsigned int i;
+
+  if (ws == NULL)
+    return;
+  __atomic_store_n(&(ws->running), 0, __ATOMIC_RELEASE);
+  for (i = 0; i < ws->n; i++) {
+    struct sr_worker *w = &(ws->w[i]);
+    if (w->started) {
+      sr_worker_kick(w->efd);
+      pthread_join(w->thread, NULL);
+    }
+  }
+  for (i = 0; i < ws->n; i++) {
+    struct sr_worker *w = &(ws->w[i]);
+    if (w->rx.slots) {
+      while (sr_ring_pop(&(w->rx), &m) == 0)
+        sr_pbuf_put(m.pb);
+    }
+    if (w->tx.slots) {
+      while (sr_ring_pop(&(w->tx), &t) == 0)
+        sr_pbuf_put(t.pb);
+    }
+    sr_ring_destroy(&(w->rx));
+    sr_ring_destroy(&(w->tx));
+    sr_graph_destroy(w->graph);
+    /* the io backend may still hold buffers of the pool (uring), so the
+       pool stays until the process exits, like the shared one */
+    if (w->efd >= 0)
+      close(w->efd);
+  }
+  close(ws->efd);
+}
+
+int sr_workers_fd(const struct sr_workers *ws) {
+  return ws->efd;
+}
+
+/* Tool function: the I/O thread waits for the workers: it sends what they
+   queued, which lets a worker waiting on its send ring go on and gives the
+   buffers sent back to the pool, and lets them run */
+static void sr_workers_wait(struct sr_instance *sr) {
+  sr_workers_tx(sr);
+  if (sr->punt)
+    sr_punt_tx(sr);
+  sr_io_flush(sr);
+  sched_yield();
+}
+
+int sr_workers_dispatch(struct sr_instance *sr, struct sr_pkt *pk) {
+  struct sr_workers *ws = sr->workers;
+  struct sr_worker_rx m;
+  unsigned int spins = 0;
+
+  if (pk->ifp == NULL)
+    return -1;
+  struct sr_worker *w = &(ws->w[sr_worker_pick(ws, pk)]);
+
+  /* a frame the io backend could not put in a buffer, the pool was dry,
+     gets one once the workers gave some back; the wait is bounded since
+     the ARP queue may keep buffers for seconds */
+  m.pk = *pk;
+  while ((m.pk.data = sr_pbuf_hold(&(sr->pbufs), pk->data, pk->len, &(m.pb))) == NULL) {
+    if ((pk->len > SR_PBUF_DATA_MAX) || (++spins > SR_WORKER_STALL)) {
+      w->dropped++;
+      return -1;
+    }
+    w->stalls++;
+    sr_workers_wait(sr);
+  }
+  /* the worker is behind: the server's stream is held up rather than the
+     packet dropped */
+  while (sr_ring_push(&(w->rx), &m) != 0) {
+    w->stalls++;
+    sr_workers_wait(sr);
+  }
+  w->queued++;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&(w->sleeping), __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(&(w->sleeping), 0, __ATOMIC_SEQ_CST)) {
+    w->wakeups++;
+    sr_worker_kick(w->efd);
+  }
+  return 0;
+}
+
+void sr_workers_tx(struct sr_instance *sr) {
+  struct sr_workers *ws = sr->workers;
+  struct sr_worker_tx t;
+  uint64_t v;
+  unsigned int i;
+
+  /* cleared before the rings are drained, so a packet queued meanwhile
+     writes the eventfd again */
+  if (read(ws->efd, &v, sizeof(v)) < 0) {
+    /* nothing was pending, the rings are looked at anyway */
+  }
+  __atomic_store_n(&(ws->tx_kicked), 0, __ATOMIC_SEQ_CST);
+
+  for (i = 0; i < ws->n; i++) {
+    struct sr_worker *w = &(ws->w[i]);
+    while (sr_ring_pop(&(w->tx), &t) == 0) {
+      if (sr_io_send_pbuf(sr, t.pb, t.cmd, t.len) != 0)
+        fprintf(stderr, "Error writing packet\n");
+      sr_pbuf_put(t.pb);
+    }
+  }
+}
+
+int sr_worker_self(void) {
+  return sr_worker_tls != NULL;
+}
+
+int sr_worker_send(struct sr_instance *sr, struct sr_pbuf *pb,
+                   const void *cmd, size_t len) {
+  struct sr_worker *w = sr_worker_tls;
+  struct sr_worker_tx t;
+  unsigned int spins = 0;
+
+  t.pb = pb;
+  t.cmd = cmd;
+  t.len = len;
+  sr_pbuf_ref(pb);
+  while (sr_ring_push(&(w->tx), &t) != 0) {
+    /* the I/O thread is behind: let it catch up, but not for ever, this
+       may hold a lock the I/O thread is waiting for (the ARP cache's) */
+    if (++spins > SR_WORKER_TXWAIT) {
+      sr_worker_count(&(w->tx_dropped), 1);
+      sr_pbuf_put(pb);
+      return -1;
+    }
+    sr_worker_count(&(w->tx_waits), 1);
+    sr_worker_kick_tx(w->ws);
+    sched_yield();
+  }
+  sr_worker_count(&(w->sent), 1);
+  return 0;
+}
+
+void sr_workers_print(const struct sr_workers *ws) {
+  unsigned int i;
+
+  if (ws == NULL)
+    return;
+  for (i = 0; i < ws->n; i++) {
+    const struct sr_worker *w = &(ws->w[i]);
+    fprintf(stderr, "worker %u: %" PRIu64 " queued (%" PRIu64 " stalls), %"
+      PRIu64 " dropped, %" PRIu64 " handled in %" PRIu64 " batches, %" PRIu64
+      " sent (%" PRIu64 " waits, %" PRIu64 " dropped), %" PRIu64 " sleeps, %"
+      PRIu64 " wakeups\n", i, w->queued, w->stalls, w->dropped,
+      sr_worker_counter(&(w->handled)), sr_worker_counter(&(w->batches)),
+      sr_worker_counter(&(w->sent)), sr_worker_counter(&(w->tx_waits)),
+      sr_worker_counter(&(w->tx_dropped)), sr_worker_counter(&(w->sleeps)),
+      w->wakeups);
+  }
+}
@@ -0,0 +1,87 @@
+/* This file defines the worker threads of the data plane. With -w N the
+   event loop's thread becomes the I/O thread: it reads the VNS socket,
+   parses and filters each frame as before, and hands it to one of N
+   workers instead of handling it itself. The worker is picked by a hash of
+   the packet's 5-tuple (addresses, protocol and ports, or the ICMP echo
+   id), so the packets of one flow always go to the same worker and leave
+   it in the order they came. Fragments are hashed on the addresses and
+   protocol only, so they follow the first fragment. Everything that is not
+   IP goes to worker 0.
+
+   The I/O thread and each worker share two single producer, single
+   consumer rings (sr_ring.h), one with the received packets and one with
+   the packets the worker sends; the socket and the io backend (sr_io.h)
+   stay with the I/O thread alone. A packet travels through both rings by a
+   reference to its packet buffer, never copied. A worker that runs out of
+   packets sleeps on an eventfd that the I/O thread writes when it queues
+   the next one, and a worker that queued packets to send writes the
+   eventfd the I/O thread waits on, once per batch.
+
+   Each worker has its own packet buffer pool for the packets it builds,
+   its own graph (sr_graph.h). The FIB is read under RCU and the
+   adjacencies without a lock; the ARP cache and the NAT take their locks.
+   The ARP and NAT ticks stay on the I/O thread.
+
+   A full receive ring, or a shared pool run dry, holds the I/O thread up
+   until the workers catch up (it sends what they queued meanwhile), so
+   the server's TCP stream is slowed down rather than packets dropped. A
+   full send ring makes the worker yield to the I/O thread a few times,
+   then drop.
+   Without -w, or with -w 0, the loop's thread handles every packet itself
+   as before.
+
+   The workers are experimental and off by default. They have only been
+   run on one CPU, where they cost a hand-off per batch and gain nothing,
+   so whether they scale over cores has not been measured. The I/O thread
+   still reads, parses and sends every packet, NAT traffic takes the NAT
+   lock for each packet, and an ARP miss takes the ARP cache lock; those
+   bound any gain. */
+
+#ifndef SR_WORKER_H
+#define SR_WORKER_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define SR_WORKERS_MAX   16    /* -w at most */
+#define SR_WORKER_RING   512   /* received packets queued per worker */
+#define SR_WORKER_TXRING 2048  /* packets to send queued per worker */
+#define SR_WORKER_PBUFS  512   /* buffers in a worker's own pool */
+#define SR_WORKER_TXWAIT 64    /* yields on a full send ring before a drop */
+#define SR_WORKER_STALL  1024  /* yields for a packet buffer before a drop */
+
+struct sr_instance;
+struct sr_pkt;
+struct sr_pbuf;
+struct sr_workers;
+
+/* Starts n workers for sr; returns NULL on error. */
+struct sr_workers *sr_workers_start(struct sr_instance *sr, unsigned int n);
+
+/* Stops and joins the workers and drops what is still queued. */
+void sr_workers_stop(struct sr_workers *ws);
+
+/* The eventfd that becomes readable when workers queued packets to send. */
+int  sr_workers_fd(const struct sr_workers *ws);
+
+/* I/O thread: queues the parsed packet to its worker, taking a reference
+   to its packet buffer (or copying it into one), and waits if the worker's
+   ring is full. Returns -1 if the packet was dropped. */
+int  sr_workers_dispatch(struct sr_instance *sr, struct sr_pkt *pk);
+
+/* I/O thread: sends what the workers queued. */
+void sr_workers_tx(struct sr_instance *sr);
+
+/* Nonzero on a worker thread. */
+int  sr_worker_self(void);
+
+/* Worker: queues the server command of len bytes at cmd, which lies in the
+   packet buffer pb, for the I/O thread to send, taking a reference to pb.
+   Returns 0 on success. */
+int  sr_worker_send(struct sr_instance *sr, struct sr_pbuf *pb,
+                    const void *cmd, size_t len);
+
+/* Prints the worker counters to stderr. */
+void sr_workers_print(const struct sr_workers *ws);
+
+#endif /* SR_WORKER_H */